@@ -0,0 +1,262 @@
+// runs the standard query mix against a generated dataset under every
+// combination of QueryOptFlags, separating what it costs to plan and
+// compile a query from what each execution (a scan testing every entity)
+// costs, and working out after how many executions a JIT compile pays off:
+//
+//   c_src/bench/opt_matrix --entities 100000 --format csv
+//
+// see usage() for the options
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <memory>
+#include <map>
+
+#include "context.h"
+#include "dataset.h"
+#include "telemetry.h"
+#include "jit_cache.h"
+#include "query_bytecode.h"
+
+struct BenchOptions {
+  DatasetSpec spec;
+  size_t iterations;
+  size_t compiles;
+  bool csv;
+
+  BenchOptions() : iterations(10), compiles(5), csv(false) {}
+};
+
+struct MatrixResult {
+  const char *query;
+  QueryOptFlags flags;
+  const char *evaluator;
+  size_t rows;
+
+  // mean time to optimize the expanded query, and to compile the plan
+  // (to bytecode or native code)
+  double plan_us;
+  double compile_us;
+
+  // one scan of every entity
+  LatencySummary exec;
+
+  // executions after which the JIT compile has paid for itself, over the
+  // same plan left uncompiled or compiled to bytecode. negative if never
+  double jit_break_even_tree;
+  double jit_break_even_bytecode;
+
+  double exec_mean_us() const {
+    return exec.total_ns / 1000.0 / exec.count;
+  }
+};
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "usage: %s [options]\n%s"
+    "  --iterations N      scans per query and flags (10)\n"
+    "  --compiles N        compiles timed per query and flags (5)\n"
+    "  --format json|csv   output format (json)\n", prog, dataset_usage);
+}
+
+static bool parse_options(int argc, char **argv, BenchOptions& opts) {
+  for(int i = 1; i < argc; i++) {
+    if(i + 1 == argc) return false;
+    const char *key = argv[i], *value = argv[++i];
+    if(parse_dataset_option(key, value, opts.spec)) continue;
+
+    auto n = strtoull(value, nullptr, 10);
+    if(!strcmp(key, "--iterations"))    opts.iterations = n;
+    else if(!strcmp(key, "--compiles")) opts.compiles = n;
+    else if(!strcmp(key, "--format"))   opts.csv = !strcmp(value, "csv");
+    else return false;
+  }
+  return opts.iterations > 0 && opts.compiles > 0;
+}
+
+static const QueryOptFlags compile_flags = (QueryOptFlags) (QueryOptFlags_JIT | QueryOptFlags_Bytecode);
+
+// every combination of flags that behaves differently: JIT takes over from
+// Bytecode, and CostBased from Reorder, when both are set
+static std::vector<QueryOptFlags> flag_matrix() {
+  std::vector<QueryOptFlags> ret;
+  for(int f = 0; f < 0x20; f++) {
+    if((f & QueryOptFlags_JIT) && (f & QueryOptFlags_Bytecode)) continue;
+    if((f & QueryOptFlags_CostBased) && (f & QueryOptFlags_Reorder)) continue;
+    ret.push_back((QueryOptFlags) f);
+  }
+  return ret;
+}
+
+static std::string flags_name(QueryOptFlags flags) {
+  static const std::pair<QueryOptFlags, const char*> names[] = {
+    {QueryOptFlags_Normalize, "normalize"},
+    {QueryOptFlags_Reorder,   "reorder"},
+    {QueryOptFlags_CostBased, "cost_based"},
+    {QueryOptFlags_Bytecode,  "bytecode"},
+    {QueryOptFlags_JIT,       "jit"}
+  };
+
+  std::string ret;
+  for(auto& name : names) {
+    if(!(flags & name.first)) continue;
+    if(ret.size()) ret += "+";
+    ret += name.second;
+  }
+  return ret.empty() ? "none" : ret;
+}
+
+// the flags' plan, before it's compiled
+static QueryClause *plan(const Context& ctx, const QueryClause *source, QueryOptFlags flags) {
+  return optimize(expand_implications(source), ctx.get_stats(), (QueryOptFlags) (flags & ~compile_flags));
+}
+
+// the plan compiled the way 'flags' asks for, or nullptr if it isn't
+static QueryClause *compile(const QueryClause *plan, QueryOptFlags flags) {
+  if(flags & QueryOptFlags_JIT) {
+    // a cached compile would cost nothing
+    JitCache::shared().clear();
+    return jit_compile(plan);
+  }
+  if(flags & QueryOptFlags_Bytecode) {
+    return compile_bytecode(plan);
+  }
+  return nullptr;
+}
+
+static MatrixResult run(const Context& ctx, const NamedQuery& query, QueryOptFlags flags, const BenchOptions& opts) {
+  MatrixResult result;
+  result.query = query.name;
+  result.flags = flags;
+  result.jit_break_even_tree = result.jit_break_even_bytecode = -1;
+
+  std::unique_ptr<QueryClause> planned, compiled;
+  uint64_t plan_ns = 0, compile_ns = 0;
+  for(size_t i = 0; i < opts.compiles; i++) {
+    uint64_t start = telemetry_now_ns();
+    planned.reset(plan(ctx, query.source, flags));
+    uint64_t planned_at = telemetry_now_ns();
+    compiled.reset(compile(planned.get(), flags));
+    uint64_t end = telemetry_now_ns();
+
+    plan_ns += planned_at - start;
+    compile_ns += end - planned_at;
+  }
+  result.plan_us    = plan_ns / 1000.0 / opts.compiles;
+  result.compile_us = compile_ns / 1000.0 / opts.compiles;
+
+  const QueryClause *clause = compiled ? compiled.get() : planned.get();
+  result.evaluator =
+    !compiled ? "tree" :
+    dynamic_cast<const QueryClauseBytecode*>(clause) ? "bytecode" : "jit";
+
+  LatencyHistogram histogram;
+  for(size_t i = 0; i < opts.iterations; i++) {
+    size_t rows = 0;
+    uint64_t start = telemetry_now_ns();
+    ctx.query(clause, [&](Entity*) { rows++; });
+    histogram.record(telemetry_now_ns() - start);
+    result.rows = rows;
+  }
+  result.exec = histogram.summary();
+
+  return result;
+}
+
+// executions it takes for 'jit' to make up for its compile over 'base'
+static double break_even(const MatrixResult& jit, const MatrixResult& base) {
+  double saved = base.exec_mean_us() - jit.exec_mean_us();
+  if(saved <= 0) return -1;
+  return std::max(0.0, std::ceil((jit.compile_us - base.compile_us) / saved));
+}
+
+static std::string json_number(double n) {
+  if(n < 0) return "null";
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.2f", n);
+  return buf;
+}
+
+static std::string csv_number(double n) {
+  return n < 0 ? "" : json_number(n);
+}
+
+static void print_json(const BenchOptions& opts, const std::vector<MatrixResult>& results) {
+  auto& s = opts.spec;
+  printf("{\n");
+  printf("  \"dataset\": {\"seed\": %llu, \"entities\": %zu, \"tags\": %zu, \"zipf\": %g},\n",
+    (unsigned long long) s.seed, s.num_entities, s.num_tags, s.zipf_exponent);
+  printf("  \"iterations\": %zu,\n", opts.iterations);
+  printf("  \"results\": [\n");
+  for(size_t i = 0; i < results.size(); i++) {
+    auto& r = results[i];
+    printf("    {\"query\": \"%s\", \"flags\": \"%s\", \"evaluator\": \"%s\", \"rows\": %zu, "
+      "\"plan_us\": %.2f, \"compile_us\": %.2f, \"exec_mean_us\": %.2f, \"exec_p50_us\": %.2f, "
+      "\"exec_p99_us\": %.2f, \"jit_break_even_tree\": %s, \"jit_break_even_bytecode\": %s}%s\n",
+      r.query, flags_name(r.flags).c_str(), r.evaluator, r.rows,
+      r.plan_us, r.compile_us, r.exec_mean_us(), r.exec.p50_ns / 1000.0, r.exec.p99_ns / 1000.0,
+      json_number(r.jit_break_even_tree).c_str(), json_number(r.jit_break_even_bytecode).c_str(),
+      i + 1 < results.size() ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+static void print_csv(const BenchOptions& opts, const std::vector<MatrixResult>& results) {
+  auto& s = opts.spec;
+  printf("seed,entities,tags,query,flags,evaluator,rows,plan_us,compile_us,exec_mean_us,exec_p50_us,exec_p99_us,"
+    "jit_break_even_tree,jit_break_even_bytecode\n");
+  for(auto& r : results) {
+    printf("%llu,%zu,%zu,%s,%s,%s,%zu,%.2f,%.2f,%.2f,%.2f,%.2f,%s,%s\n",
+      (unsigned long long) s.seed, s.num_entities, s.num_tags,
+      r.query, flags_name(r.flags).c_str(), r.evaluator, r.rows,
+      r.plan_us, r.compile_us, r.exec_mean_us(), r.exec.p50_ns / 1000.0, r.exec.p99_ns / 1000.0,
+      csv_number(r.jit_break_even_tree).c_str(), csv_number(r.jit_break_even_bytecode).c_str());
+  }
+}
+
+int main(int argc, char **argv) {
+  BenchOptions opts;
+  if(!parse_options(argc, argv, opts)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  Context ctx;
+  auto dataset = generate_dataset(ctx, opts.spec);
+  auto queries = standard_queries(dataset);
+  auto matrix = flag_matrix();
+
+  std::vector<MatrixResult> results;
+  for(auto& query : queries) {
+    // results for this query by flags, to compare the JIT against
+    std::map<int, size_t> by_flags;
+    for(auto flags : matrix) {
+      by_flags[flags] = results.size();
+      results.push_back(run(ctx, query, flags, opts));
+    }
+
+    for(auto flags : matrix) {
+      auto& r = results[by_flags[flags]];
+      if(strcmp(r.evaluator, "jit")) continue;
+
+      auto tree     = flags & ~QueryOptFlags_JIT;
+      auto bytecode = tree | QueryOptFlags_Bytecode;
+      r.jit_break_even_tree     = break_even(r, results[by_flags[tree]]);
+      r.jit_break_even_bytecode = break_even(r, results[by_flags[bytecode]]);
+    }
+
+    delete query.source;
+  }
+
+  if(opts.csv) {
+    print_csv(opts, results);
+  }
+  else {
+    print_json(opts, results);
+  }
+
+  return 0;
+}
@@ -0,0 +1,217 @@
+// replays a query log recorded with AllTheTags.start_query_log against the
+// snapshot saved with it, to reproduce how a database performed without
+// the BEAM involved:
+//
+//   c_src/bench/replay --snapshot db.snapshot --log db.qlog --pacing original
+//
+// queries run one at a time on one thread, as fast as they can (the
+// default) or spaced out as they were recorded. see usage() for the options
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+
+#include "context.h"
+#include "snapshot.h"
+#include "query_log.h"
+#include "telemetry.h"
+
+struct ReplayOptions {
+  const char *snapshot;
+  const char *log;
+  bool original_pacing;
+  size_t iterations;
+  bool csv;
+
+  ReplayOptions() :
+    snapshot(nullptr),
+    log(nullptr),
+    original_pacing(false),
+    iterations(1),
+    csv(false) {}
+};
+
+struct ReplayResult {
+  size_t index;
+  uint64_t start_ns;
+  uint64_t recorded_ns;
+  uint64_t replayed_ns;
+  size_t recorded_rows;
+  size_t replayed_rows;
+};
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "usage: %s --snapshot PATH --log PATH [options]\n"
+    "  --pacing full|original  run the queries back to back, or as far apart\n"
+    "                          as they started when recorded (full)\n"
+    "  --iterations N          times to replay the log (1)\n"
+    "  --format json|csv       output format: a summary, or every query (json)\n", prog);
+}
+
+static bool parse_options(int argc, char **argv, ReplayOptions& opts) {
+  for(int i = 1; i < argc; i++) {
+    if(i + 1 == argc) return false;
+    const char *key = argv[i], *value = argv[++i];
+
+    if(!strcmp(key, "--snapshot"))        opts.snapshot = value;
+    else if(!strcmp(key, "--log"))        opts.log = value;
+    else if(!strcmp(key, "--pacing"))     opts.original_pacing = !strcmp(value, "original");
+    else if(!strcmp(key, "--iterations")) opts.iterations = strtoull(value, nullptr, 10);
+    else if(!strcmp(key, "--format"))     opts.csv = !strcmp(value, "csv");
+    else return false;
+  }
+  return opts.snapshot && opts.log && opts.iterations > 0;
+}
+
+// runs 'record' the way the NIF that recorded it did, returning the rows
+static size_t replay(const Context& ctx, const QueryClause *source, const QueryLogRecord& record) {
+  size_t rows = 0;
+  auto count = [&](Entity*) { rows++; };
+
+  if(record.cache) {
+    ctx.cached_query(source, record.range, count);
+  }
+  else {
+    std::unique_ptr<QueryClause> clause(ctx.optimize_query(expand_implications(source)));
+    ctx.query(clause.get(), record.range, count);
+  }
+  return rows;
+}
+
+static double us(uint64_t ns) {
+  return ns / 1000.0;
+}
+
+static void print_summary(const char *name, const LatencySummary& s) {
+  printf("  \"%s\": {\"mean_us\": %.2f, \"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f}",
+    name, s.count ? us(s.total_ns) / s.count : 0.0, us(s.p50_ns), us(s.p90_ns), us(s.p99_ns), us(s.max_ns));
+}
+
+static void print_json(const ReplayOptions& opts, size_t skipped, double wall_ms, const std::vector<ReplayResult>& results) {
+  LatencyHistogram recorded, replayed;
+  size_t mismatches = 0;
+  for(auto& r : results) {
+    recorded.record(r.recorded_ns);
+    replayed.record(r.replayed_ns);
+    if(r.recorded_rows != r.replayed_rows) mismatches++;
+  }
+
+  // the queries that got slowest compared with when they were recorded
+  std::vector<const ReplayResult*> slowest;
+  for(auto& r : results) slowest.push_back(&r);
+  auto ratio = [](const ReplayResult *r) { return (double) r->replayed_ns / std::max(r->recorded_ns, (uint64_t) 1); };
+  std::sort(slowest.begin(), slowest.end(), [&](const ReplayResult *l, const ReplayResult *r) {
+    return ratio(l) > ratio(r);
+  });
+  slowest.resize(std::min(slowest.size(), (size_t) 10));
+
+  printf("{\n");
+  printf("  \"pacing\": \"%s\", \"iterations\": %zu,\n", opts.original_pacing ? "original" : "full", opts.iterations);
+  printf("  \"queries\": %zu, \"skipped\": %zu, \"row_mismatches\": %zu, \"wall_ms\": %.1f,\n",
+    results.size(), skipped, mismatches, wall_ms);
+  print_summary("recorded", recorded.summary());
+  printf(",\n");
+  print_summary("replayed", replayed.summary());
+  printf(",\n  \"slowest\": [\n");
+  for(size_t i = 0; i < slowest.size(); i++) {
+    auto r = slowest[i];
+    printf("    {\"index\": %zu, \"recorded_us\": %.2f, \"replayed_us\": %.2f, \"rows\": %zu}%s\n",
+      r->index, us(r->recorded_ns), us(r->replayed_ns), r->replayed_rows,
+      i + 1 < slowest.size() ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+static void print_csv(const std::vector<ReplayResult>& results) {
+  printf("index,start_ms,recorded_us,replayed_us,recorded_rows,replayed_rows\n");
+  for(auto& r : results) {
+    printf("%zu,%.3f,%.2f,%.2f,%zu,%zu\n",
+      r.index, r.start_ns / 1e6, us(r.recorded_ns), us(r.replayed_ns), r.recorded_rows, r.replayed_rows);
+  }
+}
+
+int main(int argc, char **argv) {
+  ReplayOptions opts;
+  if(!parse_options(argc, argv, opts)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  Context ctx;
+  if(!load_snapshot(ctx, opts.snapshot)) {
+    fprintf(stderr, "%s: couldn't load snapshot %s\n", argv[0], opts.snapshot);
+    return 1;
+  }
+
+  QueryLogReader reader;
+  if(!reader.open(opts.log)) {
+    fprintf(stderr, "%s: couldn't read query log %s\n", argv[0], opts.log);
+    return 1;
+  }
+
+  // queries are logged as they finish, so concurrent ones can be out of
+  // order by when they started
+  std::vector<QueryLogRecord> records;
+  QueryLogRecord record;
+  while(reader.next(record)) {
+    records.push_back(record);
+  }
+  std::stable_sort(records.begin(), records.end(), [](const QueryLogRecord& l, const QueryLogRecord& r) {
+    return l.start_ns < r.start_ns;
+  });
+
+  // decoded up front, so that isn't timed
+  std::vector<std::unique_ptr<QueryClause> > clauses;
+  size_t skipped = 0;
+  for(auto& r : records) {
+    const char *p = r.clause.data();
+    clauses.emplace_back(decode_clause(ctx, p, p + r.clause.size()));
+    if(!clauses.back()) skipped++;
+  }
+
+  std::vector<ReplayResult> results;
+  uint64_t replay_start = telemetry_now_ns();
+  for(size_t iteration = 0; iteration < opts.iterations; iteration++) {
+    uint64_t iteration_start = telemetry_now_ns();
+
+    for(size_t i = 0; i < records.size(); i++) {
+      if(!clauses[i]) continue;
+      auto& r = records[i];
+
+      if(opts.original_pacing) {
+        uint64_t elapsed = telemetry_now_ns() - iteration_start;
+        if(r.start_ns > elapsed) {
+          std::this_thread::sleep_for(std::chrono::nanoseconds(r.start_ns - elapsed));
+        }
+      }
+
+      ReplayResult result;
+      result.index = i;
+      result.start_ns = r.start_ns;
+      result.recorded_ns = r.duration_ns;
+      result.recorded_rows = r.rows;
+
+      uint64_t start = telemetry_now_ns();
+      result.replayed_rows = replay(ctx, clauses[i].get(), r);
+      result.replayed_ns = telemetry_now_ns() - start;
+
+      results.push_back(result);
+    }
+  }
+  double wall_ms = (telemetry_now_ns() - replay_start) / 1e6;
+
+  if(opts.csv) {
+    print_csv(results);
+  }
+  else {
+    print_json(opts, skipped, wall_ms, results);
+  }
+
+  return 0;
+}
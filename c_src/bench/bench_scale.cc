@@ -0,0 +1,155 @@
+// runs the standard query mix against a generated dataset, printing the
+// results as JSON or CSV for tracking regressions across runs:
+//
+//   c_src/bench/scale --entities 1000000 --tags 50000 --format csv
+//
+// every field of DatasetSpec can be set, see usage()
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <memory>
+
+#include "context.h"
+#include "dataset.h"
+#include "telemetry.h"
+
+struct BenchOptions {
+  DatasetSpec spec;
+  size_t iterations;
+  size_t limit;
+  bool csv;
+
+  BenchOptions() : iterations(20), limit(SIZE_MAX), csv(false) {}
+};
+
+struct QueryResult {
+  const char *name;
+  const char *engine;
+  const char *evaluator;
+  size_t rows;
+  LatencySummary latency;
+};
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "usage: %s [options]\n%s"
+    "  --iterations N      runs of each query (20)\n"
+    "  --limit N           stop each query after N matches\n"
+    "  --format json|csv   output format (json)\n", prog, dataset_usage);
+}
+
+static bool parse_options(int argc, char **argv, BenchOptions& opts) {
+  for(int i = 1; i < argc; i++) {
+    if(i + 1 == argc) return false;
+    const char *key = argv[i], *value = argv[++i];
+
+    if(parse_dataset_option(key, value, opts.spec)) continue;
+
+    auto n = strtoull(value, nullptr, 10);
+    if(!strcmp(key, "--iterations"))      opts.iterations = n;
+    else if(!strcmp(key, "--limit"))      opts.limit = n;
+    else if(!strcmp(key, "--format"))     opts.csv = !strcmp(value, "csv");
+    else return false;
+  }
+  return opts.iterations > 0;
+}
+
+// runs 'source' the way an uncached do_query does: expand, optimize, query
+static QueryResult run_query(const Context& ctx, const NamedQuery& query, const BenchOptions& opts) {
+  QueryResult result;
+  result.name = query.name;
+
+  QueryRange range;
+  range.limit = opts.limit;
+
+  LatencyHistogram histogram;
+  QueryTrace trace;
+  for(size_t i = 0; i < opts.iterations; i++) {
+    size_t rows = 0;
+    trace = QueryTrace();
+
+    uint64_t start = telemetry_now_ns();
+    std::unique_ptr<QueryClause> clause(ctx.optimize_query(expand_implications(query.source)));
+    ctx.query(clause.get(), range, [&](Entity*) { rows++; }, &trace);
+    histogram.record(telemetry_now_ns() - start);
+
+    result.rows = rows;
+  }
+
+  result.engine    = trace.engine;
+  result.evaluator = trace.evaluator;
+  result.latency   = histogram.summary();
+  return result;
+}
+
+static double us(uint64_t ns) {
+  return ns / 1000.0;
+}
+
+static void print_json(const BenchOptions& opts, const Dataset& d, double generate_ms,
+  size_t memory, const std::vector<QueryResult>& results)
+{
+  auto& s = opts.spec;
+  printf("{\n");
+  printf("  \"dataset\": {\"seed\": %llu, \"entities\": %zu, \"tags\": %zu, \"zipf\": %g, "
+    "\"tags_per_entity\": %g, \"depth\": %zu, \"fan_out\": %zu, \"aliases\": %zu, \"alias_size\": %zu, "
+    "\"taggings\": %zu, \"generate_ms\": %.1f, \"memory_bytes\": %zu},\n",
+    (unsigned long long) s.seed, s.num_entities, s.num_tags, s.zipf_exponent,
+    s.tags_per_entity, s.hierarchy_depth, s.fan_out, d.aliases.size(), s.alias_size,
+    d.num_taggings, generate_ms, memory);
+  printf("  \"iterations\": %zu,\n", opts.iterations);
+  printf("  \"queries\": [\n");
+  for(size_t i = 0; i < results.size(); i++) {
+    auto& r = results[i];
+    printf("    {\"query\": \"%s\", \"engine\": \"%s\", \"evaluator\": \"%s\", \"rows\": %zu, "
+      "\"mean_us\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f}%s\n",
+      r.name, r.engine, r.evaluator, r.rows,
+      us(r.latency.total_ns) / r.latency.count, us(r.latency.p50_ns),
+      us(r.latency.p99_ns), us(r.latency.max_ns),
+      i + 1 < results.size() ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+static void print_csv(const BenchOptions& opts, const std::vector<QueryResult>& results) {
+  auto& s = opts.spec;
+  printf("seed,entities,tags,zipf,query,engine,evaluator,rows,iterations,mean_us,p50_us,p99_us,max_us\n");
+  for(auto& r : results) {
+    printf("%llu,%zu,%zu,%g,%s,%s,%s,%zu,%zu,%.2f,%.2f,%.2f,%.2f\n",
+      (unsigned long long) s.seed, s.num_entities, s.num_tags, s.zipf_exponent,
+      r.name, r.engine, r.evaluator, r.rows, opts.iterations,
+      us(r.latency.total_ns) / r.latency.count, us(r.latency.p50_ns),
+      us(r.latency.p99_ns), us(r.latency.max_ns));
+  }
+}
+
+int main(int argc, char **argv) {
+  BenchOptions opts;
+  if(!parse_options(argc, argv, opts)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  Context ctx;
+  uint64_t start = telemetry_now_ns();
+  auto dataset = generate_dataset(ctx, opts.spec);
+  double generate_ms = (telemetry_now_ns() - start) / 1e6;
+
+  auto queries = standard_queries(dataset);
+  std::vector<QueryResult> results;
+  for(auto& query : queries) {
+    results.push_back(run_query(ctx, query, opts));
+    delete query.source;
+  }
+
+  if(opts.csv) {
+    print_csv(opts, results);
+  }
+  else {
+    print_json(opts, dataset, generate_ms, ctx.get_memory().total(), results);
+  }
+
+  return 0;
+}
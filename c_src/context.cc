@@ -1,7 +1,13 @@
 #include <queue>
+#include <chrono>
 #include <stack>
+#include <cmath>
+#include <memory>
+#include <string>
 
 #include "context.h"
+#include "query_stats.h"
+#include "query_bytecode.h"
 #include "tag.h"
 
 struct Tag;
@@ -15,14 +21,33 @@ int SCCMetaNode::entity_count() const {
 }
 
 Context::~Context() {
+  // background compiles hold on to tags and metanodes
+  tiering.stop();
+
+  for(auto sq : standing_queries) {
+    delete sq;
+  }
   for(auto node : meta_nodes) {
     delete node;
   }
   for(auto pair : id_to_tag) {
     delete pair.second;
+    memory.tags.remove(sizeof(Tag));
   }
   for(auto pair : id_to_entity) {
     delete pair.second;
+    memory.entities.remove(sizeof(Entity));
+  }
+
+  // deleted ones compact() didn't get to
+  for(auto t : deleted_tags) {
+    delete t;
+    memory.tags.remove(sizeof(Tag));
+  }
+  for(auto e : entities) {
+    if(!e->deleted) continue;
+    delete e;
+    memory.entities.remove(sizeof(Entity));
   }
 }
 
@@ -41,6 +66,25 @@ bool path_between(SCCMetaNode *from, SCCMetaNode *to) {
 }
 
 void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
+  implication_generation++;
+
+  // 'tag' and whatever implies it now match (or stop matching) queries
+  // for 'target' and anything 'target' implies, which are exactly the
+  // cached queries whose dependencies include 'target'
+  query_cache.invalidate_tag(target);
+  stats.metagraph_changed();
+  tiering.invalidate();
+
+  // everything implying 'tag' may have gained or lost implied tags
+  if(!standing_queries.empty()) {
+    standing_implication_changes.insert(tag);
+  }
+
+  update_imply_dag(tag, gained_imply, target);
+  refresh_standing_queries();
+}
+
+void Context::update_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
   // if the metagraph is already stale, then don't do
   // an incremental update of the metagraph
   if(this->recalc_metagraph) return;
@@ -54,12 +98,12 @@ void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
 
     if(!tag_mn || !target_mn) {
       if(!tag_mn) {
-        tag->meta_node = tag_mn = new SCCMetaNode();
+        tag->meta_node = tag_mn = new SCCMetaNode(&memory.meta_nodes);
         tag_mn->tags.insert(tag);
         meta_nodes.insert(tag_mn);
       }
       if(!target_mn) {
-        target->meta_node = target_mn = new SCCMetaNode();
+        target->meta_node = target_mn = new SCCMetaNode(&memory.meta_nodes);
         target_mn->tags.insert(target);
         meta_nodes.insert(target_mn);
       }
@@ -99,6 +143,7 @@ void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
 
 
       if(in_scc.size()) {
+        telemetry.collapses.add();
         auto tmp_in_scc = in_scc;
 
         // incoming/outgoing edges that aren't in the SCC set being collapsed
@@ -138,7 +183,7 @@ void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
           std::cerr << "outedges: " << outedges.size() << std::endl;
         }
 
-        auto new_scc_node = new SCCMetaNode();
+        auto new_scc_node = new SCCMetaNode(&memory.meta_nodes);
 
         // transfer all tags into 'new_scc_node'
         for(auto scc : in_scc) {
@@ -255,92 +300,104 @@ void Context::dirty_tag_imply_dag(Tag* tag, bool gained_imply, Tag* target) {
   }
 }
 
+MetaGraphBuild::~MetaGraphBuild() {
+  for(auto node : meta_nodes) {
+    delete node;
+  }
+}
+
 void Context::make_clean() {
   if(!this->recalc_metagraph) return;
+  ScopedLatency timer(telemetry.make_clean);
+
+  MetaGraphBuild build;
+  snapshot_implications(build);
+  build_metagraph(build);
+  auto installed = install_metagraph(build);
+  assert(installed);
+  (void)installed;
+}
 
-  this->recalc_metagraph = false;
+void Context::snapshot_implications(MetaGraphBuild& build) const {
+  build.generation = implication_generation;
 
-  // clear metanode for all tags
-  for(auto id_tag : id_to_tag) {
-    id_tag.second->meta_node = nullptr;
-  }
+  // the new metagraph is counted like the one it replaces
+  build.memory = &memory.meta_nodes;
+  build.meta_nodes = MetaNodeSet(MetaNodeSet::allocator_type(build.memory));
+  build.sink_meta_nodes = MetaNodeSet(MetaNodeSet::allocator_type(build.memory));
 
-  auto get_new_scc = [&]() {
-    if(meta_nodes.empty()) {
-      return new SCCMetaNode();
-    }
-    else {
-      auto ret = *(meta_nodes.begin());
-      assert(meta_nodes.erase(ret) == 1);
-      ret->children.clear();
-      ret->parents.clear();
-      ret->tags.clear();
-      return ret;
+  // maps tag -> its index in build.tags
+  std::unordered_map<Tag*, size_t> tag_to_index;
+
+  for(auto tag_id : id_to_tag) {
+    // if the tag isn't part of the implication graph, don't
+    // run SCC algo on it
+    auto tag = tag_id.second;
+    if(tag->implies.empty() && tag->implied_by.empty()) { continue; }
+
+    if(debug) {
+      std::cerr << "snapshot: " << tag->id << " will be in the metagraph" << std::endl;
     }
-  };
 
-  // holds the new DAG of metanodes
+    tag_to_index.insert(std::make_pair(tag, build.tags.size()));
+    build.tags.push_back(tag);
+  }
+
+  build.implies.resize(build.tags.size());
+  for(size_t i = 0; i < build.tags.size(); i++) {
+    auto& edges = build.implies[i];
+    edges.reserve(build.tags[i]->implies.size());
+
+    for(auto implied : build.tags[i]->implies) {
+      auto mapped = tag_to_index.find(implied);
+      assert(mapped != tag_to_index.end());
+      edges.push_back((*mapped).second);
+    }
+  }
+}
 
+void build_metagraph(MetaGraphBuild& build) {
   // run Tarjan's SCC algorithm
   struct TarjanWrapper {
-    Tag *tag;
     int index;
     int low_link;
     bool on_stack;
 
-    TarjanWrapper(Tag *t) :
-      tag(t), index(-1), low_link(-1), on_stack(false) {}
+    TarjanWrapper() :
+      index(-1), low_link(-1), on_stack(false) {}
   };
 
   int index = 0;
-  std::vector<TarjanWrapper> tarjan_nodes; // bookkeping area for the tarjan nodes
-  std::unordered_map<Tag*, TarjanWrapper*> tag_to_tarjan; // maps tag -> its tarjan node in the vector
-  std::stack<TarjanWrapper*> tarjan_stack; // stack required by the algo
-  std::stack<SCCMetaNode*> metanode_stack; // stack of metanodes generated by Tarjan's algo (in topological descending order)
+  std::vector<TarjanWrapper> tarjan_nodes(build.tags.size()); // bookkeping area for the tarjan nodes
+  std::stack<size_t> tarjan_stack; // stack required by the algo
 
-  tarjan_nodes.reserve(id_to_tag.size());
-  for(auto tag_id : id_to_tag) {
-    // if the tag isn't part of the implication graph, don't
-    // run SCC algo on it
-    auto tag = tag_id.second;
-    if(tag->implies.empty() && tag->implied_by.empty()) { continue; }
+  build.tag_meta_nodes.assign(build.tags.size(), nullptr);
 
-    if(debug) {
-      std::cerr << "tarjan: " << tag->id << " will be in the metagraph" << std::endl;
-    }
-
-    tarjan_nodes.push_back(TarjanWrapper(tag));
-    auto iter = tarjan_nodes.end(); // iterator to the last element in the vector
-    iter--;
-    tag_to_tarjan.insert(std::make_pair(tag, &(*iter)));
-  }
-
-  std::function<void(TarjanWrapper*)> strongconnect = [&](TarjanWrapper *v) {
+  std::function<void(size_t)> strongconnect = [&](size_t vi) {
+    TarjanWrapper *v = &tarjan_nodes[vi];
     v->index    = index;
     v->low_link = index;
     index++;
 
-    tarjan_stack.push(v);
+    tarjan_stack.push(vi);
     v->on_stack = true;
 
     if(debug) {
       std::cerr <<
-        "tag " << v->tag->id <<
-        " implies " << v->tag->implies.size() <<
+        "tag " << build.tags[vi]->id <<
+        " implies " << build.implies[vi].size() <<
         " others" << std::endl;
     }
-    for(auto implied : v->tag->implies) {
-      auto mapped = tag_to_tarjan.find(implied);
-      assert(mapped != tag_to_tarjan.end());
-      TarjanWrapper* w = (*mapped).second;
+    for(auto wi : build.implies[vi]) {
+      TarjanWrapper* w = &tarjan_nodes[wi];
 
       if(debug) {
-        std::cerr << "(-> " << w->tag->id << ")" << std::endl;
+        std::cerr << "(-> " << build.tags[wi]->id << ")" << std::endl;
       }
 
       if(w->index == -1) {
         // successor w not visited, recurse on it
-        strongconnect(w);
+        strongconnect(wi);
         v->low_link = std::min(v->low_link, w->low_link);
       }
       else if(w->on_stack) {
@@ -352,89 +409,742 @@ void Context::make_clean() {
     // if v is a root node, pop the stack and generate an SCC
     if(v->low_link == v->index) {
       // start a new SCC
-      auto component = get_new_scc();
-      assert(component);
+      auto component = new SCCMetaNode(build.memory);
 
       while(true) {
-        auto w = tarjan_stack.top();
+        auto wi = tarjan_stack.top();
         tarjan_stack.pop();
 
-        component->tags.insert(w->tag);
-        w->tag->meta_node = component;
-        w->on_stack = false;
+        component->tags.insert(build.tags[wi]);
+        build.tag_meta_nodes[wi] = component;
+        tarjan_nodes[wi].on_stack = false;
 
-        if(w == v) break;
+        if(wi == vi) break;
       }
-      metanode_stack.push(component);
+      build.meta_nodes.insert(component);
     }
   };
 
-  {
-    auto b = tarjan_nodes.begin();
-    auto e = tarjan_nodes.end();
-    while(b != e) {
-      auto tarjan_node = &(*b);
-      if(tarjan_node->index == -1) {
-        strongconnect(tarjan_node);
+  for(size_t i = 0; i < tarjan_nodes.size(); i++) {
+    if(tarjan_nodes[i].index == -1) {
+      strongconnect(i);
+    }
+  }
+
+  if(debug) {
+    std::cerr << "tarjan: " << build.meta_nodes.size() << " metanodes total" << std::endl;
+  }
+
+  // set up links between metanodes in the graph
+  for(size_t i = 0; i < build.tags.size(); i++) {
+    auto top = build.tag_meta_nodes[i];
+
+    for(auto implied : build.implies[i]) {
+      if(debug) {
+        std::cerr << "tarjan: checking edge " << build.tags[i]->id << " -> " << build.tags[implied]->id << std::endl;
+      }
+
+      auto imn = build.tag_meta_nodes[implied];
+      assert(imn);
+      if(imn != top) {
+        auto ret = top->add_child(imn);
+        if(debug && ret) {
+          std::cerr << "adding SCC edge ";
+          top->print_tag_set(std::cerr) << " -> ";
+          imn->print_tag_set(std::cerr) << std::endl;
+        }
       }
-      b++;
     }
   }
 
-  // destroy the remaining metanodes in the old set
+  // identify all the sink metanodes
+  for(auto node : build.meta_nodes) {
+    if(node->children.empty()) {
+      assert(build.sink_meta_nodes.insert(node).second);
+    }
+  }
+}
+
+bool Context::install_metagraph(MetaGraphBuild& build) {
+  if(build.generation != implication_generation) {
+    return false;
+  }
+
+  // detach tags from the old metagraph
   for(auto node : meta_nodes) {
-    delete node;
+    for(auto tag : node->tags) {
+      tag->meta_node = nullptr;
+    }
   }
-  meta_nodes.clear();
 
-  if(debug) {
-    std::cerr << "tarjan: " << metanode_stack.size() << " metanodes total" << std::endl;
+  for(size_t i = 0; i < build.tags.size(); i++) {
+    build.tags[i]->meta_node = build.tag_meta_nodes[i];
   }
 
-  // set up links between metanodes in the graph
-  while(metanode_stack.size()) {
-    auto top = metanode_stack.top();
-    metanode_stack.pop();
-    meta_nodes.insert(top);
+  // the old metanodes are freed along with 'build'
+  std::swap(meta_nodes, build.meta_nodes);
+  std::swap(sink_meta_nodes, build.sink_meta_nodes);
+  build.sink_meta_nodes.clear();
 
-    if(debug) {
-      std::cerr << "tarjan: linking ";
-      top->print_tag_set(std::cerr) << std::endl;
+  this->recalc_metagraph = false;
+  implication_generation++;
+  stats.metagraph_changed();
+  tiering.invalidate();
+
+  refresh_standing_queries();
+  return true;
+}
+
+void Context::refresh_standing_queries() {
+  // wait for a clean metagraph before bringing the standing queries up to
+  // date; until then they keep checking entities against the old one
+  if(is_dirty() || standing_queries.empty()) return;
+
+  for(auto sq : standing_queries) {
+    sq->expand();
+  }
+
+  if(standing_implication_changes.empty()) return;
+
+  // the entities affected are the ones tagged with a changed tag, or with
+  // anything implying one
+  TagSet impliers;
+  std::vector<Tag*> tag_stack(
+    standing_implication_changes.begin(),
+    standing_implication_changes.end());
+  standing_implication_changes.clear();
+
+  while(tag_stack.size()) {
+    auto tag = tag_stack.back();
+    tag_stack.pop_back();
+    if(!impliers.insert(tag).second) continue;
+
+    for(auto implier : tag->implied_by) {
+      tag_stack.push_back(implier);
     }
+  }
 
-    // top is a source SCC - set up links to successor metanodes
-    for(auto tag : top->tags) {
-      for(auto implied : tag->implies) {
+  std::unordered_set<Entity*> affected;
+  for(auto tag : impliers) {
+    auto& list = tag->postings();
+    affected.insert(list.begin(), list.end());
+  }
 
-        if(debug) {
-          std::cerr << "tarjan: checking edge " << tag->id << " -> " << implied->id << std::endl;
-        }
+  for(size_t i = 0; i < standing_queries.size(); ) {
+    auto sq = standing_queries[i];
 
-        auto imn = implied->meta_node;
-        assert(imn);
-        if(imn != top) {
-          auto ret = top->add_child(imn);
-          if(debug && ret) {
-            std::cerr << "adding SCC edge ";
-            top->print_tag_set(std::cerr) << " -> ";
-            imn->print_tag_set(std::cerr) << std::endl;
-          }
+    std::vector<Entity*> added, removed;
+    for(auto e : affected) {
+      sq->check(e, added, removed);
+    }
+
+    if(notify_standing_query(sq, added, removed)) i++;
+  }
+}
+
+bool Context::notify_standing_query(StandingQuery *sq, const std::vector<Entity*>& added, const std::vector<Entity*>& removed) {
+  if(added.empty() && removed.empty()) return true;
+  if(sq->listener(added, removed)) return true;
+
+  remove_standing_query(sq);
+  return false;
+}
+
+StandingQuery *Context::add_standing_query(QueryClause *source, StandingQuery::Listener listener) {
+  auto sq = new StandingQuery(source, listener);
+  sq->expand();
+  standing_queries.push_back(sq);
+
+  std::vector<Entity*> added, removed;
+  for(auto e : entities) {
+    if(!e->deleted) sq->check(e, added, removed);
+  }
+
+  return notify_standing_query(sq, added, removed) ? sq : nullptr;
+}
+
+void Context::remove_standing_query(StandingQuery *sq) {
+  auto pos = std::find(standing_queries.begin(), standing_queries.end(), sq);
+  assert(pos != standing_queries.end());
+  standing_queries.erase(pos);
+  delete sq;
+
+  if(standing_queries.empty()) {
+    standing_implication_changes.clear();
+  }
+}
+
+void Context::dirty_entity_tags(Entity *entity, Tag *tag) {
+  query_cache.invalidate_tag(tag);
+  stats.entity_tagged(entity, tag, entity->tags.find(tag) != entity->tags.end());
+
+  for(size_t i = 0; i < standing_queries.size(); ) {
+    auto sq = standing_queries[i];
+    if(sq->depends_on.find(tag) == sq->depends_on.end()) {
+      i++;
+      continue;
+    }
+
+    std::vector<Entity*> added, removed;
+    sq->check(entity, added, removed);
+    if(notify_standing_query(sq, added, removed)) i++;
+  }
+}
+
+// position of the first entity in 'list' past the range's cursor, walking
+// in the range's order. returns list.size() if there is none
+template<class List>
+static size_t range_start(const List& list, const QueryRange& range) {
+  if(range.order == QueryOrderAsc) {
+    if(!range.has_after) return 0;
+
+    auto pos = std::upper_bound(list.begin(), list.end(), range.after,
+      [](id_type id, const Entity *e) { return id < e->id; });
+    return pos - list.begin();
+  }
+  else {
+    if(!range.has_after) return list.empty() ? list.size() : list.size() - 1;
+
+    auto pos = std::lower_bound(list.begin(), list.end(), range.after,
+      [](const Entity *e, id_type id) { return e->id < id; });
+    return pos == list.begin() ? list.size() : (pos - list.begin()) - 1;
+  }
+}
+
+// k-way merge of the entity lists of groups of tags in the range's order,
+// starting at its cursor. entities on the lists of at least 'k' groups are
+// passed on, with 'filter' only those matching it too. 'examined' counts
+// the entities that got that far
+static void merge_postings(
+  const std::vector<TagSet>& groups, size_t k,
+  const QueryRange& range, const QueryClause *filter,
+  std::function<void(Entity*)>& match, size_t *examined = nullptr)
+{
+  size_t found = 0;
+  bool asc = range.order == QueryOrderAsc;
+
+  struct Cursor {
+    const EntityList *list;
+    size_t pos;
+    size_t group;
+  };
+  auto cmp = [asc](const Cursor& l, const Cursor& r) {
+    auto lid = (*l.list)[l.pos]->id;
+    auto rid = (*r.list)[r.pos]->id;
+    return asc ? lid > rid : lid < rid;
+  };
+  std::priority_queue<Cursor, std::vector<Cursor>, decltype(cmp)> heads(cmp);
+
+  for(size_t group = 0; group < groups.size(); group++) {
+    for(auto tag : groups[group]) {
+      auto& list = tag->postings();
+      auto pos = range_start(list, range);
+      if(pos < list.size()) {
+        heads.push(Cursor{&list, pos, group});
+      }
+    }
+  }
+
+  // the entity each group was last counted for
+  std::vector<const Entity*> counted(groups.size(), nullptr);
+
+  while(heads.size()) {
+    auto e = (*heads.top().list)[heads.top().pos];
+
+    // move every list past this entity, counting the groups it's in
+    size_t in_groups = 0;
+    while(heads.size()) {
+      auto top = heads.top();
+      if((*top.list)[top.pos] != e) break;
+      heads.pop();
+
+      if(counted[top.group] != e) {
+        counted[top.group] = e;
+        in_groups++;
+      }
+
+      if(asc) {
+        if(++top.pos == top.list->size()) continue;
+      }
+      else {
+        if(top.pos-- == 0) continue;
+      }
+      heads.push(top);
+    }
+
+    if(in_groups < k) continue;
+    if(examined) (*examined)++;
+
+    if(!filter || filter->matches_set(e->tags)) {
+      match(e);
+      if(++found == range.limit) return;
+    }
+  }
+}
+
+static void merge_postings(
+  const TagSet& tags, const QueryRange& range,
+  const QueryClause *filter, std::function<void(Entity*)>& match,
+  size_t *examined = nullptr)
+{
+  merge_postings(std::vector<TagSet>(1, tags), 1, range, filter, match, examined);
+}
+
+// the tags making up each operand of a threshold, if they're all unions
+// of tags
+static bool threshold_groups(const QueryClause *q, std::vector<TagSet>& groups) {
+  auto th = dynamic_cast<const QueryClauseThreshold*>(q);
+  if(!th || th->k == 0) return false;
+
+  groups.resize(th->children.size());
+  for(size_t i = 0; i < th->children.size(); i++) {
+    if(!collect_union_tags(th->children[i], groups[i])) return false;
+  }
+  return true;
+}
+
+// scans at least this long compile their clause to bytecode first; the
+// compile costs about as much as evaluating the tree a couple hundred times
+static const size_t bytecode_min_scan = 256;
+
+typedef std::chrono::steady_clock query_clock;
+
+static double elapsed_us(query_clock::time_point since) {
+  return std::chrono::duration<double, std::micro>(query_clock::now() - since).count();
+}
+
+static const char *evaluator_name(const QueryClause *q, const QueryClause *scan) {
+  if(scan == q) return "tree";
+  if(dynamic_cast<const QueryClauseBytecode*>(scan)) return "bytecode";
+  return "jit";
+}
+
+const QueryClause *Context::scan_clause(const QueryClause *q, size_t n, std::shared_ptr<const QueryClause>& compiled, QueryTrace *trace) const {
+  if(trace && trace->probe) {
+    trace->evaluator = "tree";
+    return trace->probe;
+  }
+
+  bool leaf = q->depth() == 0;
+  if(leaf || n < bytecode_min_scan || dynamic_cast<const QueryClauseBytecode*>(q)) {
+    if(trace) trace->evaluator = "tree";
+    return q;
+  }
+
+  // what a run would use, without it counting as one
+  if(trace && trace->dry_run) {
+    compiled = tiering.lookup(q);
+    trace->evaluator = compiled ? evaluator_name(q, compiled.get()) : "bytecode";
+    return compiled ? compiled.get() : q;
+  }
+
+  auto start = query_clock::now();
+
+  // the shape's JIT compiled code once it's hot, bytecode until then
+  compiled = tiering.executed(q);
+  if(!compiled) {
+    compiled.reset(compile_bytecode(q));
+  }
+  auto scan = compiled ? compiled.get() : q;
+
+  if(trace) {
+    trace->evaluator = evaluator_name(q, scan);
+    trace->compile_us += elapsed_us(start);
+  }
+  return scan;
+}
+
+size_t Context::count(const QueryClause *q) const {
+  if(dynamic_cast<const QueryClauseAny*>(q)) {
+    return num_entities();
+  }
+
+  bool negated = false;
+  if(auto not_ = dynamic_cast<const QueryClauseNot*>(q)) {
+    negated = true;
+    q = not_->c;
+  }
+
+  TagSet tags;
+  if(collect_union_tags(q, tags)) {
+    auto count = union_size(tags);
+    return negated ? num_entities() - count : count;
+  }
+
+  if(negated && dynamic_cast<const QueryClauseAny*>(q)) {
+    return 0;
+  }
+
+  std::vector<TagSet> groups;
+  if(threshold_groups(q, groups)) {
+    size_t count = 0;
+    std::function<void(Entity*)> counter = [&](Entity*) { count++; };
+    merge_postings(groups, ((const QueryClauseThreshold*) q)->k, QueryRange(), nullptr, counter);
+    return negated ? num_entities() - count : count;
+  }
+
+  // fall back to a counting scan
+  std::shared_ptr<const QueryClause> compiled;
+  auto& list = sorted_entities();
+  auto scan = scan_clause(q, list.size(), compiled, nullptr);
+
+  size_t count = 0;
+  for(auto e : list) {
+    if(!e->deleted && scan->matches_set(e->tags)) {
+      count++;
+    }
+  }
+
+  return negated ? num_entities() - count : count;
+}
+
+bool Context::index_driver(const QueryClause *q, const QueryRange& range, TagSet& driver) const {
+  auto bin  = dynamic_cast<const QueryClauseBin*>(q);
+  auto nary = dynamic_cast<const QueryClauseNary*>(q);
+  if(!(bin && bin->type == QueryClauseAnd) && !(nary && nary->type == QueryClauseAnd)) return false;
+
+  double n = num_entities();
+  if(n == 0) return false;
+
+  // an entity can only match if it matches every operand of the AND
+  std::vector<const QueryClause*> operands;
+  std::vector<const QueryClause*> stack(1, q);
+  while(stack.size()) {
+    auto top = stack.back();
+    stack.pop_back();
+
+    auto and_  = dynamic_cast<const QueryClauseBin*>(top);
+    auto nand_ = dynamic_cast<const QueryClauseNary*>(top);
+    if(and_ && and_->type == QueryClauseAnd) {
+      stack.push_back(and_->r);
+      stack.push_back(and_->l);
+    }
+    else if(nand_ && nand_->type == QueryClauseAnd) {
+      stack.insert(stack.end(), nand_->children.rbegin(), nand_->children.rend());
+    }
+    else {
+      operands.push_back(top);
+    }
+  }
+
+  // either way every entity looked at is run through 'q', and a limited
+  // query stops once it has found enough. matches are assumed to be
+  // spread evenly over the ids
+  double eval = stats.cost(q);
+  double matching = stats.selectivity(q) * n;
+  double read = 1;
+  if(range.limit != SIZE_MAX && matching > 0) {
+    read = std::min(1.0, range.limit / matching);
+  }
+
+  double best = n * read * eval;
+  bool found = false;
+  for(auto op : operands) {
+    TagSet tags;
+    if(!collect_union_tags(op, tags)) continue;
+
+    double postings = 0;
+    for(auto tag : tags) postings += tag->entity_count();
+
+    // plus a heap operation per posting
+    double cost = postings * read * (eval + std::log2(tags.size() + 1));
+    if(cost < best) {
+      best = cost;
+      driver.swap(tags);
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+void Context::query(const QueryClause *q, const QueryRange& range, std::function<void(Entity*)> match, QueryTrace *trace) const {
+  if(range.limit == 0) return;
+
+  // the candidates found by merging entity lists are only tested against
+  // a probe, where they'd otherwise always match
+  const QueryClause *probe = trace ? trace->probe : nullptr;
+  size_t *examined = trace ? &trace->examined : nullptr;
+
+  TagSet tags;
+  if(collect_union_tags(q, tags)) {
+    if(trace) {
+      trace->engine = "postings";
+      if(trace->dry_run) return;
+    }
+
+    merge_postings(tags, range, probe, match, examined);
+    return;
+  }
+
+  // count, per entity, how many of the threshold's operands list it
+  std::vector<TagSet> groups;
+  if(threshold_groups(q, groups)) {
+    if(trace) {
+      trace->engine = "threshold";
+      if(trace->dry_run) return;
+    }
+
+    merge_postings(groups, ((const QueryClauseThreshold*) q)->k, range, probe, match, examined);
+    return;
+  }
+
+  // read candidates off the entity lists of one of an AND's operands,
+  // when the statistics say that beats a scan
+  std::shared_ptr<const QueryClause> compiled;
+  if(index_driver(q, range, tags)) {
+    size_t postings = 0;
+    for(auto tag : tags) postings += tag->entity_count();
+
+    auto filter = scan_clause(q, postings, compiled, trace);
+    if(trace) {
+      trace->engine = "index";
+      trace->driver.assign(tags.begin(), tags.end());
+      if(trace->dry_run) return;
+    }
+
+    merge_postings(tags, range, filter, match, examined);
+    return;
+  }
+
+  // scan from the cursor, stopping as soon as the limit is hit
+  auto& list = sorted_entities();
+  auto scan = scan_clause(q, list.size(), compiled, trace);
+  if(trace) {
+    trace->engine = "scan";
+    if(trace->dry_run) return;
+  }
+
+  size_t found = 0;
+  size_t tested = 0;
+  bool asc = range.order == QueryOrderAsc;
+  auto pos = range_start(list, range);
+  while(pos < list.size()) {
+    auto e = list[pos];
+    if(!e->deleted) {
+      tested++;
+      if(scan->matches_set(e->tags)) {
+        match(e);
+        if(++found == range.limit) break;
+      }
+    }
+
+    if(asc) pos++;
+    else if(pos-- == 0) break;
+  }
+  if(examined) *examined += tested;
+}
+
+QueryExplain Context::explain(const QueryClause *source, const QueryRange& range, bool analyze) const {
+  QueryExplain ret;
+
+  auto start = query_clock::now();
+  std::unique_ptr<QueryClause> clause(optimize_query(expand_implications(source)));
+  ret.optimize_us = elapsed_us(start);
+  ret.plan = explain_clause(clause.get(), stats, num_entities());
+
+  QueryTrace trace;
+  trace.dry_run = !analyze;
+
+  start = query_clock::now();
+  query(clause.get(), range, [&](Entity*) { ret.rows++; }, &trace);
+  double run_us = elapsed_us(start);
+
+  ret.engine    = trace.engine;
+  ret.evaluator = trace.evaluator;
+  for(auto t : trace.driver) ret.driver.push_back(t->id);
+  std::sort(ret.driver.begin(), ret.driver.end());
+  if(!analyze) return ret;
+
+  ret.analyzed   = true;
+  ret.examined   = trace.examined;
+  ret.compile_us = trace.compile_us;
+  ret.execute_us = run_us - trace.compile_us;
+
+  // again, with the plan's nodes counting what they do
+  std::unique_ptr<QueryClause> probe(build_probe(clause.get(), ret.plan));
+  QueryTrace counting;
+  counting.probe = probe.get();
+  query(clause.get(), range, [](Entity*) {}, &counting);
+
+  return ret;
+}
+
+void Context::cached_query(const QueryClause *source, const QueryRange& range, std::function<void(Entity*)> match) const {
+  std::string key;
+  QueryCache::Results results;
+
+  // results computed against a stale metagraph aren't worth keeping
+  bool cacheable = !recalc_metagraph && query_cache_key(source, key);
+  if(cacheable) {
+    results = query_cache.lookup(key);
+  }
+
+  if(!results) {
+    std::unique_ptr<QueryClause> clause(optimize_query(expand_implications(source)));
+
+    // a limited query can stop early, which beats computing the whole
+    // result just to cache it
+    if(!cacheable || range.limit != SIZE_MAX) {
+      query(clause.get(), range, match);
+      return;
+    }
+
+    auto all = std::make_shared<std::vector<Entity*> >();
+    query(clause.get(), QueryRange(), [&](Entity *e) {
+      all->push_back(e);
+    });
+    query_cache.insert(key, clause.get(), all);
+    results = all;
+  }
+
+  size_t found = 0;
+  auto pos = range_start(*results, range);
+  while(pos < results->size() && found < range.limit) {
+    match((*results)[pos]);
+    found++;
+
+    if(range.order == QueryOrderAsc) pos++;
+    else if(pos-- == 0) break;
+  }
+}
+
+size_t Context::cached_count(const QueryClause *source) const {
+  std::string key;
+  if(!recalc_metagraph && query_cache_key(source, key)) {
+    auto results = query_cache.lookup(key);
+    if(results) return results->size();
+  }
+
+  std::unique_ptr<QueryClause> clause(optimize_query(expand_implications(source)));
+  return count(clause.get());
+}
+
+// tallies tags carried by matching entities, one entity at a time
+struct FacetCounter {
+  bool implied;
+
+  std::unordered_map<Tag*, size_t> tag_counts;
+  std::unordered_map<SCCMetaNode*, size_t> node_counts;
+
+  // last entity each metanode was counted for, so a metanode reachable
+  // through several of an entity's tags is only counted once
+  std::unordered_map<SCCMetaNode*, const Entity*> node_seen;
+  std::vector<SCCMetaNode*> node_stack;
+
+  FacetCounter(bool implied_) : implied(implied_) {}
+
+  void add(const Entity *e) {
+    for(auto tag : e->tags) {
+      if(!implied || !tag->meta_node) {
+        tag_counts[tag]++;
+        continue;
+      }
+
+      // count the tag's metanode and everything it implies
+      node_stack.push_back(tag->meta_node);
+      while(node_stack.size()) {
+        auto node = node_stack.back();
+        node_stack.pop_back();
+
+        auto& seen = node_seen[node];
+        if(seen == e) continue;
+        seen = e;
+
+        node_counts[node]++;
+        for(auto child : node->children) {
+          node_stack.push_back(child);
         }
       }
     }
   }
 
-  // identify all the sink metanodes
-  sink_meta_nodes.clear();
-  for(auto node : meta_nodes) {
-    if(node->children.empty()) {
-      assert(sink_meta_nodes.insert(node).second);
+  size_t count(Tag *tag) const {
+    if(implied && tag->meta_node) {
+      auto iter = node_counts.find(tag->meta_node);
+      return iter == node_counts.end() ? 0 : (*iter).second;
+    }
+
+    auto iter = tag_counts.find(tag);
+    return iter == tag_counts.end() ? 0 : (*iter).second;
+  }
+};
+
+// feeds every entity matching 'q' to 'counter', through the same planned
+// query do_query runs rather than a scan over all the entities
+static void tally_facets(const Context& ctx, const QueryClause *q, FacetCounter& counter) {
+  std::unique_ptr<QueryClause> planned(ctx.optimize_query(q->dup()));
+  ctx.query(planned.get(), QueryRange(), [&](Entity *e) {
+    counter.add(e);
+  }, nullptr);
+}
+
+std::vector<TagFacet> Context::facets(const QueryClause *q, const std::vector<Tag*>& candidates, bool implied) const {
+  std::vector<TagFacet> ret;
+  ret.reserve(candidates.size());
+
+  // for a handful of direct tags, walking their entity lists and testing
+  // each entity against the query beats scanning all the matches
+  size_t postings_size = 0;
+  for(auto tag : candidates) {
+    postings_size += tag->entity_count();
+  }
+
+  if(!implied && postings_size < num_entities()) {
+    for(auto tag : candidates) {
+      size_t count = 0;
+      for(auto e : tag->postings()) {
+        if(q->matches_set(e->tags)) count++;
+      }
+      ret.push_back(TagFacet(tag, count));
+    }
+
+    return ret;
+  }
+
+  FacetCounter counter(implied);
+  tally_facets(*this, q, counter);
+
+  for(auto tag : candidates) {
+    ret.push_back(TagFacet(tag, counter.count(tag)));
+  }
+
+  return ret;
+}
+
+std::vector<TagFacet> Context::top_facets(const QueryClause *q, size_t k, bool implied) const {
+  FacetCounter counter(implied);
+  tally_facets(*this, q, counter);
+
+  std::vector<TagFacet> ret;
+  for(auto& tag_count : counter.tag_counts) {
+    ret.push_back(TagFacet(tag_count.first, tag_count.second));
+  }
+  for(auto& node_count : counter.node_counts) {
+    for(auto tag : node_count.first->tags) {
+      ret.push_back(TagFacet(tag, node_count.second));
     }
   }
+
+  auto by_count = [](const TagFacet& l, const TagFacet& r) {
+    if(l.count != r.count) return l.count > r.count;
+    return l.tag->id < r.tag->id;
+  };
+
+  if(ret.size() > k) {
+    std::partial_sort(ret.begin(), ret.begin() + k, ret.end(), by_count);
+    ret.erase(ret.begin() + k, ret.end());
+  }
+  else {
+    std::sort(ret.begin(), ret.end(), by_count);
+  }
+
+  return ret;
 }
 
 Tag *Context::new_tag_common(id_type id) {
-  auto t = new Tag(this, id);
+  auto t = new Tag(this, id, &memory);
+  memory.tags.add(sizeof(Tag));
   this->id_to_tag.insert(std::make_pair(id, t));
   return t;
 }
@@ -459,14 +1169,42 @@ Tag *Context::new_tag() {
 Entity* Context::new_entity(id_type id) {
   if(id_to_entity.find(id) == id_to_entity.end()) {
     // id not present
-    auto e = new Entity(id);
+    auto e = new Entity(id, &memory);
+    memory.entities.add(sizeof(Entity));
     id_to_entity.insert(std::make_pair(id, e));
+
+    // entities usually come in with increasing ids. any that don't wait
+    // for the next reader to sort them in, so a bulk load in no particular
+    // order sorts once rather than shifting the list for every entity
+    if(!entities.empty() && id < entities.back()->id) {
+      entities_unsorted.store(true, std::memory_order_release);
+    }
+    entities.push_back(e);
+
+    // an untagged entity can still match, e.g. a 'not' query
+    query_cache.invalidate_untagged();
+    for(size_t i = 0; i < standing_queries.size(); ) {
+      std::vector<Entity*> added, removed;
+      standing_queries[i]->check(e, added, removed);
+      if(notify_standing_query(standing_queries[i], added, removed)) i++;
+    }
+
     return e;
   }
 
   return nullptr;
 }
 
+void Context::sort_entities() const {
+  // readers share the context, so the first one in sorts while the rest
+  // wait
+  std::lock_guard<std::mutex> lock(entities_mutex);
+  if(!entities_unsorted.load(std::memory_order_relaxed)) return;
+
+  std::sort(entities.begin(), entities.end(), entity_id_less);
+  entities_unsorted.store(false, std::memory_order_release);
+}
+
 Entity* Context::new_entity() {
   // no ID given, keep looping until we find the next available ID
   while(true) {
@@ -477,6 +1215,140 @@ Entity* Context::new_entity() {
   }
 }
 
+void Context::delete_entity(Entity *e) {
+  assert(!e->deleted);
+
+  // off its tags' entity lists, and out of the results cached for them.
+  // not through remove_tag, which would re-check it against the standing
+  // queries as an untagged entity
+  for(auto tag : e->tags) {
+    tag->remove_entity(e);
+    query_cache.invalidate_tag(tag);
+    stats.entity_tagged(e, tag, false);
+  }
+  e->tags.clear();
+
+  // an untagged entity can still match, e.g. a 'not' query
+  query_cache.invalidate_untagged();
+
+  e->deleted = true;
+  deleted_entities++;
+  id_to_entity.erase(e->id);
+
+  for(size_t i = 0; i < standing_queries.size(); ) {
+    auto sq = standing_queries[i];
+    if(sq->matches.erase(e) == 0) {
+      i++;
+      continue;
+    }
+
+    std::vector<Entity*> added, removed(1, e);
+    if(notify_standing_query(sq, added, removed)) i++;
+  }
+}
+
+bool Context::delete_tag(Tag *tag) {
+  // standing queries are re-expanded from their source as the metagraph
+  // changes, so the tags in it have to stay
+  for(auto sq : standing_queries) {
+    TagSet source_tags;
+    collect_dependencies(sq->source, source_tags);
+    if(source_tags.find(tag) != source_tags.end()) return false;
+  }
+
+  // the implications go the way unimply takes them, updating the metagraph
+  // incrementally, or marking it dirty when that breaks up a cycle
+  std::vector<Tag*> others(tag->implied_by.begin(), tag->implied_by.end());
+  for(auto implier : others) {
+    implier->unimply(tag);
+  }
+  others.assign(tag->implies.begin(), tag->implies.end());
+  for(auto implied : others) {
+    tag->unimply(implied);
+  }
+
+  // then it comes off its entities as with remove_tag, last first so the
+  // entity list is shortened from the end
+  auto& list = tag->postings();
+  std::vector<Entity*> tagged(list.begin(), list.end());
+  for(auto i = tagged.rbegin(); i != tagged.rend(); ++i) {
+    (*i)->remove_tag(tag);
+  }
+
+  // a clean metagraph has dropped the tag's metanode along with its last
+  // implication, unless it was part of a cycle, which left the metagraph
+  // dirty. the stale metanode stays until the rebuild replaces it, as
+  // standing queries may still refer to it, but without the tag
+  if(tag->meta_node) {
+    tag->meta_node->tags.erase(tag);
+    tag->meta_node = nullptr;
+  }
+
+  // cached results for the tag, even empty ones, mustn't outlive it, and
+  // rebuilds snapshotted with it in mustn't be installed
+  query_cache.invalidate_tag(tag);
+  stats.tag_deleted(tag);
+  stats.metagraph_changed();
+  tiering.invalidate();
+  implication_generation++;
+  standing_implication_changes.erase(tag);
+
+  id_to_tag.erase(tag->id);
+  deleted_tags.push_back(tag);
+  return true;
+}
+
+size_t Context::compact() {
+  ScopedLatency timer(telemetry.compact);
+  size_t freed = 0;
+
+  if(deleted_entities) {
+    size_t live = 0;
+    for(auto e : entities) {
+      if(e->deleted) {
+        delete e;
+        memory.entities.remove(sizeof(Entity));
+        freed++;
+      }
+      else {
+        entities[live++] = e;
+      }
+    }
+    entities.resize(live);
+    deleted_entities = 0;
+  }
+
+  if(!deleted_tags.empty()) {
+    // queued compiles may still be reading clauses naming them
+    tiering.wait_idle();
+
+    for(auto t : deleted_tags) {
+      delete t;
+      memory.tags.remove(sizeof(Tag));
+      freed++;
+    }
+    deleted_tags.clear();
+    deleted_tags.shrink_to_fit();
+  }
+
+  // lists and indexes that mostly emptied out keep their capacity until
+  // shrunk
+  if(entities.capacity() > 2 * entities.size()) {
+    entities.shrink_to_fit();
+  }
+  for(auto& kv : id_to_tag) {
+    kv.second->compact();
+  }
+  if(id_to_entity.bucket_count() > 2 * id_to_entity.size()) {
+    id_to_entity.rehash(0);
+  }
+  if(id_to_tag.bucket_count() > 2 * id_to_tag.size()) {
+    id_to_tag.rehash(0);
+  }
+
+  return freed;
+}
+
 Tag* Context::tag_by_id(id_type tid) const {
   auto iter = id_to_tag.find(tid);
   if(iter != id_to_tag.end()) {
@@ -487,6 +1359,16 @@ Tag* Context::tag_by_id(id_type tid) const {
   }
 }
 
+std::vector<Tag*> Context::all_tags() const {
+  std::vector<Tag*> ret;
+  ret.reserve(id_to_tag.size());
+  for(auto& kv : id_to_tag) {
+    ret.push_back(kv.second);
+  }
+  std::sort(ret.begin(), ret.end(), [](const Tag *l, const Tag *r) { return l->id < r->id; });
+  return ret;
+}
+
 // entity lookup functions
 Entity* Context::entity_by_id(id_type eid) const {
   auto iter = id_to_entity.find(eid);
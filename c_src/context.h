@@ -6,38 +6,214 @@
 #include <unordered_map>
 #include <algorithm>
 #include <utility>
+#include <cstdint>
+#include <functional>
+#include <atomic>
+#include <mutex>
 
 #include "entity.h"
 #include "query.h"
 #include "scc_meta_node.h"
+#include "standing_query.h"
+#include "query_cache.h"
+#include "query_stats.h"
+#include "query_tiering.h"
+#include "query_explain.h"
+#include "telemetry.h"
 
 struct Tag;
 
+enum QueryOrder {
+  QueryOrderAsc,
+  QueryOrderDesc
+};
+
+// bounds on a query evaluated in entity id order
+struct QueryRange {
+  QueryOrder order;
+
+  // only entities after 'after' (in 'order') are matched
+  bool has_after;
+  id_type after;
+
+  // stop after this many matches
+  size_t limit;
+
+  QueryRange() :
+    order(QueryOrderAsc),
+    has_after(false),
+    after(0),
+    limit(SIZE_MAX) {}
+};
+
+// number of matching entities carrying a tag
+struct TagFacet {
+  Tag *tag;
+  size_t count;
+
+  TagFacet(Tag *tag_, size_t count_) : tag(tag_), count(count_) {}
+};
+
+// what query() did with a query, filled in when it's passed one
+struct QueryTrace {
+  // as in QueryExplain
+  const char *engine;
+  const char *evaluator;
+  std::vector<Tag*> driver;
+
+  // entities tested against the query
+  size_t examined;
+  double compile_us;
+
+  // pick the engine and evaluator, but don't run anything
+  bool dry_run;
+
+  // tested against the candidates in place of the query's clause
+  const QueryClause *probe;
+
+  QueryTrace() :
+    engine("none"),
+    evaluator("none"),
+    examined(0),
+    compile_us(0),
+    dry_run(false),
+    probe(nullptr) {}
+};
+
+// a metagraph computed away from the live context, so the expensive part of
+// a rebuild can run without holding the context's write lock:
+//  - snapshot_implications copies the implication edges (cheap, needs a read lock)
+//  - build_metagraph runs Tarjan's algorithm on the copy (needs no lock at all)
+//  - install_metagraph swaps the result in (needs a write lock, no graph walks)
+struct MetaGraphBuild {
+  // implication generation the snapshot was taken at
+  uint64_t generation;
+
+  // tags taking part in the implication graph, and their outgoing
+  // edges as indexes into 'tags'
+  std::vector<Tag*> tags;
+  std::vector<std::vector<size_t> > implies;
+
+  // output of build_metagraph, counted into 'memory' (the context's,
+  // set by snapshot_implications)
+  MemoryCounter *memory;
+  MetaNodeSet meta_nodes;
+  MetaNodeSet sink_meta_nodes;
+  std::vector<SCCMetaNode*> tag_meta_nodes; // parallel to 'tags'
+
+  MetaGraphBuild() : generation(0), memory(nullptr) {}
+  ~MetaGraphBuild();
+
+private:
+  MetaGraphBuild(const MetaGraphBuild&);
+  MetaGraphBuild& operator=(const MetaGraphBuild&);
+};
+
+// runs Tarjan's SCC algorithm over the snapshot in 'build', filling in
+// its metanodes. touches nothing but 'build'
+void build_metagraph(MetaGraphBuild& build);
+
 struct Context {
 private:
+  typedef std::unordered_map<id_type, Tag*, std::hash<id_type>, std::equal_to<id_type>,
+    CountingAllocator<std::pair<const id_type, Tag*> > > TagIndex;
+  typedef std::unordered_map<id_type, Entity*, std::hash<id_type>, std::equal_to<id_type>,
+    CountingAllocator<std::pair<const id_type, Entity*> > > EntityIndex;
+
   id_type last_tag_id;
   id_type last_entity_id;
 
-  std::unordered_map<id_type,     Tag*> id_to_tag;
+  // what everything below is using, counted as it's allocated
+  mutable MemoryAccount memory;
+
+  TagIndex    id_to_tag;
 
-  std::unordered_map<id_type,  Entity*> id_to_entity;
+  EntityIndex id_to_entity;
+
+  // all entities, sorted by id. ones created out of id order are appended
+  // and sorted into place by the next reader (see sorted_entities), rather
+  // than each being inserted. deleted ones stay in it until compact()
+  mutable EntityList entities;
+  mutable std::atomic<bool> entities_unsorted;
+  mutable std::mutex entities_mutex;
+
+  const EntityList& sorted_entities() const {
+    if(entities_unsorted.load(std::memory_order_acquire)) sort_entities();
+    return entities;
+  }
+  void sort_entities() const;
+
+  // entities in 'entities' that are deleted, and deleted tags, waiting for
+  // compact() to free them
+  size_t deleted_entities;
+  std::vector<Tag*> deleted_tags;
 
   // does the metagraph need recalculating? call make_clean
   // to recalculate the metagraph
   bool recalc_metagraph;
 
+  // bumped on every change to the implication edges, and every time a new
+  // metagraph is installed
+  uint64_t implication_generation;
+
+  // registered standing queries, and tags whose outgoing implications
+  // changed since the standing queries were last brought up to date
+  std::vector<StandingQuery*> standing_queries;
+  TagSet standing_implication_changes;
+
+  // full results of recent queries, see cached_query
+  mutable QueryCache query_cache;
+
+  // what the optimizer knows about the entities and tags
+  QueryStats stats;
+
+  // how often each query shape runs, and the compiled code of hot ones
+  mutable QueryTiering tiering;
+
+  // rebuild timings and the like
+  mutable ContextTelemetry telemetry;
+
   // internals
   Tag *new_tag_common(id_type id);
 
+  // pick the operand of an AND whose entity lists are cheapest to read the
+  // query's candidates off, if that beats scanning every entity
+  bool index_driver(const QueryClause *q, const QueryRange& range, TagSet& driver) const;
+
+  // the clause to test each of 'n' entities against: JIT compiled once the
+  // query's shape is hot, compiled to bytecode when there are enough
+  // entities to pay for that, else 'q' itself. 'compiled' holds on to the
+  // compiled clause for the caller
+  const QueryClause *scan_clause(const QueryClause *q, size_t n, std::shared_ptr<const QueryClause>& compiled, QueryTrace *trace) const;
+
+  // incrementally update the metagraph for an implication change
+  void update_imply_dag(Tag* tag, bool gained_imply, Tag* target);
+
+  // run a standing query's listener, unregistering it if asked to
+  bool notify_standing_query(StandingQuery *sq, const std::vector<Entity*>& added, const std::vector<Entity*>& removed);
+
+  // re-expand the standing queries and re-check the entities affected by
+  // implication changes, once the metagraph is clean
+  void refresh_standing_queries();
+
 public:
   // meta nodes representing the DAG of tag implications
-  std::unordered_set<SCCMetaNode*> meta_nodes;
-  std::unordered_set<SCCMetaNode*> sink_meta_nodes;
+  MetaNodeSet meta_nodes;
+  MetaNodeSet sink_meta_nodes;
 
   Context() :
     last_tag_id(0),
     last_entity_id(0),
-    recalc_metagraph(false)
+    id_to_tag(TagIndex::allocator_type(&memory.tags)),
+    id_to_entity(EntityIndex::allocator_type(&memory.entities)),
+    entities(EntityList::allocator_type(&memory.entities)),
+    entities_unsorted(false),
+    deleted_entities(0),
+    recalc_metagraph(false),
+    implication_generation(0),
+    stats(*this, &memory.stats),
+    meta_nodes(MetaNodeSet::allocator_type(&memory.meta_nodes)),
+    sink_meta_nodes(MetaNodeSet::allocator_type(&memory.meta_nodes))
     {}
   ~Context();
 
@@ -60,28 +236,135 @@ public:
   // tag. 'gained_imply' true if it now implies other, false if implication removed
   void dirty_tag_imply_dag(Tag* dirtying_tag, bool gained_imply, Tag* other);
 
+  // notify the context that 'tag' was added to or removed from 'entity'
+  void dirty_entity_tags(Entity *entity, Tag *tag);
+
   // look up entity by id
   Entity* entity_by_id(id_type eid) const;
 
+  // every tag, sorted by id
+  std::vector<Tag*> all_tags() const;
+
+  // every entity, sorted by id, including deleted ones compact() hasn't
+  // freed yet (check Entity::deleted)
+  const EntityList& all_entities() const {
+    return sorted_entities();
+  }
+
+  // removes 'e' from the context: its tags are taken off it (updating the
+  // cache, statistics and standing queries as remove_tag would) and it's
+  // dropped from the id index, so it can't be found or matched any more.
+  // the entity itself is freed by compact()
+  void delete_entity(Entity *e);
+
+  // removes 'tag' from the context, along with its implications (the
+  // metagraph is updated incrementally, as unimply would) and its place
+  // on every entity carrying it. the tag itself is freed by compact().
+  // returns false (and deletes nothing) if a standing query refers to it
+  bool delete_tag(Tag *tag);
+
+  // compact() is worth running once this fraction of the entity list (or
+  // of the tags) is waiting to be freed
+  static constexpr double compact_threshold = 0.25;
+
+  // deleted entities and tags waiting for compact()
+  size_t num_deleted_entities() const {
+    return deleted_entities;
+  }
+  size_t num_deleted_tags() const {
+    return deleted_tags.size();
+  }
+
+  bool needs_compaction() const {
+    return
+      deleted_entities > entities.size() * compact_threshold ||
+      deleted_tags.size() > (id_to_tag.size() + deleted_tags.size()) * compact_threshold;
+  }
+
+  // frees deleted entities and tags, drops them from the entity list, and
+  // shrinks the entity lists and id indexes that have mostly emptied out,
+  // so memory and the cost of full scans follow the live entities.
+  // returns the number of entities and tags freed
+  size_t compact();
+
+  // register a standing query over 'source', a clause built from bare
+  // QueryClauseLits (the context takes ownership of it). its initial
+  // matches are passed to the listener as additions
+  StandingQuery *add_standing_query(QueryClause *source, StandingQuery::Listener listener);
+  void remove_standing_query(StandingQuery *sq);
+
   // calls 'match' with all entities that match the QueryClause
+  // on a dirty context, tags are resolved against the metagraph as it was
+  // before the context went dirty; call make_clean first to see the
+  // latest implications
   template<class UnaryFunction>
   void query(const QueryClause *q, UnaryFunction match) const {
-    if(is_dirty()) {
-      assert(false && "can't call query on dirty context");
-    }
-
-    // TODO: use for() here
-    auto iter = id_to_entity.begin();
-    auto end = id_to_entity.end();
-    for(; iter != end; iter++) {
-      auto e = (*iter).second;
-
-      if(q->matches_set(e->tags)) {
+    for(auto e : sorted_entities()) {
+      if(!e->deleted && q->matches_set(e->tags)) {
         match(e);
       }
     }
   }
 
+  // calls 'match' with the entities that match the QueryClause within
+  // 'range', in entity id order. unions of tags are read off the tags'
+  // entity lists, an AND off the entity lists of its most selective union
+  // of tags when that's estimated to be cheaper, anything else scans the
+  // entities from the range's cursor. what was done is recorded in 'trace'
+  void query(const QueryClause *q, const QueryRange& range, std::function<void(Entity*)> match, QueryTrace *trace = nullptr) const;
+
+  // how query() would run 'source', a clause built from bare
+  // QueryClauseLits, within 'range'. with 'analyze' it's run (bypassing
+  // the result cache) to time it and count what each node of the plan did
+  QueryExplain explain(const QueryClause *source, const QueryRange& range, bool analyze) const;
+
+  // query() for 'source', a clause built from bare QueryClauseLits, going
+  // through the result cache. unlimited queries on a clean metagraph fill
+  // the cache, and any range of a cached result is served from it
+  void cached_query(const QueryClause *source, const QueryRange& range, std::function<void(Entity*)> match) const;
+
+  // count() for 'source', answered from the result cache when it's there
+  size_t cached_count(const QueryClause *source) const;
+
+  QueryCache& get_query_cache() const {
+    return query_cache;
+  }
+
+  const QueryStats& get_stats() const {
+    return stats;
+  }
+
+  QueryTiering& get_tiering() const {
+    return tiering;
+  }
+
+  ContextTelemetry& get_telemetry() const {
+    return telemetry;
+  }
+
+  MemoryAccount& get_memory() const {
+    return memory;
+  }
+
+  // cost based optimization of 'clause' (expanded against the metagraph)
+  // using the context's statistics. takes ownership of 'clause'
+  QueryClause *optimize_query(QueryClause *clause) const {
+    return optimize(clause, stats);
+  }
+
+  // number of entities matching the QueryClause, without materializing them.
+  // answered from the tags' entity lists when the clause is a literal, a
+  // metanode, an OR of those or the negation of one, otherwise by a
+  // counting scan
+  size_t count(const QueryClause *q) const;
+
+  // for each of 'candidates', how many of the entities matching 'q' carry
+  // it. with 'implied', tags implied by an entity's tags count as carried
+  std::vector<TagFacet> facets(const QueryClause *q, const std::vector<Tag*>& candidates, bool implied) const;
+
+  // the 'k' tags carried by the most entities matching 'q', most common first
+  std::vector<TagFacet> top_facets(const QueryClause *q, size_t k, bool implied) const;
+
   // context statistics
   size_t num_tags() const {
     return id_to_tag.size();
@@ -99,10 +382,24 @@ public:
   // happen all in one go with a call to make_clean
   void mark_dirty() {
     recalc_metagraph = true;
+    implication_generation++;
+  }
+
+  uint64_t get_implication_generation() const {
+    return implication_generation;
   }
 
   // recalculate the metagraph of tag implications from scratch
   void make_clean();
+
+  // copy the implication edges into 'build' for an out of line rebuild
+  void snapshot_implications(MetaGraphBuild& build) const;
+
+  // swap the metagraph in 'build' in as the context's metagraph, handing
+  // the old metanodes to 'build' to be freed along with it.
+  // returns false (and installs nothing) if the implications changed
+  // since the snapshot was taken
+  bool install_metagraph(MetaGraphBuild& build);
 };
 
 #endif
@@ -0,0 +1,20 @@
+#include "entity.h"
+#include "context.h"
+
+bool Entity::add_tag(Tag* t) {
+  auto success = tags.insert(t).second;
+  if(success) {
+    t->add_entity(this);
+    t->context->dirty_entity_tags(this, t);
+  }
+  return success;
+}
+
+bool Entity::remove_tag(Tag* t) {
+  auto success = tags.erase(t) == 1;
+  if(success) {
+    t->remove_entity(this);
+    t->context->dirty_entity_tags(this, t);
+  }
+  return success;
+}
@@ -8,26 +8,30 @@
 // represents an entity that can be tagged
 // is represented by a unique ID
 struct Entity {
-  std::unordered_set<Tag*> tags;
+  TagSet tags;
   id_type id;
 
-  Entity(id_type _id) : id(_id) {}
+  // set by Context::delete_entity. a deleted entity stays in the context's
+  // entity list, skipped by scans, until Context::compact frees it
+  bool deleted;
+
+  // the tag set is counted into 'memory', if given
+  Entity(id_type _id, MemoryAccount *memory = nullptr) :
+    tags(TagSet::allocator_type(memory ? &memory->entity_tags : nullptr)),
+    id(_id),
+    deleted(false) {}
 
   // add tag to the entity
   // returns:
   //  - true: tag was added
   //  - false: tag arleady on this entity
-  bool add_tag(Tag* t) {
-    auto success = tags.insert(t).second;
-    if(success) t->inc_entity_count();
-    return success;
-  }
-
-  bool remove_tag(Tag* t) {
-    auto success = tags.erase(t) == 1;
-    if(success) t->dec_entity_count();
-    return success;
-  }
+  bool add_tag(Tag* t);
+  bool remove_tag(Tag* t);
 };
 
+// orders entities by id, for the sorted entity lists
+inline bool entity_id_less(const Entity *l, const Entity *r) {
+  return l->id < r->id;
+}
+
 #endif
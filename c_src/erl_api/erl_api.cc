@@ -2,12 +2,43 @@
 #include <cassert>
 #include <cstring>
 #include <numeric>
+#include <algorithm>
+#include <thread>
+#include <memory>
+#include <chrono>
+#include <condition_variable>
 
 #include "erl_api_helpers.h"
+#include "jit_cache.h"
+#include "snapshot.h"
 
 static bool debug = false;
 
 static ErlNifResourceType *context_type = nullptr;
+static ErlNifResourceType *stream_type  = nullptr;
+
+// pool running async_query jobs, created on first use
+// (or by configure_async) and shared by all contexts
+static std::mutex async_pool_mutex;
+static std::shared_ptr<WorkerPool> async_pool;
+static size_t async_pool_threads = 0; // 0: one per core
+static size_t async_pool_queued  = 1024;
+
+// drains the pool configure_async replaced, joined by the next
+// configure_async or on unload
+static std::thread async_pool_drain;
+
+static std::shared_ptr<WorkerPool> get_async_pool() {
+  std::lock_guard<std::mutex> lock(async_pool_mutex);
+  if(!async_pool) {
+    size_t threads = async_pool_threads;
+    if(threads == 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    async_pool = std::make_shared<WorkerPool>(threads, async_pool_queued);
+  }
+  return async_pool;
+}
 
 static void context_resource_cleanup(ErlNifEnv *env, void *arg) {
   UNUSED(env);
@@ -21,6 +52,87 @@ static void context_resource_cleanup(ErlNifEnv *env, void *arg) {
   cw->~ContextWrapper();
 }
 
+// a streamed query, shared between the resource handed to erlang and the
+// jobs fetching its chunks on the async_query pool. each chunk is a query
+// of its own, resuming after the last entity sent, against the context as
+// the first chunk saw it: a write in between ends the stream
+struct QueryStream {
+  std::mutex mutex;
+
+  // kept alive until the stream finishes
+  ContextWrapper *cw;
+
+  // holds 'clause' and 'ref'
+  ErlNifEnv *env;
+  ERL_NIF_TERM clause;
+  ERL_NIF_TERM ref;
+  ErlNifPid pid;
+
+  size_t chunk_size;
+
+  // ContextWrapper::writes when the first chunk was fetched
+  bool pinned;
+  uint64_t writes;
+
+  // the range of the next chunk: after the last entity sent, and limited
+  // to what's left of the query's limit
+  QueryOpts opts;
+
+  // chunks the receiver is ready for
+  unsigned demand;
+
+  // a chunk is queued or being fetched
+  bool running;
+  bool cancelled;
+  bool finished;
+
+  QueryStream(ContextWrapper *cw_) :
+    cw(cw_),
+    env(enif_alloc_env()),
+    chunk_size(0),
+    pinned(false),
+    writes(0),
+    demand(1),
+    running(false),
+    cancelled(false),
+    finished(false) {
+    enif_keep_resource(cw);
+  }
+  ~QueryStream() { enif_free_env(env); }
+
+  // lets go of the context, called with 'mutex' held
+  void finish() {
+    if(finished) return;
+    finished = true;
+    enif_release_resource(cw);
+    cw = nullptr;
+  }
+};
+
+struct QueryStreamHandle {
+  std::shared_ptr<QueryStream> stream;
+};
+
+static void stream_pump(const std::shared_ptr<QueryStream>& stream, ErlNifEnv *caller_env);
+
+static void cancel_stream(const std::shared_ptr<QueryStream>& stream, ErlNifEnv *caller_env) {
+  {
+    std::lock_guard<std::mutex> lock(stream->mutex);
+    stream->cancelled = true;
+  }
+  stream_pump(stream, caller_env);
+}
+
+static void stream_resource_cleanup(ErlNifEnv *env, void *arg) {
+  UNUSED(env);
+  assert(arg);
+
+  // nobody is around to ack chunks anymore, let the stream go
+  QueryStreamHandle *handle = (QueryStreamHandle*) arg;
+  cancel_stream(handle->stream, nullptr);
+  handle->~QueryStreamHandle();
+}
+
 // main entrypoint that erlang talks to to perform queries on
 // a tag/entity collection context
 static int init_lib(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info) {
@@ -44,10 +156,82 @@ static int init_lib(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info) {
     return -2;
   }
 
+  stream_type = enif_open_resource_type(env,
+    nullptr, "tags_nif_stream",
+    &stream_resource_cleanup,
+    ERL_NIF_RT_CREATE, nullptr);
+
+  if(stream_type == nullptr) {
+    if(debug) std::cerr << "native: couldn't make stream resource type" << std::endl;
+    return -2;
+  }
+
   if(debug) std::cerr << "native: done with initialize" << std::endl;
   return 0;
 }
 
+// finishes the async_query jobs before the code they run goes away.
+// contexts join their own background threads as they're freed
+static void unload_lib(ErlNifEnv *env, void *priv_data) {
+  UNUSED(env);
+  UNUSED(priv_data);
+
+  std::lock_guard<std::mutex> lock(async_pool_mutex);
+  async_pool.reset();
+  if(async_pool_drain.joinable()) async_pool_drain.join();
+}
+
+// list of entity ids, in the order given
+static ERL_NIF_TERM make_id_list(ErlNifEnv *env, const id_type *ids, size_t count) {
+  // build the list back to front to keep it in result order
+  ERL_NIF_TERM res_list = enif_make_list(env, 0); // start with empty list
+  for(size_t i = count; i > 0; i--) {
+    res_list = enif_make_list_cell(env, enif_make_uint(env, ids[i - 1]), res_list);
+  }
+  return res_list;
+}
+
+// sends watchers the changes to their standing queries buffered since the
+// last flush. called with the write lock held after anything that can
+// change a standing query's matches. 'env' is the calling process's env,
+// or nullptr on threads created by the nif
+static void flush_watchers(ContextWrapper& cw, ErlNifEnv *env) {
+  for(size_t i = 0; i < cw.watchers.size(); ) {
+    Watcher *w = cw.watchers[i];
+    bool alive = true;
+
+    auto send = [&](const char *kind, std::vector<id_type>& ids) {
+      if(ids.empty() || !alive) return;
+
+      // a successful send invalidates the message env, so build each
+      // message in one of its own
+      ErlNifEnv *msg_env = enif_alloc_env();
+      auto msg = enif_make_tuple2(msg_env,
+        enif_make_copy(msg_env, w->ref),
+        enif_make_tuple2(msg_env,
+          enif_make_atom(msg_env, kind),
+          make_id_list(msg_env, ids.data(), ids.size())));
+
+      // the watcher is gone, stop maintaining its query
+      alive = enif_send(env, &w->pid, msg_env, msg);
+      enif_free_env(msg_env);
+      ids.clear();
+    };
+
+    send("removed", w->removed);
+    send("added",   w->added);
+
+    if(alive) {
+      i++;
+      continue;
+    }
+
+    cw.context.remove_standing_query(w->sq);
+    cw.watchers.erase(cw.watchers.begin() + i);
+    delete w;
+  }
+}
+
 ERL_FUNC(new_) {
   UNUSED(argv);
   ENSURE_ARG(argc == 0);
@@ -125,6 +309,7 @@ ERL_FUNC(new_entity) {
     return A_ERR(env);
   }
 
+  flush_watchers(cw, env);
   return enif_make_tuple2(env, A_OK(env), enif_make_uint(env, e->id));
 }
 
@@ -157,6 +342,7 @@ ERL_FUNC(add_tag) {
 
   if(!entity->add_tag(tag)) return A_ERR(env);
 
+  flush_watchers(cw, env);
   return A_OK(env);
 }
 
@@ -181,6 +367,7 @@ ERL_FUNC(remove_tag) {
 
   if(!entity->remove_tag(tag)) return A_ERR(env);
 
+  flush_watchers(cw, env);
   return A_OK(env);
 }
 
@@ -194,9 +381,9 @@ ERL_FUNC(entity_tags) {
   auto entity = context.entity_by_id(entity_id);
   if(!entity) return A_ERR(env);
 
-  std::unordered_set<Tag*>                            all_set; // superset of all other sets
-  std::unordered_set<Tag*>                            direct;  // direclty tagged on the entity
-  std::unordered_map<Tag*, std::unordered_set<Tag*> > implied; // implied by another tag on the post
+  TagSet                           all_set; // superset of all other sets
+  TagSet                           direct;  // direclty tagged on the entity
+  std::unordered_map<Tag*, TagSet> implied; // implied by another tag on the post
 
   // initialize direct tags and their parents
   for(Tag *tag : entity->tags) {
@@ -205,14 +392,14 @@ ERL_FUNC(entity_tags) {
   }
 
   do {
-    std::unordered_set<Tag*> tmp_all_set = all_set;
+    TagSet tmp_all_set = all_set;
 
     for(Tag *tag : all_set) {
       // walk impliers
       for(Tag *imp : tag->implies) {
         auto i = implied.find(imp);
         if(i == implied.end()) {
-          implied.insert(std::make_pair(imp, std::unordered_set<Tag*>()));
+          implied.insert(std::make_pair(imp, TagSet()));
           i = implied.find(imp);
         }
         assert(i != implied.end());
@@ -255,39 +442,919 @@ ERL_FUNC(entity_tags) {
   return enif_make_tuple2(env, A_OK(env), res_list);
 }
 
-// {handle, clause}
-ERL_FUNC(do_query) {
+// rebuilds a dirty context's metagraph on its background thread, then swaps
+// it in. readers keep querying the previous metagraph in the meantime, and
+// only wait on the write lock for the swap itself
+static void rebuild_metagraph_async(ContextWrapper *cw) {
+  bool expected = false;
+  if(!cw->rebuilding.compare_exchange_strong(expected, true)) {
+    // a rebuild is already under way
+    return;
+  }
+
+  auto job = [cw]() {
+    Context& context = cw->context;
+    ScopedLatency timer(context.get_telemetry().make_clean);
+
+    while(true) {
+      MetaGraphBuild build;
+
+      {
+        ReadLock lock(*cw);
+        if(!context.is_dirty()) break;
+        context.snapshot_implications(build);
+      }
+
+      build_metagraph(build);
+
+      {
+        WriteLock lock(*cw);
+        bool installed = context.install_metagraph(build);
+        flush_watchers(*cw, nullptr);
+        if(installed) break;
+      }
+
+      // implications changed while building; take another snapshot
+      if(debug) std::cerr << "native: metagraph changed during rebuild, retrying" << std::endl;
+    }
+
+    cw->rebuilding = false;
+  };
+
+  if(!cw->run_in_background(job)) {
+    cw->rebuilding = false;
+  }
+}
+
+// compacts the context on its background thread once enough of it is
+// deleted and waiting to be freed. the caller usually holds the write lock,
+// which the compaction then waits on, so deletes don't wait for it
+static void compact_async(ContextWrapper *cw) {
+  if(!cw->context.needs_compaction()) return;
+
+  bool expected = false;
+  if(!cw->compacting.compare_exchange_strong(expected, true)) {
+    // one's already coming
+    return;
+  }
+
+  auto job = [cw]() {
+    {
+      WriteLock lock(*cw);
+      if(cw->context.needs_compaction()) {
+        cw->context.compact();
+      }
+    }
+
+    cw->compacting = false;
+  };
+
+  if(!cw->run_in_background(job)) {
+    cw->compacting = false;
+  }
+}
+
+// delete_entity(handle, entity_id) :: :ok | :error
+ERL_FUNC(delete_entity) {
   ENSURE_ARG(argc == 2);
   ENSURE_CONTEXT(env, argv[0]);
+  WriteLock lock(cw);
 
-  Lmake_clean:
-  while(context.is_dirty()) {
-    WriteLock wlock(cw);
-    context.make_clean();
+  id_type entity_id;
+  ENSURE_ARG(enif_get_uint(env, argv[1], &entity_id));
+
+  auto entity = context.entity_by_id(entity_id);
+  if(!entity) return A_ERR(env);
+
+  context.delete_entity(entity);
+
+  flush_watchers(cw, env);
+  compact_async(&cw);
+  return A_OK(env);
+}
+
+// delete_tag(handle, tag_id) :: :ok | :error
+// :error if there's no such tag, or a standing query names it
+ERL_FUNC(delete_tag) {
+  ENSURE_ARG(argc == 2);
+  ENSURE_CONTEXT(env, argv[0]);
+  WriteLock lock(cw);
+
+  id_type tag_id;
+  ENSURE_ARG(enif_get_uint(env, argv[1], &tag_id));
+
+  auto tag = context.tag_by_id(tag_id);
+  if(!tag) return A_ERR(env);
+
+  if(!context.delete_tag(tag)) return A_ERR(env);
+
+  flush_watchers(cw, env);
+
+  // watchers only hear about the change once the metagraph is rebuilt
+  if(context.is_dirty() && !cw.watchers.empty()) {
+    rebuild_metagraph_async(&cw);
   }
 
-  ReadLock rlock(cw);
-  if(context.is_dirty()) {
-    // 'goto' will call the dtor on rlock, as it's jumping
-    // before its decl. spec section 6.6, paragraph 2
-    goto Lmake_clean;
+  compact_async(&cw);
+  return A_OK(env);
+}
+
+// compact(handle) :: {:ok, freed}
+// frees deleted entities and tags without waiting for the background
+// compaction to get to them
+ERL_FUNC(compact) {
+  ENSURE_ARG(argc == 1);
+  ENSURE_CONTEXT(env, argv[0]);
+  WriteLock lock(cw);
+
+  return enif_make_tuple2(env, A_OK(env), enif_make_uint64(env, context.compact()));
+}
+
+// read lock taken by the query functions. with 'consistent' set, a dirty
+// metagraph is rebuilt inline before the lock is handed out, otherwise a
+// background rebuild is started and the query runs against the previous
+// metagraph
+struct QueryLock {
+  ContextWrapper& ctx;
+
+  // 'env' is passed on to flush_watchers
+  QueryLock(ContextWrapper& ctx_, const QueryOpts& opts, ErlNifEnv *env) : ctx(ctx_) {
+    Context& context = ctx.context;
+
+    while(true) {
+      while(opts.consistent && context.is_dirty()) {
+        WriteLock wlock(ctx);
+        context.make_clean();
+        flush_watchers(ctx, env);
+      }
+
+      {
+        ScopedLatency wait(ctx.telemetry.read_lock_wait);
+        ctx.mutex.lock();
+        ctx.readers++;
+        ctx.mutex.unlock();
+      }
+
+      if(!context.is_dirty()) break;
+
+      if(!opts.consistent) {
+        rebuild_metagraph_async(&ctx);
+        break;
+      }
+
+      // dirtied again between the rebuild and taking the read lock
+      ctx.release_reader();
+    }
+  }
+
+  ~QueryLock() {
+    ctx.release_reader();
   }
+};
+
+// binary of native endian entity ids, or 'error' if it couldn't be allocated
+static ERL_NIF_TERM make_id_binary(ErlNifEnv *env, const id_type *ids, size_t count) {
+  ErlNifBinary bin;
+  if(!enif_alloc_binary(count * sizeof(id_type), &bin)) {
+    return A_ERR(env);
+  }
+  memcpy(bin.data, ids, count * sizeof(id_type));
+  return enif_make_binary(env, &bin);
+}
+
+// {handle, clause, opts}
+ERL_FUNC(do_query) {
+  ENSURE_ARG(argc == 3);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  QueryOpts opts;
+  ENSURE_ARG(get_query_opts(env, argv[2], opts));
+  QueryLock lock(cw, opts, env);
 
   if(debug) std::cerr << "native: do_query called" << std::endl;
 
+  if(opts.binary) {
+    // write the ids straight into a binary, doubling it as the matches
+    // come in (never past the worst case), and shrink it down once they're
+    // known. sizing it for the worst case up front would allocate for
+    // every entity on an unlimited query that matches a handful
+    ErlNifBinary bin;
+    size_t most = std::min(opts.range.limit, context.num_entities());
+    size_t capacity = std::min(most, (size_t) 256);
+    if(!enif_alloc_binary(capacity * sizeof(id_type), &bin)) {
+      return A_ERR(env);
+    }
+
+    size_t found = 0;
+    bool grown = true;
+    bool valid = run_query(env, argv[1], context, opts, [&](const Entity* e) {
+      if(!grown) return;
+      if(found == capacity) {
+        capacity = std::min(most, std::max(capacity * 2, (size_t) 1));
+        grown = found < capacity && enif_realloc_binary(&bin, capacity * sizeof(id_type));
+        if(!grown) return;
+      }
+      ((id_type*) bin.data)[found++] = e->id;
+    }, &cw.query_log, &cw.slow_queries);
+
+    if(!valid || !grown) {
+      enif_release_binary(&bin);
+      return A_ERR(env);
+    }
+
+    if(found != capacity && !enif_realloc_binary(&bin, found * sizeof(id_type))) {
+      enif_release_binary(&bin);
+      return A_ERR(env);
+    }
+
+    return enif_make_tuple2(env, A_OK(env), enif_make_binary(env, &bin));
+  }
+
+  std::vector<id_type> ids;
+  bool valid = run_query(env, argv[1], context, opts, [&](const Entity* e) {
+    ids.push_back(e->id);
+  }, &cw.query_log, &cw.slow_queries);
+  if(!valid) { return A_ERR(env); }
+
+  return enif_make_tuple2(env, A_OK(env), make_id_list(env, ids.data(), ids.size()));
+}
+
+// {handle, clause, opts}
+ERL_FUNC(count) {
+  ENSURE_ARG(argc == 3);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  QueryOpts opts;
+  ENSURE_ARG(get_query_opts(env, argv[2], opts));
+  QueryLock lock(cw, opts, env);
+
+  QueryClause *c = build_clause(env, argv[1], context, !opts.cache);
+  if(c == nullptr) { return A_ERR(env); }
+
+  if(!opts.cache) c = context.optimize_query(c);
+  auto count = opts.cache ? context.cached_count(c) : context.count(c);
+  delete c;
+
+  return enif_make_tuple2(env, A_OK(env), enif_make_uint64(env, count));
+}
+
+static ERL_NIF_TERM make_kv(ErlNifEnv *env, const char *key, ERL_NIF_TERM value) {
+  return enif_make_tuple2(env, enif_make_atom(env, key), value);
+}
+
+static ERL_NIF_TERM make_explain_node(ErlNifEnv *env, const ExplainNode& node, bool analyzed) {
+  std::vector<ERL_NIF_TERM> fields;
+  fields.push_back(make_kv(env, "op", enif_make_atom(env, node.op.c_str())));
+  if(node.tags.size()) {
+    fields.push_back(make_kv(env, "tags", make_id_list(env, node.tags.data(), node.tags.size())));
+  }
+  if(node.op == "at_least") {
+    fields.push_back(make_kv(env, "k", enif_make_uint64(env, node.k)));
+  }
+  fields.push_back(make_kv(env, "estimated_rows", enif_make_double(env, node.estimated_rows)));
+  fields.push_back(make_kv(env, "cost", enif_make_double(env, node.cost)));
+
+  if(analyzed) {
+    fields.push_back(make_kv(env, "evaluated", enif_make_uint64(env, node.evaluated)));
+    fields.push_back(make_kv(env, "rows", enif_make_uint64(env, node.matched)));
+    if(node.children.size() > 1) {
+      fields.push_back(make_kv(env, "short_circuits", enif_make_uint64(env, node.short_circuits)));
+    }
+  }
+
+  if(node.children.size()) {
+    std::vector<ERL_NIF_TERM> children;
+    for(auto& child : node.children) {
+      children.push_back(make_explain_node(env, child, analyzed));
+    }
+    fields.push_back(make_kv(env, "children", enif_make_list_from_array(env, children.data(), children.size())));
+  }
+
+  return enif_make_list_from_array(env, fields.data(), fields.size());
+}
+
+// explain's fields for 'ex', with the rows, entities examined and compile
+// and execute times if it was run
+static void push_explain_fields(ErlNifEnv *env, const QueryExplain& ex, bool ran, std::vector<ERL_NIF_TERM>& fields) {
+  fields.push_back(make_kv(env, "engine", enif_make_atom(env, ex.engine)));
+  fields.push_back(make_kv(env, "evaluator", enif_make_atom(env, ex.evaluator)));
+  if(ex.driver.size()) {
+    fields.push_back(make_kv(env, "driver", make_id_list(env, ex.driver.data(), ex.driver.size())));
+  }
+  fields.push_back(make_kv(env, "estimated_rows", enif_make_double(env, ex.plan.estimated_rows)));
+
+  std::vector<ERL_NIF_TERM> times;
+  times.push_back(make_kv(env, "parse", enif_make_double(env, ex.parse_us)));
+  times.push_back(make_kv(env, "optimize", enif_make_double(env, ex.optimize_us)));
+
+  if(ran) {
+    fields.push_back(make_kv(env, "rows", enif_make_uint64(env, ex.rows)));
+    fields.push_back(make_kv(env, "examined", enif_make_uint64(env, ex.examined)));
+    times.push_back(make_kv(env, "compile", enif_make_double(env, ex.compile_us)));
+    times.push_back(make_kv(env, "execute", enif_make_double(env, ex.execute_us)));
+  }
+
+  fields.push_back(make_kv(env, "time_us", enif_make_list_from_array(env, times.data(), times.size())));
+  fields.push_back(make_kv(env, "plan", make_explain_node(env, ex.plan, ex.analyzed)));
+}
+
+// {handle, clause, opts} :: {:ok, [engine: ..., plan: ..., ...]}
+// the plan the query is run with, and with analyze: true how running it went
+ERL_FUNC(explain) {
+  ENSURE_ARG(argc == 3);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  QueryOpts opts;
+  ENSURE_ARG(get_query_opts(env, argv[2], opts));
+  QueryLock lock(cw, opts, env);
+
+  auto start = std::chrono::steady_clock::now();
+  std::unique_ptr<QueryClause> c(build_clause(env, argv[1], context, false));
+  if(!c) { return A_ERR(env); }
+  double parse_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+  auto ex = context.explain(c.get(), opts.range, opts.analyze);
+  ex.parse_us = parse_us;
+
+  std::vector<ERL_NIF_TERM> fields;
+  push_explain_fields(env, ex, ex.analyzed, fields);
+  return enif_make_tuple2(env, A_OK(env), enif_make_list_from_array(env, fields.data(), fields.size()));
+}
+
+// {handle, clause, [tag_id] | top_k, opts}
+ERL_FUNC(facets) {
+  ENSURE_ARG(argc == 4);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  QueryOpts opts;
+  ENSURE_ARG(get_query_opts(env, argv[3], opts));
+  QueryLock lock(cw, opts, env);
+
+  std::vector<Tag*> candidates;
+  unsigned top_k = 0;
+  if(enif_is_list(env, argv[2])) {
+    ERL_NIF_TERM head, tail = argv[2];
+    while(enif_get_list_cell(env, tail, &head, &tail)) {
+      auto tag = get_tag_from_arg(context, env, head);
+      if(!tag) return A_ERR(env);
+      candidates.push_back(tag);
+    }
+  }
+  else {
+    ENSURE_ARG(enif_get_uint(env, argv[2], &top_k));
+  }
+
   QueryClause *c = build_clause(env, argv[1], context);
   if(c == nullptr) { return A_ERR(env); }
 
-  ERL_NIF_TERM res_list = enif_make_list(env, 0); // start with empty list
+  auto facets = top_k ?
+    context.top_facets(c, top_k, opts.implied) :
+    context.facets(c, candidates, opts.implied);
+  delete c;
 
-  context.query(c, [&](const Entity* e) {
-    auto term = enif_make_uint(env, e->id);
+  ERL_NIF_TERM res_list = enif_make_list(env, 0); // start with empty list
+  for(auto iter = facets.rbegin(); iter != facets.rend(); iter++) {
+    auto term = enif_make_tuple2(env,
+      enif_make_uint(env, iter->tag->id),
+      enif_make_uint64(env, iter->count));
     res_list = enif_make_list_cell(env, term, res_list);
+  }
+
+  return enif_make_tuple2(env, A_OK(env), res_list);
+}
+
+// sends {ref, reply} to the stream's receiver. false if it's gone.
+// 'caller_env' is the calling process's env, nullptr off a scheduler thread
+static bool stream_send(QueryStream& stream, ErlNifEnv *caller_env, ErlNifEnv *msg_env, ERL_NIF_TERM reply) {
+  auto msg = enif_make_tuple2(msg_env, enif_make_copy(msg_env, stream.ref), reply);
+  bool sent = enif_send(caller_env, &stream.pid, msg_env, msg);
+  enif_clear_env(msg_env);
+  return sent;
+}
+
+// fetches and sends the stream's next chunk, holding the read lock only
+// while it's fetched. runs on the async_query pool
+static void run_stream_chunk(std::shared_ptr<QueryStream> stream) {
+  // only one chunk runs at a time, so 'opts', 'pinned' and 'writes' are
+  // left alone meanwhile
+  auto opts = stream->opts;
+  auto limit = std::min(opts.range.limit, stream->chunk_size);
+  opts.range.limit = limit;
+
+  std::vector<id_type> ids;
+  bool valid = true;
+  bool changed = false;
+  {
+    auto cw = stream->cw;
+    QueryLock lock(*cw, opts, nullptr);
+
+    // no write got in between this chunk and the ones before it, so
+    // together they're the one scan of the context the first chunk saw
+    if(!stream->pinned) {
+      stream->pinned = true;
+      stream->writes = cw->writes;
+    }
+    else if(cw->writes != stream->writes) {
+      changed = true;
+    }
+
+    // the chunks aren't logged: replayed, they'd be unrelated queries
+    if(!changed) {
+      valid = run_query(stream->env, stream->clause, cw->context, opts, [&](const Entity* e) {
+        ids.push_back(e->id);
+      });
+    }
+  }
+
+  ErlNifEnv *msg_env = enif_alloc_env();
+  bool sent = true;
+  if(valid && !ids.empty()) {
+    auto chunk = opts.binary ?
+      make_id_binary(msg_env, ids.data(), ids.size()) :
+      make_id_list(msg_env, ids.data(), ids.size());
+    sent = stream_send(*stream, nullptr, msg_env, enif_make_tuple2(msg_env, enif_make_atom(msg_env, "chunk"), chunk));
+  }
+
+  // a short chunk is the last one
+  bool done = changed || !valid || ids.size() < limit || ids.size() == stream->opts.range.limit;
+  if(sent && done) {
+    ERL_NIF_TERM reply;
+    if(changed) reply = enif_make_tuple2(msg_env, A_ERR(msg_env), enif_make_atom(msg_env, "changed"));
+    else if(!valid) reply = A_ERR(msg_env);
+    else reply = enif_make_atom(msg_env, "done");
+    stream_send(*stream, nullptr, msg_env, reply);
+  }
+  enif_free_env(msg_env);
+
+  {
+    std::lock_guard<std::mutex> lock(stream->mutex);
+    stream->running = false;
+    if(!ids.empty()) {
+      stream->opts.range.has_after = true;
+      stream->opts.range.after = ids.back();
+      if(stream->opts.range.limit != SIZE_MAX) stream->opts.range.limit -= ids.size();
+    }
+    if(done || !sent) stream->cancelled = true;
+  }
+
+  stream_pump(stream, nullptr);
+}
+
+// queues the stream's next chunk if the receiver is ready for it and there
+// isn't one on the way already, or lets the stream go once it's cancelled.
+// 'caller_env' as for stream_send
+static void stream_pump(const std::shared_ptr<QueryStream>& stream, ErlNifEnv *caller_env) {
+  std::lock_guard<std::mutex> lock(stream->mutex);
+  if(stream->finished || stream->running) return;
+
+  if(stream->cancelled) {
+    stream->finish();
+    return;
+  }
+  if(stream->demand == 0) return;
+
+  stream->demand--;
+  stream->running = true;
+
+  std::shared_ptr<QueryStream> job_stream = stream;
+  if(!get_async_pool()->submit(stream->opts.lane, [job_stream]() { run_stream_chunk(job_stream); })) {
+    stream->running = false;
+
+    ErlNifEnv *msg_env = enif_alloc_env();
+    stream_send(*stream, caller_env, msg_env,
+      enif_make_tuple2(msg_env, A_ERR(msg_env), enif_make_atom(msg_env, "busy")));
+    enif_free_env(msg_env);
+
+    stream->finish();
+  }
+}
+
+// {handle, clause, chunk_size, opts} :: {:ok, ref, stream}
+// sends {ref, {:chunk, ids}} messages to the caller, one per stream_ack,
+// followed by {ref, :done} (or {ref, :error} for an invalid query,
+// {ref, {:error, :busy}} when the async_query pool's queue is full, and
+// {ref, {:error, :changed}} when the context is written to mid-stream).
+// the chunks are fetched on the async_query pool as they're acked, against
+// a clean metagraph so a background rebuild doesn't end the stream
+ERL_FUNC(stream_start) {
+  ENSURE_ARG(argc == 4);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  unsigned chunk_size;
+  ENSURE_ARG(enif_get_uint(env, argv[2], &chunk_size) && chunk_size > 0);
+
+  QueryOpts opts;
+  ENSURE_ARG(get_query_opts(env, argv[3], opts));
+
+  assert(stream_type);
+  auto handle = (QueryStreamHandle*) enif_alloc_resource(stream_type, sizeof(QueryStreamHandle));
+  if(handle == nullptr) return A_ERR(env);
+  new(handle) QueryStreamHandle();
+
+  auto stream = std::make_shared<QueryStream>(&cw);
+  handle->stream = stream;
+
+  // the chunks outlive this call, give them their own copy of the terms
+  stream->clause = enif_make_copy(stream->env, argv[1]);
+  stream->ref    = enif_make_ref(stream->env);
+  enif_self(env, &stream->pid);
+  stream->chunk_size = chunk_size;
+  stream->opts = opts;
+  stream->opts.consistent = true;
+
+  auto handle_term = enif_make_resource(env, handle);
+  enif_release_resource(handle);
+
+  stream_pump(stream, env);
+
+  return enif_make_tuple3(env, A_OK(env), enif_make_copy(env, stream->ref), handle_term);
+}
+
+// {stream} - the receiver is ready for another chunk
+ERL_FUNC(stream_ack) {
+  ENSURE_ARG(argc == 1);
+  QueryStreamHandle *handle;
+  ENSURE_ARG(enif_get_resource(env, argv[0], stream_type, (void**)&handle));
+
+  {
+    std::lock_guard<std::mutex> lock(handle->stream->mutex);
+    handle->stream->demand++;
+  }
+  stream_pump(handle->stream, env);
+
+  return A_OK(env);
+}
+
+// {stream} - stop sending chunks
+ERL_FUNC(stream_cancel) {
+  ENSURE_ARG(argc == 1);
+  QueryStreamHandle *handle;
+  ENSURE_ARG(enif_get_resource(env, argv[0], stream_type, (void**)&handle));
+
+  cancel_stream(handle->stream, env);
+  return A_OK(env);
+}
+
+// {handle, clause, opts} :: {:ok, ref} | {:error, :busy}
+// runs the query on the worker pool, and replies to the caller with
+// {ref, {:ok, ids}} or {ref, :error}
+ERL_FUNC(async_query) {
+  ENSURE_ARG(argc == 3);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  QueryOpts opts;
+  ENSURE_ARG(get_query_opts(env, argv[2], opts));
+
+  ErlNifPid pid;
+  enif_self(env, &pid);
+
+  // the job outlives this call, give it its own copy of the terms
+  ErlNifEnv *msg_env = enif_alloc_env();
+  auto clause = enif_make_copy(msg_env, argv[1]);
+  auto ref    = enif_make_ref(msg_env);
+
+  ContextWrapper *cw_job = &cw;
+  enif_keep_resource(cw_job);
+
+  auto job = [cw_job, msg_env, clause, ref, pid, opts]() {
+    Context& context = cw_job->context;
+    ERL_NIF_TERM reply;
+
+    {
+      QueryLock lock(*cw_job, opts, nullptr);
+
+      std::vector<id_type> ids;
+      bool valid = run_query(msg_env, clause, context, opts, [&](const Entity* e) {
+        ids.push_back(e->id);
+      }, &cw_job->query_log, &cw_job->slow_queries);
+
+      if(!valid) {
+        reply = A_ERR(msg_env);
+      }
+      else {
+        auto res = opts.binary ?
+          make_id_binary(msg_env, ids.data(), ids.size()) :
+          make_id_list(msg_env, ids.data(), ids.size());
+        reply = enif_make_tuple2(msg_env, A_OK(msg_env), res);
+      }
+    }
+
+    enif_release_resource(cw_job);
+
+    enif_send(nullptr, &pid, msg_env, enif_make_tuple2(msg_env, ref, reply));
+    enif_free_env(msg_env);
+  };
+
+  if(!get_async_pool()->submit(opts.lane, job)) {
+    enif_release_resource(cw_job);
+    enif_free_env(msg_env);
+    return enif_make_tuple2(env, A_ERR(env), enif_make_atom(env, "busy"));
+  }
+
+  return enif_make_tuple2(env, A_OK(env), enif_make_copy(env, ref));
+}
+
+// {threads, max_queued} - resize the async_query pool. queries already
+// queued on the old pool still run
+ERL_FUNC(configure_async) {
+  ENSURE_ARG(argc == 2);
+
+  unsigned threads, max_queued;
+  ENSURE_ARG(enif_get_uint(env, argv[0], &threads));
+  ENSURE_ARG(enif_get_uint(env, argv[1], &max_queued) && max_queued > 0);
+
+  std::lock_guard<std::mutex> lock(async_pool_mutex);
+  async_pool_threads = threads;
+  async_pool_queued  = max_queued;
+
+  // draining the old pool can take a while, do it off the scheduler thread
+  if(async_pool) {
+    if(async_pool_drain.joinable()) async_pool_drain.join();
+    async_pool_drain = std::thread([](std::shared_ptr<WorkerPool> pool) {
+      pool.reset();
+    }, std::move(async_pool));
+    async_pool.reset();
+  }
+
+  return A_OK(env);
+}
+
+// keyword list of counters
+static ERL_NIF_TERM make_stats_list(ErlNifEnv *env, const std::pair<const char*, size_t> *fields, size_t n) {
+  ERL_NIF_TERM res_list = enif_make_list(env, 0);
+  for(size_t i = n; i > 0; i--) {
+    auto& field = fields[i - 1];
+    res_list = enif_make_list_cell(env,
+      enif_make_tuple2(env,
+        enif_make_atom(env, field.first),
+        enif_make_uint64(env, field.second)),
+      res_list);
+  }
+  return res_list;
+}
+
+// cache_stats(handle) :: {:ok, [hits: n, misses: n, ...]}
+ERL_FUNC(cache_stats) {
+  ENSURE_ARG(argc == 1);
+  ENSURE_CONTEXT(env, argv[0]);
+  ReadLock lock(cw);
+
+  auto stats = context.get_query_cache().stats();
+  std::pair<const char*, size_t> fields[] = {
+    {"hits",          stats.hits},
+    {"misses",        stats.misses},
+    {"inserts",       stats.inserts},
+    {"evictions",     stats.evictions},
+    {"invalidations", stats.invalidations},
+    {"entries",       stats.entries},
+    {"bytes",         stats.bytes},
+    {"max_bytes",     stats.max_bytes}
+  };
+
+  return enif_make_tuple2(env, A_OK(env),
+    make_stats_list(env, fields, sizeof(fields) / sizeof(fields[0])));
+}
+
+// configure_cache(handle, max_bytes) :: :ok
+ERL_FUNC(configure_cache) {
+  ENSURE_ARG(argc == 2);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  ErlNifUInt64 max_bytes;
+  ENSURE_ARG(enif_get_uint64(env, argv[1], &max_bytes));
+
+  ReadLock lock(cw);
+  context.get_query_cache().set_max_bytes(max_bytes);
+
+  return A_OK(env);
+}
+
+// jit_stats() :: {:ok, [hits: n, misses: n, ...]}
+// the compiled code cache shared by all contexts
+ERL_FUNC(jit_stats) {
+  ENSURE_ARG(argc == 0);
+  UNUSED(argv);
+
+  auto stats = JitCache::shared().stats();
+  std::pair<const char*, size_t> fields[] = {
+    {"hits",             stats.hits},
+    {"misses",           stats.misses},
+    {"compile_failures", stats.compile_failures},
+    {"evictions",        stats.evictions},
+    {"entries",          stats.entries},
+    {"bytes",            stats.bytes},
+    {"max_bytes",        stats.max_bytes},
+    {"live",             stats.live},
+    {"live_bytes",       stats.live_bytes}
+  };
+
+  return enif_make_tuple2(env, A_OK(env),
+    make_stats_list(env, fields, sizeof(fields) / sizeof(fields[0])));
+}
+
+// configure_jit(max_bytes) :: :ok
+ERL_FUNC(configure_jit) {
+  ENSURE_ARG(argc == 1);
+
+  ErlNifUInt64 max_bytes;
+  ENSURE_ARG(enif_get_uint64(env, argv[0], &max_bytes));
+  JitCache::shared().set_max_bytes(max_bytes);
+
+  return A_OK(env);
+}
+
+// memory(handle) :: {:ok, [entities: bytes, entity_tags: bytes, ...]}
+// bytes allocated by each part of the context, counted as they're
+// allocated. jit_code is the code of the JIT cache shared by all contexts
+ERL_FUNC(memory) {
+  ENSURE_ARG(argc == 1);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  // the counters are atomics, no lock needed
+  auto& memory = context.get_memory();
+  auto cache_bytes = context.get_query_cache().stats().bytes;
+  auto jit_bytes = JitCache::shared().stats().live_bytes;
+
+  std::pair<const char*, size_t> fields[] = {
+    {"entities",     memory.entities.bytes()},
+    {"entity_tags",  memory.entity_tags.bytes()},
+    {"tags",         memory.tags.bytes()},
+    {"implications", memory.implications.bytes()},
+    {"postings",     memory.postings.bytes()},
+    {"meta_nodes",   memory.meta_nodes.bytes()},
+    {"stats",        memory.stats.bytes()},
+    {"query_cache",  cache_bytes},
+    {"jit_code",     jit_bytes},
+    {"total",        memory.total() + cache_bytes + jit_bytes}
+  };
+
+  return enif_make_tuple2(env, A_OK(env),
+    make_stats_list(env, fields, sizeof(fields) / sizeof(fields[0])));
+}
+
+// a file path given as a binary or charlist
+static bool get_path(ErlNifEnv *env, ERL_NIF_TERM term, std::string& path) {
+  ErlNifBinary bin;
+  if(!enif_inspect_iolist_as_binary(env, term, &bin) || bin.size == 0) return false;
+  path.assign((const char*) bin.data, bin.size);
+  return path.find('\0') == std::string::npos;
+}
+
+// save_snapshot(handle, path) :: :ok | :error
+// writes the context's tags, implications and entities to 'path'
+ERL_FUNC(save_snapshot) {
+  ENSURE_ARG(argc == 2);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  std::string path;
+  ENSURE_ARG(get_path(env, argv[1], path));
+
+  std::string snapshot;
+  {
+    ReadLock lock(cw);
+    snapshot = encode_snapshot(context);
+  }
+  return write_snapshot(snapshot, path.c_str()) ? A_OK(env) : A_ERR(env);
+}
+
+// start_query_log(handle, log_path, snapshot_path | nil) :: :ok | :error
+// records every query run on the context to 'log_path' until
+// stop_query_log, saving a snapshot to go with it first if asked to. the
+// write lock is held while the snapshot is taken and the log opened, so
+// the log starts where the snapshot ends, but not while it's written out
+ERL_FUNC(start_query_log) {
+  ENSURE_ARG(argc == 3);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  std::string log_path, snapshot_path;
+  ENSURE_ARG(get_path(env, argv[1], log_path));
+  bool snapshot = enif_compare(argv[2], enif_make_atom(env, "nil")) != 0;
+  if(snapshot) {
+    ENSURE_ARG(get_path(env, argv[2], snapshot_path));
+  }
+
+  std::string encoded;
+  {
+    WriteLock lock(cw);
+    if(snapshot) encoded = encode_snapshot(context);
+    if(!cw.query_log.open(log_path.c_str())) return A_ERR(env);
+  }
+
+  if(snapshot && !write_snapshot(encoded, snapshot_path.c_str())) {
+    cw.query_log.close();
+    return A_ERR(env);
+  }
+  return A_OK(env);
+}
+
+// stop_query_log(handle) :: {:ok, queries_recorded}
+ERL_FUNC(stop_query_log) {
+  ENSURE_ARG(argc == 1);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  return enif_make_tuple2(env, A_OK(env), enif_make_uint64(env, cw.query_log.close()));
+}
+
+// configure_slow_queries(handle, threshold_us, capacity) :: :ok
+// queries taking threshold_us or longer are kept, up to the 'capacity'
+// most recent, for slow_queries to drain. a threshold of 0 turns it off
+ERL_FUNC(configure_slow_queries) {
+  ENSURE_ARG(argc == 3);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  ErlNifUInt64 threshold_us, capacity;
+  ENSURE_ARG(enif_get_uint64(env, argv[1], &threshold_us));
+  ENSURE_ARG(enif_get_uint64(env, argv[2], &capacity));
+  ENSURE_ARG(capacity > 0);
+
+  cw.slow_queries.configure(threshold_us * 1000, capacity);
+  return A_OK(env);
+}
+
+// slow_queries(handle) :: {:ok, [[query: term, started_at: ms, total_us: us, ...]]}
+// the slow queries recorded since the last call, oldest first
+ERL_FUNC(slow_queries) {
+  ENSURE_ARG(argc == 1);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  std::vector<ERL_NIF_TERM> entries;
+  for(auto q : cw.slow_queries.drain()) {
+    std::vector<ERL_NIF_TERM> fields;
+    fields.push_back(make_kv(env, "query", enif_make_copy(env, q->term)));
+    fields.push_back(make_kv(env, "cache", enif_make_atom(env, q->cache ? "true" : "false")));
+    if(q->range.limit != SIZE_MAX) {
+      fields.push_back(make_kv(env, "limit", enif_make_uint64(env, q->range.limit)));
+    }
+    fields.push_back(make_kv(env, "started_at", enif_make_uint64(env, q->started_at_ms)));
+    fields.push_back(make_kv(env, "total_us", enif_make_double(env, q->total_us)));
+    push_explain_fields(env, q->explain, true, fields);
+
+    entries.push_back(enif_make_list_from_array(env, fields.data(), fields.size()));
+    delete q;
+  }
+
+  return enif_make_tuple2(env, A_OK(env), enif_make_list_from_array(env, entries.data(), entries.size()));
+}
+
+// watch(handle, query) :: {:ok, ref, ids} | :error
+// registers a standing query for the calling process, which is sent
+// {ref, {:added, ids}} and {ref, {:removed, ids}} as entities start and
+// stop matching it. changes to implications are only reported once the
+// metagraph has been rebuilt
+ERL_FUNC(watch) {
+  ENSURE_ARG(argc == 2);
+  ENSURE_CONTEXT(env, argv[0]);
+  WriteLock lock(cw);
+
+  // the initial matches are computed against a clean metagraph
+  if(context.is_dirty()) {
+    context.make_clean();
+    flush_watchers(cw, env);
+  }
+
+  QueryClause *source = build_clause(env, argv[1], context, false);
+  if(source == nullptr) { return A_ERR(env); }
+
+  Watcher *w = new Watcher();
+  enif_self(env, &w->pid);
+  w->ref = enif_make_ref(w->env);
+
+  w->sq = context.add_standing_query(source, [w](
+    const std::vector<Entity*>& added, const std::vector<Entity*>& removed)
+  {
+    for(auto e : added)   w->added.push_back(e->id);
+    for(auto e : removed) w->removed.push_back(e->id);
+    return true;
   });
+  assert(w->sq);
+  cw.watchers.push_back(w);
 
-  delete c;
+  // the initial matches are the reply rather than a message
+  std::sort(w->added.begin(), w->added.end());
+  auto ids = make_id_list(env, w->added.data(), w->added.size());
+  w->added.clear();
 
-  return enif_make_tuple2(env, A_OK(env), res_list);
+  return enif_make_tuple3(env, A_OK(env), enif_make_copy(env, w->ref), ids);
+}
+
+// unwatch(handle, ref) :: :ok | :error
+ERL_FUNC(unwatch) {
+  ENSURE_ARG(argc == 2);
+  ENSURE_CONTEXT(env, argv[0]);
+  ENSURE_ARG(enif_is_ref(env, argv[1]));
+  WriteLock lock(cw);
+
+  for(auto i = cw.watchers.begin(); i != cw.watchers.end(); ++i) {
+    Watcher *w = *i;
+    if(!enif_is_identical(w->ref, argv[1])) continue;
+
+    context.remove_standing_query(w->sq);
+    cw.watchers.erase(i);
+    delete w;
+    return A_OK(env);
+  }
+
+  return A_ERR(env);
 }
 
 ERL_FUNC(imply_tag) {
@@ -304,6 +1371,13 @@ ERL_FUNC(imply_tag) {
     return A_ERR(env);
   }
 
+  flush_watchers(cw, env);
+
+  // watchers only hear about the change once the metagraph is rebuilt
+  if(context.is_dirty() && !cw.watchers.empty()) {
+    rebuild_metagraph_async(&cw);
+  }
+
   return A_OK(env);
 }
 ERL_FUNC(unimply_tag) {
@@ -320,6 +1394,13 @@ ERL_FUNC(unimply_tag) {
     return A_ERR(env);
   }
 
+  flush_watchers(cw, env);
+
+  // watchers only hear about the change once the metagraph is rebuilt
+  if(context.is_dirty() && !cw.watchers.empty()) {
+    rebuild_metagraph_async(&cw);
+  }
+
   return A_OK(env);
 }
 
@@ -384,23 +1465,133 @@ ERL_FUNC(make_clean) {
 }
 #endif
 
+// times a NIF into the telemetry of the context it's called on, by its
+// position 'I' in nif_funcs (see NIF_LIST)
+template<ERL_NIF_TERM (*F)(ErlNifEnv*, int, const ERL_NIF_TERM*), size_t I>
+static ERL_NIF_TERM timed(ErlNifEnv *env, int argc, const ERL_NIF_TERM *argv) {
+  auto start = telemetry_now_ns();
+  auto ret = F(env, argc, argv);
+
+  ContextWrapper *cw = nullptr;
+  if(argc > 0 && enif_get_resource(env, argv[0], context_type, (void**) &cw)) {
+    cw->telemetry.calls[I].record(telemetry_now_ns() - start);
+  }
+  return ret;
+}
+
+ERL_FUNC(stats);
+
+// every NIF, as X(name, arity, func, flags). a NIF's telemetry index is
+// its position in this list, as numbered by NifIndex, so nif_funcs and the
+// indexes can't drift apart. the ones writing files run on the dirty IO
+// schedulers. make_clean isn't exported
+#define NIF_LIST(X) \
+  X("new",                0, new_, 0) \
+  X("new_tag",            2, new_tag, 0) \
+  X("num_tags",           1, num_tags, 0) \
+  X("new_entity",         2, new_entity, 0) \
+  X("num_entities",       1, num_entities, 0) \
+  X("add_tag",            3, add_tag, 0) \
+  X("remove_tag",         3, remove_tag, 0) \
+  X("delete_entity",      2, delete_entity, 0) \
+  X("delete_tag",         2, delete_tag, 0) \
+  X("compact",            1, compact, 0) \
+  X("entity_tags",        2, entity_tags, 0) \
+  X("do_query",           3, do_query, 0) \
+  X("count",              3, count, 0) \
+  X("facets",             4, facets, 0) \
+  X("explain",            3, explain, 0) \
+  X("stream_start",       4, stream_start, 0) \
+  X("stream_ack",         1, stream_ack, 0) \
+  X("stream_cancel",      1, stream_cancel, 0) \
+  X("async_query",        3, async_query, 0) \
+  X("configure_async",    2, configure_async, 0) \
+  X("watch",              2, watch, 0) \
+  X("unwatch",            2, unwatch, 0) \
+  X("cache_stats",        1, cache_stats, 0) \
+  X("configure_cache",    2, configure_cache, 0) \
+  X("jit_stats",          0, jit_stats, 0) \
+  X("configure_jit",      1, configure_jit, 0) \
+  X("memory",             1, memory, 0) \
+  X("save_snapshot",      2, save_snapshot, ERL_NIF_DIRTY_JOB_IO_BOUND) \
+  X("start_query_log",    3, start_query_log, ERL_NIF_DIRTY_JOB_IO_BOUND) \
+  X("stop_query_log",     1, stop_query_log, 0) \
+  X("configure_slow_queries", 3, configure_slow_queries, 0) \
+  X("slow_queries",       1, slow_queries, 0) \
+  X("imply_tag",          3, imply_tag, 0) \
+  X("unimply_tag",        3, unimply_tag, 0) \
+  X("get_implies",        2, get_implies, 0) \
+  X("get_implied_by",     2, get_implied_by, 0) \
+  X("is_dirty",           1, is_dirty, 0) \
+  X("mark_dirty",         1, mark_dirty, 0) \
+  X("stats",              1, stats, 0)
+
+enum NifIndex {
+#define X(name, arity, func, flags) nif_index_##func,
+  NIF_LIST(X)
+#undef X
+  num_nifs
+};
+static_assert(num_nifs <= NifTelemetry::max_nifs, "not enough room for every NIF's telemetry");
+
 static ErlNifFunc nif_funcs[] = {
-  {"new",              0, new_,             0},
-  {"new_tag" ,         2, new_tag,          0},
-  {"num_tags",         1, num_tags,         0},
-  {"new_entity",       2, new_entity,       0},
-  {"num_entities",     1, num_entities,     0},
-  {"add_tag",          3, add_tag,          0},
-  {"remove_tag",       3, remove_tag,       0},
-  {"entity_tags",      2, entity_tags,      0},
-  {"do_query",         2, do_query,         0},
-  {"imply_tag",        3, imply_tag,        0},
-  {"unimply_tag",      3, unimply_tag,      0},
-  {"get_implies",      2, get_implies,      0},
-  {"get_implied_by",   2, get_implied_by,   0},
-  {"is_dirty",         1, is_dirty,         0},
-  {"mark_dirty",       1, mark_dirty,       0}
-  // {"make_clean",       1, make_clean,       0}
+#define X(name, arity, func, flags) {name, arity, timed<func, nif_index_##func>, flags},
+  NIF_LIST(X)
+#undef X
 };
 
-ERL_NIF_INIT(Elixir.AllTheTags, nif_funcs, init_lib, NULL, NULL, NULL)
+static_assert(sizeof(nif_funcs) / sizeof(nif_funcs[0]) == num_nifs, "a NIF's telemetry index is its position in nif_funcs");
+
+static ERL_NIF_TERM make_latency(ErlNifEnv *env, const LatencyHistogram& histogram) {
+  auto s = histogram.summary();
+  std::pair<const char*, size_t> fields[] = {
+    {"count",    s.count},
+    {"total_ns", s.total_ns},
+    {"max_ns",   s.max_ns},
+    {"p50_ns",   s.p50_ns},
+    {"p90_ns",   s.p90_ns},
+    {"p99_ns",   s.p99_ns},
+    {"p999_ns",  s.p999_ns}
+  };
+  return make_stats_list(env, fields, sizeof(fields) / sizeof(fields[0]));
+}
+
+// stats(handle) :: {:ok, [nifs: [{name, latency}], read_lock_wait: latency, ...]}
+// where each latency is a keyword list of count, total_ns, max_ns and
+// percentiles. NIFs that haven't been called are left out
+ERL_FUNC(stats) {
+  ENSURE_ARG(argc == 1);
+  ENSURE_CONTEXT(env, argv[0]);
+
+  // only atomics are read, no lock needed
+  auto& telemetry = cw.telemetry;
+  auto& context_telemetry = context.get_telemetry();
+  auto& tiering = context.get_tiering();
+
+  ERL_NIF_TERM nifs = enif_make_list(env, 0);
+  for(size_t i = num_nifs; i > 0; i--) {
+    auto& histogram = telemetry.calls[i - 1];
+    if(histogram.summary().count == 0) continue;
+
+    nifs = enif_make_list_cell(env,
+      enif_make_tuple2(env,
+        enif_make_atom(env, nif_funcs[i - 1].name),
+        make_latency(env, histogram)),
+      nifs);
+  }
+
+  ERL_NIF_TERM fields[] = {
+    make_kv(env, "nifs",            nifs),
+    make_kv(env, "read_lock_wait",  make_latency(env, telemetry.read_lock_wait)),
+    make_kv(env, "write_lock_wait", make_latency(env, telemetry.write_lock_wait)),
+    make_kv(env, "make_clean",      make_latency(env, context_telemetry.make_clean)),
+    make_kv(env, "collapses",       enif_make_uint64(env, context_telemetry.collapses.value())),
+    make_kv(env, "compact",         make_latency(env, context_telemetry.compact)),
+    make_kv(env, "jit_compiles",    make_latency(env, tiering.compile_latency))
+  };
+
+  return enif_make_tuple2(env, A_OK(env),
+    enif_make_list_from_array(env, fields, sizeof(fields) / sizeof(fields[0])));
+}
+
+ERL_NIF_INIT(Elixir.AllTheTags, nif_funcs, init_lib, NULL, NULL, unload_lib)
@@ -1,16 +1,38 @@
 #include <string>
 #include <cstring>
+#include <memory>
+#include <chrono>
+#include <algorithm>
 
 #include "erl_api_helpers.h"
 
 // converts erlang clause AST into native AST representation
-QueryClause *build_clause(ErlNifEnv *env, const ERL_NIF_TERM term, const Context& c) {
+// build a clause for each member of the list 'term'
+static bool build_clause_list(ErlNifEnv *env, const ERL_NIF_TERM term, const Context& c, bool expand, std::vector<QueryClause*>& clauses) {
+  ERL_NIF_TERM head, tail = term;
+  bool ok = true;
+  while(ok && enif_get_list_cell(env, tail, &head, &tail)) {
+    auto clause = build_clause(env, head, c, expand);
+    if(clause) clauses.push_back(clause);
+    else ok = false;
+  }
+
+  // a member that isn't a clause, or not a proper list
+  if(!ok || !enif_is_empty_list(env, tail)) {
+    for(auto clause : clauses) delete clause;
+    clauses.clear();
+    return false;
+  }
+  return true;
+}
+
+QueryClause *build_clause(ErlNifEnv *env, const ERL_NIF_TERM term, const Context& c, bool expand) {
   if(enif_is_number(env, term)) {
 
     auto tag = get_tag_from_arg(c, env, term);
     if(!tag) return nullptr;
 
-    return build_lit(tag);
+    return expand ? build_lit(tag) : new QueryClauseLit(tag);
   }
   else if(enif_is_tuple(env, term)) {
     // tuple in the form of {:and, a, b}
@@ -25,15 +47,41 @@ QueryClause *build_clause(ErlNifEnv *env, const ERL_NIF_TERM term, const Context
     if(!enif_is_atom(env, first)) return nullptr;
 
     if(arity == 2) {
-      // arity of 2 - must be a "not"
+      // arity of 2 - "not", "all" or "any"
+      bool matches_all = enif_compare(first, enif_make_atom(env, "all")) == 0;
+      bool matches_any = enif_compare(first, enif_make_atom(env, "any")) == 0;
+      if(matches_all || matches_any) {
+        std::vector<QueryClause*> children;
+        if(!build_clause_list(env, elems[1], c, expand, children)) return nullptr;
+
+        // all of nothing is everything, any of nothing is nothing
+        if(children.empty()) {
+          return matches_all ?
+            (QueryClause*) new QueryClauseAny() :
+            build_not(new QueryClauseAny());
+        }
+        if(children.size() == 1) return children[0];
+        return build_nary(matches_all ? QueryClauseAnd : QueryClauseOr, children);
+      }
+
       bool matches_not = enif_compare(first, enif_make_atom(env, "not")) == 0;
       if(!matches_not) return nullptr;
 
-      auto e = build_clause(env, elems[1], c);
+      auto e = build_clause(env, elems[1], c, expand);
       if(!e) return nullptr;
 
       return build_not(e);
     }
+    else if(arity == 3 && enif_compare(first, enif_make_atom(env, "at_least")) == 0) {
+      // {:at_least, k, clauses}
+      unsigned k;
+      if(!enif_get_uint(env, elems[1], &k)) return nullptr;
+
+      std::vector<QueryClause*> children;
+      if(!build_clause_list(env, elems[2], c, expand, children)) return nullptr;
+
+      return build_threshold(k, children);
+    }
     else if(arity == 3) {
       // arity of 3 - "and" or "or"
       bool matches_and = enif_compare(first, enif_make_atom(env, "and")) == 0;
@@ -44,10 +92,10 @@ QueryClause *build_clause(ErlNifEnv *env, const ERL_NIF_TERM term, const Context
       }
 
       // AND clause
-      auto l = build_clause(env, elems[1], c);
+      auto l = build_clause(env, elems[1], c, expand);
       if(!l) return nullptr;
-      auto r = build_clause(env, elems[2], c);
-      if(!r) return nullptr;
+      auto r = build_clause(env, elems[2], c, expand);
+      if(!r) { delete l; return nullptr; }
 
       return matches_and ? build_and(l, r) : build_or(l, r);
     }
@@ -71,6 +119,249 @@ QueryClause *build_clause(ErlNifEnv *env, const ERL_NIF_TERM term, const Context
   assert(false && "impossible");
 }
 
+// run_query for a query being logged or watched for slowness: the query
+// is built from bare literals whether or not it goes to the cache, so it
+// can be logged as given, and each step is timed
+static bool run_recorded_query(ErlNifEnv *env, const ERL_NIF_TERM term, const Context& c, const QueryOpts& opts,
+  std::function<void(Entity*)> match, QueryLogWriter *log, SlowQueryLog *slow)
+{
+  auto started_at = std::chrono::system_clock::now();
+  uint64_t start = telemetry_now_ns();
+
+  std::unique_ptr<QueryClause> source(build_clause(env, term, c, false));
+  if(!source) return false;
+  uint64_t parsed = telemetry_now_ns();
+
+  QueryExplain ex;
+  auto counted = [&](Entity *e) {
+    ex.rows++;
+    match(e);
+  };
+
+  std::unique_ptr<QueryClause> plan;
+  uint64_t optimized = parsed;
+  if(opts.cache) {
+    c.cached_query(source.get(), opts.range, counted);
+  }
+  else {
+    plan.reset(c.optimize_query(expand_implications(source.get())));
+    optimized = telemetry_now_ns();
+
+    QueryTrace trace;
+    c.query(plan.get(), opts.range, counted, &trace);
+    ex.engine     = trace.engine;
+    ex.evaluator  = trace.evaluator;
+    ex.examined   = trace.examined;
+    ex.compile_us = trace.compile_us;
+    for(auto t : trace.driver) ex.driver.push_back(t->id);
+  }
+  uint64_t end = telemetry_now_ns();
+
+  if(log && log->is_open()) {
+    QueryLogRecord record;
+    record.cache = opts.cache;
+    record.range = opts.range;
+    record.start_ns = parsed;
+    record.duration_ns = end - parsed;
+    record.rows = ex.rows;
+    if(encode_clause(source.get(), record.clause)) log->write(record);
+  }
+
+  if(slow && slow->is_slow(end - start)) {
+    auto q = new SlowQuery(term);
+    q->cache = opts.cache;
+    q->range = opts.range;
+    q->started_at_ms = std::chrono::duration_cast<std::chrono::milliseconds>(started_at.time_since_epoch()).count();
+    q->total_us = (end - start) / 1000.0;
+
+    ex.parse_us    = (parsed - start) / 1000.0;
+    ex.optimize_us = (optimized - parsed) / 1000.0;
+    ex.execute_us  = (end - optimized) / 1000.0 - ex.compile_us;
+    if(plan) {
+      ex.plan = explain_clause(plan.get(), c.get_stats(), c.num_entities());
+    }
+    else {
+      // answered through the cache: the plan it has now, without running it
+      auto planned = c.explain(source.get(), opts.range, false);
+      ex.engine    = planned.engine;
+      ex.evaluator = planned.evaluator;
+      ex.driver    = planned.driver;
+      ex.plan      = planned.plan;
+    }
+    std::sort(ex.driver.begin(), ex.driver.end());
+
+    q->explain = ex;
+    slow->record(q);
+  }
+
+  return true;
+}
+
+bool run_query(ErlNifEnv *env, const ERL_NIF_TERM term, const Context& c, const QueryOpts& opts, std::function<void(Entity*)> match,
+  QueryLogWriter *log, SlowQueryLog *slow)
+{
+  if((log && log->is_open()) || (slow && slow->is_on())) {
+    return run_recorded_query(env, term, c, opts, match, log, slow);
+  }
+
+  QueryClause *q = build_clause(env, term, c, !opts.cache);
+  if(q == nullptr) return false;
+
+  if(opts.cache) {
+    c.cached_query(q, opts.range, match);
+  }
+  else {
+    q = c.optimize_query(q);
+    c.query(q, opts.range, match);
+  }
+
+  delete q;
+  return true;
+}
+
+SlowQueryLog::~SlowQueryLog() {
+  for(auto q : ring) delete q;
+}
+
+void SlowQueryLog::configure(uint64_t threshold_ns_, size_t capacity) {
+  assert(capacity > 0);
+  std::lock_guard<std::mutex> lock(mutex);
+  threshold_ns = threshold_ns_;
+
+  auto kept = drain_locked();
+  ring.assign(capacity, nullptr);
+  for(auto q : kept) {
+    if(ring[head]) delete ring[head];
+    ring[head] = q;
+    head = (head + 1) % capacity;
+    count = std::min(count + 1, capacity);
+  }
+  if(count < capacity) head = 0;
+}
+
+void SlowQueryLog::record(SlowQuery *q) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if(count == ring.size()) {
+    // full, the oldest makes way
+    delete ring[head];
+    ring[head] = q;
+    head = (head + 1) % ring.size();
+  }
+  else {
+    ring[(head + count) % ring.size()] = q;
+    count++;
+  }
+}
+
+std::vector<SlowQuery*> SlowQueryLog::drain() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return drain_locked();
+}
+
+std::vector<SlowQuery*> SlowQueryLog::drain_locked() {
+  std::vector<SlowQuery*> ret;
+  for(size_t i = 0; i < count; i++) {
+    auto& slot = ring[(head + i) % ring.size()];
+    ret.push_back(slot);
+    slot = nullptr;
+  }
+  head = count = 0;
+  return ret;
+}
+
+static bool get_bool(ErlNifEnv *env, ERL_NIF_TERM term, bool& out) {
+  if(enif_compare(term, enif_make_atom(env, "true")) == 0) {
+    out = true;
+    return true;
+  }
+  if(enif_compare(term, enif_make_atom(env, "false")) == 0) {
+    out = false;
+    return true;
+  }
+  return false;
+}
+
+bool get_query_opts(ErlNifEnv *env, ERL_NIF_TERM term, QueryOpts& opts) {
+  ERL_NIF_TERM head, tail = term;
+
+  while(enif_get_list_cell(env, tail, &head, &tail)) {
+    // each option is a {key, value} tuple
+    const ERL_NIF_TERM *elems;
+    int arity;
+    if(!enif_get_tuple(env, head, &arity, &elems) || arity != 2) {
+      return false;
+    }
+
+    auto key   = elems[0];
+    auto value = elems[1];
+
+    if(enif_compare(key, enif_make_atom(env, "consistent")) == 0) {
+      if(!get_bool(env, value, opts.consistent)) return false;
+    }
+    else if(enif_compare(key, enif_make_atom(env, "cache")) == 0) {
+      if(!get_bool(env, value, opts.cache)) return false;
+    }
+    else if(enif_compare(key, enif_make_atom(env, "format")) == 0) {
+      if(enif_compare(value, enif_make_atom(env, "list")) == 0) {
+        opts.binary = false;
+      }
+      else if(enif_compare(value, enif_make_atom(env, "binary")) == 0) {
+        opts.binary = true;
+      }
+      else {
+        return false;
+      }
+    }
+    else if(enif_compare(key, enif_make_atom(env, "priority")) == 0) {
+      if(enif_compare(value, enif_make_atom(env, "interactive")) == 0) {
+        opts.lane = WorkerLaneInteractive;
+      }
+      else if(enif_compare(value, enif_make_atom(env, "batch")) == 0) {
+        opts.lane = WorkerLaneBatch;
+      }
+      else {
+        return false;
+      }
+    }
+    else if(enif_compare(key, enif_make_atom(env, "implied")) == 0) {
+      if(!get_bool(env, value, opts.implied)) return false;
+    }
+    else if(enif_compare(key, enif_make_atom(env, "analyze")) == 0) {
+      if(!get_bool(env, value, opts.analyze)) return false;
+    }
+    else if(enif_compare(key, enif_make_atom(env, "limit")) == 0) {
+      ErlNifUInt64 limit;
+      if(!enif_get_uint64(env, value, &limit)) return false;
+      opts.range.limit = limit;
+    }
+    else if(enif_compare(key, enif_make_atom(env, "after")) == 0) {
+      // 'nil' is the start of the results
+      if(enif_compare(value, enif_make_atom(env, "nil")) != 0) {
+        if(!enif_get_uint(env, value, &opts.range.after)) return false;
+        opts.range.has_after = true;
+      }
+    }
+    else if(enif_compare(key, enif_make_atom(env, "order")) == 0) {
+      if(enif_compare(value, enif_make_atom(env, "asc")) == 0) {
+        opts.range.order = QueryOrderAsc;
+      }
+      else if(enif_compare(value, enif_make_atom(env, "desc")) == 0) {
+        opts.range.order = QueryOrderDesc;
+      }
+      else {
+        return false;
+      }
+    }
+    else {
+      // unknown option
+      return false;
+    }
+  }
+
+  // must have been a proper list
+  return enif_is_empty_list(env, tail);
+}
+
 int enif_binary_or_list_to_string(ErlNifEnv *env, ERL_NIF_TERM term, char *buf, unsigned int buflen) {
   if(enif_is_binary(env, term)) {
     ErlNifBinary bin;
@@ -105,3 +396,11 @@ Tag *get_tag_from_arg(const Context& context, ErlNifEnv* env, ERL_NIF_TERM term)
 
   return context.tag_by_id(tag_id);
 }
+
+bool ContextWrapper::run_in_background(WorkerPool::Job job) {
+  std::lock_guard<std::mutex> lock(background_mutex);
+  if(!background) {
+    background.reset(new WorkerPool(1, 16));
+  }
+  return background->submit(WorkerLaneInteractive, job);
+}
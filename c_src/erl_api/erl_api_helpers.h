@@ -4,10 +4,15 @@
 #include <cassert>
 #include <mutex>
 #include <atomic>
+#include <memory>
+#include <condition_variable>
 
 #include "erl_nif.h"
 #include "query.h"
 #include "context.h"
+#include "worker_pool.h"
+#include "telemetry.h"
+#include "query_log.h"
 
 #define UNUSED(x) (void)(x);
 #define ENSURE_ARG(get) do { if(!(get)) { return enif_make_badarg(env); }} while(0);
@@ -25,14 +30,159 @@
   ContextWrapper& cw = *cw_p; \
   Context& context   = cw.context;
 
+// a process watching a standing query, see watch/2
+struct Watcher {
+  ErlNifPid pid;
+
+  // holds 'ref', which tags the messages sent to 'pid'
+  ErlNifEnv *env;
+  ERL_NIF_TERM ref;
+
+  StandingQuery *sq;
+
+  // changes not sent yet
+  std::vector<id_type> added;
+  std::vector<id_type> removed;
+
+  Watcher() : env(enif_alloc_env()), sq(nullptr) {}
+  ~Watcher() { enif_free_env(env); }
+};
+
+// a query that took longer than its context's slow query threshold
+struct SlowQuery {
+  // holds 'term', the query as it was given
+  ErlNifEnv *env;
+  ERL_NIF_TERM term;
+
+  bool cache;
+  QueryRange range;
+
+  // when it started, in milliseconds since the epoch, and how long it took
+  uint64_t started_at_ms;
+  double total_us;
+
+  // its plan, with the optimizer's estimates, and the rows it returned,
+  // the entities it examined and the time spent on each step. the plan's
+  // nodes aren't analyzed, that would take running the query again
+  QueryExplain explain;
+
+  SlowQuery(ERL_NIF_TERM term_) :
+    env(enif_alloc_env()),
+    term(enif_make_copy(env, term_)),
+    cache(false),
+    started_at_ms(0),
+    total_us(0) {}
+  ~SlowQuery() { enif_free_env(env); }
+};
+
+// a ring buffer of a context's most recent slow queries, waiting for
+// slow_queries/1 to drain them. the oldest are dropped once it's full
+struct SlowQueryLog {
+  SlowQueryLog() : threshold_ns(0), head(0), count(0) {
+    ring.resize(100, nullptr);
+  }
+  ~SlowQueryLog();
+
+  // cheap enough to check on every query
+  bool is_on() const {
+    return threshold_ns.load(std::memory_order_relaxed) != 0;
+  }
+  bool is_slow(uint64_t ns) const {
+    auto threshold = threshold_ns.load(std::memory_order_relaxed);
+    return threshold && ns >= threshold;
+  }
+
+  // a threshold of 0 turns it off. shrinking it keeps the newest queries
+  void configure(uint64_t threshold_ns, size_t capacity);
+
+  // takes ownership of 'q'
+  void record(SlowQuery *q);
+
+  // the queries recorded since the last drain, oldest first. the caller
+  // owns them
+  std::vector<SlowQuery*> drain();
+
+private:
+  std::atomic<uint64_t> threshold_ns;
+
+  std::mutex mutex;
+  std::vector<SlowQuery*> ring;
+  size_t head;  // the oldest
+  size_t count;
+
+  std::vector<SlowQuery*> drain_locked();
+};
+
+// how long the NIFs called on a context take, and how long they wait for
+// its locks
+struct NifTelemetry {
+  // by position in nif_funcs. slots past the last NIF, like NIFs that
+  // are never called, cost a few pointers each (see LatencyHistogram)
+  static const size_t max_nifs = 64;
+  LatencyHistogram calls[max_nifs];
+
+  LatencyHistogram read_lock_wait;
+  LatencyHistogram write_lock_wait;
+};
+
 struct ContextWrapper {
   Context context;
+  NifTelemetry telemetry;
+
+  // processes watching standing queries on the context
+  std::vector<Watcher*> watchers;
+
+  // do_query calls, when start_query_log has turned it on
+  QueryLogWriter query_log;
+
+  // queries slower than configure_slow_queries' threshold
+  SlowQueryLog slow_queries;
+
+  ~ContextWrapper() {
+    // background jobs use the context without keeping it alive, so they
+    // have to finish first
+    background.reset();
+
+    for(auto w : watchers) {
+      delete w;
+    }
+  }
 
   // implements a basic readers/writer mutex
   // it'll be slow, but it'll work fine for our purposes
   // and will prefer the writer over the readers
   std::mutex mutex;
   std::atomic<int> readers;
+
+  // signalled when the last reader leaves, for a writer holding 'mutex'
+  std::mutex readers_mutex;
+  std::condition_variable readers_done;
+
+  void release_reader() {
+    if(--readers == 0) {
+      std::lock_guard<std::mutex> lock(readers_mutex);
+      readers_done.notify_one();
+    }
+    assert(readers >= 0);
+  }
+
+  // bumped as each WriteLock lets go, so a reader can tell whether the
+  // context changed since it last held the lock
+  std::atomic<uint64_t> writes;
+
+  // is a background metagraph rebuild running for this context
+  std::atomic<bool> rebuilding;
+
+  // is a background compaction running or waiting for the write lock
+  std::atomic<bool> compacting;
+
+  // runs 'job' on the context's background thread (started on first use),
+  // one job at a time. false if too many are queued
+  bool run_in_background(WorkerPool::Job job);
+
+private:
+  std::mutex background_mutex;
+  std::unique_ptr<WorkerPool> background;
 };
 
 struct ReadLock {
@@ -43,34 +193,84 @@ struct ReadLock {
     // or locked for more than 100ns or something
     // maybe: check 'writing' atomic bool flag if a WriteLock has locked the
     // context?
+    ScopedLatency wait(ctx.telemetry.read_lock_wait);
     ctx.mutex.lock();
     ctx.readers++;
     ctx.mutex.unlock();
   }
 
   ~ReadLock() {
-    ctx.readers--;
-    assert(ctx.readers >= 0);
+    ctx.release_reader();
   }
 };
 struct WriteLock {
   ContextWrapper& ctx;
 
   WriteLock(ContextWrapper& ctx_) : ctx(ctx_) {
+    ScopedLatency wait(ctx.telemetry.write_lock_wait);
     ctx.mutex.lock();
-    // TODO: use condition variables to wake the write lock up
+
+    // no new readers get in while 'mutex' is held, wait out the ones in
     // TODO: perhaps use schedule_nif here
-    while(ctx.readers > 0) {}
+    std::unique_lock<std::mutex> lock(ctx.readers_mutex);
+    ctx.readers_done.wait(lock, [this]() { return ctx.readers == 0; });
   }
 
   ~WriteLock() {
+    ctx.writes++;
     ctx.mutex.unlock();
   }
 };
 
+// options accepted by the do_query family of functions, as a keyword list
+struct QueryOpts {
+  // rebuild a dirty metagraph inline before running the query, rather than
+  // answering from the last consistent metagraph
+  bool consistent;
+
+  // go through the context's result cache
+  bool cache;
+
+  // limit/after/order of the results
+  QueryRange range;
+
+  // facets: count tags implied by an entity's tags as carried by it
+  bool implied;
+
+  // return matches as a binary of native endian uint32 ids
+  // rather than a list
+  bool binary;
+
+  // async_query: worker pool lane to run the query on
+  WorkerLane lane;
+
+  // explain: run the query, timing it and counting what it did
+  bool analyze;
+
+  QueryOpts() :
+    consistent(false),
+    cache(true),
+    implied(false),
+    binary(false),
+    lane(WorkerLaneInteractive),
+    analyze(false) {}
+};
+
+// parses a keyword list of query options into 'opts'
+// returns false on an unknown key or malformed value
+bool get_query_opts(ErlNifEnv *env, ERL_NIF_TERM term, QueryOpts& opts);
+
 // converts a term query clause into its C++ AST representation
 // caller is responsible for deleteing the returned QueryClause
-QueryClause *build_clause(ErlNifEnv *env, const ERL_NIF_TERM term, const Context& c);
+// with 'expand' false, tags become bare QueryClauseLits rather than being
+// expanded against the metagraph (see expand_implications)
+QueryClause *build_clause(ErlNifEnv *env, const ERL_NIF_TERM term, const Context& c, bool expand = true);
+
+// runs the query 'term' with 'opts', through the result cache unless
+// opts.cache is off, recording it to 'log' if that's open and to 'slow'
+// if it's slow. returns false if 'term' isn't a valid query
+bool run_query(ErlNifEnv *env, const ERL_NIF_TERM term, const Context& c, const QueryOpts& opts, std::function<void(Entity*)> match,
+  QueryLogWriter *log = nullptr, SlowQueryLog *slow = nullptr);
 
 // Returns the Tag (or nullptr) that corresponds to the binary/list in the given context
 Tag *get_tag_from_arg(const Context& c, ErlNifEnv *env, ERL_NIF_TERM);
@@ -0,0 +1,174 @@
+#include <cassert>
+#include <sstream>
+
+#include "jit_cache.h"
+#include "query.h"
+#include "tag.h"
+
+JitCache& JitCache::shared() {
+  // never freed, compiled clauses can outlive static destructors
+  static JitCache *cache = new JitCache();
+  return *cache;
+}
+
+JitCache::JitCache(size_t max_bytes_) :
+  max_bytes(max_bytes_),
+  bytes(0),
+  live(0),
+  live_bytes(0),
+  hits(0),
+  misses(0),
+  compile_failures(0),
+  evictions(0) {}
+
+JitCache::~JitCache() {
+  clear();
+  assert(live == 0 && "compiled code outlived its cache");
+}
+
+std::shared_ptr<const JitCode> JitCache::get(const std::string& key, const Compile& compile) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto i = entries.find(key);
+    if(i != entries.end()) {
+      hits++;
+      lru.splice(lru.begin(), lru, i->second.lru_pos);
+      return i->second.code;
+    }
+    misses++;
+  }
+
+  // compiled without holding the lock, so hits don't wait on it. two
+  // threads missing on the same key both compile, and the loser's is freed
+  auto compiled = compile();
+
+  // released once the lock is, freeing them takes it
+  std::vector<std::shared_ptr<const JitCode> > evicted;
+  std::lock_guard<std::mutex> lock(mutex);
+  if(!compiled) {
+    compile_failures++;
+    return compiled;
+  }
+
+  auto i = entries.find(key);
+  if(i != entries.end()) {
+    lru.splice(lru.begin(), lru, i->second.lru_pos);
+    return i->second.code;
+  }
+
+  // counted as live until the last reference to it goes
+  size_t code_bytes = compiled->bytes;
+  live++;
+  live_bytes += code_bytes;
+  std::shared_ptr<const JitCode> code(compiled.get(), [this, compiled, code_bytes](const JitCode*) {
+    std::lock_guard<std::mutex> lock(mutex);
+    live--;
+    live_bytes -= code_bytes;
+  });
+
+  // too big to keep, the caller can still run it
+  if(code_bytes > max_bytes) {
+    return code;
+  }
+  evict_to(max_bytes - code_bytes, evicted);
+
+  auto& entry = entries[key];
+  entry.code = code;
+  lru.push_front(key);
+  entry.lru_pos = lru.begin();
+  bytes += code_bytes;
+
+  return code;
+}
+
+void JitCache::evict_to(size_t target, std::vector<std::shared_ptr<const JitCode> >& evicted) {
+  while(bytes > target) {
+    auto i = entries.find(lru.back());
+    assert(i != entries.end());
+
+    bytes -= i->second.code->bytes;
+    evicted.push_back(i->second.code);
+    entries.erase(i);
+    lru.pop_back();
+    evictions++;
+  }
+}
+
+void JitCache::set_max_bytes(size_t max_bytes_) {
+  std::vector<std::shared_ptr<const JitCode> > evicted;
+  std::lock_guard<std::mutex> lock(mutex);
+  max_bytes = max_bytes_;
+  evict_to(max_bytes, evicted);
+}
+
+void JitCache::clear() {
+  std::vector<std::shared_ptr<const JitCode> > evicted;
+  std::lock_guard<std::mutex> lock(mutex);
+  evict_to(0, evicted);
+}
+
+JitCacheStats JitCache::stats() {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  JitCacheStats s;
+  s.hits             = hits;
+  s.misses           = misses;
+  s.compile_failures = compile_failures;
+  s.evictions        = evictions;
+  s.entries          = entries.size();
+  s.bytes            = bytes;
+  s.max_bytes        = max_bytes;
+  s.live             = live;
+  s.live_bytes       = live_bytes;
+  return s;
+}
+
+static void append_jit_key(const QueryClause *clause, std::ostringstream& key) {
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(clause)) {
+    key << "t" << (const void*) lit->t;
+  }
+  else if(auto meta = dynamic_cast<const QueryClauseMetaNode*>(clause)) {
+    key << "m" << (const void*) meta->node;
+  }
+  else if(dynamic_cast<const QueryClauseAny*>(clause)) {
+    key << "*";
+  }
+  else if(auto not_ = dynamic_cast<const QueryClauseNot*>(clause)) {
+    key << "!(";
+    append_jit_key(not_->c, key);
+    key << ")";
+  }
+  else if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    key << (bin->type == QueryClauseAnd ? "&(" : "|(");
+    append_jit_key(bin->l, key);
+    key << ",";
+    append_jit_key(bin->r, key);
+    key << ")";
+  }
+  else if(auto nary = dynamic_cast<const QueryClauseNary*>(clause)) {
+    key << (nary->type == QueryClauseAnd ? "&(" : "|(");
+    for(size_t i = 0; i < nary->children.size(); i++) {
+      if(i) key << ",";
+      append_jit_key(nary->children[i], key);
+    }
+    key << ")";
+  }
+  else if(auto th = dynamic_cast<const QueryClauseThreshold*>(clause)) {
+    key << th->k << "(";
+    for(size_t i = 0; i < th->children.size(); i++) {
+      if(i) key << ",";
+      append_jit_key(th->children[i], key);
+    }
+    key << ")";
+  }
+  else {
+    // nothing else is shared
+    key << "?" << (const void*) clause;
+  }
+}
+
+std::string jit_key(const QueryClause *clause) {
+  std::ostringstream key;
+  append_jit_key(clause, key);
+  return key.str();
+}
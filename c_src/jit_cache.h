@@ -0,0 +1,113 @@
+#ifndef __JIT_CACHE_H__
+#define __JIT_CACHE_H__
+
+#include <string>
+#include <list>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <asmjit/asmjit.h>
+
+#include "tag.h"
+
+struct QueryClause;
+
+// a compiled query, freed once the last clause running it goes away
+struct JitCode {
+  typedef bool (*func_type)(const TagSet*);
+
+  func_type func;
+
+  // size of the code, as assembled
+  size_t bytes;
+
+  JitCode(func_type func_, size_t bytes_) : func(func_), bytes(bytes_) {}
+};
+
+struct JitCacheStats {
+  size_t hits;
+  size_t misses;
+  size_t compile_failures;
+  size_t evictions;
+  size_t entries;
+  size_t bytes;
+  size_t max_bytes;
+
+  // code still alive, cached or not
+  size_t live;
+  size_t live_bytes;
+};
+
+// compiled code, shared between every clause (and every context) compiled
+// to the same thing. code is added to one runtime, so it's packed into the
+// same executable pages rather than mapping some for every query. the
+// cache keeps the most recently used code up to max_bytes; evicted code
+// lives on until the clauses using it are freed. safe to use from several
+// threads at once
+struct JitCache {
+  typedef std::function<std::shared_ptr<const JitCode>()> Compile;
+
+  static const size_t default_max_bytes = 4 * 1024 * 1024;
+
+  // the process wide cache jit_compile uses
+  static JitCache& shared();
+
+  JitCache(size_t max_bytes = default_max_bytes);
+  ~JitCache();
+
+  // the code cached under 'key', or 'compile's (which is cached) if there
+  // isn't any. nullptr if it fails to compile
+  std::shared_ptr<const JitCode> get(const std::string& key, const Compile& compile);
+
+  void set_max_bytes(size_t max_bytes);
+  void clear();
+
+  JitCacheStats stats();
+
+  // what compiled code is added to and released from, only touched while
+  // holding runtime_mutex
+  asmjit::JitRuntime runtime;
+  std::mutex runtime_mutex;
+
+private:
+  struct Entry {
+    std::shared_ptr<const JitCode> code;
+
+    // position in 'lru'
+    std::list<std::string>::iterator lru_pos;
+  };
+
+  std::mutex mutex;
+  std::unordered_map<std::string, Entry> entries;
+
+  // keys, most recently used first
+  std::list<std::string> lru;
+
+  size_t max_bytes;
+  size_t bytes;
+  size_t live;
+  size_t live_bytes;
+
+  size_t hits;
+  size_t misses;
+  size_t compile_failures;
+  size_t evictions;
+
+  // drops the least recently used code until there's at most 'target'
+  // bytes cached, moving it to 'evicted' to be released after unlocking
+  void evict_to(size_t target, std::vector<std::shared_ptr<const JitCode> >& evicted);
+
+  JitCache(const JitCache&);
+  JitCache& operator=(const JitCache&);
+};
+
+// identifies what jit_compile emits for 'clause': unlike clause_key, tags
+// and metanodes are keyed by address (which is what the code tests for)
+// and operands are kept in order
+std::string jit_key(const QueryClause *clause);
+
+#endif /* __JIT_CACHE_H__ */
@@ -0,0 +1,95 @@
+#ifndef __MEMORY_ACCOUNT_H__
+#define __MEMORY_ACCOUNT_H__
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+
+// bytes allocated for one kind of thing, added to and taken off from any thread
+struct MemoryCounter {
+  MemoryCounter() : n(0) {}
+
+  void add(size_t bytes)    { n.fetch_add(bytes, std::memory_order_relaxed); }
+  void remove(size_t bytes) { n.fetch_sub(bytes, std::memory_order_relaxed); }
+
+  size_t bytes() const {
+    return n.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<size_t> n;
+
+  MemoryCounter(const MemoryCounter&);
+  MemoryCounter& operator=(const MemoryCounter&);
+};
+
+// std::allocator that counts what a container allocates into 'counter'.
+// a default constructed one counts nothing, and that's what copies of a
+// counted container get, so temporaries don't show up in the counts.
+// moves and swaps carry the allocator along with the memory, so whatever
+// is freed is taken off the counter it was added to
+template<class T>
+struct CountingAllocator {
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  template<class U> struct rebind {
+    typedef CountingAllocator<U> other;
+  };
+
+  MemoryCounter *counter;
+
+  CountingAllocator() : counter(nullptr) {}
+  explicit CountingAllocator(MemoryCounter *counter_) : counter(counter_) {}
+
+  template<class U>
+  CountingAllocator(const CountingAllocator<U>& other) : counter(other.counter) {}
+
+  T *allocate(size_t n) {
+    auto p = std::allocator<T>().allocate(n);
+    if(counter) counter->add(n * sizeof(T));
+    return p;
+  }
+
+  void deallocate(T *p, size_t n) {
+    if(counter) counter->remove(n * sizeof(T));
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  CountingAllocator select_on_container_copy_construction() const {
+    return CountingAllocator();
+  }
+};
+
+template<class T, class U>
+bool operator==(const CountingAllocator<T>& l, const CountingAllocator<U>& r) {
+  return l.counter == r.counter;
+}
+
+template<class T, class U>
+bool operator!=(const CountingAllocator<T>& l, const CountingAllocator<U>& r) {
+  return l.counter != r.counter;
+}
+
+// what a context's memory goes to. containers and objects owned by the
+// context are counted as they're allocated, so this is exact, minus
+// the malloc's own overhead
+struct MemoryAccount {
+  MemoryCounter entities;     // Entity objects, and the id index and list of them
+  MemoryCounter entity_tags;  // the tag set of each entity
+  MemoryCounter tags;         // Tag objects, and the id index of them
+  MemoryCounter implications; // the implies/implied_by sets of each tag
+  MemoryCounter postings;     // the sorted entity list of each tag
+  MemoryCounter meta_nodes;   // SCC metanodes, their edges and tag sets
+  MemoryCounter stats;        // the optimizer's per-tag sketches
+
+  size_t total() const {
+    return entities.bytes() + entity_tags.bytes() + tags.bytes() +
+      implications.bytes() + postings.bytes() + meta_nodes.bytes() +
+      stats.bytes();
+  }
+};
+
+#endif /* __MEMORY_ACCOUNT_H__ */
@@ -1,4 +1,7 @@
 #include "query.h"
+#include "query_stats.h"
+#include "query_bytecode.h"
+#include "jit_cache.h"
 #include "context.h"
 
 #include <asmjit/asmjit.h>
@@ -38,10 +41,15 @@ QueryClause *build_lit(Tag *tag) {
     // collect all reachable metanodes from this node into meta_nodes
     recurse(tag->meta_node);
 
-    for(auto node : meta_nodes) {
-      auto built = new QueryClauseMetaNode(node);
-      if(!clause) { clause = built; }
-      else        { clause = build_or(clause, built); }
+    if(meta_nodes.size() == 1) {
+      clause = new QueryClauseMetaNode(*meta_nodes.begin());
+    }
+    else {
+      auto any = new QueryClauseNary(QueryClauseOr);
+      for(auto node : meta_nodes) {
+        any->children.push_back(new QueryClauseMetaNode(node));
+      }
+      clause = any;
     }
   }
   else {
@@ -52,6 +60,62 @@ QueryClause *build_lit(Tag *tag) {
   return clause;
 }
 
+QueryClause *expand_implications(const QueryClause *clause) {
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(clause)) {
+    return build_lit(lit->t);
+  }
+  if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    return new QueryClauseBin(bin->type,
+      expand_implications(bin->l),
+      expand_implications(bin->r));
+  }
+  if(auto nary = dynamic_cast<const QueryClauseNary*>(clause)) {
+    auto ret = new QueryClauseNary(nary->type);
+    for(auto child : nary->children) {
+      ret->children.push_back(expand_implications(child));
+    }
+    return ret;
+  }
+  if(auto th = dynamic_cast<const QueryClauseThreshold*>(clause)) {
+    auto ret = new QueryClauseThreshold(th->k);
+    for(auto child : th->children) {
+      ret->children.push_back(expand_implications(child));
+    }
+    return ret;
+  }
+  if(auto not_ = dynamic_cast<const QueryClauseNot*>(clause)) {
+    return build_not(expand_implications(not_->c));
+  }
+
+  return clause->dup();
+}
+
+void collect_dependencies(const QueryClause *c, TagSet& tags) {
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(c)) {
+    tags.insert(lit->t);
+  }
+  else if(auto meta = dynamic_cast<const QueryClauseMetaNode*>(c)) {
+    tags.insert(meta->node->tags.begin(), meta->node->tags.end());
+  }
+  else if(auto bin = dynamic_cast<const QueryClauseBin*>(c)) {
+    collect_dependencies(bin->l, tags);
+    collect_dependencies(bin->r, tags);
+  }
+  else if(auto nary = dynamic_cast<const QueryClauseNary*>(c)) {
+    for(auto child : nary->children) {
+      collect_dependencies(child, tags);
+    }
+  }
+  else if(auto th = dynamic_cast<const QueryClauseThreshold*>(c)) {
+    for(auto child : th->children) {
+      collect_dependencies(child, tags);
+    }
+  }
+  else if(auto not_ = dynamic_cast<const QueryClauseNot*>(c)) {
+    collect_dependencies(not_->c, tags);
+  }
+}
+
 QueryClauseBin *build_and(QueryClause *r, QueryClause *l) {
   return new QueryClauseBin(QueryClauseAnd, r, l);
 }
@@ -61,14 +125,39 @@ QueryClauseBin *build_or (QueryClause *r, QueryClause *l) {
 QueryClauseNot *build_not(QueryClause *c) {
   return new QueryClauseNot(c);
 }
+QueryClauseNary *build_nary(QueryClauseBinType type, const std::vector<QueryClause*>& children) {
+  auto ret = new QueryClauseNary(type);
+  ret->children = children;
+  return ret;
+}
+QueryClauseThreshold *build_threshold(size_t k, const std::vector<QueryClause*>& children) {
+  auto ret = new QueryClauseThreshold(k);
+  ret->children = children;
+  return ret;
+}
 
 // forward decls
 QueryClause* hc_tree_optimize(QueryClauseBin* clause);
-QueryClause* jit_optimize(QueryClause* clause);
+QueryClause* cost_optimize(QueryClause* clause, const QueryStats& stats);
 
 QueryClause *optimize(QueryClause *clause, QueryOptFlags flags) {
 
+  if(flags & QueryOptFlags_Normalize) {
+    clause = normalize(clause);
+  }
+
   if(flags & QueryOptFlags_Reorder) {
+    // the huffman tree is built out of binary nodes
+    if(auto nary = dynamic_cast<QueryClauseNary*>(clause)) {
+      auto chain = nary->children.back();
+      for(size_t i = nary->children.size() - 1; i > 0; i--) {
+        chain = new QueryClauseBin(nary->type, nary->children[i - 1], chain);
+      }
+      nary->children.clear();
+      delete nary;
+      clause = chain;
+    }
+
     auto cast_bin = dynamic_cast<QueryClauseBin*>(clause);
     // not a binary clause; ignore
     if(cast_bin) {
@@ -77,14 +166,38 @@ QueryClause *optimize(QueryClause *clause, QueryOptFlags flags) {
   }
 
   if(flags & QueryOptFlags_JIT) {
-    auto old = clause;
-    clause = jit_optimize(clause);
-    delete old;
+    // left as it is if it can't be compiled
+    if(auto compiled = jit_compile(clause)) {
+      delete clause;
+      clause = compiled;
+    }
+  }
+  else if(flags & QueryOptFlags_Bytecode) {
+    // much cheaper to compile than the JIT, for one-off queries
+    if(auto compiled = compile_bytecode(clause)) {
+      delete clause;
+      clause = compiled;
+    }
   }
 
   return clause;
 }
 
+QueryClause *optimize(QueryClause *clause, const QueryStats& stats, QueryOptFlags flags) {
+  if(flags & QueryOptFlags_Normalize) {
+    clause = normalize(clause);
+  }
+
+  if(flags & QueryOptFlags_CostBased) {
+    clause = cost_optimize(clause, stats);
+    flags = (QueryOptFlags) (flags & ~(QueryOptFlags_CostBased | QueryOptFlags_Reorder));
+  }
+
+  flags = (QueryOptFlags) (flags & ~QueryOptFlags_Normalize);
+
+  return optimize(clause, flags);
+}
+
 class QueryClauseCompare
 {
   QueryClauseBinType type;
@@ -115,11 +228,19 @@ QueryClause* hc_tree_optimize(QueryClauseBin* clause) {
 
   // push a given query clause to the bin_nodes or the leafs
   // queue depending on its type
-  auto enqueue_node = [&](QueryClause* c) {
+  std::function<void(QueryClause*)> enqueue_node = [&](QueryClause* c) {
     auto casted = dynamic_cast<QueryClauseBin*>(c);
+    auto nary   = dynamic_cast<QueryClauseNary*>(c);
     if(casted && casted->type == clause->type) {
       bin_nodes.push(casted);
     }
+    else if(nary && nary->type == clause->type) {
+      for(auto child : nary->children) {
+        enqueue_node(child);
+      }
+      nary->children.clear();
+      delete nary;
+    }
     else {
       unsorted_leafs.push_back(c);
     }
@@ -205,39 +326,188 @@ QueryClause* hc_tree_optimize(QueryClauseBin* clause) {
   return queued_leafs.top();
 }
 
-struct QueryClauseJitNode : public QueryClause {
-  asmjit::JitRuntime runtime;
+// an operand of an AND/OR chain, as seen by cost_optimize
+struct CostedClause {
+  QueryClause *clause;
+  double selectivity;
+  double cost;
 
-  typedef bool (*func_type)(const std::unordered_set<Tag*>*);
-  func_type func;
+  // for unions of tags: the entities matching, for correlation estimates
+  bool is_union;
+  EntitySketch sketch;
+  double count;
+};
+
+// detach the operands of a chain of 'type' clauses, freeing the chain
+static void flatten_chain(QueryClause *c, QueryClauseBinType type, std::vector<QueryClause*>& operands) {
+  auto bin  = dynamic_cast<QueryClauseBin*>(c);
+  auto nary = dynamic_cast<QueryClauseNary*>(c);
 
-  QueryClauseJitNode() {}
+  if(bin && bin->type == type) {
+    flatten_chain(bin->l, type, operands);
+    flatten_chain(bin->r, type, operands);
+    bin->l = bin->r = nullptr;
+    delete bin;
+  }
+  else if(nary && nary->type == type) {
+    for(auto child : nary->children) {
+      flatten_chain(child, type, operands);
+    }
+    nary->children.clear();
+    delete nary;
+  }
+  else {
+    operands.push_back(c);
+  }
+}
+
+// orders each AND/OR's operands for short circuit evaluation, into an
+// n-ary node. an AND should run cheap operands that are likely to be false
+// first (lowest cost / (1 - p)), an OR cheap operands likely to be true
+// (lowest cost / p). picked greedily, with p conditioned on the previously
+// picked operand when both are unions of tags, so correlated tags aren't
+// overrated
+QueryClause* cost_optimize(QueryClause* clause, const QueryStats& stats) {
+  if(auto not_ = dynamic_cast<QueryClauseNot*>(clause)) {
+    not_->c = cost_optimize(not_->c, stats);
+    return clause;
+  }
+
+  // a threshold stops once k operands matched or too few are left to, so
+  // cheap operands that are nearly always or never true go first
+  if(auto th = dynamic_cast<QueryClauseThreshold*>(clause)) {
+    std::vector<std::pair<double, QueryClause*> > ranked;
+    for(auto child : th->children) {
+      child = cost_optimize(child, stats);
+      double p = stats.selectivity(child);
+      double decides = std::max(p, 1 - p);
+      ranked.push_back(std::make_pair(stats.cost(child) / decides, child));
+    }
+    std::stable_sort(ranked.begin(), ranked.end(),
+      [](const std::pair<double, QueryClause*>& l, const std::pair<double, QueryClause*>& r) {
+        return l.first < r.first;
+      });
+
+    for(size_t i = 0; i < ranked.size(); i++) {
+      th->children[i] = ranked[i].second;
+    }
+    return clause;
+  }
+
+  auto bin  = dynamic_cast<QueryClauseBin*>(clause);
+  auto nary = dynamic_cast<QueryClauseNary*>(clause);
+  if(!bin && !nary) return clause;
+
+  auto type = bin ? bin->type : nary->type;
+  std::vector<QueryClause*> operands;
+  flatten_chain(clause, type, operands);
+
+  // AND and OR are idempotent, drop repeated metanodes and literals
+  std::unordered_set<SCCMetaNode*> seen_nodes;
+  TagSet seen_tags;
+  std::vector<CostedClause> costed;
+  for(auto op : operands) {
+    auto meta = dynamic_cast<QueryClauseMetaNode*>(op);
+    auto lit  = dynamic_cast<QueryClauseLit*>(op);
+    if((meta && !seen_nodes.insert(meta->node).second) ||
+       (lit  && !seen_tags.insert(lit->t).second)) {
+      delete op;
+      continue;
+    }
+
+    CostedClause cc;
+    cc.clause = cost_optimize(op, stats);
+    cc.selectivity = stats.selectivity(cc.clause);
+    cc.cost = stats.cost(cc.clause);
+
+    TagSet tags;
+    cc.is_union = collect_union_tags(cc.clause, tags);
+    if(cc.is_union) {
+      cc.sketch = stats.sketch(tags);
+      cc.count = cc.selectivity * stats.num_entities();
+    }
+    costed.push_back(std::move(cc));
+  }
+
+  // pairwise correlation is quadratic in the number of operands
+  const size_t max_correlated = 32;
+  bool correlate = costed.size() <= max_correlated;
+  double n = stats.num_entities();
+
+  // probability the operand decides nothing (true in an AND, false in an OR)
+  // given the last picked one didn't either
+  auto passes = [&](const CostedClause& cc, const CostedClause *last) {
+    double p = type == QueryClauseAnd ? cc.selectivity : 1 - cc.selectivity;
+    if(!correlate || !last || !cc.is_union || !last->is_union) return p;
+
+    double both = EntitySketch::intersection(cc.sketch, last->sketch);
+    if(type == QueryClauseAnd) {
+      if(last->count <= 0) return p;
+      p = both / last->count;
+    }
+    else {
+      if(n - last->count <= 0) return p;
+      p = 1 - (cc.count - both) / (n - last->count);
+    }
+    return std::min(1.0, std::max(0.0, p));
+  };
+
+  std::vector<CostedClause*> remaining;
+  for(auto& cc : costed) remaining.push_back(&cc);
+
+  std::vector<QueryClause*> ordered;
+  const CostedClause *last = nullptr;
+  while(remaining.size()) {
+    size_t best = 0;
+    double best_rank = 0;
+    for(size_t i = 0; i < remaining.size(); i++) {
+      double decides = 1 - passes(*remaining[i], last);
+      double rank = remaining[i]->cost / std::max(decides, 1e-9);
+      if(i == 0 || rank < best_rank) {
+        best = i;
+        best_rank = rank;
+      }
+    }
+
+    last = remaining[best];
+    ordered.push_back(last->clause);
+    remaining.erase(remaining.begin() + best);
+  }
+
+  if(ordered.size() == 1) return ordered[0];
+  return build_nary(type, ordered);
+}
+
+struct QueryClauseJitNode : public QueryClause {
+  // shared with every other clause compiled to the same code
+  std::shared_ptr<const JitCode> code;
+
+  QueryClauseJitNode(std::shared_ptr<const JitCode> code_) : code(code_) {}
   virtual ~QueryClauseJitNode() {}
 
   virtual int depth()        const { return 0; }
   virtual int num_children() const { return 0; }
   virtual int entity_count() const { return 0; }
 
-  virtual bool matches_set(const std::unordered_set<Tag*>& tags) const {
-    return func(&tags);
+  virtual bool matches_set(const TagSet& tags) const {
+    return code->func(&tags);
   }
 
   virtual QueryClauseJitNode *dup() const {
-    assert(false);
-    return nullptr;
+    return new QueryClauseJitNode(code);
   }
 
   virtual void debug_print(int indent = 0) const {
     print_indent(indent);
-    std::cerr << "jit()" << std::endl;
+    std::cerr << "jit(" << code->bytes << " bytes)" << std::endl;
   }
 };
 
 // TODO: merge this logic with the matches_set methods on MetaNode and LitNode
-bool extern_set_has_tag(const std::unordered_set<Tag*>* tags, Tag* tag) {
+bool extern_set_has_tag(const TagSet* tags, Tag* tag) {
   return tags->find(tag) != tags->end();
 }
-bool extern_set_has_meta(const std::unordered_set<Tag*>* tags, const SCCMetaNode* node) {
+bool extern_set_has_meta(const TagSet* tags, const SCCMetaNode* node) {
   for(auto t : *tags) {
     if(t->meta_node == node) return true;
   }
@@ -245,13 +515,14 @@ bool extern_set_has_meta(const std::unordered_set<Tag*>* tags, const SCCMetaNode
   return false;
 }
 
-QueryClause* jit_optimize(QueryClause* clause) {
+static std::shared_ptr<const JitCode> jit_emit(const QueryClause* clause) {
   using namespace asmjit;
 
-  auto ret = new QueryClauseJitNode();
+  auto& cache = JitCache::shared();
+  std::lock_guard<std::mutex> lock(cache.runtime_mutex);
 
-  X86Compiler c(&(ret->runtime));
-  c.addFunc(kFuncConvHost, FuncBuilder1<int, std::unordered_set<Tag*>*>());
+  X86Compiler c(&cache.runtime);
+  c.addFunc(kFuncConvHost, FuncBuilder1<int, TagSet*>());
 
   X86GpVar tag_set_ptr(c, kVarTypeIntPtr);
   c.setArg(0, tag_set_ptr);
@@ -284,6 +555,61 @@ QueryClause* jit_optimize(QueryClause* clause) {
       codegen_tree(bin->r, res_var);
       c.bind(Lcompare_done);
     }
+    else if(auto nary = dynamic_cast<const QueryClauseNary*>(clause)) {
+      // same short circuiting as a chain of binary nodes
+      Label Lcompare_done(c);
+      for(size_t i = 0; i < nary->children.size(); i++) {
+        codegen_tree(nary->children[i], res_var);
+        if(i + 1 == nary->children.size()) break;
+
+        c.test(res_var, res_var);
+        if(nary->type == QueryClauseAnd) {
+          c.je(Lcompare_done);
+        }
+        else {
+          c.jne(Lcompare_done);
+        }
+      }
+      c.bind(Lcompare_done);
+    }
+    else if(auto th = dynamic_cast<const QueryClauseThreshold*>(clause)) {
+      size_t n = th->children.size();
+      if(th->k == 0 || th->k > n) {
+        c.mov(res_var, th->k == 0 ? 1 : 0);
+        return;
+      }
+
+      // count matching children, leaving as soon as the result is known
+      X86GpVar count(c, kVarTypeInt32, "count");
+      X86GpVar matched(c, kVarTypeInt32, "matched");
+      Label Lreached(c);
+      Label Lfailed(c);
+      Label Ldone(c);
+
+      c.xor_(count, count);
+      for(size_t i = 0; i < n; i++) {
+        codegen_tree(th->children[i], res_var);
+        c.movzx(matched, res_var);
+        c.add(count, matched);
+
+        c.cmp(count, imm(th->k));
+        c.jge(Lreached);
+
+        // the children left can't make up the difference
+        size_t left = n - i - 1;
+        if(th->k > left) {
+          c.cmp(count, imm(th->k - left));
+          c.jl(Lfailed);
+        }
+      }
+
+      c.bind(Lfailed);
+      c.mov(res_var, 0);
+      c.jmp(Ldone);
+      c.bind(Lreached);
+      c.mov(res_var, 1);
+      c.bind(Ldone);
+    }
     else if(auto lit = dynamic_cast<const QueryClauseLit*>(clause)) {
       X86CallNode* call = c.call(has_tag_func_ptr, kFuncConvHost, FuncBuilder2<int, int*, int*>());
       call->setArg(0, tag_set_ptr);
@@ -313,8 +639,35 @@ QueryClause* jit_optimize(QueryClause* clause) {
   c.ret(test_var);
   c.endFunc();
 
-  void* func = c.make();
-  ret->func = (QueryClauseJitNode::func_type) func;
+  // assembled by hand rather than with c.make(), to get at the size of
+  // the code for JitCache's budget and memory/1
+  X86Assembler a(&cache.runtime);
+  if(c.serialize(&a) != kErrorOk) {
+    return std::shared_ptr<const JitCode>();
+  }
+  size_t bytes = a.getCodeSize();
+
+  void* func = a.make();
+  if(!func) {
+    return std::shared_ptr<const JitCode>();
+  }
 
-  return ret;
+  // handed back to the runtime once the last clause using it is freed
+  JitCache *owner = &cache;
+  return std::shared_ptr<const JitCode>(
+    new JitCode((JitCode::func_type) func, bytes),
+    [owner](const JitCode *code) {
+      std::lock_guard<std::mutex> lock(owner->runtime_mutex);
+      owner->runtime.release((void*) code->func);
+      delete code;
+    });
+}
+
+QueryClause* jit_compile(const QueryClause* clause) {
+  auto code = JitCache::shared().get(jit_key(clause), [clause]() {
+    return jit_emit(clause);
+  });
+  if(!code) return nullptr;
+
+  return new QueryClauseJitNode(code);
 }
@@ -2,7 +2,10 @@
 #define __QUERY_H__
 
 #include <unordered_set>
+#include <vector>
+#include <string>
 #include <algorithm>
+#include <functional>
 #include <iostream>
 
 #include "tag.h"
@@ -10,23 +13,77 @@
 struct QueryClause;
 struct QueryClauseBin;
 struct QueryClauseNot;
+struct QueryClauseNary;
+struct QueryClauseThreshold;
 struct SCCMetaNode;
+struct QueryStats;
+
+// logical clause operators
+enum QueryClauseBinType {
+  QueryClauseAnd,
+  QueryClauseOr
+};
 
 enum QueryOptFlags {
-  QueryOptFlags_Reorder = 0x1,
-  QueryOptFlags_JIT     = 0x2
+  QueryOptFlags_Reorder   = 0x1,
+  QueryOptFlags_JIT       = 0x2,
+  QueryOptFlags_CostBased = 0x4,
+  QueryOptFlags_Normalize = 0x8,
+  QueryOptFlags_Bytecode  = 0x10
 };
 
 QueryClause    *build_lit(Tag *tag);
 QueryClauseBin *build_and(QueryClause *r, QueryClause *l);
 QueryClauseBin *build_or (QueryClause *r, QueryClause *l);
 QueryClauseNot *build_not(QueryClause *c);
+
+// AND/OR over any number of clauses
+QueryClauseNary *build_nary(QueryClauseBinType type, const std::vector<QueryClause*>& children);
+
+// matches when at least k of 'children' do
+QueryClauseThreshold *build_threshold(size_t k, const std::vector<QueryClause*>& children);
+
 QueryClause    *optimize(QueryClause *clause, QueryOptFlags flags = QueryOptFlags_Reorder);
 
+// as above, with QueryOptFlags_CostBased ordering ANDs and ORs by the
+// estimated selectivity and evaluation cost of their operands (taking
+// tags that occur together into account) in place of QueryOptFlags_Reorder
+QueryClause    *optimize(QueryClause *clause, const QueryStats& stats,
+  QueryOptFlags flags = (QueryOptFlags) (QueryOptFlags_Normalize | QueryOptFlags_CostBased));
+
+// native code for 'clause' (which is left alone), what QueryOptFlags_JIT
+// swaps in. nullptr if it can't be compiled
+QueryClause    *jit_compile(const QueryClause *clause);
+
+// rewrites 'clause' (taking ownership of it) into a smaller canonical form
+// with the same matches, what QueryOptFlags_Normalize runs:
+//  - nested ANDs/ORs are flattened into QueryClauseNary nodes
+//  - NOTs are pushed down to the leaves (De Morgan), double NOTs dropped
+//  - 'nil' (any) and 'not nil' constants are folded away
+//  - 'x and not x' becomes 'not nil', 'x or not x' becomes 'nil'
+//  - repeated operands are dropped, and absorbed ones ('x and (x or y)' is 'x')
+//  - in an AND, a union of metanodes containing every metanode of another
+//    operand is implied by it and dropped
+//  - thresholds drop constant operands, and become an OR when k is 1 or an
+//    AND when every operand has to match
+QueryClause    *normalize(QueryClause *clause);
+
+// structural key of 'clause': equal for clauses that are the same up to
+// the order of AND/OR operands
+std::string     clause_key(const QueryClause *clause);
+
+// copy of 'clause' with its literals expanded with build_lit, for
+// clauses built from bare QueryClauseLits
+QueryClause    *expand_implications(const QueryClause *clause);
+
+// tags whose presence on an entity can change whether it matches 'c'
+// (an expanded clause)
+void            collect_dependencies(const QueryClause *c, TagSet& tags);
+
 // root clause AST type
 struct QueryClause {
   // returns true/false if the clause matches a given unordered set
-  virtual bool matches_set(const std::unordered_set<Tag*>& tags) const = 0;
+  virtual bool matches_set(const TagSet& tags) const = 0;
   virtual ~QueryClause() {}
 
   virtual int depth() const = 0;
@@ -50,7 +107,7 @@ struct QueryClauseNot : public QueryClause {
   QueryClauseNot(QueryClause *c_) : c(c_) {}
   virtual ~QueryClauseNot() { delete c; }
 
-  virtual bool matches_set(const std::unordered_set<Tag*>& tags) const {
+  virtual bool matches_set(const TagSet& tags) const {
     return !(c->matches_set(tags));
   }
 
@@ -69,11 +126,6 @@ struct QueryClauseNot : public QueryClause {
 
 };
 
-// logical clause operators
-enum QueryClauseBinType {
-  QueryClauseAnd,
-  QueryClauseOr
-};
 struct QueryClauseBin : public QueryClause {
   QueryClauseBinType type;
   QueryClause *l;
@@ -87,7 +139,7 @@ struct QueryClauseBin : public QueryClause {
     if(r) delete r;
   }
 
-  virtual bool matches_set(const std::unordered_set<Tag*>& tags) const {
+  virtual bool matches_set(const TagSet& tags) const {
     if(type == QueryClauseAnd) {
       return l->matches_set(tags) && r->matches_set(tags);
     }
@@ -122,13 +174,133 @@ struct QueryClauseBin : public QueryClause {
   }
 };
 
+// AND/OR of any number of clauses, evaluated left to right
+struct QueryClauseNary : public QueryClause {
+  QueryClauseBinType type;
+  std::vector<QueryClause*> children;
+
+  QueryClauseNary(QueryClauseBinType type_) : type(type_) {}
+
+  virtual ~QueryClauseNary() {
+    for(auto c : children) {
+      if(c) delete c;
+    }
+  }
+
+  virtual bool matches_set(const TagSet& tags) const {
+    // an AND is decided by the first false operand, an OR by the first true one
+    bool decides = type == QueryClauseOr;
+    for(auto c : children) {
+      if(c->matches_set(tags) == decides) return decides;
+    }
+    return !decides;
+  }
+
+  virtual int depth() const {
+    int ret = 0;
+    for(auto c : children) ret = std::max(ret, c->depth());
+    return ret + 1;
+  }
+  virtual int num_children() const {
+    int ret = 1;
+    for(auto c : children) ret += c->num_children();
+    return ret;
+  }
+  virtual int entity_count() const {
+    int ret = type == QueryClauseAnd ? 999999999 : 0;
+    for(auto c : children) {
+      ret = type == QueryClauseAnd ?
+        std::min(ret, c->entity_count()) :
+        std::max(ret, c->entity_count());
+    }
+    return ret;
+  }
+
+  virtual QueryClauseNary *dup() const {
+    auto ret = new QueryClauseNary(type);
+    ret->children.reserve(children.size());
+    for(auto c : children) ret->children.push_back(c->dup());
+    return ret;
+  }
+
+  virtual void debug_print(int indent = 0) const {
+    print_indent(indent);
+    std::cerr <<
+      "nary(" << (type == QueryClauseAnd ? "and" : "or") << ")" <<
+      "(" << entity_count() << ") ->" << std::endl;
+
+    for(auto c : children) c->debug_print(indent + 1);
+  }
+};
+
+// matches when at least k of its children match. children are counted
+// left to right, stopping as soon as the result is known
+struct QueryClauseThreshold : public QueryClause {
+  size_t k;
+  std::vector<QueryClause*> children;
+
+  QueryClauseThreshold(size_t k_) : k(k_) {}
+
+  virtual ~QueryClauseThreshold() {
+    for(auto c : children) {
+      if(c) delete c;
+    }
+  }
+
+  virtual bool matches_set(const TagSet& tags) const {
+    size_t matched = 0, left = children.size();
+    for(auto c : children) {
+      if(matched >= k) return true;
+      if(matched + left < k) return false;
+
+      if(c->matches_set(tags)) matched++;
+      left--;
+    }
+    return matched >= k;
+  }
+
+  virtual int depth() const {
+    int ret = 0;
+    for(auto c : children) ret = std::max(ret, c->depth());
+    return ret + 1;
+  }
+  virtual int num_children() const {
+    int ret = 1;
+    for(auto c : children) ret += c->num_children();
+    return ret;
+  }
+  virtual int entity_count() const {
+    // can't be more than the k-th largest child's
+    std::vector<int> counts;
+    for(auto c : children) counts.push_back(c->entity_count());
+    if(k == 0) return 999999999;
+    if(k > counts.size()) return 0;
+    std::sort(counts.begin(), counts.end(), std::greater<int>());
+    return counts[k - 1];
+  }
+
+  virtual QueryClauseThreshold *dup() const {
+    auto ret = new QueryClauseThreshold(k);
+    ret->children.reserve(children.size());
+    for(auto c : children) ret->children.push_back(c->dup());
+    return ret;
+  }
+
+  virtual void debug_print(int indent = 0) const {
+    print_indent(indent);
+    std::cerr << "at_least(" << k << ")(" << entity_count() << ") ->" << std::endl;
+
+    for(auto c : children) c->debug_print(indent + 1);
+  }
+};
+
 // literal tag match
 struct QueryClauseLit : public QueryClause {
   Tag *t;
 
   QueryClauseLit(Tag *t_) : t(t_) {}
   virtual ~QueryClauseLit() { t = nullptr; }
-  virtual bool matches_set(const std::unordered_set<Tag*>& tags) const {
+  virtual bool matches_set(const TagSet& tags) const {
     return tags.find(t) != tags.end();
   }
 
@@ -151,7 +323,7 @@ struct QueryClauseMetaNode : public QueryClause {
   QueryClauseMetaNode(SCCMetaNode *node_) : node(node_) {}
   virtual ~QueryClauseMetaNode() { node = nullptr; }
 
-  virtual bool matches_set(const std::unordered_set<Tag*>& tags) const {
+  virtual bool matches_set(const TagSet& tags) const {
     // do any of the tags belong to this metanode
     // TODO: store set of relevant meta_nodes on posts instead of
     // tags directly
@@ -174,7 +346,7 @@ struct QueryClauseMetaNode : public QueryClause {
 
 // represents an empty clause (matches everything)
 struct QueryClauseAny : public QueryClause {
-  virtual bool matches_set(const std::unordered_set<Tag*>& tags) const {
+  virtual bool matches_set(const TagSet& tags) const {
     (void)tags;
     return true;
   }
@@ -0,0 +1,265 @@
+#include <cassert>
+#include <memory>
+
+#include "query_bytecode.h"
+#include "scc_meta_node.h"
+
+// counters kept on the stack before falling back to the heap
+static const size_t local_counters = 16;
+
+bool QueryProgram::run(const TagSet& tags) const {
+  uint32_t local[local_counters];
+  std::vector<uint32_t> heap;
+  uint32_t *counters = local;
+  if(max_counters > local_counters) {
+    heap.resize(max_counters);
+    counters = heap.data();
+  }
+  size_t depth = 0;
+
+  bool reg = false;
+  const QueryOp *op = ops.data();
+  for(;;) {
+    switch(op->code) {
+    case QueryOp_Tag:
+      reg = tags.find((Tag*) op->ptr) != tags.end();
+      break;
+
+    case QueryOp_Meta:
+      reg = false;
+      for(auto t : tags) {
+        if(t->meta_node == op->ptr) {
+          reg = true;
+          break;
+        }
+      }
+      break;
+
+    case QueryOp_Const:
+      reg = op->arg;
+      break;
+
+    case QueryOp_Not:
+      reg = !reg;
+      break;
+
+    case QueryOp_JumpIfFalse:
+      if(!reg) {
+        op = ops.data() + op->target;
+        continue;
+      }
+      break;
+
+    case QueryOp_JumpIfTrue:
+      if(reg) {
+        op = ops.data() + op->target;
+        continue;
+      }
+      break;
+
+    case QueryOp_CountPush:
+      counters[depth++] = 0;
+      break;
+
+    case QueryOp_CountAdd:
+      counters[depth - 1] += reg;
+      break;
+
+    case QueryOp_CountAtLeast:
+      if(counters[depth - 1] >= op->arg) {
+        reg = true;
+        op = ops.data() + op->target;
+        continue;
+      }
+      break;
+
+    case QueryOp_CountBelow:
+      if(counters[depth - 1] < op->arg) {
+        reg = false;
+        op = ops.data() + op->target;
+        continue;
+      }
+      break;
+
+    case QueryOp_CountPop:
+      depth--;
+      break;
+
+    case QueryOp_Return:
+      return reg;
+
+    default:
+      assert(false && "bad opcode");
+      return false;
+    }
+
+    op++;
+  }
+}
+
+void QueryProgram::disassemble(std::ostream& out) const {
+  static const char *names[] = {
+    "tag", "meta", "const", "not", "jump_if_false", "jump_if_true",
+    "count_push", "count_add", "count_at_least", "count_below", "count_pop",
+    "return"
+  };
+
+  for(size_t i = 0; i < ops.size(); i++) {
+    auto& op = ops[i];
+    out << i << ": " << names[op.code];
+
+    switch(op.code) {
+    case QueryOp_Tag:
+      out << " " << ((const Tag*) op.ptr)->id;
+      break;
+    case QueryOp_Meta:
+      out << " " << op.ptr;
+      break;
+    case QueryOp_Const:
+      out << " " << op.arg;
+      break;
+    case QueryOp_JumpIfFalse:
+    case QueryOp_JumpIfTrue:
+      out << " -> " << op.target;
+      break;
+    case QueryOp_CountAtLeast:
+    case QueryOp_CountBelow:
+      out << " " << op.arg << " -> " << op.target;
+      break;
+    }
+    out << std::endl;
+  }
+}
+
+static void emit(QueryProgram& program, uint32_t code, uint32_t arg = 0, const void *ptr = nullptr) {
+  QueryOp op;
+  op.code = code;
+  op.arg = arg;
+  op.ptr = ptr;
+  program.ops.push_back(op);
+}
+
+// point the jumps at 'jumps' to the next instruction
+static void patch(QueryProgram& program, const std::vector<size_t>& jumps) {
+  for(auto i : jumps) {
+    program.ops[i].target = program.ops.size();
+  }
+}
+
+// emit the code for 'clause', leaving its result in the register
+static bool compile(const QueryClause *clause, QueryProgram& program, size_t depth) {
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(clause)) {
+    emit(program, QueryOp_Tag, 0, lit->t);
+    return true;
+  }
+  if(auto meta = dynamic_cast<const QueryClauseMetaNode*>(clause)) {
+    emit(program, QueryOp_Meta, 0, meta->node);
+    return true;
+  }
+  if(dynamic_cast<const QueryClauseAny*>(clause)) {
+    emit(program, QueryOp_Const, 1);
+    return true;
+  }
+  if(auto not_ = dynamic_cast<const QueryClauseNot*>(clause)) {
+    if(!compile(not_->c, program, depth)) return false;
+    emit(program, QueryOp_Not);
+    return true;
+  }
+
+  // an AND leaves at its first false operand, an OR at its first true one
+  auto bin  = dynamic_cast<const QueryClauseBin*>(clause);
+  auto nary = dynamic_cast<const QueryClauseNary*>(clause);
+  if(bin || nary) {
+    std::vector<const QueryClause*> operands;
+    if(bin) {
+      operands.push_back(bin->l);
+      operands.push_back(bin->r);
+    }
+    else {
+      operands.assign(nary->children.begin(), nary->children.end());
+    }
+
+    auto type = bin ? bin->type : nary->type;
+    if(operands.empty()) {
+      emit(program, QueryOp_Const, type == QueryClauseAnd);
+      return true;
+    }
+
+    std::vector<size_t> exits;
+    for(size_t i = 0; i < operands.size(); i++) {
+      if(!compile(operands[i], program, depth)) return false;
+      if(i + 1 == operands.size()) break;
+
+      exits.push_back(program.ops.size());
+      emit(program, type == QueryClauseAnd ? QueryOp_JumpIfFalse : QueryOp_JumpIfTrue);
+    }
+    patch(program, exits);
+    return true;
+  }
+
+  if(auto th = dynamic_cast<const QueryClauseThreshold*>(clause)) {
+    size_t n = th->children.size();
+    if(th->k == 0 || th->k > n) {
+      emit(program, QueryOp_Const, th->k == 0);
+      return true;
+    }
+
+    depth++;
+    program.max_counters = std::max(program.max_counters, depth);
+
+    // every operand leaves once the count is decided, the last one always
+    std::vector<size_t> exits;
+    emit(program, QueryOp_CountPush);
+    for(size_t i = 0; i < n; i++) {
+      if(!compile(th->children[i], program, depth)) return false;
+      emit(program, QueryOp_CountAdd);
+
+      exits.push_back(program.ops.size());
+      emit(program, QueryOp_CountAtLeast, th->k);
+
+      // the operands left can't make up the difference
+      size_t left = n - i - 1;
+      if(th->k > left) {
+        exits.push_back(program.ops.size());
+        emit(program, QueryOp_CountBelow, th->k - left);
+      }
+    }
+    patch(program, exits);
+    emit(program, QueryOp_CountPop);
+    return true;
+  }
+
+  if(auto compiled = dynamic_cast<const QueryClauseBytecode*>(clause)) {
+    // inline it, less its return
+    auto& ops = compiled->program.ops;
+    size_t base = program.ops.size();
+    for(size_t i = 0; i + 1 < ops.size(); i++) {
+      auto op = ops[i];
+      switch(op.code) {
+      case QueryOp_JumpIfFalse:
+      case QueryOp_JumpIfTrue:
+      case QueryOp_CountAtLeast:
+      case QueryOp_CountBelow:
+        op.target += base;
+        break;
+      }
+      program.ops.push_back(op);
+    }
+    program.max_counters = std::max(program.max_counters, depth + compiled->program.max_counters);
+    return true;
+  }
+
+  // JIT compiled clauses and the like
+  return false;
+}
+
+QueryClauseBytecode *compile_bytecode(const QueryClause *clause) {
+  std::unique_ptr<QueryClauseBytecode> ret(new QueryClauseBytecode());
+  if(!compile(clause, ret->program, 0)) return nullptr;
+  emit(ret->program, QueryOp_Return);
+
+  ret->source_depth    = clause->depth();
+  ret->source_children = clause->num_children();
+  ret->source_count    = clause->entity_count();
+  return ret.release();
+}
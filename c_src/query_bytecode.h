@@ -0,0 +1,86 @@
+#ifndef __QUERY_BYTECODE_H__
+#define __QUERY_BYTECODE_H__
+
+#include <vector>
+#include <unordered_set>
+#include <iostream>
+#include <cstdint>
+
+#include "query.h"
+
+// instructions of the query VM. it has a single boolean register, the
+// result of the last test, and a stack of counters for thresholds
+enum QueryOpCode {
+  QueryOp_Tag,          // reg = the set has tag 'ptr'
+  QueryOp_Meta,         // reg = the set has a tag of metanode 'ptr'
+  QueryOp_Const,        // reg = 'arg'
+  QueryOp_Not,          // reg = !reg
+  QueryOp_JumpIfFalse,  // jump to 'target' if !reg
+  QueryOp_JumpIfTrue,   // jump to 'target' if reg
+  QueryOp_CountPush,    // push a counter of 0
+  QueryOp_CountAdd,     // add reg to the top counter
+  QueryOp_CountAtLeast, // top counter >= 'arg'? reg = true, jump to 'target'
+  QueryOp_CountBelow,   // top counter < 'arg'? reg = false, jump to 'target'
+  QueryOp_CountPop,     // pop the top counter
+  QueryOp_Return        // return reg
+};
+
+struct QueryOp {
+  uint32_t code;
+  uint32_t arg;
+  union {
+    const void *ptr;
+    size_t target;
+  };
+};
+
+// a clause compiled to a flat array of instructions, with short circuit
+// evaluation done by jumps instead of by walking the tree
+struct QueryProgram {
+  std::vector<QueryOp> ops;
+
+  // deepest nesting of thresholds
+  size_t max_counters;
+
+  QueryProgram() : max_counters(0) {}
+
+  bool run(const TagSet& tags) const;
+
+  void disassemble(std::ostream& out) const;
+};
+
+// a compiled clause, in place of the tree it was compiled from
+struct QueryClauseBytecode : public QueryClause {
+  QueryProgram program;
+
+  // of the source clause, for the optimizer
+  int source_depth;
+  int source_children;
+  int source_count;
+
+  QueryClauseBytecode() : source_depth(0), source_children(0), source_count(0) {}
+  virtual ~QueryClauseBytecode() {}
+
+  virtual bool matches_set(const TagSet& tags) const {
+    return program.run(tags);
+  }
+
+  virtual int depth()        const { return source_depth;    }
+  virtual int num_children() const { return source_children; }
+  virtual int entity_count() const { return source_count;    }
+
+  virtual QueryClauseBytecode *dup() const {
+    return new QueryClauseBytecode(*this);
+  }
+
+  virtual void debug_print(int indent = 0) const {
+    print_indent(indent);
+    std::cerr << "bytecode(" << program.ops.size() << " ops)" << std::endl;
+  }
+};
+
+// compile 'clause' to bytecode (the clause is left alone). returns nullptr
+// if it has nodes the VM can't run, like JIT compiled ones
+QueryClauseBytecode *compile_bytecode(const QueryClause *clause);
+
+#endif /* __QUERY_BYTECODE_H__ */
@@ -0,0 +1,248 @@
+#include <cassert>
+#include <algorithm>
+
+#include "query_cache.h"
+#include "entity.h"
+
+// collect the keys of the operands of a chain of 'type' clauses
+static bool collect_operand_keys(const QueryClause *c, QueryClauseBinType type, std::vector<std::string>& keys) {
+  auto bin = dynamic_cast<const QueryClauseBin*>(c);
+  if(bin && bin->type == type) {
+    return
+      collect_operand_keys(bin->l, type, keys) &&
+      collect_operand_keys(bin->r, type, keys);
+  }
+  auto nary = dynamic_cast<const QueryClauseNary*>(c);
+  if(nary && nary->type == type) {
+    for(auto child : nary->children) {
+      if(!collect_operand_keys(child, type, keys)) return false;
+    }
+    return true;
+  }
+
+  std::string key;
+  if(!query_cache_key(c, key)) return false;
+  keys.push_back(std::move(key));
+  return true;
+}
+
+bool query_cache_key(const QueryClause *source, std::string& key) {
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(source)) {
+    key = "t" + std::to_string(lit->t->id);
+    return true;
+  }
+  if(dynamic_cast<const QueryClauseAny*>(source)) {
+    key = "*";
+    return true;
+  }
+  if(auto not_ = dynamic_cast<const QueryClauseNot*>(source)) {
+    // not(not(x)) == x
+    if(auto inner = dynamic_cast<const QueryClauseNot*>(not_->c)) {
+      return query_cache_key(inner->c, key);
+    }
+
+    if(!query_cache_key(not_->c, key)) return false;
+    key = "!(" + key + ")";
+    return true;
+  }
+  auto bin  = dynamic_cast<const QueryClauseBin*>(source);
+  auto nary = dynamic_cast<const QueryClauseNary*>(source);
+  if(bin || nary) {
+    auto type = bin ? bin->type : nary->type;
+    std::vector<std::string> keys;
+    if(!collect_operand_keys(source, type, keys)) return false;
+
+    // AND and OR are commutative and idempotent
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    if(keys.size() == 1) {
+      key = std::move(keys[0]);
+      return true;
+    }
+
+    key = type == QueryClauseAnd ? "&(" : "|(";
+    for(size_t i = 0; i < keys.size(); i++) {
+      if(i) key += ",";
+      key += keys[i];
+    }
+    key += ")";
+    return true;
+  }
+
+  if(auto th = dynamic_cast<const QueryClauseThreshold*>(source)) {
+    // commutative, but repeated operands count twice
+    std::vector<std::string> keys;
+    for(auto child : th->children) {
+      std::string child_key;
+      if(!query_cache_key(child, child_key)) return false;
+      keys.push_back(std::move(child_key));
+    }
+    std::sort(keys.begin(), keys.end());
+
+    key = std::to_string(th->k) + "(";
+    for(size_t i = 0; i < keys.size(); i++) {
+      if(i) key += ",";
+      key += keys[i];
+    }
+    key += ")";
+    return true;
+  }
+
+  // metanodes and JIT compiled clauses only exist after expansion
+  return false;
+}
+
+QueryCache::QueryCache(size_t max_bytes_) :
+  bytes(0),
+  max_bytes(max_bytes_),
+  hits(0),
+  misses(0),
+  inserts(0),
+  evictions(0),
+  invalidations(0) {}
+
+QueryCache::~QueryCache() {
+  for(auto entry : lru) {
+    delete entry;
+  }
+}
+
+QueryCache::Results QueryCache::lookup(const std::string& key) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto i = by_key.find(key);
+  if(i == by_key.end()) {
+    misses++;
+    return Results();
+  }
+
+  hits++;
+  auto entry = i->second;
+  lru.splice(lru.begin(), lru, entry->lru_pos);
+  return entry->results;
+}
+
+void QueryCache::insert(const std::string& key, const QueryClause *clause, Results results) {
+  assert(results);
+
+  auto entry = new Entry();
+  entry->key = key;
+  entry->results = results;
+
+  TagSet depends_on;
+  collect_dependencies(clause, depends_on);
+  entry->depends_on.assign(depends_on.begin(), depends_on.end());
+  entry->matches_untagged = clause->matches_set(TagSet());
+
+  // the entry, its results and its index slots
+  entry->bytes =
+    sizeof(Entry) + key.size() +
+    results->capacity() * sizeof(Entity*) +
+    entry->depends_on.size() * (sizeof(Tag*) + sizeof(Entry*) * 2);
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // another reader may have beaten us to it
+  auto existing = by_key.find(key);
+  if(existing != by_key.end()) {
+    remove(existing->second);
+  }
+
+  if(entry->bytes > max_bytes) {
+    delete entry;
+    return;
+  }
+
+  evict_to(max_bytes - entry->bytes);
+
+  lru.push_front(entry);
+  entry->lru_pos = lru.begin();
+  by_key[entry->key] = entry;
+  for(auto tag : entry->depends_on) {
+    by_tag[tag].insert(entry);
+  }
+  if(entry->matches_untagged) {
+    untagged.insert(entry);
+  }
+
+  bytes += entry->bytes;
+  inserts++;
+}
+
+void QueryCache::invalidate_tag(Tag *tag) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto i = by_tag.find(tag);
+  if(i == by_tag.end()) return;
+
+  // remove() edits the set being walked
+  std::vector<Entry*> entries(i->second.begin(), i->second.end());
+  for(auto entry : entries) {
+    remove(entry);
+    invalidations++;
+  }
+}
+
+void QueryCache::invalidate_untagged() {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  std::vector<Entry*> entries(untagged.begin(), untagged.end());
+  for(auto entry : entries) {
+    remove(entry);
+    invalidations++;
+  }
+}
+
+void QueryCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  while(!lru.empty()) {
+    remove(lru.back());
+  }
+}
+
+void QueryCache::set_max_bytes(size_t max_bytes_) {
+  std::lock_guard<std::mutex> lock(mutex);
+  max_bytes = max_bytes_;
+  evict_to(max_bytes);
+}
+
+QueryCacheStats QueryCache::stats() {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  QueryCacheStats s;
+  s.hits          = hits;
+  s.misses        = misses;
+  s.inserts       = inserts;
+  s.evictions     = evictions;
+  s.invalidations = invalidations;
+  s.entries       = by_key.size();
+  s.bytes         = bytes;
+  s.max_bytes     = max_bytes;
+  return s;
+}
+
+void QueryCache::remove(Entry *entry) {
+  lru.erase(entry->lru_pos);
+  by_key.erase(entry->key);
+
+  for(auto tag : entry->depends_on) {
+    auto i = by_tag.find(tag);
+    assert(i != by_tag.end());
+    i->second.erase(entry);
+    if(i->second.empty()) by_tag.erase(i);
+  }
+  if(entry->matches_untagged) {
+    untagged.erase(entry);
+  }
+
+  bytes -= entry->bytes;
+  delete entry;
+}
+
+void QueryCache::evict_to(size_t target) {
+  while(bytes > target) {
+    assert(!lru.empty());
+    remove(lru.back());
+    evictions++;
+  }
+}
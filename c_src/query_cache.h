@@ -0,0 +1,101 @@
+#ifndef __QUERY_CACHE_H__
+#define __QUERY_CACHE_H__
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <mutex>
+
+#include "query.h"
+
+struct Entity;
+
+// normalized form of 'source', a clause built from bare QueryClauseLits:
+// nested ANDs/ORs are flattened and their operands sorted and deduplicated,
+// and double negations dropped, so equivalent spellings of a query share
+// a key. returns false if the clause can't be cached
+bool query_cache_key(const QueryClause *source, std::string& key);
+
+struct QueryCacheStats {
+  size_t hits;
+  size_t misses;
+  size_t inserts;
+  size_t evictions;
+  size_t invalidations;
+  size_t entries;
+  size_t bytes;
+  size_t max_bytes;
+};
+
+// bounded LRU cache of full query results, keyed on query_cache_key.
+// each entry records the tags an entity's membership in which can change
+// the result, so a change to one tag only drops the entries depending on it.
+// safe to use from several readers at once
+struct QueryCache {
+  typedef std::shared_ptr<const std::vector<Entity*> > Results;
+
+  static const size_t default_max_bytes = 64 << 20;
+
+  QueryCache(size_t max_bytes = default_max_bytes);
+  ~QueryCache();
+
+  // results cached under 'key', or null. counts a hit or a miss
+  Results lookup(const std::string& key);
+
+  // cache 'results' of 'clause' (expanded against the current metagraph)
+  // under 'key'. entries larger than the whole cache are dropped
+  void insert(const std::string& key, const QueryClause *clause, Results results);
+
+  // drop entries whose results depend on which entities carry 'tag'
+  void invalidate_tag(Tag *tag);
+
+  // drop entries that an entity without any tags would match, for when
+  // entities are created
+  void invalidate_untagged();
+
+  void clear();
+
+  // evicts down to the new size if needed; 0 disables the cache
+  void set_max_bytes(size_t max_bytes);
+
+  QueryCacheStats stats();
+
+private:
+  struct Entry {
+    std::string key;
+    Results results;
+    std::vector<Tag*> depends_on;
+    bool matches_untagged;
+    size_t bytes;
+
+    std::list<Entry*>::iterator lru_pos;
+  };
+
+  std::mutex mutex;
+
+  // most recently used first
+  std::list<Entry*> lru;
+  std::unordered_map<std::string, Entry*> by_key;
+  std::unordered_map<Tag*, std::unordered_set<Entry*> > by_tag;
+  std::unordered_set<Entry*> untagged;
+
+  size_t bytes;
+  size_t max_bytes;
+
+  size_t hits;
+  size_t misses;
+  size_t inserts;
+  size_t evictions;
+  size_t invalidations;
+
+  void remove(Entry *entry);
+  void evict_to(size_t target);
+
+  QueryCache(const QueryCache&);
+  QueryCache& operator=(const QueryCache&);
+};
+
+#endif /* __QUERY_CACHE_H__ */
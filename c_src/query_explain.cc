@@ -0,0 +1,153 @@
+#include <algorithm>
+
+#include "query_explain.h"
+#include "query_stats.h"
+#include "scc_meta_node.h"
+#include "tag.h"
+
+// a clause's operands, in evaluation order
+static std::vector<const QueryClause*> operands(const QueryClause *clause) {
+  std::vector<const QueryClause*> ret;
+  if(auto not_ = dynamic_cast<const QueryClauseNot*>(clause)) {
+    ret.push_back(not_->c);
+  }
+  else if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    ret.push_back(bin->l);
+    ret.push_back(bin->r);
+  }
+  else if(auto nary = dynamic_cast<const QueryClauseNary*>(clause)) {
+    ret.assign(nary->children.begin(), nary->children.end());
+  }
+  else if(auto th = dynamic_cast<const QueryClauseThreshold*>(clause)) {
+    ret.assign(th->children.begin(), th->children.end());
+  }
+  return ret;
+}
+
+ExplainNode explain_clause(const QueryClause *clause, const QueryStats& stats, size_t num_entities) {
+  ExplainNode node;
+
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(clause)) {
+    node.op = "tag";
+    node.tags.push_back(lit->t->id);
+  }
+  else if(auto meta = dynamic_cast<const QueryClauseMetaNode*>(clause)) {
+    node.op = "implied";
+    for(auto t : meta->node->tags) {
+      node.tags.push_back(t->id);
+    }
+    std::sort(node.tags.begin(), node.tags.end());
+  }
+  else if(dynamic_cast<const QueryClauseAny*>(clause)) {
+    node.op = "any";
+  }
+  else if(dynamic_cast<const QueryClauseNot*>(clause)) {
+    node.op = "not";
+  }
+  else if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    node.op = bin->type == QueryClauseAnd ? "and" : "or";
+  }
+  else if(auto nary = dynamic_cast<const QueryClauseNary*>(clause)) {
+    node.op = nary->type == QueryClauseAnd ? "and" : "or";
+  }
+  else if(auto th = dynamic_cast<const QueryClauseThreshold*>(clause)) {
+    node.op = "at_least";
+    node.k = th->k;
+  }
+  else {
+    // bytecode, JIT code and the like
+    node.op = "compiled";
+  }
+
+  node.estimated_rows = stats.selectivity(clause) * num_entities;
+  node.cost = stats.cost(clause);
+
+  for(auto op : operands(clause)) {
+    node.children.push_back(explain_clause(op, stats, num_entities));
+  }
+  return node;
+}
+
+// evaluates like the clause it mirrors, counting into its plan node
+struct QueryClauseProbe : public QueryClause {
+  const QueryClause *clause;
+  ExplainNode *node;
+  std::vector<QueryClauseProbe*> children;
+
+  QueryClauseProbe(const QueryClause *clause_, ExplainNode *node_) : clause(clause_), node(node_) {
+    auto ops = operands(clause);
+    for(size_t i = 0; i < ops.size(); i++) {
+      children.push_back(new QueryClauseProbe(ops[i], &node->children[i]));
+    }
+  }
+  virtual ~QueryClauseProbe() {
+    for(auto c : children) delete c;
+  }
+
+  virtual int depth()        const { return clause->depth(); }
+  virtual int num_children() const { return clause->num_children(); }
+  virtual int entity_count() const { return clause->entity_count(); }
+
+  virtual bool matches_set(const TagSet& tags) const {
+    node->evaluated++;
+    bool ret = evaluate(tags);
+    if(ret) node->matched++;
+    return ret;
+  }
+
+  virtual QueryClauseProbe *dup() const {
+    return new QueryClauseProbe(clause, node);
+  }
+
+  virtual void debug_print(int indent = 0) const {
+    print_indent(indent);
+    std::cerr << "probe(" << node->op << ")" << std::endl;
+    for(auto c : children) c->debug_print(indent + 1);
+  }
+
+private:
+  // the clause's own logic, run over the probes of its operands
+  bool evaluate(const TagSet& tags) const {
+    size_t n = children.size();
+
+    if(dynamic_cast<const QueryClauseNot*>(clause)) {
+      return !children[0]->matches_set(tags);
+    }
+
+    auto bin  = dynamic_cast<const QueryClauseBin*>(clause);
+    auto nary = dynamic_cast<const QueryClauseNary*>(clause);
+    if(bin || nary) {
+      bool is_and = (bin ? bin->type : nary->type) == QueryClauseAnd;
+      for(size_t i = 0; i < n; i++) {
+        // an AND stops at its first false operand, an OR at its first true one
+        if(children[i]->matches_set(tags) != is_and) {
+          if(i + 1 < n) node->short_circuits++;
+          return !is_and;
+        }
+      }
+      return is_and;
+    }
+
+    if(auto th = dynamic_cast<const QueryClauseThreshold*>(clause)) {
+      if(th->k == 0 || th->k > n) return th->k == 0;
+
+      size_t count = 0;
+      for(size_t i = 0; i < n; i++) {
+        count += children[i]->matches_set(tags);
+
+        size_t left = n - i - 1;
+        if(count >= th->k || count + left < th->k) {
+          if(left) node->short_circuits++;
+          return count >= th->k;
+        }
+      }
+      return false;
+    }
+
+    return clause->matches_set(tags);
+  }
+};
+
+QueryClause *build_probe(const QueryClause *clause, ExplainNode& plan) {
+  return new QueryClauseProbe(clause, &plan);
+}
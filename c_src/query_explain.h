@@ -0,0 +1,97 @@
+#ifndef __QUERY_EXPLAIN_H__
+#define __QUERY_EXPLAIN_H__
+
+#include <string>
+#include <vector>
+
+#include "id.h"
+#include "query.h"
+
+struct QueryStats;
+
+// a node of an explained query, with its children in the order the
+// optimizer left them in (the order they're evaluated in)
+struct ExplainNode {
+  // "tag", "implied" (any tag implying a metanode's tags), "any", "not",
+  // "and", "or", "at_least" or "compiled"
+  std::string op;
+
+  // the tag of a "tag", the tags of an "implied"'s metanode
+  std::vector<id_type> tags;
+
+  // for "at_least"
+  size_t k;
+
+  // what the optimizer expected
+  double estimated_rows;
+  double cost;
+
+  // filled in by an analyzed run: how many entities the node was tested
+  // against, how many it matched, and how often an and/or/at_least was
+  // decided before getting to its last operand
+  size_t evaluated;
+  size_t matched;
+  size_t short_circuits;
+
+  std::vector<ExplainNode> children;
+
+  ExplainNode() :
+    k(0),
+    estimated_rows(0),
+    cost(0),
+    evaluated(0),
+    matched(0),
+    short_circuits(0) {}
+};
+
+// how a query is (or was) run, see Context::explain
+struct QueryExplain {
+  // how candidates are found:
+  //  - "postings": merging the entity lists of a union of tags
+  //  - "threshold": merging entity lists, counting the operands listing each
+  //  - "index": the entity lists of an AND's most selective operand
+  //  - "scan": every entity from the cursor on
+  const char *engine;
+
+  // how candidates are tested: "none", "tree", "bytecode" or "jit"
+  const char *evaluator;
+
+  // the tags an "index" query reads candidates off
+  std::vector<id_type> driver;
+
+  ExplainNode plan;
+
+  // the rest is only filled in by an analyzed run
+  bool analyzed;
+  size_t rows;
+  size_t examined;
+
+  // microseconds spent turning the query term into a clause, optimizing
+  // it, compiling it for the scan, and running it
+  double parse_us;
+  double optimize_us;
+  double compile_us;
+  double execute_us;
+
+  QueryExplain() :
+    engine("none"),
+    evaluator("none"),
+    analyzed(false),
+    rows(0),
+    examined(0),
+    parse_us(0),
+    optimize_us(0),
+    compile_us(0),
+    execute_us(0) {}
+};
+
+// the plan for an optimized clause, with the estimates of 'stats' for a
+// context holding 'num_entities' entities
+ExplainNode explain_clause(const QueryClause *clause, const QueryStats& stats, size_t num_entities);
+
+// a clause matching what 'clause' does, evaluating its operands in the
+// same order, which counts what each node did into 'plan' (as returned by
+// explain_clause for 'clause'). both have to outlive it
+QueryClause *build_probe(const QueryClause *clause, ExplainNode& plan);
+
+#endif /* __QUERY_EXPLAIN_H__ */
@@ -0,0 +1,235 @@
+#include <cstring>
+#include <vector>
+
+#include "query_log.h"
+#include "telemetry.h"
+
+static const char log_magic[] = "ATTQLOG1";
+
+void put_varint(std::string& out, uint64_t n) {
+  while(n >= 0x80) {
+    out.push_back((char) (n | 0x80));
+    n >>= 7;
+  }
+  out.push_back((char) n);
+}
+
+bool get_varint(const char *& p, const char *end, uint64_t& n) {
+  n = 0;
+  for(int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t byte = *p++;
+    n |= (uint64_t) (byte & 0x7f) << shift;
+    if(!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+bool read_varint(FILE *f, uint64_t& n) {
+  n = 0;
+  for(int shift = 0; shift < 64; shift += 7) {
+    int byte = getc(f);
+    if(byte == EOF) return false;
+    n |= (uint64_t) (byte & 0x7f) << shift;
+    if(!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+static void encode_children(const std::vector<QueryClause*>& children, std::string& out, bool& ok) {
+  put_varint(out, children.size());
+  for(auto c : children) {
+    ok = ok && encode_clause(c, out);
+  }
+}
+
+bool encode_clause(const QueryClause *clause, std::string& out) {
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(clause)) {
+    out.push_back(QueryLogOp_Lit);
+    put_varint(out, lit->t->id);
+    return true;
+  }
+  if(dynamic_cast<const QueryClauseAny*>(clause)) {
+    out.push_back(QueryLogOp_Any);
+    return true;
+  }
+  if(auto not_ = dynamic_cast<const QueryClauseNot*>(clause)) {
+    out.push_back(QueryLogOp_Not);
+    return encode_clause(not_->c, out);
+  }
+  if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    out.push_back(bin->type == QueryClauseAnd ? QueryLogOp_And : QueryLogOp_Or);
+    put_varint(out, 2);
+    return encode_clause(bin->l, out) && encode_clause(bin->r, out);
+  }
+
+  bool ok = true;
+  if(auto nary = dynamic_cast<const QueryClauseNary*>(clause)) {
+    out.push_back(nary->type == QueryClauseAnd ? QueryLogOp_And : QueryLogOp_Or);
+    encode_children(nary->children, out, ok);
+    return ok;
+  }
+  if(auto th = dynamic_cast<const QueryClauseThreshold*>(clause)) {
+    out.push_back(QueryLogOp_AtLeast);
+    put_varint(out, th->k);
+    encode_children(th->children, out, ok);
+    return ok;
+  }
+
+  // metanodes and compiled clauses are only made from a query after it's
+  // given, and don't mean anything outside of the context
+  return false;
+}
+
+static bool decode_children(const Context& ctx, const char *& p, const char *end, std::vector<QueryClause*>& children) {
+  uint64_t n;
+  if(!get_varint(p, end, n) || n > (uint64_t) (end - p)) return false;
+
+  for(uint64_t i = 0; i < n; i++) {
+    auto c = decode_clause(ctx, p, end);
+    if(!c) {
+      for(auto child : children) delete child;
+      children.clear();
+      return false;
+    }
+    children.push_back(c);
+  }
+  return true;
+}
+
+QueryClause *decode_clause(const Context& ctx, const char *& p, const char *end) {
+  if(p >= end) return nullptr;
+
+  uint64_t n;
+  std::vector<QueryClause*> children;
+  uint8_t op = *p++;
+  switch(op) {
+  case QueryLogOp_Any:
+    return new QueryClauseAny();
+
+  case QueryLogOp_Lit: {
+    if(!get_varint(p, end, n)) return nullptr;
+    auto tag = ctx.tag_by_id((id_type) n);
+    return tag ? new QueryClauseLit(tag) : nullptr;
+  }
+
+  case QueryLogOp_Not: {
+    auto c = decode_clause(ctx, p, end);
+    return c ? build_not(c) : nullptr;
+  }
+
+  case QueryLogOp_And:
+  case QueryLogOp_Or: {
+    auto type = op == QueryLogOp_And ? QueryClauseAnd : QueryClauseOr;
+    if(!decode_children(ctx, p, end, children) || children.empty()) return nullptr;
+    if(children.size() == 1) return children[0];
+    if(children.size() == 2) {
+      return type == QueryClauseAnd ?
+        build_and(children[0], children[1]) :
+        build_or(children[0], children[1]);
+    }
+    return build_nary(type, children);
+  }
+
+  case QueryLogOp_AtLeast:
+    if(!get_varint(p, end, n)) return nullptr;
+    if(!decode_children(ctx, p, end, children)) return nullptr;
+    return build_threshold(n, children);
+  }
+
+  return nullptr;
+}
+
+bool QueryLogWriter::open(const char *path) {
+  close();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  file = fopen(path, "wb");
+  if(!file) return false;
+
+  if(fwrite(log_magic, 1, strlen(log_magic), file) != strlen(log_magic)) {
+    fclose(file);
+    file = nullptr;
+    return false;
+  }
+
+  started_ns = telemetry_now_ns();
+  records = 0;
+  recording = true;
+  return true;
+}
+
+size_t QueryLogWriter::close() {
+  std::lock_guard<std::mutex> lock(mutex);
+  recording = false;
+  if(!file) return 0;
+
+  fclose(file);
+  file = nullptr;
+  return records;
+}
+
+void QueryLogWriter::write(const QueryLogRecord& record) {
+  int flags =
+    (record.cache ? QueryLogFlags_Cache : 0) |
+    (record.range.order == QueryOrderDesc ? QueryLogFlags_Desc : 0) |
+    (record.range.limit != SIZE_MAX ? QueryLogFlags_Limit : 0) |
+    (record.range.has_after ? QueryLogFlags_After : 0);
+
+  // encoded outside the lock as far as possible, written under it so
+  // concurrent queries' records don't interleave
+  std::string buf;
+  put_varint(buf, record.duration_ns);
+  put_varint(buf, record.rows);
+  put_varint(buf, flags);
+  if(flags & QueryLogFlags_Limit) put_varint(buf, record.range.limit);
+  if(flags & QueryLogFlags_After) put_varint(buf, record.range.after);
+  put_varint(buf, record.clause.size());
+  buf += record.clause;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if(!file) return;
+
+  std::string start;
+  put_varint(start, record.start_ns > started_ns ? record.start_ns - started_ns : 0);
+  fwrite(start.data(), 1, start.size(), file);
+  fwrite(buf.data(), 1, buf.size(), file);
+  records++;
+}
+
+bool QueryLogReader::open(const char *path) {
+  file = fopen(path, "rb");
+  if(!file) return false;
+
+  char magic[sizeof(log_magic) - 1];
+  return fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+    memcmp(magic, log_magic, sizeof(magic)) == 0;
+}
+
+bool QueryLogReader::next(QueryLogRecord& record) {
+  if(!file) return false;
+
+  uint64_t flags, n;
+  record = QueryLogRecord();
+  if(!read_varint(file, record.start_ns) ||
+     !read_varint(file, record.duration_ns) ||
+     !read_varint(file, record.rows) ||
+     !read_varint(file, flags)) {
+    return false;
+  }
+
+  record.cache = flags & QueryLogFlags_Cache;
+  if(flags & QueryLogFlags_Desc) record.range.order = QueryOrderDesc;
+  if(flags & QueryLogFlags_Limit) {
+    if(!read_varint(file, n)) return false;
+    record.range.limit = n;
+  }
+  if(flags & QueryLogFlags_After) {
+    if(!read_varint(file, n)) return false;
+    record.range.has_after = true;
+    record.range.after = n;
+  }
+
+  if(!read_varint(file, n)) return false;
+  record.clause.resize(n);
+  return n == 0 || fread(&record.clause[0], 1, n, file) == n;
+}
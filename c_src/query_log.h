@@ -0,0 +1,123 @@
+#ifndef __QUERY_LOG_H__
+#define __QUERY_LOG_H__
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <mutex>
+#include <atomic>
+
+#include "context.h"
+
+// a log of the queries run against a context, written as they finish, to
+// replay them later against a snapshot of the context (see snapshot.h)
+// without the BEAM involved. every number is a LEB128 varint:
+//
+//   file:    "ATTQLOG1" record*
+//   record:  start_ns duration_ns rows flags [limit] [after] clause_len clause
+//
+// start_ns is since the log was opened, flags is a QueryLogFlags mask, and
+// limit/after are only there when the flags say so. the clause is the query
+// as given, before implications are expanded:
+//
+//   clause:  QueryLogOp_Any
+//          | QueryLogOp_Lit tag_id
+//          | QueryLogOp_Not clause
+//          | QueryLogOp_And n clause*n | QueryLogOp_Or n clause*n
+//          | QueryLogOp_AtLeast k n clause*n
+
+enum QueryLogOp {
+  QueryLogOp_Any     = 0,
+  QueryLogOp_Lit     = 1,
+  QueryLogOp_Not     = 2,
+  QueryLogOp_And     = 3,
+  QueryLogOp_Or      = 4,
+  QueryLogOp_AtLeast = 5
+};
+
+enum QueryLogFlags {
+  QueryLogFlags_Cache = 0x1,
+  QueryLogFlags_Desc  = 0x2,
+  QueryLogFlags_Limit = 0x4,
+  QueryLogFlags_After = 0x8
+};
+
+struct QueryLogRecord {
+  // when the query started, relative to the log's start when read back
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  uint64_t rows;
+
+  // went through the result cache
+  bool cache;
+  QueryRange range;
+
+  // encoded with encode_clause
+  std::string clause;
+
+  QueryLogRecord() : start_ns(0), duration_ns(0), rows(0), cache(false) {}
+};
+
+// varints, for the query log and snapshots
+void put_varint(std::string& out, uint64_t n);
+bool get_varint(const char *& p, const char *end, uint64_t& n);
+bool read_varint(FILE *f, uint64_t& n);
+
+// appends 'clause' (built from bare QueryClauseLits) to 'out'. false if
+// it has nodes that can't be logged, like expanded metanodes
+bool encode_clause(const QueryClause *clause, std::string& out);
+
+// the clause encoded at 'p', with its tags looked up in 'ctx'. nullptr
+// if it's malformed or names a tag 'ctx' doesn't have
+QueryClause *decode_clause(const Context& ctx, const char *& p, const char *end);
+
+// appends records to a log file, from any number of threads. cheap to
+// check whether it's recording, so queries only pay for it when it is
+struct QueryLogWriter {
+  QueryLogWriter() : file(nullptr), started_ns(0), records(0), recording(false) {}
+  ~QueryLogWriter() { close(); }
+
+  // starts a new log at 'path', closing any open one
+  bool open(const char *path);
+
+  // closes the log, returning the number of records written to it (0 if
+  // there wasn't one open)
+  size_t close();
+
+  bool is_open() const {
+    return recording.load(std::memory_order_relaxed);
+  }
+
+  // 'record.start_ns' is a telemetry_now_ns() timestamp
+  void write(const QueryLogRecord& record);
+
+private:
+  std::mutex mutex;
+  FILE *file;
+  uint64_t started_ns;
+  size_t records;
+  std::atomic<bool> recording;
+
+  QueryLogWriter(const QueryLogWriter&);
+  QueryLogWriter& operator=(const QueryLogWriter&);
+};
+
+// reads back the records of a log
+struct QueryLogReader {
+  QueryLogReader() : file(nullptr) {}
+  ~QueryLogReader() { if(file) fclose(file); }
+
+  // false if 'path' can't be read or isn't a query log
+  bool open(const char *path);
+
+  // the next record, false at the end of the log (or a truncated record)
+  bool next(QueryLogRecord& record);
+
+private:
+  FILE *file;
+
+  QueryLogReader(const QueryLogReader&);
+  QueryLogReader& operator=(const QueryLogReader&);
+};
+
+#endif /* __QUERY_LOG_H__ */
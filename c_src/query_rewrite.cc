@@ -0,0 +1,333 @@
+#include <cassert>
+#include <sstream>
+#include <unordered_map>
+
+#include "query.h"
+#include "query_stats.h"
+#include "context.h"
+
+// 'not nil', matches nothing
+static QueryClause *make_none() {
+  return new QueryClauseNot(new QueryClauseAny());
+}
+static bool is_none(const QueryClause *c) {
+  auto not_ = dynamic_cast<const QueryClauseNot*>(c);
+  return not_ && dynamic_cast<const QueryClauseAny*>(not_->c);
+}
+static bool is_any(const QueryClause *c) {
+  return dynamic_cast<const QueryClauseAny*>(c) != nullptr;
+}
+
+// keys of the operands of a chain of 'type' clauses, binary or n-ary
+static void collect_chain_keys(const QueryClause *c, QueryClauseBinType type, std::vector<std::string>& keys) {
+  auto bin = dynamic_cast<const QueryClauseBin*>(c);
+  if(bin && bin->type == type) {
+    collect_chain_keys(bin->l, type, keys);
+    collect_chain_keys(bin->r, type, keys);
+    return;
+  }
+
+  auto nary = dynamic_cast<const QueryClauseNary*>(c);
+  if(nary && nary->type == type) {
+    for(auto child : nary->children) {
+      collect_chain_keys(child, type, keys);
+    }
+    return;
+  }
+
+  keys.push_back(clause_key(c));
+}
+
+std::string clause_key(const QueryClause *clause) {
+  std::ostringstream key;
+
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(clause)) {
+    key << "t" << lit->t->id;
+  }
+  else if(auto meta = dynamic_cast<const QueryClauseMetaNode*>(clause)) {
+    key << "m" << (const void*) meta->node;
+  }
+  else if(is_any(clause)) {
+    key << "*";
+  }
+  else if(auto not_ = dynamic_cast<const QueryClauseNot*>(clause)) {
+    key << "!(" << clause_key(not_->c) << ")";
+  }
+  else if(auto th = dynamic_cast<const QueryClauseThreshold*>(clause)) {
+    // repeated operands count twice, so they're kept
+    std::vector<std::string> keys;
+    for(auto child : th->children) {
+      keys.push_back(clause_key(child));
+    }
+    std::sort(keys.begin(), keys.end());
+
+    key << th->k << "(";
+    for(size_t i = 0; i < keys.size(); i++) {
+      if(i) key << ",";
+      key << keys[i];
+    }
+    key << ")";
+  }
+  else {
+    auto bin  = dynamic_cast<const QueryClauseBin*>(clause);
+    auto nary = dynamic_cast<const QueryClauseNary*>(clause);
+    if(bin || nary) {
+      auto type = bin ? bin->type : nary->type;
+      std::vector<std::string> keys;
+      collect_chain_keys(clause, type, keys);
+      std::sort(keys.begin(), keys.end());
+
+      key << (type == QueryClauseAnd ? "&(" : "|(");
+      for(size_t i = 0; i < keys.size(); i++) {
+        if(i) key << ",";
+        key << keys[i];
+      }
+      key << ")";
+    }
+    else {
+      // nothing to compare it with, only equal to itself
+      key << "?" << (const void*) clause;
+    }
+  }
+
+  return key.str();
+}
+
+// detach the operands of a chain of 'type' clauses, freeing the chain
+static void detach_chain(QueryClause *c, QueryClauseBinType type, std::vector<QueryClause*>& operands) {
+  auto bin = dynamic_cast<QueryClauseBin*>(c);
+  if(bin && bin->type == type) {
+    detach_chain(bin->l, type, operands);
+    detach_chain(bin->r, type, operands);
+    bin->l = bin->r = nullptr;
+    delete bin;
+    return;
+  }
+
+  auto nary = dynamic_cast<QueryClauseNary*>(c);
+  if(nary && nary->type == type) {
+    for(auto child : nary->children) {
+      detach_chain(child, type, operands);
+    }
+    nary->children.clear();
+    delete nary;
+    return;
+  }
+
+  operands.push_back(c);
+}
+
+static bool is_subset(const TagSet& sub, const TagSet& super) {
+  if(sub.size() > super.size()) return false;
+  for(auto t : sub) {
+    if(super.find(t) == super.end()) return false;
+  }
+  return true;
+}
+
+// build a 'type' node over normalized 'operands', simplifying it
+static QueryClause *simplify(QueryClauseBinType type, std::vector<QueryClause*>& operands) {
+  bool is_and = type == QueryClauseAnd;
+
+  // the operand that decides the node on its own, and the one that
+  // doesn't change it
+  auto absorbing = is_and ? is_none : is_any;
+  auto identity  = is_and ? is_any  : is_none;
+
+  auto decided = [&]() {
+    for(auto op : operands) delete op;
+    operands.clear();
+    return is_and ? make_none() : (QueryClause*) new QueryClauseAny();
+  };
+
+  for(auto op : operands) {
+    if(absorbing(op)) return decided();
+  }
+
+  std::vector<QueryClause*> kept;
+  std::vector<std::string> keys;
+  std::unordered_map<std::string, size_t> key_index;
+
+  for(auto op : operands) {
+    if(identity(op)) {
+      delete op;
+      continue;
+    }
+
+    // x and x, x or x
+    auto key = clause_key(op);
+    if(key_index.count(key)) {
+      delete op;
+      continue;
+    }
+
+    key_index[key] = kept.size();
+    keys.push_back(key);
+    kept.push_back(op);
+  }
+  operands.clear();
+
+  // x and not x, x or not x
+  for(auto& key : keys) {
+    if(key_index.count("!(" + key + ")")) {
+      operands = kept;
+      return decided();
+    }
+  }
+
+  std::vector<bool> dropped(kept.size(), false);
+
+  // absorption: x and (x or y) is x, x or (x and y) is x
+  for(size_t i = 0; i < kept.size(); i++) {
+    auto nary = dynamic_cast<const QueryClauseNary*>(kept[i]);
+    if(!nary || nary->type == type) continue;
+
+    for(auto child : nary->children) {
+      auto found = key_index.find(clause_key(child));
+      if(found != key_index.end() && found->second != i) {
+        dropped[i] = true;
+        break;
+      }
+    }
+  }
+
+  // subsumption between unions of tags: the smaller one implies the larger
+  // one, so an AND only needs the smaller and an OR only the larger
+  std::vector<TagSet> unions(kept.size());
+  std::vector<bool> is_union(kept.size(), false);
+  for(size_t i = 0; i < kept.size(); i++) {
+    is_union[i] = collect_union_tags(kept[i], unions[i]);
+  }
+  for(size_t i = 0; i < kept.size(); i++) {
+    if(!is_union[i] || dropped[i]) continue;
+
+    for(size_t j = 0; j < kept.size(); j++) {
+      if(i == j || !is_union[j] || dropped[j]) continue;
+
+      // i is a subset of j: an AND keeps i, an OR keeps j
+      if(is_subset(unions[i], unions[j])) {
+        dropped[is_and ? j : i] = true;
+        if(!is_and) break;
+      }
+    }
+  }
+
+  std::vector<QueryClause*> children;
+  for(size_t i = 0; i < kept.size(); i++) {
+    if(dropped[i]) delete kept[i];
+    else children.push_back(kept[i]);
+  }
+
+  if(children.empty()) {
+    return is_and ? (QueryClause*) new QueryClauseAny() : make_none();
+  }
+  if(children.size() == 1) {
+    return children[0];
+  }
+  return build_nary(type, children);
+}
+
+static QueryClause *normalize_rec(QueryClause *clause, bool negate);
+
+// normalize the operands of a threshold, folding away constants
+static QueryClause *normalize_threshold(QueryClauseThreshold *th) {
+  size_t k = th->k;
+  std::vector<QueryClause*> children;
+
+  for(auto child : th->children) {
+    child = normalize_rec(child, false);
+
+    // always counts, or never does
+    if(is_any(child)) {
+      if(k > 0) k--;
+      delete child;
+    }
+    else if(is_none(child)) {
+      delete child;
+    }
+    else {
+      children.push_back(child);
+    }
+  }
+  th->children.clear();
+  delete th;
+
+  if(k == 0) {
+    for(auto child : children) delete child;
+    return new QueryClauseAny();
+  }
+  if(k > children.size()) {
+    for(auto child : children) delete child;
+    return make_none();
+  }
+
+  // at least one is an OR, all of them an AND
+  if(k == 1 || k == children.size()) {
+    std::vector<QueryClause*> operands;
+    auto type = k == 1 ? QueryClauseOr : QueryClauseAnd;
+    for(auto child : children) {
+      detach_chain(child, type, operands);
+    }
+    return simplify(type, operands);
+  }
+
+  return build_threshold(k, children);
+}
+
+// normalize 'clause', negated if 'negate' is set
+static QueryClause *normalize_rec(QueryClause *clause, bool negate) {
+  if(is_any(clause)) {
+    if(!negate) return clause;
+    delete clause;
+    return make_none();
+  }
+
+  if(auto not_ = dynamic_cast<QueryClauseNot*>(clause)) {
+    auto inner = not_->c;
+    not_->c = nullptr;
+    delete not_;
+    return normalize_rec(inner, !negate);
+  }
+
+  if(auto th = dynamic_cast<QueryClauseThreshold*>(clause)) {
+    auto normalized = normalize_threshold(th);
+
+    // the result may have become an AND/OR, which the negation can be
+    // pushed into
+    if(negate) {
+      if(dynamic_cast<QueryClauseThreshold*>(normalized)) {
+        return build_not(normalized);
+      }
+      return normalize_rec(normalized, true);
+    }
+    return normalized;
+  }
+
+  auto bin  = dynamic_cast<QueryClauseBin*>(clause);
+  auto nary = dynamic_cast<QueryClauseNary*>(clause);
+  if(!bin && !nary) {
+    // a leaf
+    return negate ? build_not(clause) : clause;
+  }
+
+  auto type = bin ? bin->type : nary->type;
+  std::vector<QueryClause*> operands;
+  detach_chain(clause, type, operands);
+
+  // De Morgan: not (x and y) is (not x) or (not y), and vice versa
+  if(negate) {
+    type = type == QueryClauseAnd ? QueryClauseOr : QueryClauseAnd;
+  }
+
+  std::vector<QueryClause*> normalized;
+  for(auto op : operands) {
+    // operands that became the same kind of node merge into this one
+    detach_chain(normalize_rec(op, negate), type, normalized);
+  }
+
+  return simplify(type, normalized);
+}
+
+QueryClause *normalize(QueryClause *clause) {
+  return normalize_rec(clause, false);
+}
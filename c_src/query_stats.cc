@@ -0,0 +1,478 @@
+#include <cassert>
+#include <cmath>
+#include <queue>
+#include <algorithm>
+
+#include "query_stats.h"
+#include "context.h"
+
+bool collect_union_tags(const QueryClause *q, TagSet& tags) {
+  if(auto lit = dynamic_cast<const QueryClauseLit*>(q)) {
+    tags.insert(lit->t);
+    return true;
+  }
+  if(auto meta = dynamic_cast<const QueryClauseMetaNode*>(q)) {
+    tags.insert(meta->node->tags.begin(), meta->node->tags.end());
+    return true;
+  }
+  if(auto bin = dynamic_cast<const QueryClauseBin*>(q)) {
+    return
+      bin->type == QueryClauseOr &&
+      collect_union_tags(bin->l, tags) &&
+      collect_union_tags(bin->r, tags);
+  }
+  if(auto nary = dynamic_cast<const QueryClauseNary*>(q)) {
+    if(nary->type != QueryClauseOr) return false;
+    for(auto child : nary->children) {
+      if(!collect_union_tags(child, tags)) return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+size_t union_size(const TagSet& tags) {
+  if(tags.size() == 1) {
+    return (*tags.begin())->entity_count();
+  }
+
+  // k-way merge of the (sorted) entity lists, counting distinct ids
+  typedef std::pair<EntityList::const_iterator, EntityList::const_iterator> Range;
+  auto cmp = [](const Range& l, const Range& r) {
+    return (*l.first)->id > (*r.first)->id;
+  };
+  std::priority_queue<Range, std::vector<Range>, decltype(cmp)> heads(cmp);
+
+  for(auto tag : tags) {
+    auto& list = tag->postings();
+    if(!list.empty()) {
+      heads.push(Range(list.begin(), list.end()));
+    }
+  }
+
+  size_t count = 0;
+  const Entity *last = nullptr;
+  while(heads.size()) {
+    auto top = heads.top();
+    heads.pop();
+
+    if(*top.first != last) {
+      last = *top.first;
+      count++;
+    }
+
+    if(++top.first != top.second) {
+      heads.push(top);
+    }
+  }
+
+  return count;
+}
+
+uint64_t EntitySketch::hash(id_type id) {
+  // splitmix64 finalizer, spreads sequential ids over the whole range
+  uint64_t x = id + 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+void EntitySketch::add(uint64_t h) {
+  auto pos = std::lower_bound(hashes.begin(), hashes.end(), h);
+  if(pos != hashes.end() && *pos == h) return;
+
+  if(exact) {
+    if(hashes.size() < k) {
+      hashes.insert(pos, h);
+      return;
+    }
+
+    // full: the set now has members the sketch doesn't hold
+    exact = false;
+  }
+
+  // the held hashes are the smallest of the set, but past the largest of
+  // them are members the sketch dropped (or never held), so only smaller
+  // ones go in. after a remove() that's fewer than k
+  if(pos != hashes.end()) {
+    hashes.insert(pos, h);
+    if(hashes.size() > k) hashes.pop_back();
+  }
+}
+
+void EntitySketch::remove(uint64_t h) {
+  // the k-1 smallest hashes of what's left are still the ones held, so
+  // the sketch stays valid, just smaller
+  auto pos = std::lower_bound(hashes.begin(), hashes.end(), h);
+  if(pos != hashes.end() && *pos == h) {
+    hashes.erase(pos);
+  }
+}
+
+void EntitySketch::merge(const EntitySketch& other) {
+  Hashes merged(hashes.get_allocator());
+  merged.reserve(hashes.size() + other.hashes.size());
+  std::set_union(
+    hashes.begin(), hashes.end(),
+    other.hashes.begin(), other.hashes.end(),
+    std::back_inserter(merged));
+
+  exact = exact && other.exact && merged.size() <= k;
+  if(merged.size() > k) {
+    merged.resize(k);
+  }
+  hashes.swap(merged);
+}
+
+double EntitySketch::cardinality() const {
+  if(exact || hashes.size() < 2) return hashes.size();
+
+  // the kth smallest of n uniform hashes sits around k/n of the way in
+  double kth = (double) hashes.back() / (double) UINT64_MAX;
+  return (hashes.size() - 1) / kth;
+}
+
+double EntitySketch::intersection(const EntitySketch& a, const EntitySketch& b) {
+  if(a.exact && b.exact) {
+    size_t both = 0;
+    auto i = a.hashes.begin();
+    auto j = b.hashes.begin();
+    while(i != a.hashes.end() && j != b.hashes.end()) {
+      if(*i < *j) i++;
+      else if(*j < *i) j++;
+      else { both++; i++; j++; }
+    }
+    return both;
+  }
+
+  // a hash among the smallest of the union is in a set exactly when it's
+  // in that set's sketch, so the fraction found in both estimates the
+  // jaccard similarity
+  EntitySketch u = a;
+  u.merge(b);
+  if(u.hashes.empty()) return 0;
+
+  size_t both = 0;
+  for(auto h : u.hashes) {
+    if(std::binary_search(a.hashes.begin(), a.hashes.end(), h) &&
+       std::binary_search(b.hashes.begin(), b.hashes.end(), h)) {
+      both++;
+    }
+  }
+
+  return u.cardinality() * both / u.hashes.size();
+}
+
+void QueryStats::entity_tagged(const Entity *e, Tag *tag, bool added) {
+  auto h = EntitySketch::hash(e->id);
+  auto i = tag_sketches.find(tag);
+  if(i == tag_sketches.end()) {
+    i = tag_sketches.insert(std::make_pair(tag, EntitySketch(memory))).first;
+  }
+  auto& sketch = i->second;
+
+  if(added) {
+    total_taggings++;
+    sketch.add(h);
+  }
+  else {
+    total_taggings--;
+    sketch.remove(h);
+
+    // too many of the held members went, resample from the entity list
+    if(!sketch.exact && sketch.hashes.size() < EntitySketch::k / 2) {
+      sketch = EntitySketch(memory);
+      for(auto te : tag->postings()) {
+        sketch.add(EntitySketch::hash(te->id));
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if(!tag->meta_node) return;
+  meta_node_counts.erase(tag->meta_node);
+
+  // the closures the metanode is part of: its own, and those of the
+  // metanodes it implies
+  std::unordered_set<const SCCMetaNode*> seen;
+  std::vector<const SCCMetaNode*> stack(1, tag->meta_node);
+  while(stack.size() && !closure_counts.empty()) {
+    auto top = stack.back();
+    stack.pop_back();
+    if(!seen.insert(top).second) continue;
+
+    closure_counts.erase(top);
+    stack.insert(stack.end(), top->children.begin(), top->children.end());
+  }
+}
+
+void QueryStats::tag_deleted(const Tag *tag) {
+  // its entities are untagged first, this just frees the sketch
+  tag_sketches.erase(tag);
+}
+
+void QueryStats::metagraph_changed() {
+  std::lock_guard<std::mutex> lock(mutex);
+  meta_node_counts.clear();
+  closure_counts.clear();
+}
+
+size_t QueryStats::num_entities() const {
+  return context.num_entities();
+}
+
+double QueryStats::tags_per_entity() const {
+  auto n = num_entities();
+  return n ? (double) total_taggings / n : 0;
+}
+
+size_t QueryStats::meta_node_count(const SCCMetaNode *node) const {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto i = meta_node_counts.find(node);
+    if(i != meta_node_counts.end()) return i->second;
+  }
+
+  auto count = union_size(node->tags);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  meta_node_counts[node] = count;
+  return count;
+}
+
+size_t QueryStats::closure_count(const SCCMetaNode *node) const {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto i = closure_counts.find(node);
+    if(i != closure_counts.end()) return i->second;
+  }
+
+  std::unordered_set<const SCCMetaNode*> seen;
+  TagSet tags;
+  std::vector<const SCCMetaNode*> stack(1, node);
+  while(stack.size()) {
+    auto top = stack.back();
+    stack.pop_back();
+    if(!seen.insert(top).second) continue;
+
+    tags.insert(top->tags.begin(), top->tags.end());
+    stack.insert(stack.end(), top->parents.begin(), top->parents.end());
+  }
+
+  auto count = (size_t) union_count(tags);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  closure_counts[node] = count;
+  return count;
+}
+
+const EntitySketch& QueryStats::tag_sketch(const Tag *tag) const {
+  static const EntitySketch empty;
+  auto i = tag_sketches.find(tag);
+  return i == tag_sketches.end() ? empty : i->second;
+}
+
+EntitySketch QueryStats::sketch(const TagSet& tags) const {
+  EntitySketch ret;
+  for(auto tag : tags) {
+    ret.merge(tag_sketch(tag));
+  }
+  return ret;
+}
+
+double QueryStats::union_count(const TagSet& tags) const {
+  if(tags.size() == 1) {
+    return (*tags.begin())->entity_count();
+  }
+  return std::min((double) num_entities(), sketch(tags).cardinality());
+}
+
+double QueryStats::cooccurrence(const TagSet& a, const TagSet& b) const {
+  return EntitySketch::intersection(sketch(a), sketch(b));
+}
+
+// if 'metas' is exactly some metanode's ancestor closure, that metanode
+static const SCCMetaNode *closure_root(const std::unordered_set<const SCCMetaNode*>& metas) {
+  for(auto node : metas) {
+    // the root is the one none of the others are children of
+    bool is_root = true;
+    for(auto child : node->children) {
+      if(metas.count(child)) { is_root = false; break; }
+    }
+    if(!is_root) continue;
+
+    std::unordered_set<const SCCMetaNode*> seen;
+    std::vector<const SCCMetaNode*> stack(1, node);
+    while(stack.size()) {
+      auto top = stack.back();
+      stack.pop_back();
+      if(!metas.count(top)) return nullptr;
+      if(!seen.insert(top).second) continue;
+      stack.insert(stack.end(), top->parents.begin(), top->parents.end());
+    }
+    return seen.size() == metas.size() ? node : nullptr;
+  }
+  return nullptr;
+}
+
+// metanodes making up a union clause, false if there's a bare literal in it
+static bool collect_union_metas(const QueryClause *q, std::unordered_set<const SCCMetaNode*>& metas) {
+  if(auto meta = dynamic_cast<const QueryClauseMetaNode*>(q)) {
+    metas.insert(meta->node);
+    return true;
+  }
+  if(auto bin = dynamic_cast<const QueryClauseBin*>(q)) {
+    return
+      bin->type == QueryClauseOr &&
+      collect_union_metas(bin->l, metas) &&
+      collect_union_metas(bin->r, metas);
+  }
+  if(auto nary = dynamic_cast<const QueryClauseNary*>(q)) {
+    if(nary->type != QueryClauseOr) return false;
+    for(auto child : nary->children) {
+      if(!collect_union_metas(child, metas)) return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+double QueryStats::selectivity(const QueryClause *clause) const {
+  double n = num_entities();
+  if(n == 0) return 0;
+
+  if(dynamic_cast<const QueryClauseAny*>(clause)) {
+    return 1;
+  }
+  if(auto not_ = dynamic_cast<const QueryClauseNot*>(clause)) {
+    return 1 - selectivity(not_->c);
+  }
+
+  TagSet tags;
+  if(collect_union_tags(clause, tags)) {
+    // a query for a tag is the ancestor closure of its metanode, which
+    // has a count of its own
+    std::unordered_set<const SCCMetaNode*> metas;
+    if(collect_union_metas(clause, metas)) {
+      if(metas.size() == 1) {
+        return meta_node_count(*metas.begin()) / n;
+      }
+      if(auto root = closure_root(metas)) {
+        return closure_count(root) / n;
+      }
+    }
+    return union_count(tags) / n;
+  }
+
+  if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    double l = selectivity(bin->l);
+    double r = selectivity(bin->r);
+
+    // correlated tags: use how often they actually occur together
+    double both = l * r;
+    TagSet ltags, rtags;
+    if(collect_union_tags(bin->l, ltags) && collect_union_tags(bin->r, rtags)) {
+      both = std::min(std::min(l, r), cooccurrence(ltags, rtags) / n);
+    }
+
+    return bin->type == QueryClauseAnd ? both : l + r - both;
+  }
+
+  if(auto nary = dynamic_cast<const QueryClauseNary*>(clause)) {
+    // an AND is taken operand by operand, each conditioned on the one
+    // before it when they're both unions of tags. ORs that aren't plain
+    // unions are taken as independent
+    double p = 1;
+    const QueryClause *prev = nullptr;
+    TagSet prev_tags;
+    bool prev_union = false;
+
+    for(auto child : nary->children) {
+      double sel = selectivity(child);
+      TagSet child_tags;
+      bool child_union = collect_union_tags(child, child_tags);
+
+      if(nary->type == QueryClauseOr) {
+        p *= 1 - sel;
+      }
+      else if(prev && prev_union && child_union && selectivity(prev) > 0) {
+        double given = cooccurrence(prev_tags, child_tags) / (selectivity(prev) * n);
+        p *= std::min(1.0, given);
+      }
+      else {
+        p *= sel;
+      }
+
+      prev = child;
+      prev_tags.swap(child_tags);
+      prev_union = child_union;
+    }
+
+    return nary->type == QueryClauseAnd ? p : 1 - p;
+  }
+
+  if(auto th = dynamic_cast<const QueryClauseThreshold*>(clause)) {
+    // operands taken as independent: dist[j] is the probability that j of
+    // those seen so far matched, with everything from k on lumped together
+    size_t k = th->k;
+    if(k == 0) return 1;
+    if(k > th->children.size()) return 0;
+
+    std::vector<double> dist(k + 1, 0);
+    dist[0] = 1;
+    for(auto child : th->children) {
+      double sel = selectivity(child);
+      dist[k] += dist[k - 1] * sel;
+      for(size_t j = k - 1; j > 0; j--) {
+        dist[j] = dist[j] * (1 - sel) + dist[j - 1] * sel;
+      }
+      dist[0] *= 1 - sel;
+    }
+    return dist[k];
+  }
+
+  return 1;
+}
+
+double QueryStats::cost(const QueryClause *clause) const {
+  if(dynamic_cast<const QueryClauseLit*>(clause)) {
+    return 1;
+  }
+  if(dynamic_cast<const QueryClauseMetaNode*>(clause)) {
+    // walks the entity's tags
+    return std::max(1.0, tags_per_entity());
+  }
+  if(dynamic_cast<const QueryClauseAny*>(clause)) {
+    return 0;
+  }
+  if(auto not_ = dynamic_cast<const QueryClauseNot*>(clause)) {
+    return cost(not_->c);
+  }
+  if(auto bin = dynamic_cast<const QueryClauseBin*>(clause)) {
+    // the right side only runs when the left doesn't decide the result
+    double l = selectivity(bin->l);
+    double runs_r = bin->type == QueryClauseAnd ? l : 1 - l;
+    return cost(bin->l) + runs_r * cost(bin->r);
+  }
+  if(auto nary = dynamic_cast<const QueryClauseNary*>(clause)) {
+    // each operand runs if none before it decided the result
+    double total = 0, runs = 1;
+    for(auto child : nary->children) {
+      total += runs * cost(child);
+      double sel = selectivity(child);
+      runs *= nary->type == QueryClauseAnd ? sel : 1 - sel;
+    }
+    return total;
+  }
+  if(auto th = dynamic_cast<const QueryClauseThreshold*>(clause)) {
+    // at worst every operand runs
+    double total = 0;
+    for(auto child : th->children) {
+      total += cost(child);
+    }
+    return total;
+  }
+
+  // compiled clauses and the like
+  return 1;
+}
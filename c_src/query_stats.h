@@ -0,0 +1,125 @@
+#ifndef __QUERY_STATS_H__
+#define __QUERY_STATS_H__
+
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <cstdint>
+
+#include "query.h"
+#include "memory_account.h"
+
+struct Context;
+struct Entity;
+struct SCCMetaNode;
+
+// bottom-k MinHash sketch of a set of entities: the k smallest hashes of
+// its members' ids. sketches of two sets merge into the sketch of their
+// union, and estimate how much the two sets overlap
+struct EntitySketch {
+  static const size_t k = 128;
+
+  typedef std::vector<uint64_t, CountingAllocator<uint64_t> > Hashes;
+
+  // ascending, at most k
+  Hashes hashes;
+
+  // the sketch holds every member of the set
+  bool exact;
+
+  EntitySketch() : exact(true) {}
+  explicit EntitySketch(MemoryCounter *memory) : hashes(Hashes::allocator_type(memory)), exact(true) {}
+
+  static uint64_t hash(id_type id);
+
+  void add(uint64_t h);
+  void remove(uint64_t h);
+
+  // sketch of the union of this and 'other'
+  void merge(const EntitySketch& other);
+
+  // estimated number of members
+  double cardinality() const;
+
+  // estimated number of members the two sets have in common
+  static double intersection(const EntitySketch& a, const EntitySketch& b);
+};
+
+// statistics on the context's entities and tags, used by the cost based
+// optimizer to estimate how selective a clause is and what it costs to
+// evaluate. counts are kept exact; sketches are maintained as entities are
+// tagged, and anything depending on the metagraph is recomputed lazily
+// after it changes. safe to read from several readers at once
+struct QueryStats {
+  // the per-tag sketches are counted into 'memory_'
+  QueryStats(const Context& context_, MemoryCounter *memory_ = nullptr) :
+    context(context_),
+    memory(memory_),
+    total_taggings(0),
+    tag_sketches(SketchMap::allocator_type(memory_)) {}
+
+  // hooks called by the context
+  void entity_tagged(const Entity *e, Tag *tag, bool added);
+  void tag_deleted(const Tag *tag);
+  void metagraph_changed();
+
+  size_t num_entities() const;
+
+  // average number of tags directly on an entity
+  double tags_per_entity() const;
+
+  // distinct entities directly carrying a tag of 'node'
+  size_t meta_node_count(const SCCMetaNode *node) const;
+
+  // distinct entities carrying a tag of 'node' or of any metanode implying
+  // it, i.e. those matching a query for one of its tags. estimated from the
+  // tags' sketches (so exact for small closures); merging the closure's
+  // entity lists would cost as much as running the query. Context::count
+  // has the exact number
+  size_t closure_count(const SCCMetaNode *node) const;
+
+  // sketch of the entities carrying any of 'tags'
+  EntitySketch sketch(const TagSet& tags) const;
+
+  // estimated number of entities carrying any of 'tags'
+  double union_count(const TagSet& tags) const;
+
+  // estimated number of entities carrying both one of 'a' and one of 'b'
+  double cooccurrence(const TagSet& a, const TagSet& b) const;
+
+  // estimated fraction of entities matching 'clause'
+  double selectivity(const QueryClause *clause) const;
+
+  // estimated cost of evaluating 'clause' against one entity, in tag set
+  // lookups, given short circuit evaluation in the clause's order
+  double cost(const QueryClause *clause) const;
+
+private:
+  typedef std::unordered_map<const Tag*, EntitySketch,
+    std::hash<const Tag*>, std::equal_to<const Tag*>,
+    CountingAllocator<std::pair<const Tag* const, EntitySketch> > > SketchMap;
+
+  const Context& context;
+  MemoryCounter *memory;
+  size_t total_taggings;
+
+  // per tag sketches, kept up to date as entities are tagged
+  SketchMap tag_sketches;
+
+  // lazily computed, dropped when the metagraph or tagging changes
+  mutable std::mutex mutex;
+  mutable std::unordered_map<const SCCMetaNode*, size_t> meta_node_counts;
+  mutable std::unordered_map<const SCCMetaNode*, size_t> closure_counts;
+
+  const EntitySketch& tag_sketch(const Tag *tag) const;
+};
+
+// collect the tags whose entity lists make up the result of 'clause', if
+// it's nothing but a union of tags (literals, metanodes and ORs of those)
+bool collect_union_tags(const QueryClause *clause, TagSet& tags);
+
+// number of distinct entities across the tags' entity lists
+size_t union_size(const TagSet& tags);
+
+#endif /* __QUERY_STATS_H__ */
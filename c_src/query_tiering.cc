@@ -0,0 +1,182 @@
+#include <cassert>
+
+#include "query_tiering.h"
+
+// compiles waiting for the background thread before hot shapes are left
+// interpreted until there's room
+static const size_t max_queued_compiles = 64;
+
+QueryTiering::QueryTiering(Compiler compiler_) :
+  compiler(compiler_ ? compiler_ : Compiler(jit_compile)),
+  hot_threshold(default_hot_threshold),
+  max_compiled(default_max_compiled),
+  generation(0),
+  pending(0),
+  stopping(false),
+  executions(0),
+  compiles(0),
+  compile_failures(0),
+  evictions(0),
+  invalidations(0) {}
+
+QueryTiering::~QueryTiering() {
+  stop();
+}
+
+std::shared_ptr<const QueryClause> QueryTiering::executed(const QueryClause *clause) {
+  auto key = clause_key(clause);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  executions++;
+
+  // forget the shapes that never got hot rather than count every query
+  // ever run
+  if(shapes.size() >= max_tracked && shapes.find(key) == shapes.end()) {
+    for(auto i = shapes.begin(); i != shapes.end(); ) {
+      if(!i->second.compiled && !i->second.queued) i = shapes.erase(i);
+      else i++;
+    }
+  }
+
+  auto& shape = shapes[key];
+  shape.executions++;
+
+  if(shape.compiled) {
+    lru.splice(lru.begin(), lru, shape.lru_pos);
+    return shape.compiled;
+  }
+
+  bool hot = shape.executions >= hot_threshold;
+  if(hot && !shape.queued && !shape.uncompilable && !stopping && max_compiled > 0) {
+    if(!pool) {
+      pool.reset(new WorkerPool(1, max_queued_compiles));
+    }
+
+    // compile a copy, the caller's clause is gone by the time it runs
+    std::shared_ptr<QueryClause> source(clause->dup());
+    size_t gen = generation;
+    bool queued = pool->submit(WorkerLaneBatch, [this, key, source, gen]() {
+      compile(key, source, gen);
+    });
+
+    if(queued) {
+      shape.queued = true;
+      pending++;
+    }
+  }
+
+  return std::shared_ptr<const QueryClause>();
+}
+
+std::shared_ptr<const QueryClause> QueryTiering::lookup(const QueryClause *clause) {
+  auto key = clause_key(clause);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto i = shapes.find(key);
+  if(i == shapes.end()) return std::shared_ptr<const QueryClause>();
+  return i->second.compiled;
+}
+
+void QueryTiering::compile(const std::string& key, std::shared_ptr<QueryClause> source, size_t gen) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(stopping || gen != generation) {
+      pending--;
+      idle.notify_all();
+      return;
+    }
+  }
+
+  std::shared_ptr<const QueryClause> compiled;
+  {
+    ScopedLatency timer(compile_latency);
+    compiled.reset(compiler(source.get()));
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  pending--;
+  idle.notify_all();
+
+  // invalidated while compiling
+  auto i = shapes.find(key);
+  if(gen != generation || i == shapes.end()) return;
+
+  auto& shape = i->second;
+  shape.queued = false;
+  if(!compiled) {
+    // don't try it again
+    compile_failures++;
+    shape.uncompilable = true;
+    return;
+  }
+
+  // configured to keep nothing while it compiled
+  if(max_compiled == 0) return;
+  evict_to(max_compiled - 1);
+
+  // readers already running the interpreted form carry on with it
+  shape.compiled = compiled;
+  lru.push_front(key);
+  shape.lru_pos = lru.begin();
+  compiles++;
+}
+
+void QueryTiering::evict_to(size_t target) {
+  while(lru.size() > target) {
+    auto i = shapes.find(lru.back());
+    assert(i != shapes.end());
+
+    // back to being interpreted, and cold
+    i->second.compiled.reset();
+    i->second.executions = 0;
+    lru.pop_back();
+    evictions++;
+  }
+}
+
+void QueryTiering::invalidate() {
+  std::lock_guard<std::mutex> lock(mutex);
+  generation++;
+  invalidations += lru.size();
+  shapes.clear();
+  lru.clear();
+}
+
+void QueryTiering::configure(size_t hot_threshold_, size_t max_compiled_) {
+  std::lock_guard<std::mutex> lock(mutex);
+  hot_threshold = hot_threshold_ > 0 ? hot_threshold_ : 1;
+  max_compiled = max_compiled_;
+  evict_to(max_compiled);
+}
+
+void QueryTiering::wait_idle() {
+  std::unique_lock<std::mutex> lock(mutex);
+  idle.wait(lock, [this]() { return pending == 0; });
+}
+
+void QueryTiering::stop() {
+  std::unique_ptr<WorkerPool> joining;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    joining.swap(pool);
+  }
+
+  // queued compiles see 'stopping' and return straight away
+  joining.reset();
+}
+
+QueryTieringStats QueryTiering::stats() {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  QueryTieringStats s;
+  s.executions       = executions;
+  s.compiles         = compiles;
+  s.compile_failures = compile_failures;
+  s.evictions        = evictions;
+  s.invalidations    = invalidations;
+  s.shapes           = shapes.size();
+  s.compiled         = lru.size();
+  s.pending          = pending;
+  return s;
+}
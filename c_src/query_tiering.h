@@ -0,0 +1,119 @@
+#ifndef __QUERY_TIERING_H__
+#define __QUERY_TIERING_H__
+
+#include <string>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "query.h"
+#include "worker_pool.h"
+#include "telemetry.h"
+
+struct QueryTieringStats {
+  size_t executions;
+  size_t compiles;
+  size_t compile_failures;
+  size_t evictions;
+  size_t invalidations;
+  size_t shapes;
+  size_t compiled;
+  size_t pending;
+};
+
+// decides how queries are evaluated by how often their shape (the
+// clause_key of the optimized clause) runs. shapes start out interpreted
+// (as the tree, or bytecode for long scans); once one has run hot_threshold
+// times it's queued for compilation on a background thread, and the
+// compiled clause is swapped in for later runs. only the max_compiled most
+// recently used compiled shapes are kept. safe to use from several readers
+// at once
+struct QueryTiering {
+  // compiles a copy of a clause, returns nullptr if it can't
+  typedef std::function<QueryClause*(const QueryClause*)> Compiler;
+
+  static const size_t default_hot_threshold = 16;
+  static const size_t default_max_compiled  = 128;
+
+  // shapes counted before the ones that never got hot are forgotten
+  static const size_t max_tracked = 4096;
+
+  // compiles with the JIT by default
+  QueryTiering(Compiler compiler = Compiler());
+  ~QueryTiering();
+
+  // record a run of 'clause', returning its compiled form if there is one
+  std::shared_ptr<const QueryClause> executed(const QueryClause *clause);
+
+  // the compiled form of 'clause' if there is one, without counting a run
+  std::shared_ptr<const QueryClause> lookup(const QueryClause *clause);
+
+  // drop everything compiled or being compiled, for when the metanodes
+  // compiled clauses refer to change
+  void invalidate();
+
+  void configure(size_t hot_threshold, size_t max_compiled);
+
+  // wait for queued compiles to finish
+  void wait_idle();
+
+  // drop queued compiles and wait for running ones, before the tags and
+  // metanodes they refer to go away
+  void stop();
+
+  QueryTieringStats stats();
+
+  // how long compiles took, failed ones included
+  LatencyHistogram compile_latency;
+
+private:
+  struct Shape {
+    size_t executions;
+    bool queued;
+    bool uncompilable;
+    std::shared_ptr<const QueryClause> compiled;
+
+    // position in 'lru' when compiled
+    std::list<std::string>::iterator lru_pos;
+
+    Shape() : executions(0), queued(false), uncompilable(false) {}
+  };
+
+  Compiler compiler;
+
+  std::mutex mutex;
+  std::condition_variable idle;
+
+  std::unordered_map<std::string, Shape> shapes;
+
+  // keys of compiled shapes, most recently used first
+  std::list<std::string> lru;
+
+  size_t hot_threshold;
+  size_t max_compiled;
+
+  // bumped by invalidate(), so compiles queued before it are dropped
+  size_t generation;
+  size_t pending;
+  bool stopping;
+
+  size_t executions;
+  size_t compiles;
+  size_t compile_failures;
+  size_t evictions;
+  size_t invalidations;
+
+  void compile(const std::string& key, std::shared_ptr<QueryClause> source, size_t generation);
+  void evict_to(size_t target);
+
+  // runs the compiles, started on the first one. joined by stop()
+  std::unique_ptr<WorkerPool> pool;
+
+  QueryTiering(const QueryTiering&);
+  QueryTiering& operator=(const QueryTiering&);
+};
+
+#endif /* __QUERY_TIERING_H__ */
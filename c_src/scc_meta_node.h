@@ -4,9 +4,22 @@
 #include "context.h"
 
 struct SCCMetaNode {
-  std::unordered_set<SCCMetaNode*> children;
-  std::unordered_set<SCCMetaNode*> parents;
-  std::unordered_set<Tag*>         tags;
+  MetaNodeSet children;
+  MetaNodeSet parents;
+  TagSet      tags;
+
+  // the node and its sets are counted into 'memory', if given
+  SCCMetaNode(MemoryCounter *memory = nullptr) :
+    children(MetaNodeSet::allocator_type(memory)),
+    parents(MetaNodeSet::allocator_type(memory)),
+    tags(TagSet::allocator_type(memory)) {
+    if(memory) memory->add(sizeof(SCCMetaNode));
+  }
+
+  ~SCCMetaNode() {
+    auto memory = tags.get_allocator().counter;
+    if(memory) memory->remove(sizeof(SCCMetaNode));
+  }
 
   bool add_child(SCCMetaNode* c) {
     assert(c);
@@ -0,0 +1,123 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "snapshot.h"
+#include "query_log.h"
+
+static const char snapshot_magic[] = "ATTSNAP1";
+
+static bool tag_id_less(const Tag *l, const Tag *r) {
+  return l->id < r->id;
+}
+
+std::string encode_snapshot(const Context& ctx) {
+  std::string out(snapshot_magic, strlen(snapshot_magic));
+
+  auto tags = ctx.all_tags();
+  put_varint(out, tags.size());
+  size_t num_edges = 0;
+  for(auto t : tags) {
+    put_varint(out, t->id);
+    num_edges += t->implies.size();
+  }
+
+  // sorted, so the same context always saves the same file
+  std::vector<Tag*> sorted;
+  put_varint(out, num_edges);
+  for(auto t : tags) {
+    sorted.assign(t->implies.begin(), t->implies.end());
+    std::sort(sorted.begin(), sorted.end(), tag_id_less);
+    for(auto implied : sorted) {
+      put_varint(out, t->id);
+      put_varint(out, implied->id);
+    }
+  }
+
+  put_varint(out, ctx.num_entities());
+  for(auto e : ctx.all_entities()) {
+    if(e->deleted) continue;
+    put_varint(out, e->id);
+    put_varint(out, e->tags.size());
+    sorted.assign(e->tags.begin(), e->tags.end());
+    std::sort(sorted.begin(), sorted.end(), tag_id_less);
+    for(auto t : sorted) {
+      put_varint(out, t->id);
+    }
+  }
+
+  return out;
+}
+
+bool write_snapshot(const std::string& snapshot, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if(!file) return false;
+
+  bool ok = fwrite(snapshot.data(), 1, snapshot.size(), file) == snapshot.size();
+  return fclose(file) == 0 && ok;
+}
+
+bool save_snapshot(const Context& ctx, const char *path) {
+  return write_snapshot(encode_snapshot(ctx), path);
+}
+
+// reads a tag id, and looks it up in 'ctx'
+static Tag *read_tag(FILE *file, const Context& ctx) {
+  uint64_t id;
+  if(!read_varint(file, id)) return nullptr;
+  return ctx.tag_by_id((id_type) id);
+}
+
+static bool load(Context& ctx, FILE *file) {
+  char magic[sizeof(snapshot_magic) - 1];
+  if(fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+     memcmp(magic, snapshot_magic, sizeof(magic))) {
+    return false;
+  }
+
+  uint64_t n, id;
+  if(!read_varint(file, n)) return false;
+  for(uint64_t i = 0; i < n; i++) {
+    if(!read_varint(file, id) || !ctx.new_tag((id_type) id)) return false;
+  }
+
+  // the metagraph is built once, after every edge is in
+  ctx.mark_dirty();
+  if(!read_varint(file, n)) return false;
+  for(uint64_t i = 0; i < n; i++) {
+    auto implier = read_tag(file, ctx);
+    auto implied = read_tag(file, ctx);
+    if(!implier || !implied || !implier->imply(implied)) return false;
+  }
+  ctx.make_clean();
+
+  if(!read_varint(file, n)) return false;
+  for(uint64_t i = 0; i < n; i++) {
+    uint64_t num_tags;
+    if(!read_varint(file, id) || !read_varint(file, num_tags)) return false;
+
+    auto e = ctx.new_entity((id_type) id);
+    if(!e) return false;
+    for(uint64_t j = 0; j < num_tags; j++) {
+      auto t = read_tag(file, ctx);
+      if(!t || !e->add_tag(t)) return false;
+    }
+  }
+
+  return true;
+}
+
+bool load_snapshot(Context& ctx, const char *path) {
+  if(ctx.num_tags() || ctx.num_entities()) return false;
+
+  FILE *file = fopen(path, "rb");
+  if(!file) return false;
+
+  bool ok = load(ctx, file);
+  fclose(file);
+
+  if(ctx.is_dirty()) ctx.make_clean();
+  return ok;
+}
@@ -0,0 +1,33 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <string>
+
+#include "context.h"
+
+// a context's tags, implications and entities saved to a file, to load
+// into another process (like the query log replayer) and get the same
+// context back. every number is a varint (see query_log.h):
+//
+//   file:    "ATTSNAP1" num_tags tag_id*num_tags
+//            num_edges (implier_id implied_id)*num_edges
+//            num_entities entity*num_entities
+//   entity:  entity_id num_tags tag_id*num_tags
+//
+// derived state (the metagraph, the optimizer's statistics and caches) is
+// rebuilt on load
+
+// false if 'path' couldn't be written
+bool save_snapshot(const Context& ctx, const char *path);
+
+// save_snapshot in two steps, so a caller holding a lock on 'ctx' only
+// needs it while the snapshot is encoded, not while it's written out
+std::string encode_snapshot(const Context& ctx);
+bool write_snapshot(const std::string& snapshot, const char *path);
+
+// fills the empty context 'ctx' from the snapshot at 'path'. false if it
+// can't be read, isn't a snapshot, or 'ctx' isn't empty. a truncated
+// snapshot leaves 'ctx' with what was read of it
+bool load_snapshot(Context& ctx, const char *path);
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,24 @@
+#include "standing_query.h"
+#include "context.h"
+
+void StandingQuery::expand() {
+  delete clause;
+  clause = expand_implications(source);
+
+  depends_on.clear();
+  collect_dependencies(clause, depends_on);
+}
+
+void StandingQuery::check(Entity *e, std::vector<Entity*>& added, std::vector<Entity*>& removed) {
+  bool matched = matches.find(e) != matches.end();
+  bool matching = clause->matches_set(e->tags);
+
+  if(matching && !matched) {
+    matches.insert(e);
+    added.push_back(e);
+  }
+  else if(!matching && matched) {
+    matches.erase(e);
+    removed.push_back(e);
+  }
+}
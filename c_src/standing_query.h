@@ -0,0 +1,52 @@
+#ifndef __STANDING_QUERY_H__
+#define __STANDING_QUERY_H__
+
+#include <vector>
+#include <unordered_set>
+#include <functional>
+
+#include "query.h"
+
+struct Entity;
+
+// a query registered against a context, whose matches are kept up to date
+// as entities are created and tagged, and as implications change. only the
+// entities a change can affect are re-checked
+struct StandingQuery {
+  // called with the entities that started and stopped matching.
+  // returning false unregisters the query
+  typedef std::function<bool(const std::vector<Entity*>& added, const std::vector<Entity*>& removed)> Listener;
+
+  // the query with its literals referring to tags directly, so it
+  // can be expanded again whenever the metagraph changes
+  QueryClause *source;
+
+  // 'source' expanded against the current metagraph
+  QueryClause *clause;
+
+  // tags whose presence on an entity can change whether it matches
+  TagSet depends_on;
+
+  std::unordered_set<Entity*> matches;
+  Listener listener;
+
+  StandingQuery(QueryClause *source_, Listener listener_) :
+    source(source_), clause(nullptr), listener(listener_) {}
+
+  ~StandingQuery() {
+    delete source;
+    delete clause;
+  }
+
+  // re-expand 'source' against the metagraph
+  void expand();
+
+  // re-check 'e', recording it in 'added'/'removed' if it changed
+  void check(Entity *e, std::vector<Entity*>& added, std::vector<Entity*>& removed);
+
+private:
+  StandingQuery(const StandingQuery&);
+  StandingQuery& operator=(const StandingQuery&);
+};
+
+#endif /* __STANDING_QUERY_H__ */
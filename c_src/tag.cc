@@ -1,5 +1,81 @@
+#include <algorithm>
+#include <mutex>
+
 #include "tag.h"
 #include "context.h"
+#include "entity.h"
+
+// removals held back before the writer applies them itself, relative to
+// the length of the list, so each costs a few moves amortized
+static const size_t min_removed_batch = 64;
+static const size_t removed_batch_ratio = 16;
+
+void Tag::add_entity(Entity *e) {
+  // entities are usually tagged in the order they were created,
+  // so appending is the common case
+  if(entities.empty() || entities.back()->id < e->id) {
+    entities.push_back(e);
+    return;
+  }
+
+  auto pos = std::lower_bound(entities.begin(), entities.end(), e, entity_id_less);
+  if(pos != entities.end() && *pos == e) {
+    // tagged again before its removal was applied
+    auto r = std::find(removed.begin(), removed.end(), e);
+    assert(r != removed.end());
+    removed.erase(r);
+    if(removed.empty()) unsettled.store(false, std::memory_order_release);
+    return;
+  }
+  entities.insert(pos, e);
+}
+
+void Tag::remove_entity(Entity *e) {
+  // entities untagged last first (see Context::delete_tag) come straight
+  // off the end
+  if(entities.back() == e) {
+    entities.pop_back();
+    return;
+  }
+
+  assert(std::binary_search(entities.begin(), entities.end(), e, entity_id_less));
+  removed.push_back(e);
+  unsettled.store(true, std::memory_order_release);
+
+  if(removed.size() >= std::max(min_removed_batch, entities.size() / removed_batch_ratio)) {
+    settle();
+  }
+}
+
+void Tag::settle() const {
+  // readers share the context, so the first one in applies the removals
+  // while the rest wait
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+  if(!unsettled.load(std::memory_order_relaxed)) return;
+
+  // both sorted by id, so one pass drops them
+  std::sort(removed.begin(), removed.end(), entity_id_less);
+  size_t live = 0, r = 0;
+  for(auto e : entities) {
+    if(r < removed.size() && removed[r] == e) {
+      r++;
+      continue;
+    }
+    entities[live++] = e;
+  }
+  assert(r == removed.size());
+  entities.resize(live);
+  removed.clear();
+
+  unsettled.store(false, std::memory_order_release);
+}
+
+void Tag::compact() {
+  settle();
+  if(entities.capacity() > 2 * entities.size()) entities.shrink_to_fit();
+  removed.shrink_to_fit();
+}
 
 bool Tag::imply(Tag *other) {
   auto a = other->implied_by.insert(this).second;
@@ -2,50 +2,81 @@
 #define __TAGS_H__
 
 #include <unordered_set>
+#include <vector>
+#include <atomic>
 #include <cassert>
 
 #include "id.h"
+#include "memory_account.h"
 
 // needs forward declaration because C++ uses goddamn textual inclusion
 struct Context;
 struct SCCMetaNode;
+struct Entity;
+struct Tag;
+
+// sets and lists of the context's tags and entities, counted against the
+// context's MemoryAccount when they're part of it
+typedef std::unordered_set<Tag*, std::hash<Tag*>, std::equal_to<Tag*>, CountingAllocator<Tag*> > TagSet;
+typedef std::vector<Entity*, CountingAllocator<Entity*> > EntityList;
+typedef std::unordered_set<SCCMetaNode*, std::hash<SCCMetaNode*>, std::equal_to<SCCMetaNode*>, CountingAllocator<SCCMetaNode*> > MetaNodeSet;
 
 struct Tag {
   id_type id;
 
   // TODO: implement tag implications
-  std::unordered_set<Tag*> implies;
-  std::unordered_set<Tag*> implied_by;
+  TagSet implies;
+  TagSet implied_by;
 
   Context *context;
 
   // DAG SCC meta node that the tag belongs to
   SCCMetaNode *meta_node;
 
-  // how many entities have this particular tag
-  int _entity_count;
+private:
+  // entities directly tagged with this tag, sorted by entity id. taking
+  // one off the middle of the list is batched up in 'removed' rather than
+  // moving the rest of the list along each time, and applied in one pass
+  // by the next reader, or once enough have piled up
+  mutable EntityList entities;
+  mutable EntityList removed;
+  mutable std::atomic<bool> unsettled;
+
+  void settle() const;
 
 public:
-  Tag(Context *context_, id_type _id) :
+  // the tag's sets and entity list are counted into 'memory', if given
+  Tag(Context *context_, id_type _id, MemoryAccount *memory = nullptr) :
     id(_id),
+    implies(TagSet::allocator_type(memory ? &memory->implications : nullptr)),
+    implied_by(TagSet::allocator_type(memory ? &memory->implications : nullptr)),
     context(context_),
     meta_node(nullptr),
-    _entity_count(0) {}
+    entities(EntityList::allocator_type(memory ? &memory->postings : nullptr)),
+    removed(EntityList::allocator_type(memory ? &memory->postings : nullptr)),
+    unsettled(false) {}
 
   // this tag implies -> other tag
   bool imply(Tag *other);
   bool unimply(Tag *other);
 
+  // how many entities have this particular tag
   int entity_count() const {
-    return _entity_count;
+    return postings().size();
   }
 
-  void inc_entity_count() {
-    _entity_count++;
-  }
-  void dec_entity_count() {
-    _entity_count--;
+  // entities directly tagged with this tag, sorted by entity id
+  const EntityList& postings() const {
+    if(unsettled.load(std::memory_order_acquire)) settle();
+    return entities;
   }
+
+  // maintain the entity list, called by Entity
+  void add_entity(Entity *e);
+  void remove_entity(Entity *e);
+
+  // applies pending removals and gives back what the list outgrew
+  void compact();
 };
 
 #endif
@@ -0,0 +1,118 @@
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <functional>
+
+#include "telemetry.h"
+
+uint64_t telemetry_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t Counter::shard_index() {
+  static thread_local size_t index =
+    std::hash<std::thread::id>()(std::this_thread::get_id()) % num_shards;
+  return index;
+}
+
+uint64_t Counter::value() const {
+  uint64_t ret = 0;
+  for(auto& shard : shards) {
+    ret += shard.n.load(std::memory_order_relaxed);
+  }
+  return ret;
+}
+
+size_t LatencyHistogram::bucket_of(uint64_t ns) {
+  const uint64_t sub_buckets = 1 << sub_bucket_bits;
+  if(ns < 2 * sub_buckets) return ns;
+
+  // position of the highest bit, then the bits right below it
+  size_t exponent = 63 - __builtin_clzll(ns);
+  if(exponent > max_exponent) return num_buckets - 1;
+
+  size_t sub = (ns >> (exponent - sub_bucket_bits)) & (sub_buckets - 1);
+  return 2 * sub_buckets + (exponent - sub_bucket_bits - 1) * sub_buckets + sub;
+}
+
+uint64_t LatencyHistogram::bucket_value(size_t bucket) {
+  const uint64_t sub_buckets = 1 << sub_bucket_bits;
+  if(bucket < 2 * sub_buckets) return bucket;
+
+  size_t exponent = (bucket - 2 * sub_buckets) / sub_buckets + sub_bucket_bits + 1;
+  uint64_t sub = (bucket - 2 * sub_buckets) % sub_buckets;
+  uint64_t width = 1ull << (exponent - sub_bucket_bits);
+  return (1ull << exponent) + sub * width + width / 2;
+}
+
+LatencyHistogram::~LatencyHistogram() {
+  for(auto& shard : shards) delete shard.load();
+}
+
+LatencyHistogram::Shard& LatencyHistogram::shard() {
+  auto& slot = shards[Counter::shard_index()];
+  Shard *ret = slot.load(std::memory_order_acquire);
+  if(ret) return *ret;
+
+  // another thread on the same shard may get there first
+  Shard *fresh = new Shard();
+  if(slot.compare_exchange_strong(ret, fresh, std::memory_order_acq_rel)) {
+    return *fresh;
+  }
+  delete fresh;
+  return *ret;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+  auto& s = shard();
+  s.buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+  s.total.fetch_add(ns, std::memory_order_relaxed);
+
+  uint64_t seen = max.load(std::memory_order_relaxed);
+  while(ns > seen && !max.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {}
+}
+
+LatencySummary LatencyHistogram::summary() const {
+  LatencySummary s;
+  s.count    = 0;
+  s.total_ns = 0;
+  s.max_ns   = max.load(std::memory_order_relaxed);
+
+  // the buckets are read once, so the percentiles agree with each other
+  // even while more is being recorded
+  uint64_t counts[num_buckets] = {};
+  for(auto& slot : shards) {
+    auto shard = slot.load(std::memory_order_acquire);
+    if(!shard) continue;
+
+    s.total_ns += shard->total.load(std::memory_order_relaxed);
+    for(size_t i = 0; i < num_buckets; i++) {
+      counts[i] += shard->buckets[i].load(std::memory_order_relaxed);
+    }
+  }
+  for(auto c : counts) s.count += c;
+
+  struct { double q; uint64_t *out; } quantiles[] = {
+    {0.5, &s.p50_ns}, {0.9, &s.p90_ns}, {0.99, &s.p99_ns}, {0.999, &s.p999_ns}
+  };
+
+  size_t bucket = 0;
+  uint64_t seen = 0;
+  for(auto& quantile : quantiles) {
+    *quantile.out = 0;
+    if(s.count == 0) continue;
+
+    // the smallest value at least q of the recorded values are at or below
+    uint64_t rank = (uint64_t) std::ceil(quantile.q * s.count - 1e-9);
+    if(rank == 0) rank = 1;
+    while(bucket < num_buckets && seen + counts[bucket] < rank) {
+      seen += counts[bucket++];
+    }
+
+    *quantile.out = std::min(bucket_value(bucket), s.max_ns);
+  }
+
+  return s;
+}
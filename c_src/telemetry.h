@@ -0,0 +1,122 @@
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// monotonic clock in nanoseconds
+uint64_t telemetry_now_ns();
+
+// a counter bumped from many threads at once. each thread adds to its own
+// cache line, so they don't fight over one; reading sums them up
+struct Counter {
+  static const size_t num_shards = 8;
+
+  Counter() {
+    for(auto& shard : shards) shard.n = 0;
+  }
+
+  void add(uint64_t n = 1) {
+    shards[shard_index()].n.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  uint64_t value() const;
+
+  // the shard the calling thread adds to
+  static size_t shard_index();
+
+private:
+  struct Shard {
+    std::atomic<uint64_t> n;
+    char pad[64 - sizeof(std::atomic<uint64_t>)];
+  };
+  Shard shards[num_shards];
+
+  Counter(const Counter&);
+  Counter& operator=(const Counter&);
+};
+
+struct LatencySummary {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+};
+
+// latencies bucketed the way HdrHistogram does it: exact below 16ns, then
+// 8 buckets per power of two, so any percentile is within 1/16th of the
+// real value. everything past ~18 minutes lands in the last bucket.
+// like Counter, each thread records into its own shard of the buckets,
+// allocated the first time it's recorded into, so a histogram nothing is
+// recorded into costs next to nothing. recording is a few relaxed atomic
+// adds
+struct LatencyHistogram {
+  static const size_t sub_bucket_bits = 3;
+  static const size_t max_exponent    = 40;
+  static const size_t num_buckets =
+    (2 << sub_bucket_bits) + (max_exponent - sub_bucket_bits) * (1 << sub_bucket_bits);
+
+  LatencyHistogram() : max(0) {
+    for(auto& shard : shards) shard = nullptr;
+  }
+  ~LatencyHistogram();
+
+  void record(uint64_t ns);
+
+  LatencySummary summary() const;
+
+private:
+  struct Shard {
+    std::atomic<uint64_t> buckets[num_buckets];
+    std::atomic<uint64_t> total;
+
+    Shard() : total(0) {
+      for(auto& b : buckets) b = 0;
+    }
+  };
+  std::atomic<Shard*> shards[Counter::num_shards];
+  std::atomic<uint64_t> max;
+
+  // the calling thread's shard, allocating it if need be
+  Shard& shard();
+
+  static size_t bucket_of(uint64_t ns);
+
+  // middle of the range a bucket covers
+  static uint64_t bucket_value(size_t bucket);
+
+  LatencyHistogram(const LatencyHistogram&);
+  LatencyHistogram& operator=(const LatencyHistogram&);
+};
+
+// records how long it's been alive into a histogram
+struct ScopedLatency {
+  LatencyHistogram& histogram;
+  uint64_t start;
+
+  ScopedLatency(LatencyHistogram& histogram_) :
+    histogram(histogram_),
+    start(telemetry_now_ns()) {}
+
+  ~ScopedLatency() {
+    histogram.record(telemetry_now_ns() - start);
+  }
+};
+
+// what a context measures about itself
+struct ContextTelemetry {
+  // metagraph rebuilds, inline (make_clean) or in the background
+  LatencyHistogram make_clean;
+
+  // compact() runs, freeing deleted entities and tags
+  LatencyHistogram compact;
+
+  // cycles collapsed into a single metanode by an incremental update
+  Counter collapses;
+};
+
+#endif /* __TELEMETRY_H__ */
@@ -0,0 +1,122 @@
+#include <hayai.hpp>
+#include <memory>
+#include "test_helper.h"
+
+// implication graph edits, and what they cost the metagraph, at a few
+// graph sizes. a fixture builds its graph (with mark_dirty, so that part
+// is cheap) before every run, and edits run once per run since they
+// change the graph
+
+// N tags, no implications yet
+template<size_t N>
+class MetagraphTags : public ::hayai::Fixture
+{
+public:
+  std::unique_ptr<Context> c;
+  std::vector<Tag*> tags;
+
+  virtual void SetUp() {
+    c.reset(new Context());
+    tags.clear();
+    for(size_t i = 0; i < N; i++) {
+      tags.push_back(c->new_tag());
+    }
+  }
+
+  virtual void TearDown() {
+    c.reset();
+  }
+
+  // a taxonomy: every tag implies its parent, 4 children to a parent
+  void imply_tree() {
+    for(size_t i = 1; i < N; i++) {
+      tags[i]->imply(tags[(i - 1) / 4]);
+    }
+  }
+};
+
+// tag i implies tag i-1, N metanodes deep
+template<size_t N>
+class MetagraphChain : public MetagraphTags<N>
+{
+public:
+  virtual void SetUp() {
+    MetagraphTags<N>::SetUp();
+    this->c->mark_dirty();
+    for(size_t i = 1; i < N; i++) {
+      this->tags[i]->imply(this->tags[i - 1]);
+    }
+    this->c->make_clean();
+  }
+};
+
+// the chain closed into a cycle, all N tags in one metanode
+template<size_t N>
+class MetagraphCycle : public MetagraphChain<N>
+{
+public:
+  virtual void SetUp() {
+    MetagraphChain<N>::SetUp();
+    this->tags[0]->imply(this->tags[N - 1]);
+  }
+};
+
+// layers of 2 tags, each implying both tags of the layer below, so
+// the top tags reach the bottom ones along 2^Depth paths
+template<size_t Depth>
+class MetagraphLayers : public MetagraphTags<2 * Depth>
+{
+public:
+  virtual void SetUp() {
+    MetagraphTags<2 * Depth>::SetUp();
+    auto& tags = this->tags;
+    this->c->mark_dirty();
+    for(size_t i = 2; i < tags.size(); i++) {
+      tags[i]->imply(tags[(i / 2 - 1) * 2]);
+      tags[i]->imply(tags[(i / 2 - 1) * 2 + 1]);
+    }
+    this->c->make_clean();
+  }
+};
+
+typedef MetagraphTags<100>    Tags100;
+typedef MetagraphTags<1000>   Tags1000;
+typedef MetagraphTags<10000>  Tags10000;
+typedef MetagraphChain<100>   Chain100;
+typedef MetagraphChain<1000>  Chain1000;
+typedef MetagraphChain<10000> Chain10000;
+typedef MetagraphCycle<100>   Cycle100;
+typedef MetagraphCycle<1000>  Cycle1000;
+typedef MetagraphCycle<10000> Cycle10000;
+typedef MetagraphLayers<8>    Layers8;
+typedef MetagraphLayers<12>   Layers12;
+typedef MetagraphLayers<16>   Layers16;
+
+// a taxonomy's edges added one at a time, updating the metagraph as they go
+BENCHMARK_F(Tags100,   ImplyIncremental, 10, 1) { imply_tree(); }
+BENCHMARK_F(Tags1000,  ImplyIncremental, 10, 1) { imply_tree(); }
+BENCHMARK_F(Tags10000, ImplyIncremental, 5,  1) { imply_tree(); }
+
+// the same edges with the metagraph built once at the end
+BENCHMARK_F(Tags100,   ImplyDirtyThenClean, 10, 1) { c->mark_dirty(); imply_tree(); c->make_clean(); }
+BENCHMARK_F(Tags1000,  ImplyDirtyThenClean, 10, 1) { c->mark_dirty(); imply_tree(); c->make_clean(); }
+BENCHMARK_F(Tags10000, ImplyDirtyThenClean, 5,  1) { c->mark_dirty(); imply_tree(); c->make_clean(); }
+
+// closing the chain collapses all of it into one metanode
+BENCHMARK_F(Chain100,   CollapseCycle, 10, 1) { tags[0]->imply(tags[99]); }
+BENCHMARK_F(Chain1000,  CollapseCycle, 10, 1) { tags[0]->imply(tags[999]); }
+BENCHMARK_F(Chain10000, CollapseCycle, 5,  1) { tags[0]->imply(tags[9999]); }
+
+// breaking a cycle dirties the metagraph, which is rebuilt from scratch
+BENCHMARK_F(Cycle100,   UnimplyInSCC, 10, 1) { tags[0]->unimply(tags[99]);   c->make_clean(); }
+BENCHMARK_F(Cycle1000,  UnimplyInSCC, 10, 1) { tags[0]->unimply(tags[999]);  c->make_clean(); }
+BENCHMARK_F(Cycle10000, UnimplyInSCC, 5,  1) { tags[0]->unimply(tags[9999]); c->make_clean(); }
+
+// a tag implied by every other one expands to every metanode
+BENCHMARK_F(Chain100,   ExpandDeep, 10, 100) { delete build_lit(tags[0]); }
+BENCHMARK_F(Chain1000,  ExpandDeep, 10, 10)  { delete build_lit(tags[0]); }
+BENCHMARK_F(Chain10000, ExpandDeep, 5,  1)   { delete build_lit(tags[0]); }
+
+BENCHMARK_F(Layers8,  ExpandLayers, 10, 10) { delete build_lit(tags[0]); }
+BENCHMARK_F(Layers12, ExpandLayers, 10, 1)  { delete build_lit(tags[0]); }
+BENCHMARK_F(Layers16, ExpandLayers, 5,  1)  { delete build_lit(tags[0]); }
@@ -1,10 +1,11 @@
 #include <hayai.hpp>
 #include "test_helper.h"
+#include "query_bytecode.h"
 
 class BenchQuery : public ::hayai::Fixture
 {
 public:
-  std::unordered_set<Tag*> tags;
+  TagSet tags;
   std::unordered_set<QueryClause*> queries;
   Context c;
 
@@ -100,7 +101,7 @@ BENCHMARK_F(BenchQuery, QueryForQux, 10, 100) {
 class DeepBenchQuery : public ::hayai::Fixture
 {
 public:
-  std::unordered_set<Tag*> tags;
+  TagSet tags;
   std::unordered_set<QueryClause*> queries;
   Context c;
 
@@ -210,3 +211,86 @@ BENCHMARK_F(DeepBenchQuery, OptQueryC, 10, 100) {
   // matches all posts
   assert(count == 2200);
 }
+
+// the same clause evaluated by walking the tree, by the bytecode VM and by
+// JIT compiled code, and what it costs to get each of them. a one-off
+// query pays the compile once per scan; a prepared one only once
+class TierBenchQuery : public ::hayai::Fixture
+{
+public:
+  Context c;
+  std::vector<Tag*> tags;
+  QueryClause *tree, *bytecode, *jit;
+
+  // (t0 and not t1) or (t2 and t3 and not t4) or ... over 24 tags
+  QueryClause *build_query() {
+    std::vector<QueryClause*> ors;
+    for(size_t i = 0; i + 3 < tags.size(); i += 4) {
+      ors.push_back(build_nary(QueryClauseAnd, {
+        build_lit(tags[i]),
+        build_not(build_lit(tags[i + 1])),
+        build_or(build_lit(tags[i + 2]), build_lit(tags[i + 3]))
+      }));
+    }
+    return build_nary(QueryClauseOr, ors);
+  }
+
+  virtual void SetUp() {
+    for(int i = 0; i < 24; i++) {
+      tags.push_back(c.new_tag());
+    }
+
+    // a few tags on each of 10000 entities
+    unsigned seed = 1;
+    for(int i = 0; i < 10000; i++) {
+      auto e = c.new_entity();
+      for(int j = 0; j < 4; j++) {
+        seed = seed * 1103515245 + 12345;
+        e->add_tag(tags[(seed >> 16) % tags.size()]);
+      }
+    }
+
+    tree     = build_query();
+    bytecode = compile_bytecode(tree);
+    jit      = optimize(build_query(), QueryOptFlags_JIT);
+  }
+
+  virtual void TearDown() {
+    delete tree;
+    delete bytecode;
+    delete jit;
+  }
+
+  size_t scan(const QueryClause *q) {
+    size_t count = 0;
+    c.query(q, [&](Entity*) { count++; });
+    return count;
+  }
+};
+
+BENCHMARK_F(TierBenchQuery, ScanTree, 10, 20) {
+  scan(tree);
+}
+BENCHMARK_F(TierBenchQuery, ScanBytecode, 10, 20) {
+  scan(bytecode);
+}
+BENCHMARK_F(TierBenchQuery, ScanJIT, 10, 20) {
+  scan(jit);
+}
+
+BENCHMARK_F(TierBenchQuery, CompileBytecode, 10, 100) {
+  delete compile_bytecode(tree);
+}
+BENCHMARK_F(TierBenchQuery, CompileJIT, 10, 100) {
+  delete optimize(tree->dup(), QueryOptFlags_JIT);
+}
+
+// a one-off query: compile, then scan once
+BENCHMARK_F(TierBenchQuery, OneOffBytecode, 10, 20) {
+  std::unique_ptr<QueryClause> q(compile_bytecode(tree));
+  scan(q.get());
+}
+BENCHMARK_F(TierBenchQuery, OneOffJIT, 10, 20) {
+  std::unique_ptr<QueryClause> q(optimize(tree->dup(), QueryOptFlags_JIT));
+  scan(q.get());
+}
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "dataset.h"
+
+ZipfSampler::ZipfSampler(size_t n, double exponent) {
+  cdf.reserve(n);
+  double sum = 0;
+  for(size_t rank = 1; rank <= n; rank++) {
+    sum += 1.0 / std::pow((double) rank, exponent);
+    cdf.push_back(sum);
+  }
+  for(auto& c : cdf) c /= sum;
+}
+
+size_t ZipfSampler::sample(DatasetRng& rng) const {
+  auto pos = std::upper_bound(cdf.begin(), cdf.end(), rng.uniform());
+  return std::min((size_t) (pos - cdf.begin()), cdf.size() - 1);
+}
+
+// Fisher-Yates, drawing from 'rng' so it's the same everywhere
+template<class T>
+static void shuffle(std::vector<T>& v, DatasetRng& rng) {
+  for(size_t i = v.size(); i > 1; i--) {
+    std::swap(v[i - 1], v[rng.below(i)]);
+  }
+}
+
+Dataset generate_dataset(Context& ctx, const DatasetSpec& spec) {
+  Dataset d;
+  DatasetRng rng(spec.seed);
+
+  std::vector<Tag*> tags;
+  tags.reserve(spec.num_tags);
+  for(size_t i = 0; i < spec.num_tags; i++) {
+    tags.push_back(ctx.new_tag(i));
+  }
+  if(tags.empty()) return d;
+
+  // where a tag sits in the taxonomy has nothing to do with how popular it is
+  d.by_popularity = tags;
+  shuffle(d.by_popularity, rng);
+
+  // load the implications in one go, the metagraph is built once at the end
+  ctx.mark_dirty();
+
+  // taxonomy: tag i's parent is tag (i - 1) / fan_out, level by level
+  size_t in_taxonomy = 0;
+  size_t level_size = 1;
+  for(size_t level = 0; level <= spec.hierarchy_depth && in_taxonomy < tags.size(); level++) {
+    size_t end = std::min(in_taxonomy + level_size, tags.size());
+    d.levels.push_back(std::vector<Tag*>(tags.begin() + in_taxonomy, tags.begin() + end));
+    for(size_t i = std::max(in_taxonomy, (size_t) 1); i < end; i++) {
+      tags[i]->imply(tags[(i - 1) / spec.fan_out]);
+    }
+    in_taxonomy = end;
+    level_size *= spec.fan_out;
+    if(spec.fan_out == 0) break;
+  }
+
+  // alias cycles among the rest
+  std::vector<Tag*> rest(tags.begin() + in_taxonomy, tags.end());
+  shuffle(rest, rng);
+  for(size_t c = 0; c < spec.alias_cycles && spec.alias_size > 1; c++) {
+    if((c + 1) * spec.alias_size > rest.size()) break;
+
+    std::vector<Tag*> cycle(rest.begin() + c * spec.alias_size, rest.begin() + (c + 1) * spec.alias_size);
+    for(size_t i = 0; i < cycle.size(); i++) {
+      cycle[i]->imply(cycle[(i + 1) % cycle.size()]);
+    }
+    d.aliases.push_back(cycle);
+  }
+
+  ctx.make_clean();
+
+  // 1 to 2*tags_per_entity - 1 tags on each entity, averaging tags_per_entity
+  ZipfSampler zipf(tags.size(), spec.zipf_exponent);
+  size_t spread = (size_t) std::max(0.0, 2 * (spec.tags_per_entity - 1)) + 1;
+
+  for(size_t i = 0; i < spec.num_entities; i++) {
+    auto e = ctx.new_entity();
+    size_t n = 1 + rng.below(spread);
+    for(size_t j = 0; j < n; j++) {
+      // a tag drawn twice is only on the entity once
+      if(e->add_tag(d.by_popularity[zipf.sample(rng)])) {
+        d.num_taggings++;
+      }
+    }
+  }
+
+  return d;
+}
+
+const char *dataset_usage =
+  "  --seed N            dataset seed (1)\n"
+  "  --entities N        entities, 10k to 10M (100000)\n"
+  "  --tags N            tags (10000)\n"
+  "  --zipf S            tag popularity exponent (1.0)\n"
+  "  --tags-per-entity N average tags on an entity (8)\n"
+  "  --depth N           taxonomy depth (4)\n"
+  "  --fan-out N         taxonomy children per tag (6)\n"
+  "  --aliases N         alias cycles (100)\n"
+  "  --alias-size N      tags per alias cycle (3)\n";
+
+bool parse_dataset_option(const char *key, const char *value, DatasetSpec& spec) {
+  auto n = strtoull(value, nullptr, 10);
+  if(!strcmp(key, "--seed"))                 spec.seed = n;
+  else if(!strcmp(key, "--entities"))        spec.num_entities = n;
+  else if(!strcmp(key, "--tags"))            spec.num_tags = n;
+  else if(!strcmp(key, "--zipf"))            spec.zipf_exponent = strtod(value, nullptr);
+  else if(!strcmp(key, "--tags-per-entity")) spec.tags_per_entity = strtod(value, nullptr);
+  else if(!strcmp(key, "--depth"))           spec.hierarchy_depth = n;
+  else if(!strcmp(key, "--fan-out"))         spec.fan_out = n;
+  else if(!strcmp(key, "--aliases"))         spec.alias_cycles = n;
+  else if(!strcmp(key, "--alias-size"))      spec.alias_size = n;
+  else return false;
+  return true;
+}
+
+std::vector<NamedQuery> standard_queries(const Dataset& d) {
+  std::vector<NamedQuery> ret;
+  auto& pop = d.by_popularity;
+  if(pop.size() < 8) return ret;
+
+  // a tag around 'rank', clamped to the ones there are
+  auto ranked = [&](size_t rank) -> QueryClause* {
+    return new QueryClauseLit(pop[std::min(rank, pop.size() - 1)]);
+  };
+
+  ret.push_back({"tag_head",        ranked(0)});
+  ret.push_back({"tag_mid",         ranked(100)});
+  ret.push_back({"tag_tail",        ranked(pop.size() / 2)});
+  ret.push_back({"taxonomy_root",   new QueryClauseLit(d.levels[0][0])});
+  if(d.levels.size() > 2) {
+    ret.push_back({"taxonomy_branch", new QueryClauseLit(d.levels[2][0])});
+  }
+  if(d.aliases.size()) {
+    ret.push_back({"alias",         new QueryClauseLit(d.aliases[0][0])});
+  }
+  ret.push_back({"or_head",         build_or(ranked(0), ranked(1))});
+  ret.push_back({"or_mid",          build_nary(QueryClauseOr, {ranked(10), ranked(11), ranked(12), ranked(13)})});
+  ret.push_back({"and_head",        build_and(ranked(0), ranked(1))});
+  ret.push_back({"and_selective",   build_and(ranked(0), ranked(100))});
+  ret.push_back({"and_not",         build_and(ranked(1), build_not(ranked(0)))});
+  ret.push_back({"not_head",        build_not(ranked(0))});
+  ret.push_back({"at_least_2_of_4", build_threshold(2, {ranked(2), ranked(3), ranked(4), ranked(5)})});
+  return ret;
+}
@@ -0,0 +1,111 @@
+#ifndef __DATASET_H__
+#define __DATASET_H__
+
+#include <vector>
+#include <random>
+#include <cstdint>
+
+#include "context.h"
+
+// shape of a synthetic dataset, see generate_dataset
+struct DatasetSpec {
+  uint64_t seed;
+
+  size_t num_entities;
+  size_t num_tags;
+
+  // tag popularity is Zipf distributed: the tag of rank r is picked with
+  // probability proportional to 1/r^zipf_exponent
+  double zipf_exponent;
+
+  // average number of tags directly on an entity, at least 1
+  double tags_per_entity;
+
+  // the first tags form a taxonomy, a tree 'hierarchy_depth' levels deep
+  // below its root with 'fan_out' children per tag, each implying its parent
+  size_t hierarchy_depth;
+  size_t fan_out;
+
+  // groups of 'alias_size' tags outside the taxonomy implying each other
+  // in a cycle, like synonyms do. each collapses into one metanode
+  size_t alias_cycles;
+  size_t alias_size;
+
+  DatasetSpec() :
+    seed(1),
+    num_entities(100000),
+    num_tags(10000),
+    zipf_exponent(1.0),
+    tags_per_entity(8),
+    hierarchy_depth(4),
+    fan_out(6),
+    alias_cycles(100),
+    alias_size(3) {}
+};
+
+// what generate_dataset built, to pick queries from
+struct Dataset {
+  // every tag, most popular first
+  std::vector<Tag*> by_popularity;
+
+  // the taxonomy's tags by level, the root's first
+  std::vector<std::vector<Tag*> > levels;
+
+  // the tags of each alias cycle
+  std::vector<std::vector<Tag*> > aliases;
+
+  size_t num_taggings;
+
+  Dataset() : num_taggings(0) {}
+};
+
+// random numbers that come out the same for a seed on any platform:
+// mt19937_64 is fully specified, unlike the std distributions
+struct DatasetRng {
+  std::mt19937_64 engine;
+
+  DatasetRng(uint64_t seed) : engine(seed) {}
+
+  // uniform in [0, 1)
+  double uniform() {
+    return (engine() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  // uniform in [0, n)
+  size_t below(size_t n) {
+    return (size_t) (uniform() * n);
+  }
+};
+
+// picks ranks in [0, n) with Zipf distributed probabilities
+struct ZipfSampler {
+  std::vector<double> cdf;
+
+  ZipfSampler(size_t n, double exponent);
+
+  size_t sample(DatasetRng& rng) const;
+};
+
+// sets the DatasetSpec field for a command line option like "--entities",
+// returns false for an option that isn't one of them
+bool parse_dataset_option(const char *key, const char *value, DatasetSpec& spec);
+
+// usage lines for the options parse_dataset_option takes
+extern const char *dataset_usage;
+
+// a query of the standard mix, built from bare QueryClauseLits
+struct NamedQuery {
+  const char *name;
+  QueryClause *source;
+};
+
+// fills an empty context with a dataset shaped by 'spec', with a clean
+// metagraph. the same spec always generates the same dataset
+Dataset generate_dataset(Context& ctx, const DatasetSpec& spec);
+
+// the queries benchmarks run against a dataset: single tags of varying
+// popularity, taxonomy and alias lookups, ANDs, ORs, negations and a
+// threshold. the caller owns the clauses
+std::vector<NamedQuery> standard_queries(const Dataset& d);
+
+#endif /* __DATASET_H__ */
@@ -1,4 +1,5 @@
 #include <hayai.hpp>
+#include <cstring>
 #include "gtest/gtest.h"
 
 #include "context.h"
@@ -8,9 +9,14 @@ int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   if(RUN_ALL_TESTS() != 0) { return -1; }
 
-  // hayai::ConsoleOutputter consoleOutputter;
-  // hayai::Benchmarker::AddOutputter(consoleOutputter);
-  // hayai::Benchmarker::RunAllTests();
+  // and the benchmarks, when asked to
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--benchmark") == 0) {
+      hayai::ConsoleOutputter consoleOutputter;
+      hayai::Benchmarker::AddOutputter(consoleOutputter);
+      hayai::Benchmarker::RunAllTests();
+    }
+  }
 
   return 0;
 }
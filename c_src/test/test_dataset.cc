@@ -0,0 +1,77 @@
+#include "test_helper.h"
+#include "dataset.h"
+
+static DatasetSpec small_spec() {
+  DatasetSpec spec;
+  spec.num_entities = 5000;
+  spec.num_tags = 500;
+  spec.hierarchy_depth = 3;
+  spec.fan_out = 4;
+  spec.alias_cycles = 10;
+  spec.alias_size = 3;
+  return spec;
+}
+
+TEST(DatasetTest, SameSeedSameDataset) {
+  Context a, b;
+  auto da = generate_dataset(a, small_spec());
+  auto db = generate_dataset(b, small_spec());
+
+  ASSERT_EQ(da.num_taggings, db.num_taggings);
+  for(size_t i = 0; i < da.by_popularity.size(); i++) {
+    ASSERT_EQ(da.by_popularity[i]->id, db.by_popularity[i]->id);
+    ASSERT_EQ(da.by_popularity[i]->entity_count(), db.by_popularity[i]->entity_count());
+  }
+
+  Context c;
+  auto spec = small_spec();
+  spec.seed = 2;
+  auto dc = generate_dataset(c, spec);
+  ASSERT_NE(da.by_popularity[0]->id, dc.by_popularity[0]->id);
+}
+
+TEST(DatasetTest, Shape) {
+  Context ctx;
+  auto spec = small_spec();
+  auto d = generate_dataset(ctx, spec);
+
+  ASSERT_EQ(spec.num_entities, ctx.num_entities());
+  ASSERT_EQ(spec.num_tags, ctx.num_tags());
+  ASSERT_FALSE(ctx.is_dirty());
+
+  // popularity falls off with rank
+  auto& pop = d.by_popularity;
+  ASSERT_GT(pop[0]->entity_count(), pop[10]->entity_count());
+  ASSERT_GT(pop[10]->entity_count(), pop[400]->entity_count());
+
+  // 1 to 15 tags per entity, minus repeats
+  double per_entity = (double) d.num_taggings / spec.num_entities;
+  ASSERT_GT(per_entity, 6);
+  ASSERT_LT(per_entity, 8.5);
+
+  // 1 + 4 + 16 + 64 tags in the taxonomy
+  ASSERT_EQ(4, d.levels.size());
+  ASSERT_EQ(64, d.levels[3].size());
+  auto leaf = d.levels[3][0];
+  ASSERT_EQ(1, leaf->implies.size());
+  ASSERT_TRUE(leaf->implies.count(d.levels[2][0]));
+
+  ASSERT_EQ(10, d.aliases.size());
+  for(auto& cycle : d.aliases) {
+    ASSERT_EQ(3, cycle.size());
+    ASSERT_EQ(cycle[0]->meta_node, cycle[2]->meta_node);
+  }
+}
+
+TEST(DatasetTest, StandardQueriesRun) {
+  Context ctx;
+  auto d = generate_dataset(ctx, small_spec());
+
+  for(auto& query : standard_queries(d)) {
+    std::unique_ptr<QueryClause> clause(ctx.optimize_query(expand_implications(query.source)));
+    size_t rows = 0;
+    ctx.query(clause.get(), QueryRange(), [&](Entity*) { rows++; });
+    ASSERT_EQ(ctx.count(clause.get()), rows) << query.name;
+    delete query.source;
+  }
+}
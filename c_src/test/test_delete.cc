@@ -0,0 +1,186 @@
+#include <memory>
+
+#include "test_helper.h"
+
+class DeleteTest : public ::testing::Test {
+public:
+  Context ctx;
+  Entity *e1, *e2, *e3;
+  Tag *a, *b, *c;
+
+  void SetUp() {
+    e1 = ctx.new_entity();
+    e2 = ctx.new_entity();
+    e3 = ctx.new_entity();
+    a = ctx.new_tag();
+    b = ctx.new_tag();
+    c = ctx.new_tag();
+  }
+
+  // matches of 'source' through query(), with and without a range
+  std::unordered_set<Entity*> matches(QueryClause *source) {
+    std::unique_ptr<QueryClause> clause(expand_implications(source));
+    delete source;
+
+    auto ret = query(ctx, *clause);
+    auto ranged = SET(Entity*, {});
+    ctx.query(clause.get(), QueryRange(), [&](Entity *e) { ranged.insert(e); });
+    EXPECT_EQ(ret, ranged);
+    EXPECT_EQ(ret.size(), ctx.count(clause.get()));
+    return ret;
+  }
+};
+
+TEST_F(DeleteTest, DeletedEntitiesDontMatch) {
+  e1->add_tag(a);
+  e2->add_tag(a);
+  e2->add_tag(b);
+
+  ctx.delete_entity(e2);
+  ASSERT_EQ(2, ctx.num_entities());
+  ASSERT_EQ(nullptr, ctx.entity_by_id(e2->id));
+  ASSERT_EQ(1, ctx.num_deleted_entities());
+  ASSERT_EQ(1, a->entity_count());
+  ASSERT_EQ(0, b->entity_count());
+
+  ASSERT_EQ(SET(Entity*, {e1}), matches(new QueryClauseLit(a)));
+  ASSERT_EQ(SET(Entity*, {}), matches(new QueryClauseLit(b)));
+  ASSERT_EQ(SET(Entity*, {e1, e3}), matches(new QueryClauseAny()));
+  ASSERT_EQ(SET(Entity*, {e3}), matches(build_not(new QueryClauseLit(a))));
+  ASSERT_EQ(SET(Entity*, {e1}), matches(build_and(new QueryClauseLit(a), build_not(new QueryClauseLit(c)))));
+}
+
+TEST_F(DeleteTest, DeletedEntitiesLeaveTheCache) {
+  e1->add_tag(a);
+  std::unique_ptr<QueryClause> not_a(build_not(new QueryClauseLit(a)));
+
+  auto cached = [&]() {
+    auto ret = SET(Entity*, {});
+    ctx.cached_query(not_a.get(), QueryRange(), [&](Entity *e) { ret.insert(e); });
+    return ret;
+  };
+  ASSERT_EQ(SET(Entity*, {e2, e3}), cached());
+
+  ctx.delete_entity(e3);
+  ASSERT_EQ(SET(Entity*, {e2}), cached());
+  ASSERT_EQ(1, ctx.cached_count(not_a.get()));
+}
+
+TEST_F(DeleteTest, StandingQueriesHearOfDeletedEntities) {
+  e1->add_tag(a);
+  e2->add_tag(a);
+
+  std::vector<Entity*> removed;
+  auto sq = ctx.add_standing_query(new QueryClauseLit(a), [&](const std::vector<Entity*>&, const std::vector<Entity*>& rem) {
+    removed.insert(removed.end(), rem.begin(), rem.end());
+    return true;
+  });
+
+  ctx.delete_entity(e2);
+  ASSERT_EQ(std::vector<Entity*>({e2}), removed);
+  ASSERT_EQ(SET(Entity*, {e1}), sq->matches);
+}
+
+TEST_F(DeleteTest, IdsCanBeReused) {
+  auto id = e2->id;
+  e2->add_tag(a);
+  ctx.delete_entity(e2);
+
+  auto again = ctx.new_entity(id);
+  ASSERT_TRUE(again != nullptr);
+  ASSERT_EQ(again, ctx.entity_by_id(id));
+  ASSERT_EQ(SET(Entity*, {}), matches(new QueryClauseLit(a)));
+  ASSERT_EQ(SET(Entity*, {e1, again, e3}), matches(new QueryClauseAny()));
+
+  ctx.compact();
+  ASSERT_EQ(SET(Entity*, {e1, again, e3}), matches(new QueryClauseAny()));
+}
+
+TEST_F(DeleteTest, DeletedTagsLoseTheirImplications) {
+  // a -> b -> c
+  a->imply(b);
+  b->imply(c);
+  e1->add_tag(a);
+  e2->add_tag(b);
+  ASSERT_EQ(SET(Entity*, {e1, e2}), matches(new QueryClauseLit(c)));
+
+  ASSERT_TRUE(ctx.delete_tag(b));
+  ASSERT_EQ(nullptr, ctx.tag_by_id(b->id));
+  ASSERT_EQ(2, ctx.num_tags());
+  ASSERT_EQ(1, ctx.num_deleted_tags());
+  ASSERT_TRUE(a->implies.empty());
+  ASSERT_TRUE(c->implied_by.empty());
+  ASSERT_TRUE(e2->tags.empty());
+
+  // updated in place, and nothing's left implying anything
+  ASSERT_FALSE(ctx.is_dirty());
+  ASSERT_EQ(0, ctx.meta_nodes.size());
+  ASSERT_EQ(SET(Entity*, {}), matches(new QueryClauseLit(c)));
+  ASSERT_EQ(SET(Entity*, {e1}), matches(new QueryClauseLit(a)));
+}
+
+TEST_F(DeleteTest, DeletingATagFromACycle) {
+  // a <-> b -> c
+  a->imply(b);
+  b->imply(a);
+  b->imply(c);
+  e1->add_tag(a);
+  e2->add_tag(b);
+  ASSERT_EQ(a->meta_node, b->meta_node);
+
+  ASSERT_TRUE(ctx.delete_tag(b));
+  ASSERT_TRUE(ctx.is_dirty());
+
+  // the stale metanode no longer has it
+  ASSERT_EQ(SET(Tag*, {a}), a->meta_node->tags);
+
+  ctx.make_clean();
+  ASSERT_EQ(nullptr, a->meta_node);
+  ASSERT_EQ(SET(Entity*, {}), matches(new QueryClauseLit(c)));
+  ASSERT_EQ(SET(Entity*, {e1}), matches(new QueryClauseLit(a)));
+}
+
+TEST_F(DeleteTest, StandingQueriesKeepTheirTags) {
+  e1->add_tag(b);
+  a->imply(b);
+
+  auto sq = ctx.add_standing_query(new QueryClauseLit(b), [](const std::vector<Entity*>&, const std::vector<Entity*>&) {
+    return true;
+  });
+  ASSERT_FALSE(ctx.delete_tag(b));
+  ASSERT_EQ(b, ctx.tag_by_id(b->id));
+
+  // but tags implying them can go
+  e2->add_tag(a);
+  ASSERT_EQ(SET(Entity*, {e1, e2}), sq->matches);
+  ASSERT_TRUE(ctx.delete_tag(a));
+  ASSERT_EQ(SET(Entity*, {e1}), sq->matches);
+}
+
+TEST_F(DeleteTest, CompactionFreesWhatWasDeleted) {
+  auto& memory = ctx.get_memory();
+  std::vector<Entity*> churned;
+  for(int i = 0; i < 1000; i++) {
+    auto e = ctx.new_entity();
+    e->add_tag(a);
+    churned.push_back(e);
+  }
+  ASSERT_FALSE(ctx.needs_compaction());
+
+  auto before = memory.total();
+  for(auto e : churned) ctx.delete_entity(e);
+  ASSERT_TRUE(ctx.delete_tag(c));
+  ASSERT_TRUE(ctx.needs_compaction());
+  ASSERT_EQ(1003, ctx.all_entities().size());
+
+  ASSERT_EQ(1001, ctx.compact());
+  ASSERT_FALSE(ctx.needs_compaction());
+  ASSERT_EQ(0, ctx.num_deleted_entities());
+  ASSERT_EQ(0, ctx.num_deleted_tags());
+  ASSERT_EQ(3, ctx.all_entities().size());
+  ASSERT_LT(memory.total(), before / 4);
+  ASSERT_EQ(1, ctx.get_telemetry().compact.summary().count);
+
+  ASSERT_EQ(SET(Entity*, {e1, e2, e3}), matches(new QueryClauseAny()));
+  ASSERT_EQ(SET(Entity*, {}), matches(new QueryClauseLit(a)));
+}
@@ -176,3 +176,49 @@ TEST_F(EntityAndTagTest2, RemovingEdge) {
     delete q;
   }
 }
+
+TEST_F(EntityAndTagTest, TagKeepsSortedEntityList) {
+  auto e3 = ctx.new_entity(10);
+  auto e4 = ctx.new_entity(5);
+
+  e3->add_tag(foo);
+  e1->add_tag(foo);
+  e4->add_tag(foo);
+  e2->add_tag(foo);
+  ASSERT_EQ(EntityList({e1, e2, e4, e3}), foo->postings());
+  ASSERT_EQ(4, foo->entity_count());
+
+  e4->remove_tag(foo);
+  ASSERT_EQ(EntityList({e1, e2, e3}), foo->postings());
+  ASSERT_EQ(3, foo->entity_count());
+}
+
+TEST_F(EntityAndTagTest, TagBatchesRemovals) {
+  std::vector<Entity*> tagged;
+  for(int i = 0; i < 1000; i++) {
+    auto e = ctx.new_entity();
+    e->add_tag(foo);
+    tagged.push_back(e);
+  }
+
+  // every other one off the middle, and a couple back on before the
+  // removals are applied
+  for(size_t i = 0; i < tagged.size() - 1; i += 2) {
+    tagged[i]->remove_tag(foo);
+  }
+  tagged[0]->add_tag(foo);
+  tagged[998]->add_tag(foo);
+  ASSERT_EQ(502, foo->entity_count());
+
+  auto& list = foo->postings();
+  ASSERT_EQ(502, list.size());
+  ASSERT_TRUE(std::is_sorted(list.begin(), list.end(), entity_id_less));
+  ASSERT_EQ(tagged[0], list[0]);
+  ASSERT_EQ(tagged[1], list[1]);
+  ASSERT_EQ(tagged[3], list[2]);
+
+  auto q = build_lit(foo);
+  ASSERT_EQ(502, query(ctx, *q).size());
+  ASSERT_EQ(502, ctx.count(q));
+  delete q;
+}
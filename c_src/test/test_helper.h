@@ -5,7 +5,13 @@
 #include "context.h"
 #include "query.h"
 
-#define SET(T, ARR...) std::unordered_set<T>(ARR)
+// sets of tags and metanodes are the context's own types, so they compare
+// against the ones in the context
+template<class T> struct set_of { typedef std::unordered_set<T> type; };
+template<> struct set_of<Tag*> { typedef TagSet type; };
+template<> struct set_of<SCCMetaNode*> { typedef MetaNodeSet type; };
+
+#define SET(T, ARR...) set_of<T>::type(ARR)
 
 std::unordered_set<Entity*> query(const Context& c, const QueryClause& query);
 
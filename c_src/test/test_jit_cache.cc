@@ -0,0 +1,156 @@
+#include <thread>
+#include <atomic>
+
+#include "test_helper.h"
+#include "context.h"
+#include "jit_cache.h"
+
+static bool always(const TagSet*) { return true; }
+
+class JitCacheTest : public ::testing::Test {
+public:
+  std::atomic<size_t> compiled, released;
+
+  void SetUp() {
+    compiled = 0;
+    released = 0;
+  }
+
+  // stands in for the JIT, so the cache can be tested without it
+  JitCache::Compile fake(size_t bytes) {
+    return [this, bytes]() {
+      compiled++;
+      return std::shared_ptr<const JitCode>(new JitCode(always, bytes), [this](const JitCode *code) {
+        released++;
+        delete code;
+      });
+    };
+  }
+};
+
+TEST_F(JitCacheTest, SharesCode) {
+  JitCache cache(1000);
+  auto c1 = cache.get("a", fake(100));
+  auto c2 = cache.get("a", fake(100));
+  ASSERT_EQ(c1, c2);
+  ASSERT_EQ(1, compiled);
+
+  auto stats = cache.stats();
+  ASSERT_EQ(1, stats.hits);
+  ASSERT_EQ(1, stats.misses);
+  ASSERT_EQ(100, stats.bytes);
+  ASSERT_EQ(1, stats.live);
+}
+
+TEST_F(JitCacheTest, EvictsLeastRecentlyUsed) {
+  JitCache cache(300);
+  cache.get("a", fake(100));
+  cache.get("b", fake(100));
+  cache.get("c", fake(100));
+
+  // 'a' was used more recently than 'b'
+  cache.get("a", fake(100));
+  cache.get("d", fake(100));
+  ASSERT_EQ(1, cache.stats().evictions);
+  ASSERT_EQ(1, released);
+
+  compiled = 0;
+  cache.get("a", fake(100));
+  cache.get("c", fake(100));
+  cache.get("d", fake(100));
+  ASSERT_EQ(0, compiled);
+
+  cache.set_max_bytes(100);
+  ASSERT_EQ(1, cache.stats().entries);
+  ASSERT_EQ(100, cache.stats().bytes);
+}
+
+TEST_F(JitCacheTest, EvictedCodeLivesOn) {
+  JitCache cache(100);
+  auto held = cache.get("a", fake(100));
+  cache.get("b", fake(100));
+
+  // still running somewhere
+  ASSERT_EQ(0, released);
+  auto stats = cache.stats();
+  ASSERT_EQ(1, stats.entries);
+  ASSERT_EQ(2, stats.live);
+  ASSERT_EQ(200, stats.live_bytes);
+
+  held.reset();
+  ASSERT_EQ(1, released);
+  ASSERT_EQ(1, cache.stats().live);
+}
+
+TEST_F(JitCacheTest, OversizedCodeIsntKept) {
+  JitCache cache(100);
+  auto code = cache.get("a", fake(500));
+  ASSERT_TRUE(code);
+  ASSERT_EQ(0, cache.stats().entries);
+
+  code.reset();
+  ASSERT_EQ(1, released);
+}
+
+TEST_F(JitCacheTest, FailedCompiles) {
+  JitCache cache(100);
+  auto code = cache.get("a", []() { return std::shared_ptr<const JitCode>(); });
+  ASSERT_FALSE(code);
+  ASSERT_EQ(1, cache.stats().compile_failures);
+  ASSERT_EQ(0, cache.stats().entries);
+}
+
+TEST_F(JitCacheTest, ConcurrentReaders) {
+  JitCache cache(1000);
+  std::vector<std::thread> threads;
+  for(int t = 0; t < 8; t++) {
+    threads.push_back(std::thread([&, t]() {
+      for(int i = 0; i < 1000; i++) {
+        auto key = std::to_string((i * 7 + t) % 30);
+        auto code = cache.get(key, fake(100));
+        ASSERT_TRUE(code->func(nullptr));
+      }
+    }));
+  }
+  for(auto& thread : threads) thread.join();
+
+  auto stats = cache.stats();
+  ASSERT_EQ(8000, stats.hits + stats.misses);
+  ASSERT_EQ(10, stats.entries);
+  ASSERT_EQ(10, stats.live);
+  ASSERT_EQ(compiled - 10, released);
+}
+
+TEST_F(JitCacheTest, KeysAreExact) {
+  // the same tag ids in another context are different tags
+  Context ctx1, ctx2;
+  auto a1 = ctx1.new_tag(0), b1 = ctx1.new_tag(1);
+  auto a2 = ctx2.new_tag(0);
+
+  std::unique_ptr<QueryClause> q1(build_and(new QueryClauseLit(a1), new QueryClauseLit(b1)));
+  std::unique_ptr<QueryClause> q2(build_and(new QueryClauseLit(b1), new QueryClauseLit(a1)));
+  std::unique_ptr<QueryClause> q3(new QueryClauseLit(a1));
+  std::unique_ptr<QueryClause> q4(new QueryClauseLit(a2));
+  ASSERT_NE(jit_key(q1.get()), jit_key(q2.get()));
+  ASSERT_NE(jit_key(q3.get()), jit_key(q4.get()));
+
+  std::unique_ptr<QueryClause> q5(new QueryClauseLit(a1));
+  ASSERT_EQ(jit_key(q3.get()), jit_key(q5.get()));
+}
+
+TEST_F(JitCacheTest, JITNodesShareCode) {
+  Context ctx;
+  auto a = ctx.new_tag(), b = ctx.new_tag();
+  auto before = JitCache::shared().stats();
+
+  std::unique_ptr<QueryClause> q(build_or(new QueryClauseLit(a), new QueryClauseLit(b)));
+  std::unique_ptr<QueryClause> j1(jit_compile(q.get()));
+  std::unique_ptr<QueryClause> j2(jit_compile(q.get()));
+  ASSERT_TRUE(j1 && j2);
+  std::unique_ptr<QueryClause> j3(j2->dup());
+
+  auto after = JitCache::shared().stats();
+  ASSERT_EQ(before.misses + 1, after.misses);
+  ASSERT_TRUE(j3->matches_set(SET(Tag*, {b})));
+  ASSERT_FALSE(j3->matches_set(SET(Tag*, {})));
+}
@@ -0,0 +1,99 @@
+#include "test_helper.h"
+#include "context.h"
+#include "memory_account.h"
+
+TEST(MemoryTest, CountsWhatContainersAllocate) {
+  MemoryCounter counter;
+  {
+    TagSet set((TagSet::allocator_type(&counter)));
+    for(uintptr_t i = 1; i <= 100; i++) set.insert((Tag*) i);
+    ASSERT_GE(counter.bytes(), 100 * sizeof(Tag*));
+  }
+  ASSERT_EQ(0, counter.bytes());
+}
+
+TEST(MemoryTest, CopiesArentCounted) {
+  MemoryCounter counter;
+  TagSet set((TagSet::allocator_type(&counter)));
+  set.insert((Tag*) 1);
+  auto before = counter.bytes();
+
+  TagSet copy = set;
+  copy.insert((Tag*) 2);
+  ASSERT_EQ(before, counter.bytes());
+
+  // but a counted set stays counted when it's assigned to
+  set = copy;
+  ASSERT_GT(counter.bytes(), before);
+}
+
+TEST(MemoryTest, CountsFollowSwapsAndMoves) {
+  MemoryCounter a, b;
+  {
+    TagSet sa((TagSet::allocator_type(&a))), sb((TagSet::allocator_type(&b)));
+    sa.insert((Tag*) 1);
+    std::swap(sa, sb);
+    sb.insert((Tag*) 2);
+
+    TagSet moved(std::move(sb));
+    moved.insert((Tag*) 3);
+    ASSERT_GT(a.bytes(), 0);
+  }
+  ASSERT_EQ(0, a.bytes());
+  ASSERT_EQ(0, b.bytes());
+}
+
+TEST(MemoryTest, ContextsCountEachPart) {
+  Context ctx;
+  auto& memory = ctx.get_memory();
+  ASSERT_EQ(0, memory.total());
+
+  auto a = ctx.new_tag(), b = ctx.new_tag();
+  ASSERT_GE(memory.tags.bytes(), 2 * sizeof(Tag));
+
+  std::vector<Entity*> entities;
+  for(int i = 0; i < 100; i++) entities.push_back(ctx.new_entity());
+  ASSERT_GE(memory.entities.bytes(), 100 * sizeof(Entity));
+  ASSERT_EQ(0, memory.entity_tags.bytes());
+  ASSERT_EQ(0, memory.postings.bytes());
+
+  for(auto e : entities) e->add_tag(a);
+  ASSERT_GE(memory.entity_tags.bytes(), 100 * sizeof(Tag*));
+  ASSERT_GE(memory.postings.bytes(), 100 * sizeof(Entity*));
+  ASSERT_GT(memory.stats.bytes(), 0);
+
+  ASSERT_EQ(0, memory.implications.bytes());
+  ASSERT_EQ(0, memory.meta_nodes.bytes());
+  a->imply(b);
+  ASSERT_GT(memory.implications.bytes(), 0);
+  ASSERT_GE(memory.meta_nodes.bytes(), 2 * sizeof(SCCMetaNode));
+}
+
+TEST(MemoryTest, RebuildsReplaceTheMetagraphsMemory) {
+  Context ctx;
+  auto& memory = ctx.get_memory();
+  auto a = ctx.new_tag(), b = ctx.new_tag(), c = ctx.new_tag();
+
+  ctx.mark_dirty();
+  a->imply(b);
+  b->imply(c);
+  ctx.make_clean();
+  auto built = memory.meta_nodes.bytes();
+  ASSERT_GE(built, 3 * sizeof(SCCMetaNode));
+
+  // rebuilt out of line, the same graph takes the same memory
+  {
+    MetaGraphBuild build;
+    ctx.snapshot_implications(build);
+    build_metagraph(build);
+    ASSERT_EQ(2 * built, memory.meta_nodes.bytes());
+    ASSERT_TRUE(ctx.install_metagraph(build));
+  }
+  ASSERT_EQ(built, memory.meta_nodes.bytes());
+
+  ctx.mark_dirty();
+  a->unimply(b);
+  b->unimply(c);
+  ctx.make_clean();
+  ASSERT_EQ(0, memory.meta_nodes.bytes());
+}
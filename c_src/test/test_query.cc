@@ -202,3 +202,172 @@ TEST_F(QueryTest, QueryOptimJITLit_Ands) {
 
   delete query;
 }
+
+TEST_F(QueryTest, CountMatchesQuery) {
+  for(int i = 0; i <  5; i++) { ctx.new_entity()->add_tag(a); }
+  for(int i = 0; i < 10; i++) { ctx.new_entity()->add_tag(b); }
+  for(int i = 0; i < 20; i++) {
+    auto ent = ctx.new_entity();
+    ent->add_tag(c);
+    ent->add_tag(d);
+  }
+
+  // a, b and c, d are mutually implicative
+  a->imply(b);
+  b->imply(a);
+  c->imply(d);
+  d->imply(c);
+  c->imply(a);
+
+  std::vector<QueryClause*> queries = {
+    build_lit(a),
+    build_lit(c),
+    build_lit(e),
+    build_or(build_lit(c), build_lit(e)),
+    build_not(build_lit(a)),
+    build_not(build_lit(c)),
+    build_and(build_lit(a), build_not(build_lit(c))),
+    build_not(build_and(build_lit(a), build_lit(c))),
+    new QueryClauseAny(),
+    build_not(new QueryClauseAny())
+  };
+
+  for(auto q : queries) {
+    if(debug) q->debug_print();
+    ASSERT_EQ(query(ctx, *q).size(), ctx.count(q));
+    delete q;
+  }
+}
+
+class QueryRangeTest : public ::testing::Test {
+public:
+  Context ctx;
+  Tag *a, *b;
+
+  void SetUp() {
+    a = ctx.new_tag();
+    b = ctx.new_tag();
+
+    // created out of order on purpose
+    for(id_type id : {7, 3, 9, 1, 5, 8, 2, 6, 4, 0}) {
+      auto e = ctx.new_entity(id);
+      if(id % 2 == 0) e->add_tag(a);
+      if(id % 3 == 0) e->add_tag(b);
+    }
+  }
+
+  std::vector<id_type> run(const QueryClause *q, const QueryRange& range) {
+    std::vector<id_type> ids;
+    ctx.query(q, range, [&](Entity *e) { ids.push_back(e->id); });
+    return ids;
+  }
+};
+
+TEST_F(QueryRangeTest, ScanInIdOrder) {
+  auto q = build_not(build_lit(a));
+  QueryRange range;
+  ASSERT_EQ(std::vector<id_type>({1, 3, 5, 7, 9}), run(q, range));
+
+  range.order = QueryOrderDesc;
+  ASSERT_EQ(std::vector<id_type>({9, 7, 5, 3, 1}), run(q, range));
+
+  range.limit = 2;
+  ASSERT_EQ(std::vector<id_type>({9, 7}), run(q, range));
+
+  range.has_after = true;
+  range.after = 7;
+  ASSERT_EQ(std::vector<id_type>({5, 3}), run(q, range));
+
+  range.order = QueryOrderAsc;
+  ASSERT_EQ(std::vector<id_type>({9}), run(q, range));
+
+  range.after = 9;
+  ASSERT_EQ(std::vector<id_type>({}), run(q, range));
+  delete q;
+}
+
+TEST_F(QueryRangeTest, TagUnionInIdOrder) {
+  auto q = build_or(build_lit(a), build_lit(b));
+  QueryRange range;
+  ASSERT_EQ(std::vector<id_type>({0, 2, 3, 4, 6, 8, 9}), run(q, range));
+
+  range.has_after = true;
+  range.after = 3;
+  range.limit = 3;
+  ASSERT_EQ(std::vector<id_type>({4, 6, 8}), run(q, range));
+
+  range.order = QueryOrderDesc;
+  range.after = 6;
+  ASSERT_EQ(std::vector<id_type>({4, 3, 2}), run(q, range));
+
+  range.after = 0;
+  ASSERT_EQ(std::vector<id_type>({}), run(q, range));
+  delete q;
+}
+
+TEST_F(QueryRangeTest, EntitiesCreatedBetweenQueries) {
+  auto q = build_not(build_lit(a));
+  QueryRange range;
+  ASSERT_EQ(std::vector<id_type>({1, 3, 5, 7, 9}), run(q, range));
+
+  // appended out of order, and sorted in by the next query
+  ctx.new_entity(13);
+  ctx.new_entity(11);
+  ctx.new_entity(12)->add_tag(a);
+  ASSERT_EQ(std::vector<id_type>({1, 3, 5, 7, 9, 11, 13}), run(q, range));
+  ASSERT_EQ(7, ctx.count(q));
+  delete q;
+
+  auto& all = ctx.all_entities();
+  ASSERT_EQ(13, all.size());
+  ASSERT_TRUE(std::is_sorted(all.begin(), all.end(), entity_id_less));
+}
+
+TEST_F(QueryTest, Facets) {
+  // a -> b -> c, d on its own
+  a->imply(b);
+  b->imply(c);
+
+  e1->add_tag(a);
+  e1->add_tag(d);
+  e2->add_tag(b);
+  auto e3 = ctx.new_entity();
+  e3->add_tag(c);
+  e3->add_tag(a);
+  auto e4 = ctx.new_entity();
+  e4->add_tag(d);
+
+  QueryClause *q = build_not(build_lit(e));
+
+  auto direct = ctx.facets(q, {a, b, c, d, e}, false);
+  ASSERT_EQ(5, direct.size());
+  std::vector<size_t> counts;
+  for(auto facet : direct) counts.push_back(facet.count);
+  ASSERT_EQ(std::vector<size_t>({2, 1, 1, 2, 0}), counts);
+
+  // e3 carries c both directly and through a, but only counts once
+  auto implied = ctx.facets(q, {a, b, c, d, e}, true);
+  counts.clear();
+  for(auto facet : implied) counts.push_back(facet.count);
+  ASSERT_EQ(std::vector<size_t>({2, 3, 3, 2, 0}), counts);
+
+  auto top = ctx.top_facets(q, 2, true);
+  ASSERT_EQ(2, top.size());
+  ASSERT_EQ(b, top[0].tag);
+  ASSERT_EQ(3, top[0].count);
+  ASSERT_EQ(c, top[1].tag);
+  ASSERT_EQ(3, top[1].count);
+  delete q;
+
+  // restricted to the entities matching the query
+  q = build_lit(d);
+  direct = ctx.facets(q, {a, d}, false);
+  ASSERT_EQ(1, direct[0].count);
+  ASSERT_EQ(2, direct[1].count);
+
+  top = ctx.top_facets(q, 10, false);
+  ASSERT_EQ(2, top.size());
+  ASSERT_EQ(d, top[0].tag);
+  ASSERT_EQ(a, top[1].tag);
+  delete q;
+}
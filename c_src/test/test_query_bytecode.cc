@@ -0,0 +1,151 @@
+#include <random>
+#include <sstream>
+
+#include "test_helper.h"
+#include "context.h"
+#include "query_bytecode.h"
+
+class QueryBytecodeTest : public ::testing::Test {
+public:
+  Context ctx;
+  std::vector<Tag*> tags;
+  std::mt19937 rng;
+
+  void SetUp() {
+    for(int i = 0; i < 6; i++) {
+      tags.push_back(ctx.new_tag());
+    }
+    tags[0]->imply(tags[1]);
+    tags[2]->imply(tags[1]);
+    ctx.make_clean();
+  }
+
+  // random clause over 'tags', at most 'depth' levels deep
+  QueryClause *random_clause(int depth) {
+    int kind = depth == 0 ? rng() % 3 : rng() % 8;
+    switch(kind) {
+    case 0: return new QueryClauseLit(tags[rng() % tags.size()]);
+    case 1: return build_lit(tags[rng() % tags.size()]);
+    case 2: return rng() % 4 ? build_lit(tags[rng() % tags.size()]) : new QueryClauseAny();
+    case 3: return build_not(random_clause(depth - 1));
+    case 4: return build_and(random_clause(depth - 1), random_clause(depth - 1));
+    case 5: return build_or(random_clause(depth - 1), random_clause(depth - 1));
+    case 6: {
+      std::vector<QueryClause*> children;
+      for(size_t i = 0, n = rng() % 5; i < n; i++) {
+        children.push_back(random_clause(depth - 1));
+      }
+      return build_nary(rng() % 2 ? QueryClauseAnd : QueryClauseOr, children);
+    }
+    default: {
+      std::vector<QueryClause*> children;
+      for(size_t i = 0, n = rng() % 5; i < n; i++) {
+        children.push_back(random_clause(depth - 1));
+      }
+      return build_threshold(rng() % 4, children);
+    }
+    }
+  }
+
+  // every subset of 'tags'
+  std::vector<TagSet> tag_sets() {
+    std::vector<TagSet> ret;
+    for(size_t bits = 0; bits < (1u << tags.size()); bits++) {
+      TagSet set;
+      for(size_t i = 0; i < tags.size(); i++) {
+        if(bits & (1 << i)) set.insert(tags[i]);
+      }
+      ret.push_back(set);
+    }
+    return ret;
+  }
+};
+
+TEST_F(QueryBytecodeTest, ShortCircuits) {
+  std::unique_ptr<QueryClause> q(build_and(
+    new QueryClauseLit(tags[0]),
+    build_or(new QueryClauseLit(tags[1]), new QueryClauseLit(tags[2]))));
+  std::unique_ptr<QueryClauseBytecode> compiled(compile_bytecode(q.get()));
+  ASSERT_TRUE(compiled.get());
+
+  std::ostringstream code;
+  compiled->program.disassemble(code);
+  ASSERT_EQ(
+    "0: tag " + std::to_string(tags[0]->id) + "\n"
+    "1: jump_if_false -> 5\n"
+    "2: tag " + std::to_string(tags[1]->id) + "\n"
+    "3: jump_if_true -> 5\n"
+    "4: tag " + std::to_string(tags[2]->id) + "\n"
+    "5: return\n", code.str());
+
+  ASSERT_FALSE(compiled->matches_set(SET(Tag*, {tags[1]})));
+  ASSERT_TRUE(compiled->matches_set(SET(Tag*, {tags[0], tags[2]})));
+}
+
+TEST_F(QueryBytecodeTest, MatchesTheTree) {
+  auto sets = tag_sets();
+  for(int i = 0; i < 300; i++) {
+    std::unique_ptr<QueryClause> q(random_clause(4));
+    std::unique_ptr<QueryClauseBytecode> compiled(compile_bytecode(q.get()));
+    ASSERT_TRUE(compiled.get());
+
+    for(auto& set : sets) {
+      ASSERT_EQ(q->matches_set(set), compiled->matches_set(set));
+    }
+  }
+}
+
+TEST_F(QueryBytecodeTest, NestedThresholdsSpillToTheHeap) {
+  // deeper than the VM's on-stack counters
+  QueryClause *q = new QueryClauseLit(tags[0]);
+  for(int i = 0; i < 40; i++) {
+    q = build_threshold(1, {q, new QueryClauseLit(tags[1 + i % 2])});
+  }
+  std::unique_ptr<QueryClause> owned(q);
+  std::unique_ptr<QueryClauseBytecode> compiled(compile_bytecode(q));
+  ASSERT_EQ(40, compiled->program.max_counters);
+
+  for(auto& set : tag_sets()) {
+    ASSERT_EQ(q->matches_set(set), compiled->matches_set(set));
+  }
+}
+
+TEST_F(QueryBytecodeTest, InlinesCompiledClauses) {
+  std::unique_ptr<QueryClause> inner(compile_bytecode(std::unique_ptr<QueryClause>(
+    build_or(new QueryClauseLit(tags[0]), build_not(new QueryClauseLit(tags[1])))).get()));
+  std::unique_ptr<QueryClause> q(build_and(inner->dup(), new QueryClauseLit(tags[2])));
+  std::unique_ptr<QueryClauseBytecode> compiled(compile_bytecode(q.get()));
+
+  for(auto& set : tag_sets()) {
+    ASSERT_EQ(q->matches_set(set), compiled->matches_set(set));
+  }
+}
+
+TEST_F(QueryBytecodeTest, OptimizeFlag) {
+  auto q = optimize(build_and(build_lit(tags[1]), build_not(build_lit(tags[3]))),
+    (QueryOptFlags) (QueryOptFlags_Reorder | QueryOptFlags_Bytecode));
+  std::unique_ptr<QueryClause> owned(q);
+  ASSERT_TRUE(dynamic_cast<QueryClauseBytecode*>(q));
+  ASSERT_TRUE(q->matches_set(SET(Tag*, {tags[0]})));
+  ASSERT_FALSE(q->matches_set(SET(Tag*, {tags[0], tags[3]})));
+}
+
+TEST_F(QueryBytecodeTest, ScansUseIt) {
+  // enough entities for a scan to compile its clause
+  for(id_type id = 0; id < 300; id++) {
+    auto e = ctx.new_entity(id);
+    for(size_t t = 0; t < tags.size(); t++) {
+      if((id >> t) & 1) e->add_tag(tags[t]);
+    }
+  }
+
+  for(int i = 0; i < 50; i++) {
+    std::unique_ptr<QueryClause> q(random_clause(3));
+
+    std::vector<Entity*> tree, ranged;
+    ctx.query(q.get(), [&](Entity *e) { tree.push_back(e); });
+    ctx.query(q.get(), QueryRange(), [&](Entity *e) { ranged.push_back(e); });
+    ASSERT_EQ(tree, ranged);
+    ASSERT_EQ(tree.size(), ctx.count(q.get()));
+  }
+}
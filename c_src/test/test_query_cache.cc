@@ -0,0 +1,160 @@
+#include "test_helper.h"
+#include "context.h"
+
+class QueryCacheTest : public ::testing::Test {
+public:
+  Context ctx;
+  Entity *e1, *e2;
+  Tag *a, *b, *c;
+
+  void SetUp() {
+    e1 = ctx.new_entity();
+    e2 = ctx.new_entity();
+    a = ctx.new_tag();
+    b = ctx.new_tag();
+    c = ctx.new_tag();
+  }
+
+  std::vector<Entity*> run(const QueryClause *source, const QueryRange& range = QueryRange()) {
+    std::vector<Entity*> ret;
+    ctx.cached_query(source, range, [&](Entity *e) { ret.push_back(e); });
+    return ret;
+  }
+
+  std::string key(const QueryClause *source) {
+    std::string k;
+    EXPECT_TRUE(query_cache_key(source, k));
+    delete source;
+    return k;
+  }
+
+  QueryCacheStats stats() {
+    return ctx.get_query_cache().stats();
+  }
+};
+
+#define LIT(t) (new QueryClauseLit(t))
+
+TEST_F(QueryCacheTest, KeysAreNormalized) {
+  ASSERT_EQ(key(build_and(LIT(a), LIT(b))), key(build_and(LIT(b), LIT(a))));
+  ASSERT_EQ(key(build_and(LIT(a), LIT(b))), key(build_and(LIT(a), build_and(LIT(b), LIT(a)))));
+  ASSERT_EQ(key(LIT(a)), key(build_not(build_not(LIT(a)))));
+  ASSERT_EQ(key(LIT(a)), key(build_or(LIT(a), LIT(a))));
+
+  ASSERT_NE(key(build_and(LIT(a), LIT(b))), key(build_or(LIT(a), LIT(b))));
+  ASSERT_NE(key(build_and(LIT(a), build_or(LIT(b), LIT(c)))), key(build_or(LIT(a), build_and(LIT(b), LIT(c)))));
+}
+
+TEST_F(QueryCacheTest, HitsAndMisses) {
+  e1->add_tag(a);
+  QueryClauseLit q(a);
+
+  ASSERT_EQ(std::vector<Entity*>({e1}), run(&q));
+  ASSERT_EQ(std::vector<Entity*>({e1}), run(&q));
+  ASSERT_EQ(1, stats().misses);
+  ASSERT_EQ(1, stats().hits);
+  ASSERT_EQ(1, stats().entries);
+  ASSERT_EQ(1, ctx.cached_count(&q));
+  ASSERT_EQ(2, stats().hits);
+}
+
+TEST_F(QueryCacheTest, RangesAreServedFromTheCache) {
+  auto e3 = ctx.new_entity();
+  QueryClauseAny q;
+  run(&q);
+
+  QueryRange range;
+  range.limit = 2;
+  range.order = QueryOrderDesc;
+  ASSERT_EQ(std::vector<Entity*>({e3, e2}), run(&q, range));
+
+  range.has_after = true;
+  range.after = e2->id;
+  ASSERT_EQ(std::vector<Entity*>({e1}), run(&q, range));
+  ASSERT_EQ(2, stats().hits);
+}
+
+TEST_F(QueryCacheTest, LimitedMissesDontFill) {
+  QueryClauseAny q;
+  QueryRange range;
+  range.limit = 1;
+
+  ASSERT_EQ(std::vector<Entity*>({e1}), run(&q, range));
+  ASSERT_EQ(0, stats().entries);
+}
+
+TEST_F(QueryCacheTest, TaggingInvalidatesDependentsOnly) {
+  QueryClauseLit qa(a), qb(b);
+  run(&qa);
+  run(&qb);
+  ASSERT_EQ(2, stats().entries);
+
+  e1->add_tag(a);
+  ASSERT_EQ(1, stats().entries);
+  ASSERT_EQ(1, stats().invalidations);
+  ASSERT_EQ(std::vector<Entity*>({e1}), run(&qa));
+
+  e1->remove_tag(a);
+  ASSERT_EQ(std::vector<Entity*>(), run(&qa));
+}
+
+TEST_F(QueryCacheTest, ImplicationsInvalidate) {
+  e1->add_tag(a);
+  QueryClauseLit qb(b), qc(c);
+  run(&qb);
+  run(&qc);
+
+  a->imply(b);
+  ASSERT_EQ(1, stats().entries);
+  ASSERT_EQ(std::vector<Entity*>({e1}), run(&qb));
+
+  // c is implied through b
+  b->imply(c);
+  ASSERT_EQ(std::vector<Entity*>({e1}), run(&qc));
+
+  a->unimply(b);
+  ASSERT_EQ(std::vector<Entity*>(), run(&qc));
+}
+
+TEST_F(QueryCacheTest, NewEntitiesInvalidateNegations) {
+  QueryClauseLit qa(a);
+  QueryClauseNot qn(LIT(a));
+  run(&qa);
+  run(&qn);
+
+  auto e3 = ctx.new_entity();
+  ASSERT_EQ(1, stats().entries);
+  ASSERT_EQ(std::vector<Entity*>({e1, e2, e3}), run(&qn));
+}
+
+TEST_F(QueryCacheTest, DirtyContextBypassesCache) {
+  ctx.mark_dirty();
+  QueryClauseLit qa(a);
+  run(&qa);
+  ASSERT_EQ(0, stats().entries);
+
+  ctx.make_clean();
+  run(&qa);
+  ASSERT_EQ(1, stats().entries);
+}
+
+TEST_F(QueryCacheTest, Bounded) {
+  QueryClauseAny q;
+  QueryClauseLit qa(a);
+  run(&q);
+  run(&qa);
+  ASSERT_EQ(2, stats().entries);
+
+  ctx.get_query_cache().set_max_bytes(stats().bytes - 1);
+  ASSERT_EQ(1, stats().entries);
+  ASSERT_EQ(1, stats().evictions);
+  ASSERT_LE(stats().bytes, stats().max_bytes);
+
+  // the least recently used entry went
+  run(&qa);
+  ASSERT_EQ(1, stats().hits);
+
+  ctx.get_query_cache().set_max_bytes(0);
+  run(&qa);
+  ASSERT_EQ(0, stats().entries);
+}
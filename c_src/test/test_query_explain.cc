@@ -0,0 +1,133 @@
+#include <cstring>
+
+#include "test_helper.h"
+#include "context.h"
+
+class QueryExplainTest : public ::testing::Test {
+public:
+  Context ctx;
+  Tag *a, *b, *c, *rare;
+
+  void SetUp() {
+    a = ctx.new_tag();
+    b = ctx.new_tag();
+    c = ctx.new_tag();
+    rare = ctx.new_tag();
+
+    for(int i = 0; i < 1000; i++) {
+      auto e = ctx.new_entity();
+      if(i % 2) e->add_tag(a);
+      if(i % 3) e->add_tag(b);
+      if(i % 5 == 0) e->add_tag(c);
+      if(i % 100 == 0) e->add_tag(rare);
+    }
+  }
+
+  size_t run(QueryClause *source) {
+    std::unique_ptr<QueryClause> clause(ctx.optimize_query(expand_implications(source)));
+    size_t n = 0;
+    ctx.query(clause.get(), QueryRange(), [&](Entity*) { n++; });
+    return n;
+  }
+};
+
+#define LIT(t) (new QueryClauseLit(t))
+
+TEST_F(QueryExplainTest, UnionsReadPostings) {
+  std::unique_ptr<QueryClause> q(build_or(LIT(a), LIT(c)));
+  auto ex = ctx.explain(q.get(), QueryRange(), true);
+
+  ASSERT_STREQ("postings", ex.engine);
+  ASSERT_STREQ("none", ex.evaluator);
+  ASSERT_EQ(run(q->dup()), ex.rows);
+  ASSERT_EQ(ex.rows, ex.examined);
+  ASSERT_EQ(ex.rows, ex.plan.matched);
+}
+
+TEST_F(QueryExplainTest, ScansCountEachNode) {
+  std::unique_ptr<QueryClause> q(build_and(build_not(LIT(a)), build_not(LIT(b))));
+  auto ex = ctx.explain(q.get(), QueryRange(), true);
+
+  ASSERT_STREQ("scan", ex.engine);
+  ASSERT_STREQ("bytecode", ex.evaluator);
+  ASSERT_EQ(run(q->dup()), ex.rows);
+  ASSERT_EQ(1000, ex.examined);
+
+  // every entity reaches the AND, only those passing its first operand
+  // reach the second
+  auto& plan = ex.plan;
+  ASSERT_EQ("and", plan.op);
+  ASSERT_EQ(2, plan.children.size());
+  ASSERT_EQ(1000, plan.evaluated);
+  ASSERT_EQ(ex.rows, plan.matched);
+  ASSERT_EQ(plan.children[0].matched, plan.children[1].evaluated);
+  ASSERT_EQ(1000 - plan.children[0].matched, plan.short_circuits);
+  ASSERT_EQ(1, plan.children[0].children.size());
+  ASSERT_EQ("not", plan.children[0].op);
+  ASSERT_GT(plan.estimated_rows, 0);
+}
+
+TEST_F(QueryExplainTest, SelectiveAndsUseAnIndex) {
+  std::unique_ptr<QueryClause> q(build_and(LIT(rare), build_not(LIT(a))));
+  auto ex = ctx.explain(q.get(), QueryRange(), true);
+
+  ASSERT_STREQ("index", ex.engine);
+  ASSERT_EQ(std::vector<id_type>({rare->id}), ex.driver);
+  ASSERT_EQ(run(q->dup()), ex.rows);
+  ASSERT_EQ(rare->postings().size(), ex.examined);
+  ASSERT_EQ(ex.examined, ex.plan.evaluated);
+}
+
+TEST_F(QueryExplainTest, Thresholds) {
+  std::unique_ptr<QueryClause> q(build_threshold(2, {LIT(a), LIT(b), LIT(c)}));
+  auto ex = ctx.explain(q.get(), QueryRange(), true);
+
+  ASSERT_STREQ("threshold", ex.engine);
+  ASSERT_EQ(run(q->dup()), ex.rows);
+  ASSERT_EQ("at_least", ex.plan.op);
+  ASSERT_EQ(2, ex.plan.k);
+}
+
+TEST_F(QueryExplainTest, LimitsStopEarly) {
+  std::unique_ptr<QueryClause> q(build_and(build_not(LIT(a)), build_not(LIT(b))));
+  QueryRange range;
+  range.limit = 10;
+  auto ex = ctx.explain(q.get(), range, true);
+
+  ASSERT_EQ(10, ex.rows);
+  ASSERT_LT(ex.examined, 1000);
+  ASSERT_EQ(ex.examined, ex.plan.evaluated);
+}
+
+TEST_F(QueryExplainTest, WithoutAnalyzeNothingRuns) {
+  std::unique_ptr<QueryClause> q(build_and(build_not(LIT(a)), build_not(LIT(b))));
+  auto before = ctx.get_tiering().stats().executions;
+  auto ex = ctx.explain(q.get(), QueryRange(), false);
+
+  ASSERT_FALSE(ex.analyzed);
+  ASSERT_STREQ("scan", ex.engine);
+  ASSERT_STREQ("bytecode", ex.evaluator);
+  ASSERT_EQ(0, ex.rows);
+  ASSERT_EQ(0, ex.plan.evaluated);
+  ASSERT_EQ(before, ctx.get_tiering().stats().executions);
+}
+
+TEST_F(QueryExplainTest, ImpliedTags) {
+  a->imply(c);
+  ctx.make_clean();
+
+  std::unique_ptr<QueryClause> q(build_and(LIT(c), build_not(LIT(b))));
+  auto ex = ctx.explain(q.get(), QueryRange(), true);
+  ASSERT_EQ(run(q->dup()), ex.rows);
+
+  // 'c' is expanded to the tags implying it
+  bool found = false;
+  std::vector<const ExplainNode*> stack(1, &ex.plan);
+  while(stack.size()) {
+    auto node = stack.back();
+    stack.pop_back();
+    if(node->op == "implied" && node->tags == std::vector<id_type>({c->id})) found = true;
+    for(auto& child : node->children) stack.push_back(&child);
+  }
+  ASSERT_TRUE(found);
+}
@@ -0,0 +1,165 @@
+#include <cstdio>
+#include <string>
+#include <memory>
+
+#include "test_helper.h"
+#include "dataset.h"
+#include "query_log.h"
+#include "snapshot.h"
+
+static std::string temp_path(const char *name) {
+  return std::string("/tmp/all_the_tags_test_") + name;
+}
+
+// the ids of the entities matching 'source' in 'ctx'
+static std::vector<id_type> matches(const Context& ctx, const QueryClause *source) {
+  std::vector<id_type> ret;
+  std::unique_ptr<QueryClause> clause(ctx.optimize_query(expand_implications(source)));
+  ctx.query(clause.get(), QueryRange(), [&](Entity *e) { ret.push_back(e->id); });
+  return ret;
+}
+
+TEST(QueryLogTest, VarintRoundTrip) {
+  uint64_t values[] = {0, 1, 127, 128, 300, 1ull << 35, UINT64_MAX};
+  std::string buf;
+  for(auto v : values) put_varint(buf, v);
+
+  const char *p = buf.data(), *end = p + buf.size();
+  for(auto v : values) {
+    uint64_t n;
+    ASSERT_TRUE(get_varint(p, end, n));
+    ASSERT_EQ(v, n);
+  }
+  ASSERT_EQ(end, p);
+
+  uint64_t n;
+  ASSERT_FALSE(get_varint(p, end, n));
+}
+
+TEST(QueryLogTest, ClauseRoundTrip) {
+  Context ctx;
+  auto a = ctx.new_tag(), b = ctx.new_tag(), c = ctx.new_tag();
+  auto e1 = ctx.new_entity(), e2 = ctx.new_entity();
+  e1->add_tag(a);
+  e2->add_tag(b);
+  e2->add_tag(c);
+
+  std::unique_ptr<QueryClause> source(build_or(
+    build_and(new QueryClauseLit(a), build_not(new QueryClauseLit(c))),
+    build_threshold(2, {new QueryClauseLit(a), new QueryClauseLit(b), new QueryClauseLit(c), new QueryClauseAny()})));
+
+  std::string encoded;
+  ASSERT_TRUE(encode_clause(source.get(), encoded));
+
+  const char *p = encoded.data(), *end = p + encoded.size();
+  std::unique_ptr<QueryClause> decoded(decode_clause(ctx, p, end));
+  ASSERT_TRUE(decoded != nullptr);
+  ASSERT_EQ(end, p);
+  ASSERT_EQ(clause_key(source.get()), clause_key(decoded.get()));
+
+  // truncated, or naming a tag that doesn't exist
+  p = encoded.data();
+  ASSERT_EQ(nullptr, decode_clause(ctx, p, encoded.data() + encoded.size() - 1));
+  Context empty;
+  p = encoded.data();
+  ASSERT_EQ(nullptr, decode_clause(empty, p, end));
+
+  // expanded clauses don't mean anything outside the context
+  b->imply(a);
+  std::unique_ptr<QueryClause> expanded(build_lit(a));
+  std::string ignored;
+  ASSERT_FALSE(encode_clause(expanded.get(), ignored));
+}
+
+TEST(QueryLogTest, WriterReaderRoundTrip) {
+  auto path = temp_path("query_log");
+  {
+    QueryLogWriter writer;
+    ASSERT_TRUE(writer.open(path.c_str()));
+    ASSERT_TRUE(writer.is_open());
+
+    QueryLogRecord r;
+    r.start_ns = telemetry_now_ns();
+    r.duration_ns = 1234;
+    r.rows = 5;
+    r.clause = "\x01\x07";
+    writer.write(r);
+
+    r.cache = true;
+    r.range.order = QueryOrderDesc;
+    r.range.limit = 10;
+    r.range.has_after = true;
+    r.range.after = 300;
+    writer.write(r);
+
+    ASSERT_EQ(2, writer.close());
+    ASSERT_FALSE(writer.is_open());
+
+    // dropped once it's closed
+    writer.write(r);
+  }
+
+  QueryLogReader reader;
+  ASSERT_TRUE(reader.open(path.c_str()));
+
+  QueryLogRecord r;
+  ASSERT_TRUE(reader.next(r));
+  ASSERT_EQ(1234, r.duration_ns);
+  ASSERT_EQ(5, r.rows);
+  ASSERT_FALSE(r.cache);
+  ASSERT_EQ(SIZE_MAX, r.range.limit);
+  ASSERT_FALSE(r.range.has_after);
+  ASSERT_EQ("\x01\x07", r.clause);
+
+  ASSERT_TRUE(reader.next(r));
+  ASSERT_TRUE(r.cache);
+  ASSERT_EQ(QueryOrderDesc, r.range.order);
+  ASSERT_EQ(10, r.range.limit);
+  ASSERT_TRUE(r.range.has_after);
+  ASSERT_EQ(300, r.range.after);
+
+  ASSERT_FALSE(reader.next(r));
+  remove(path.c_str());
+}
+
+TEST(QueryLogTest, SnapshotRoundTrip) {
+  DatasetSpec spec;
+  spec.num_entities = 2000;
+  spec.num_tags = 200;
+  spec.hierarchy_depth = 2;
+  spec.fan_out = 4;
+  spec.alias_cycles = 5;
+
+  Context original;
+  auto d = generate_dataset(original, spec);
+  auto path = temp_path("snapshot");
+  ASSERT_TRUE(save_snapshot(original, path.c_str()));
+
+  Context loaded;
+  ASSERT_TRUE(load_snapshot(loaded, path.c_str()));
+  ASSERT_FALSE(loaded.is_dirty());
+  ASSERT_EQ(original.num_tags(), loaded.num_tags());
+  ASSERT_EQ(original.num_entities(), loaded.num_entities());
+
+  for(auto t : original.all_tags()) {
+    auto copy = loaded.tag_by_id(t->id);
+    ASSERT_TRUE(copy != nullptr);
+    ASSERT_EQ(t->implies.size(), copy->implies.size());
+    ASSERT_EQ(t->entity_count(), copy->entity_count());
+  }
+
+  // the queries match the same entities, implications and all
+  for(auto& q : standard_queries(d)) {
+    std::string encoded;
+    ASSERT_TRUE(encode_clause(q.source, encoded));
+    const char *p = encoded.data();
+    std::unique_ptr<QueryClause> copy(decode_clause(loaded, p, p + encoded.size()));
+
+    ASSERT_EQ(matches(original, q.source), matches(loaded, copy.get())) << q.name;
+    delete q.source;
+  }
+
+  // only into an empty context
+  ASSERT_FALSE(load_snapshot(loaded, path.c_str()));
+  remove(path.c_str());
+}
@@ -0,0 +1,133 @@
+#include "test_helper.h"
+#include "context.h"
+
+class QueryRewriteTest : public ::testing::Test {
+public:
+  Context ctx;
+  Entity *e1, *e2, *e3;
+  Tag *a, *b, *c;
+
+  void SetUp() {
+    e1 = ctx.new_entity();
+    e2 = ctx.new_entity();
+    e3 = ctx.new_entity();
+    a = ctx.new_tag();
+    b = ctx.new_tag();
+    c = ctx.new_tag();
+
+    e1->add_tag(a);
+    e2->add_tag(a);
+    e2->add_tag(b);
+    e3->add_tag(c);
+  }
+
+  // key of the normalized 'clause'
+  std::string norm(QueryClause *clause) {
+    auto n = normalize(clause);
+    auto k = clause_key(n);
+    delete n;
+    return k;
+  }
+
+  std::string key(QueryClause *clause) {
+    auto k = clause_key(clause);
+    delete clause;
+    return k;
+  }
+};
+
+#define LIT(t) (new QueryClauseLit(t))
+#define ANY    (new QueryClauseAny())
+#define NONE   (build_not(ANY))
+
+TEST_F(QueryRewriteTest, KeysIgnoreOperandOrder) {
+  ASSERT_EQ(key(build_and(LIT(a), LIT(b))), key(build_and(LIT(b), LIT(a))));
+  ASSERT_EQ(
+    key(build_and(LIT(a), build_and(LIT(b), LIT(c)))),
+    key(build_nary(QueryClauseAnd, {LIT(c), LIT(b), LIT(a)})));
+  ASSERT_NE(key(build_and(LIT(a), LIT(b))), key(build_or(LIT(a), LIT(b))));
+}
+
+TEST_F(QueryRewriteTest, FlattensIntoNary) {
+  auto n = normalize(build_and(LIT(a), build_and(LIT(b), build_and(LIT(c), LIT(a)))));
+  auto nary = dynamic_cast<QueryClauseNary*>(n);
+  ASSERT_TRUE(nary);
+  ASSERT_EQ(QueryClauseAnd, nary->type);
+  ASSERT_EQ(3, nary->children.size());
+  delete n;
+}
+
+TEST_F(QueryRewriteTest, DeMorgan) {
+  ASSERT_EQ(
+    key(build_or(build_not(LIT(a)), build_not(LIT(b)))),
+    norm(build_not(build_and(LIT(a), LIT(b)))));
+  ASSERT_EQ(
+    key(build_and(build_not(LIT(a)), LIT(b))),
+    norm(build_not(build_or(LIT(a), build_not(LIT(b))))));
+  ASSERT_EQ(key(LIT(a)), norm(build_not(build_not(LIT(a)))));
+}
+
+TEST_F(QueryRewriteTest, FoldsConstants) {
+  ASSERT_EQ(key(LIT(a)),  norm(build_and(LIT(a), ANY)));
+  ASSERT_EQ(key(ANY),     norm(build_or(LIT(a), ANY)));
+  ASSERT_EQ(key(NONE),    norm(build_and(LIT(a), NONE)));
+  ASSERT_EQ(key(LIT(a)),  norm(build_or(NONE, LIT(a))));
+  ASSERT_EQ(key(NONE),    norm(build_not(build_or(LIT(a), ANY))));
+}
+
+TEST_F(QueryRewriteTest, DetectsContradictions) {
+  ASSERT_EQ(key(NONE), norm(build_and(LIT(a), build_and(LIT(b), build_not(LIT(a))))));
+  ASSERT_EQ(key(ANY),  norm(build_or(build_not(LIT(a)), LIT(a))));
+
+  // across De Morgan: not (a or b) and b
+  ASSERT_EQ(key(NONE), norm(build_and(build_not(build_or(LIT(a), LIT(b))), LIT(b))));
+}
+
+TEST_F(QueryRewriteTest, DropsRepeatedAndAbsorbedOperands) {
+  ASSERT_EQ(key(LIT(a)), norm(build_or(LIT(a), LIT(a))));
+  ASSERT_EQ(key(LIT(a)), norm(build_and(LIT(a), build_or(LIT(a), LIT(b)))));
+  ASSERT_EQ(key(LIT(a)), norm(build_or(build_and(LIT(b), LIT(a)), LIT(a))));
+
+  // common subexpressions among the operands of one node
+  ASSERT_EQ(
+    key(build_and(LIT(c), build_or(LIT(a), LIT(b)))),
+    norm(build_and(build_or(LIT(a), LIT(b)), build_and(LIT(c), build_or(LIT(b), LIT(a))))));
+}
+
+TEST_F(QueryRewriteTest, ImpliedOperandsAreSubsumed) {
+  // a implies b, so a query for b matches everything tagged a
+  a->imply(b);
+  ctx.make_clean();
+
+  ASSERT_EQ(key(build_lit(a)), norm(build_and(build_lit(b), build_lit(a))));
+  ASSERT_EQ(key(build_lit(b)), norm(build_or(build_lit(a), build_lit(b))));
+
+  // c is unrelated
+  auto n = normalize(build_and(build_lit(b), build_lit(c)));
+  ASSERT_TRUE(dynamic_cast<QueryClauseNary*>(n));
+  ASSERT_EQ(2, ((QueryClauseNary*) n)->children.size());
+  delete n;
+}
+
+TEST_F(QueryRewriteTest, PreservesMatches) {
+  a->imply(b);
+  ctx.make_clean();
+
+  std::vector<QueryClause*> clauses = {
+    build_and(build_lit(b), build_not(build_and(build_lit(a), build_lit(c)))),
+    build_or(build_not(build_lit(b)), build_and(build_lit(a), build_not(build_lit(a)))),
+    build_not(build_or(build_lit(c), build_and(build_lit(b), build_or(build_lit(a), build_lit(b))))),
+    build_and(build_or(build_lit(a), build_lit(c)), build_or(build_lit(c), build_lit(b))),
+  };
+
+  for(auto clause : clauses) {
+    auto expected = query(ctx, *clause);
+    auto n = normalize(clause);
+    ASSERT_EQ(expected, query(ctx, *n));
+
+    // and again with the operands reordered by the optimizer
+    n = optimize(n, ctx.get_stats());
+    ASSERT_EQ(expected, query(ctx, *n));
+    delete n;
+  }
+}
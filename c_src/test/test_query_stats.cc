@@ -0,0 +1,178 @@
+#include "test_helper.h"
+#include "context.h"
+#include "query_stats.h"
+
+class QueryStatsTest : public ::testing::Test {
+public:
+  Context ctx;
+  Tag *a, *b, *c;
+
+  void SetUp() {
+    a = ctx.new_tag();
+    b = ctx.new_tag();
+    c = ctx.new_tag();
+  }
+
+  // tag entities [from, to) with 'tag', creating them as needed
+  void tag_range(Tag *tag, id_type from, id_type to) {
+    for(id_type id = from; id < to; id++) {
+      auto e = ctx.entity_by_id(id);
+      if(!e) e = ctx.new_entity(id);
+      e->add_tag(tag);
+    }
+  }
+
+  const QueryStats& stats() {
+    return ctx.get_stats();
+  }
+
+  // operands of an optimized AND/OR, in evaluation order
+  std::vector<QueryClause*> chain(QueryClause *q) {
+    if(auto nary = dynamic_cast<QueryClauseNary*>(q)) {
+      return nary->children;
+    }
+    return std::vector<QueryClause*>(1, q);
+  }
+};
+
+TEST_F(QueryStatsTest, SketchesAreExactForSmallSets) {
+  tag_range(a, 0, 100);
+  auto sketch = stats().sketch(SET(Tag*, {a}));
+  ASSERT_TRUE(sketch.exact);
+  ASSERT_EQ(100, sketch.cardinality());
+}
+
+TEST_F(QueryStatsTest, SketchesEstimateLargeSets) {
+  tag_range(a, 0, 6000);
+  tag_range(b, 3000, 9000);
+
+  auto sketch = stats().sketch(SET(Tag*, {a, b}));
+  ASSERT_FALSE(sketch.exact);
+  ASSERT_NEAR(9000, sketch.cardinality(), 9000 * 0.3);
+  ASSERT_NEAR(9000, stats().union_count(SET(Tag*, {a, b})), 9000 * 0.3);
+  ASSERT_NEAR(3000, stats().cooccurrence(SET(Tag*, {a}), SET(Tag*, {b})), 3000 * 0.4);
+  ASSERT_EQ(0, stats().cooccurrence(SET(Tag*, {a}), SET(Tag*, {c})));
+}
+
+TEST_F(QueryStatsTest, SketchesFollowUntagging) {
+  tag_range(a, 0, 1000);
+  for(id_type id = 0; id < 900; id++) {
+    ctx.entity_by_id(id)->remove_tag(a);
+  }
+
+  ASSERT_NEAR(100, stats().sketch(SET(Tag*, {a})).cardinality(), 100 * 0.3);
+}
+
+TEST_F(QueryStatsTest, SketchesFollowChurn) {
+  // untag too few to resample, then tag more: the new hashes mustn't go
+  // in above ones the sketch already dropped
+  tag_range(a, 0, 10000);
+  for(id_type id = 0; id < 4000; id++) {
+    ctx.entity_by_id(id)->remove_tag(a);
+  }
+  tag_range(a, 10000, 10010);
+  ASSERT_NEAR(6010, stats().sketch(SET(Tag*, {a})).cardinality(), 6010 * 0.3);
+
+  tag_range(a, 10010, 14000);
+  ASSERT_NEAR(10000, stats().sketch(SET(Tag*, {a})).cardinality(), 10000 * 0.3);
+}
+
+TEST_F(QueryStatsTest, ClosureCounts) {
+  tag_range(a, 0, 10);
+  tag_range(b, 5, 20);
+  a->imply(b);
+
+  ASSERT_EQ(10, stats().meta_node_count(a->meta_node));
+  ASSERT_EQ(15, stats().meta_node_count(b->meta_node));
+  ASSERT_EQ(20, stats().closure_count(b->meta_node));
+
+  auto q = build_lit(b);
+  ASSERT_DOUBLE_EQ(1.0, stats().selectivity(q));
+  delete q;
+
+  // counts are recomputed after tagging
+  tag_range(a, 20, 30);
+  ASSERT_EQ(30, stats().closure_count(b->meta_node));
+
+  // but only the closures the tag is in. larger ones are estimated
+  c->imply(b);
+  ASSERT_EQ(30, stats().closure_count(b->meta_node));
+  ASSERT_EQ(0, stats().closure_count(c->meta_node));
+  tag_range(c, 100, 1100);
+  ASSERT_EQ(20, stats().closure_count(a->meta_node));
+  ASSERT_NEAR(1030, stats().closure_count(b->meta_node), 1030 * 0.3);
+}
+
+TEST_F(QueryStatsTest, SelectivityAndCost) {
+  tag_range(a, 0, 25);
+  tag_range(b, 0, 100);
+
+  QueryClauseLit qa(a);
+  ASSERT_DOUBLE_EQ(0.25, stats().selectivity(&qa));
+
+  auto q = build_and(new QueryClauseLit(a), new QueryClauseLit(b));
+  ASSERT_DOUBLE_EQ(0.25, stats().selectivity(q));
+  // 'b' only runs when 'a' matched
+  ASSERT_DOUBLE_EQ(1.25, stats().cost(q));
+  delete q;
+
+  auto n = build_not(new QueryClauseLit(a));
+  ASSERT_DOUBLE_EQ(0.75, stats().selectivity(n));
+  delete n;
+}
+
+TEST_F(QueryStatsTest, OrdersAndsBySelectivity) {
+  tag_range(a, 0, 90);
+  tag_range(b, 0, 10);
+
+  auto q = optimize(build_and(new QueryClauseLit(a), new QueryClauseLit(b)), stats());
+  auto ops = chain(q);
+  ASSERT_EQ(2, ops.size());
+  ASSERT_EQ(b, dynamic_cast<QueryClauseLit*>(ops[0])->t);
+  delete q;
+
+  q = optimize(build_or(new QueryClauseLit(b), new QueryClauseLit(a)), stats());
+  ops = chain(q);
+  ASSERT_EQ(a, dynamic_cast<QueryClauseLit*>(ops[0])->t);
+  delete q;
+}
+
+TEST_F(QueryStatsTest, OrderingAccountsForCorrelation) {
+  // 'b' always occurs with 'a', so checking it after 'a' is a waste
+  tag_range(a, 0, 50);
+  tag_range(b, 0, 50);
+  tag_range(c, 40, 100);
+
+  auto q = optimize(
+    build_and(new QueryClauseLit(a),
+      build_and(new QueryClauseLit(b), new QueryClauseLit(c))), stats());
+  auto ops = chain(q);
+  ASSERT_EQ(3, ops.size());
+  ASSERT_EQ(a, dynamic_cast<QueryClauseLit*>(ops[0])->t);
+  ASSERT_EQ(c, dynamic_cast<QueryClauseLit*>(ops[1])->t);
+  ASSERT_EQ(b, dynamic_cast<QueryClauseLit*>(ops[2])->t);
+  delete q;
+}
+
+TEST_F(QueryStatsTest, IndexDrivenAndsMatchScans) {
+  tag_range(a, 0, 1000);
+  tag_range(b, 500, 510);
+  tag_range(c, 505, 1000);
+
+  auto q = build_and(build_lit(a), build_and(build_lit(b), build_not(build_lit(c))));
+
+  std::vector<Entity*> scanned, ranged;
+  ctx.query(q, [&](Entity *e) { scanned.push_back(e); });
+  ctx.query(q, QueryRange(), [&](Entity *e) { ranged.push_back(e); });
+  ASSERT_EQ(5, ranged.size());
+  ASSERT_EQ(scanned, ranged);
+
+  QueryRange range;
+  range.order = QueryOrderDesc;
+  range.limit = 2;
+  ranged.clear();
+  ctx.query(q, range, [&](Entity *e) { ranged.push_back(e); });
+  ASSERT_EQ(std::vector<Entity*>({scanned[4], scanned[3]}), ranged);
+
+  delete q;
+}
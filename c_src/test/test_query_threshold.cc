@@ -0,0 +1,159 @@
+#include "test_helper.h"
+#include "context.h"
+#include "query_stats.h"
+
+class QueryThresholdTest : public ::testing::Test {
+public:
+  Context ctx;
+  std::vector<Tag*> tags;
+
+  void SetUp() {
+    for(int i = 0; i < 5; i++) {
+      tags.push_back(ctx.new_tag());
+    }
+
+    // entity i carries tag t when bit t of i is set
+    for(id_type id = 0; id < 32; id++) {
+      auto e = ctx.new_entity(id);
+      for(size_t t = 0; t < tags.size(); t++) {
+        if(id & (1 << t)) e->add_tag(tags[t]);
+      }
+    }
+  }
+
+  QueryClauseThreshold *at_least(size_t k, std::vector<QueryClause*> children) {
+    return build_threshold(k, children);
+  }
+
+  std::vector<id_type> run(const QueryClause *q, const QueryRange& range = QueryRange()) {
+    std::vector<id_type> ret;
+    ctx.query(q, range, [&](Entity *e) { ret.push_back(e->id); });
+    return ret;
+  }
+
+  std::vector<id_type> scan(const QueryClause *q) {
+    std::vector<id_type> ret;
+    ctx.query(q, [&](Entity *e) { ret.push_back(e->id); });
+    return ret;
+  }
+};
+
+#define LIT(t) (new QueryClauseLit(t))
+
+static int bits(id_type id) {
+  int ret = 0;
+  for(; id; id >>= 1) ret += id & 1;
+  return ret;
+}
+
+TEST_F(QueryThresholdTest, MatchesSet) {
+  std::unique_ptr<QueryClause> q(at_least(2, {LIT(tags[0]), LIT(tags[1]), LIT(tags[2])}));
+
+  ASSERT_FALSE(q->matches_set(SET(Tag*, {})));
+  ASSERT_FALSE(q->matches_set(SET(Tag*, {tags[0], tags[3]})));
+  ASSERT_TRUE(q->matches_set(SET(Tag*, {tags[0], tags[2]})));
+  ASSERT_TRUE(q->matches_set(SET(Tag*, {tags[0], tags[1], tags[2]})));
+
+  std::unique_ptr<QueryClause> none(at_least(4, {LIT(tags[0]), LIT(tags[1]), LIT(tags[2])}));
+  ASSERT_FALSE(none->matches_set(SET(Tag*, {tags[0], tags[1], tags[2]})));
+}
+
+TEST_F(QueryThresholdTest, MergedPostingsMatchScan) {
+  for(size_t k = 1; k <= 5; k++) {
+    std::vector<QueryClause*> children;
+    for(auto tag : tags) children.push_back(build_lit(tag));
+    std::unique_ptr<QueryClause> q(at_least(k, children));
+
+    auto merged = run(q.get());
+    ASSERT_EQ(scan(q.get()), merged);
+    ASSERT_EQ(merged.size(), ctx.count(q.get()));
+    for(auto id : merged) {
+      ASSERT_GE(bits(id), k);
+    }
+  }
+}
+
+TEST_F(QueryThresholdTest, OperandsAreCountedOnce) {
+  // an entity carrying both tags of the first operand still only counts
+  // it once
+  std::unique_ptr<QueryClause> q(at_least(2, {
+    build_nary(QueryClauseOr, {LIT(tags[0]), LIT(tags[1])}),
+    LIT(tags[2])
+  }));
+
+  auto merged = run(q.get());
+  ASSERT_EQ(scan(q.get()), merged);
+  ASSERT_EQ(std::vector<id_type>({5, 6, 7, 13, 14, 15, 21, 22, 23, 29, 30, 31}), merged);
+}
+
+TEST_F(QueryThresholdTest, Ranges) {
+  std::unique_ptr<QueryClause> q(at_least(3, {LIT(tags[0]), LIT(tags[1]), LIT(tags[2]), LIT(tags[3])}));
+
+  QueryRange range;
+  range.limit = 2;
+  range.order = QueryOrderDesc;
+  range.has_after = true;
+  range.after = 15;
+  ASSERT_EQ(std::vector<id_type>({14, 13}), run(q.get(), range));
+
+  range.order = QueryOrderAsc;
+  ASSERT_EQ(std::vector<id_type>({23, 27}), run(q.get(), range));
+}
+
+TEST_F(QueryThresholdTest, Normalizes) {
+  auto key = [](QueryClause *c) {
+    auto k = clause_key(c);
+    delete c;
+    return k;
+  };
+  auto norm = [&](QueryClause *c) {
+    return key(normalize(c));
+  };
+  auto a = tags[0], b = tags[1], c = tags[2];
+
+  ASSERT_EQ(key(build_or(LIT(a), LIT(b))), norm(at_least(1, {LIT(a), LIT(b)})));
+  ASSERT_EQ(key(build_and(LIT(a), LIT(b))), norm(at_least(2, {LIT(a), LIT(b)})));
+  ASSERT_EQ(key(new QueryClauseAny()), norm(at_least(0, {LIT(a)})));
+  ASSERT_EQ(key(build_not(new QueryClauseAny())), norm(at_least(3, {LIT(a), LIT(b)})));
+
+  // constants count for or against, then drop out
+  ASSERT_EQ(
+    key(build_or(LIT(a), LIT(b))),
+    norm(at_least(2, {LIT(a), new QueryClauseAny(), LIT(b), build_not(new QueryClauseAny())})));
+
+  // negations go through the AND/OR it became
+  ASSERT_EQ(
+    key(build_and(build_not(LIT(a)), build_not(LIT(b)))),
+    norm(build_not(at_least(1, {LIT(a), LIT(b)}))));
+
+  // repeated operands count twice
+  ASSERT_NE(
+    key(at_least(2, {LIT(a), LIT(a), LIT(b)})),
+    key(at_least(2, {LIT(a), LIT(b), LIT(c)})));
+}
+
+TEST_F(QueryThresholdTest, Selectivity) {
+  auto& stats = ctx.get_stats();
+
+  // each tag is on half the entities, independently
+  std::unique_ptr<QueryClause> q(at_least(2, {LIT(tags[0]), LIT(tags[1]), LIT(tags[2])}));
+  ASSERT_DOUBLE_EQ(0.5, stats.selectivity(q.get()));
+
+  std::unique_ptr<QueryClause> all(at_least(3, {LIT(tags[0]), LIT(tags[1]), LIT(tags[2])}));
+  ASSERT_DOUBLE_EQ(0.125, stats.selectivity(all.get()));
+}
+
+TEST_F(QueryThresholdTest, OptimizedStillMatches) {
+  auto q = at_least(2, {
+    build_lit(tags[0]),
+    build_and(build_lit(tags[1]), build_not(build_lit(tags[2]))),
+    build_lit(tags[3]),
+    build_lit(tags[4])
+  });
+  auto expected = scan(q);
+
+  auto optimized = ctx.optimize_query(q);
+  ASSERT_EQ(expected, scan(optimized));
+  ASSERT_EQ(expected, run(optimized));
+  delete optimized;
+}
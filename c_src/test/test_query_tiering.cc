@@ -0,0 +1,160 @@
+#include "test_helper.h"
+#include "context.h"
+#include "query_tiering.h"
+#include "query_bytecode.h"
+
+class QueryTieringTest : public ::testing::Test {
+public:
+  Context ctx;
+  Tag *a, *b, *c;
+
+  void SetUp() {
+    a = ctx.new_tag();
+    b = ctx.new_tag();
+    c = ctx.new_tag();
+  }
+
+  // compiles to bytecode, so the tests don't depend on the JIT
+  static QueryClause *compile(const QueryClause *clause) {
+    return compile_bytecode(clause);
+  }
+
+  // run 'clause' through 'tiering' n times, returning the last result
+  std::shared_ptr<const QueryClause> run(QueryTiering& tiering, const QueryClause *clause, size_t n) {
+    std::shared_ptr<const QueryClause> ret;
+    for(size_t i = 0; i < n; i++) {
+      ret = tiering.executed(clause);
+    }
+    return ret;
+  }
+};
+
+#define LIT(t) (new QueryClauseLit(t))
+
+TEST_F(QueryTieringTest, HotShapesGetCompiled) {
+  QueryTiering tiering(compile);
+  tiering.configure(4, 8);
+  std::unique_ptr<QueryClause> q(build_and(LIT(a), build_not(LIT(b))));
+
+  ASSERT_FALSE(run(tiering, q.get(), 3));
+  tiering.wait_idle();
+  ASSERT_EQ(0, tiering.stats().compiles);
+
+  // the 4th run queues it, later ones pick it up once it's done
+  ASSERT_FALSE(run(tiering, q.get(), 1));
+  tiering.wait_idle();
+  auto compiled = run(tiering, q.get(), 1);
+  ASSERT_TRUE(dynamic_cast<const QueryClauseBytecode*>(compiled.get()));
+  ASSERT_TRUE(compiled->matches_set(SET(Tag*, {a})));
+  ASSERT_FALSE(compiled->matches_set(SET(Tag*, {a, b})));
+
+  auto stats = tiering.stats();
+  ASSERT_EQ(1, stats.compiles);
+  ASSERT_EQ(1, stats.compiled);
+  ASSERT_EQ(5, stats.executions);
+}
+
+TEST_F(QueryTieringTest, ShapesIgnoreOperandOrder) {
+  QueryTiering tiering(compile);
+  tiering.configure(2, 8);
+  std::unique_ptr<QueryClause> q1(build_or(LIT(a), LIT(b)));
+  std::unique_ptr<QueryClause> q2(build_or(LIT(b), LIT(a)));
+
+  tiering.executed(q1.get());
+  tiering.executed(q2.get());
+  tiering.wait_idle();
+  ASSERT_TRUE(tiering.executed(q1.get()));
+  ASSERT_EQ(1, tiering.stats().shapes);
+}
+
+TEST_F(QueryTieringTest, LeastRecentlyUsedAreEvicted) {
+  QueryTiering tiering(compile);
+  tiering.configure(1, 2);
+  std::unique_ptr<QueryClause> qa(LIT(a)), qb(LIT(b)), qc(LIT(c));
+
+  for(auto q : {qa.get(), qb.get()}) {
+    tiering.executed(q);
+    tiering.wait_idle();
+  }
+  ASSERT_EQ(2, tiering.stats().compiled);
+
+  // 'a' was used more recently than 'b'
+  ASSERT_TRUE(tiering.executed(qa.get()));
+  tiering.executed(qc.get());
+  tiering.wait_idle();
+
+  ASSERT_EQ(1, tiering.stats().evictions);
+  ASSERT_TRUE(tiering.executed(qa.get()));
+  ASSERT_TRUE(tiering.executed(qc.get()));
+  ASSERT_FALSE(tiering.executed(qb.get()));
+
+  // shrinking evicts straight away
+  tiering.configure(1, 0);
+  ASSERT_EQ(0, tiering.stats().compiled);
+}
+
+TEST_F(QueryTieringTest, FailedCompilesArentRetried) {
+  size_t attempts = 0;
+  QueryTiering tiering([&](const QueryClause*) -> QueryClause* {
+    attempts++;
+    return nullptr;
+  });
+  tiering.configure(1, 8);
+  std::unique_ptr<QueryClause> q(LIT(a));
+
+  for(int i = 0; i < 5; i++) {
+    ASSERT_FALSE(tiering.executed(q.get()));
+    tiering.wait_idle();
+  }
+  ASSERT_EQ(1, attempts);
+  ASSERT_EQ(1, tiering.stats().compile_failures);
+}
+
+TEST_F(QueryTieringTest, InvalidateDropsCompiledCode) {
+  QueryTiering tiering(compile);
+  tiering.configure(1, 8);
+  std::unique_ptr<QueryClause> q(LIT(a));
+
+  tiering.executed(q.get());
+  tiering.wait_idle();
+  auto held = tiering.executed(q.get());
+  ASSERT_TRUE(held);
+
+  tiering.invalidate();
+  ASSERT_EQ(0, tiering.stats().compiled);
+  ASSERT_EQ(1, tiering.stats().invalidations);
+  ASSERT_FALSE(tiering.executed(q.get()));
+
+  // readers still running it keep it alive
+  ASSERT_TRUE(held->matches_set(SET(Tag*, {a})));
+}
+
+TEST_F(QueryTieringTest, ContextScansCountTowardsHotness) {
+  for(int i = 0; i < 300; i++) {
+    auto e = ctx.new_entity();
+    if(i % 3) e->add_tag(a);
+    if(i % 5) e->add_tag(b);
+  }
+  ctx.get_tiering().configure(3, 8);
+
+  auto q = ctx.optimize_query(build_and(build_lit(a), build_not(build_lit(b))));
+  std::vector<Entity*> expected;
+  ctx.query(q, [&](Entity *e) { expected.push_back(e); });
+
+  for(int i = 0; i < 5; i++) {
+    std::vector<Entity*> got;
+    ctx.query(q, QueryRange(), [&](Entity *e) { got.push_back(e); });
+    ASSERT_EQ(expected, got);
+    ctx.get_tiering().wait_idle();
+  }
+
+  // compiled, or found it can't be where there's no JIT
+  auto stats = ctx.get_tiering().stats();
+  ASSERT_EQ(1, stats.compiles + stats.compile_failures);
+
+  // a new metagraph means new metanodes
+  a->imply(c);
+  ctx.make_clean();
+  ASSERT_EQ(0, ctx.get_tiering().stats().shapes);
+  delete q;
+}
@@ -0,0 +1,131 @@
+#include "test_helper.h"
+
+class StandingQueryTest : public ::testing::Test {
+public:
+  Context ctx;
+  Entity *e1, *e2;
+  Tag *a, *b, *c;
+
+  std::unordered_set<Entity*> added, removed;
+  int notifications;
+
+  void SetUp() {
+    e1 = ctx.new_entity();
+    e2 = ctx.new_entity();
+    a = ctx.new_tag();
+    b = ctx.new_tag();
+    c = ctx.new_tag();
+    notifications = 0;
+  }
+
+  StandingQuery *watch(QueryClause *source) {
+    return ctx.add_standing_query(source, [&](const std::vector<Entity*>& add, const std::vector<Entity*>& rem) {
+      notifications++;
+      added.insert(add.begin(), add.end());
+      removed.insert(rem.begin(), rem.end());
+      return true;
+    });
+  }
+
+  void reset() {
+    added.clear();
+    removed.clear();
+    notifications = 0;
+  }
+};
+
+TEST_F(StandingQueryTest, InitialMatches) {
+  e1->add_tag(a);
+  auto sq = watch(new QueryClauseLit(a));
+  ASSERT_TRUE(sq);
+  ASSERT_EQ(SET(Entity*, {e1}), added);
+  ASSERT_EQ(SET(Entity*, {e1}), sq->matches);
+}
+
+TEST_F(StandingQueryTest, TaggingEntities) {
+  auto sq = watch(build_and(new QueryClauseLit(a), build_not(new QueryClauseLit(b))));
+  ASSERT_EQ(0, notifications);
+
+  e1->add_tag(a);
+  ASSERT_EQ(SET(Entity*, {e1}), added);
+  ASSERT_EQ(1, notifications);
+  reset();
+
+  // unrelated tags don't trigger anything
+  e1->add_tag(c);
+  e2->add_tag(c);
+  ASSERT_EQ(0, notifications);
+
+  e1->add_tag(b);
+  ASSERT_EQ(SET(Entity*, {e1}), removed);
+  reset();
+
+  e1->remove_tag(b);
+  ASSERT_EQ(SET(Entity*, {e1}), added);
+  ASSERT_EQ(SET(Entity*, {e1}), sq->matches);
+}
+
+TEST_F(StandingQueryTest, NewEntities) {
+  auto sq = watch(build_not(new QueryClauseLit(a)));
+  ASSERT_EQ(SET(Entity*, {e1, e2}), added);
+  reset();
+
+  auto e3 = ctx.new_entity();
+  ASSERT_EQ(SET(Entity*, {e3}), added);
+  ASSERT_EQ(3, sq->matches.size());
+}
+
+TEST_F(StandingQueryTest, Implications) {
+  e1->add_tag(a);
+  e2->add_tag(b);
+  auto sq = watch(new QueryClauseLit(c));
+  ASSERT_EQ(0, notifications);
+
+  // a -> b -> c
+  a->imply(b);
+  ASSERT_EQ(0, notifications);
+  b->imply(c);
+  ASSERT_EQ(SET(Entity*, {e1, e2}), added);
+  ASSERT_EQ(1, notifications);
+  reset();
+
+  a->unimply(b);
+  ASSERT_EQ(SET(Entity*, {e1}), removed);
+  ASSERT_EQ(SET(Entity*, {e2}), sq->matches);
+  reset();
+
+  // tagging goes through the re-expanded query
+  e1->add_tag(b);
+  ASSERT_EQ(SET(Entity*, {e1}), added);
+}
+
+TEST_F(StandingQueryTest, WaitsForCleanMetagraph) {
+  e1->add_tag(a);
+  a->imply(b);
+  b->imply(a);
+  auto sq = watch(new QueryClauseLit(b));
+  ASSERT_EQ(SET(Entity*, {e1}), added);
+  reset();
+
+  // breaks the {a, b} cycle, which dirties the context
+  b->unimply(a);
+  a->unimply(b);
+  ASSERT_TRUE(ctx.is_dirty());
+  ASSERT_EQ(0, notifications);
+
+  ctx.make_clean();
+  ASSERT_EQ(SET(Entity*, {e1}), removed);
+  ASSERT_EQ(SET(Entity*, {}), sq->matches);
+}
+
+TEST_F(StandingQueryTest, ListenerCanUnregister) {
+  int calls = 0;
+  ctx.add_standing_query(new QueryClauseLit(a), [&](const std::vector<Entity*>&, const std::vector<Entity*>&) {
+    calls++;
+    return false;
+  });
+
+  e1->add_tag(a);
+  e2->add_tag(a);
+  ASSERT_EQ(1, calls);
+}
@@ -419,3 +419,69 @@ TEST_F(TagImplicationTest, TwoNodesRemoval_AutoClean) {
   ASSERT_EQ(a->meta_node, b->meta_node);
   ASSERT_EQ(c->meta_node, d->meta_node);
 }
+
+TEST_F(TagImplicationTest, OutOfLineRebuild) {
+  auto ent = ctx.new_entity();
+  ent->add_tag(a);
+
+  a->imply(b);
+  b->imply(c);
+  c->imply(a);
+  ASSERT_EQ(1, ctx.meta_nodes.size());
+
+  ASSERT_TRUE(c->unimply(a));
+  ASSERT_TRUE(ctx.is_dirty());
+
+  MetaGraphBuild build;
+  ctx.snapshot_implications(build);
+  build_metagraph(build);
+
+  // still querying the old metagraph, where c implies a
+  auto q = build_lit(c);
+  ASSERT_EQ(SET(Entity*, {ent}), query(ctx, *q));
+  delete q;
+
+  ASSERT_TRUE(ctx.install_metagraph(build));
+  ASSERT_FALSE(ctx.is_dirty());
+
+  // a -> b -> c
+  ASSERT_EQ(3, ctx.meta_nodes.size());
+  ASSERT_EQ(ctx.sink_meta_nodes, SET(SCCMetaNode*, {c->meta_node}));
+  ASSERT_EQ(a->meta_node->children, SET(SCCMetaNode*, {b->meta_node}));
+  ASSERT_EQ(b->meta_node->children, SET(SCCMetaNode*, {c->meta_node}));
+
+  q = build_lit(c);
+  ASSERT_EQ(SET(Entity*, {ent}), query(ctx, *q));
+  delete q;
+  q = build_lit(a);
+  ASSERT_EQ(SET(Entity*, {ent}), query(ctx, *q));
+  delete q;
+
+  ent->remove_tag(a);
+  ent->add_tag(c);
+  q = build_lit(a);
+  ASSERT_EQ(SET(Entity*, {}), query(ctx, *q));
+  delete q;
+}
+
+TEST_F(TagImplicationTest, StaleRebuildIsRejected) {
+  a->imply(b);
+  b->imply(a);
+  ASSERT_TRUE(b->unimply(a));
+  ASSERT_TRUE(ctx.is_dirty());
+
+  MetaGraphBuild build;
+  ctx.snapshot_implications(build);
+  build_metagraph(build);
+
+  // implications change while the build was running
+  ASSERT_TRUE(b->imply(c));
+
+  ASSERT_FALSE(ctx.install_metagraph(build));
+  ASSERT_TRUE(ctx.is_dirty());
+
+  ctx.make_clean();
+  ASSERT_FALSE(ctx.is_dirty());
+  ASSERT_EQ(3, ctx.meta_nodes.size());
+  ASSERT_EQ(ctx.sink_meta_nodes, SET(SCCMetaNode*, {c->meta_node}));
+}
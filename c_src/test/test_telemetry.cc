@@ -0,0 +1,122 @@
+#include <thread>
+#include <random>
+
+#include "test_helper.h"
+#include "context.h"
+#include "telemetry.h"
+#include "query_bytecode.h"
+
+TEST(TelemetryTest, CountersSumAcrossThreads) {
+  Counter counter;
+  std::vector<std::thread> threads;
+  for(int t = 0; t < 8; t++) {
+    threads.push_back(std::thread([&]() {
+      for(int i = 0; i < 10000; i++) counter.add();
+    }));
+  }
+  for(auto& thread : threads) thread.join();
+
+  ASSERT_EQ(80000, counter.value());
+}
+
+TEST(TelemetryTest, HistogramsSumAcrossThreads) {
+  LatencyHistogram histogram;
+  std::vector<std::thread> threads;
+  for(int t = 0; t < 8; t++) {
+    threads.push_back(std::thread([&]() {
+      for(uint64_t ns = 1; ns <= 1000; ns++) histogram.record(ns);
+    }));
+  }
+  for(auto& thread : threads) thread.join();
+
+  auto s = histogram.summary();
+  ASSERT_EQ(8000, s.count);
+  ASSERT_EQ(8 * 500500, s.total_ns);
+  ASSERT_EQ(1000, s.max_ns);
+  ASSERT_NEAR(500, s.p50_ns, 500 / 16 + 1);
+}
+
+TEST(TelemetryTest, SmallLatenciesAreExact) {
+  LatencyHistogram histogram;
+  for(uint64_t ns = 1; ns <= 10; ns++) histogram.record(ns);
+
+  auto s = histogram.summary();
+  ASSERT_EQ(10, s.count);
+  ASSERT_EQ(55, s.total_ns);
+  ASSERT_EQ(10, s.max_ns);
+  ASSERT_EQ(5, s.p50_ns);
+  ASSERT_EQ(9, s.p90_ns);
+  ASSERT_EQ(10, s.p99_ns);
+}
+
+TEST(TelemetryTest, PercentilesAreWithinABucket) {
+  LatencyHistogram histogram;
+  std::mt19937 rng(1);
+  std::vector<uint64_t> values;
+  for(int i = 0; i < 100000; i++) {
+    // spread over several orders of magnitude
+    uint64_t ns = 1 + (rng() % 1000) * (1 + rng() % 10000);
+    values.push_back(ns);
+    histogram.record(ns);
+  }
+  std::sort(values.begin(), values.end());
+
+  auto s = histogram.summary();
+  ASSERT_EQ(values.size(), s.count);
+  ASSERT_EQ(values.back(), s.max_ns);
+
+  std::pair<double, uint64_t> checks[] = {
+    {0.5, s.p50_ns}, {0.9, s.p90_ns}, {0.99, s.p99_ns}
+  };
+  for(auto& check : checks) {
+    double expected = values[(size_t) (check.first * values.size()) - 1];
+    ASSERT_NEAR(expected, check.second, expected / 16 + 1);
+  }
+}
+
+TEST(TelemetryTest, HugeLatenciesLandInTheLastBucket) {
+  LatencyHistogram histogram;
+  histogram.record(UINT64_MAX / 2);
+
+  auto s = histogram.summary();
+  ASSERT_EQ(1, s.count);
+  ASSERT_GT(s.p50_ns, 1ull << 40);
+}
+
+TEST(TelemetryTest, ContextsCountRebuildsAndCollapses) {
+  Context ctx;
+  auto a = ctx.new_tag(), b = ctx.new_tag(), c = ctx.new_tag();
+  auto& telemetry = ctx.get_telemetry();
+
+  a->imply(b);
+  ASSERT_EQ(0, telemetry.collapses.value());
+  b->imply(a);
+  ASSERT_EQ(1, telemetry.collapses.value());
+
+  // breaking the cycle needs a rebuild
+  b->unimply(a);
+  ASSERT_TRUE(ctx.is_dirty());
+  ctx.make_clean();
+  ctx.make_clean();
+  ASSERT_EQ(1, telemetry.make_clean.summary().count);
+
+  // incremental updates don't collapse anything once dirty
+  ctx.mark_dirty();
+  c->imply(a);
+  a->imply(c);
+  ASSERT_EQ(1, telemetry.collapses.value());
+}
+
+TEST(TelemetryTest, TieringTimesCompiles) {
+  Context ctx;
+  auto a = ctx.new_tag();
+  QueryTiering tiering([](const QueryClause *clause) -> QueryClause* {
+    return compile_bytecode(clause);
+  });
+  tiering.configure(1, 8);
+
+  std::unique_ptr<QueryClause> q(new QueryClauseLit(a));
+  tiering.executed(q.get());
+  tiering.wait_idle();
+  ASSERT_EQ(1, tiering.compile_latency.summary().count);
+}
@@ -0,0 +1,131 @@
+#include <atomic>
+#include <chrono>
+
+#include "test_helper.h"
+#include "worker_pool.h"
+
+// blocks a pool thread until released
+struct Gate {
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool open;
+
+  Gate() : open(false) {}
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&]() { return open; });
+  }
+
+  void release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    open = true;
+    cond.notify_all();
+  }
+};
+
+static void wait_until(std::function<bool()> pred) {
+  while(!pred()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+TEST(WorkerPoolTest, RunsAllJobs) {
+  std::atomic<int> ran(0);
+  {
+    WorkerPool pool(4, 1000);
+    for(int i = 0; i < 500; i++) {
+      auto lane = i % 2 ? WorkerLaneBatch : WorkerLaneInteractive;
+      ASSERT_TRUE(pool.submit(lane, [&]() { ran++; }));
+    }
+  }
+  // destructor drains the queues
+  ASSERT_EQ(500, ran);
+}
+
+TEST(WorkerPoolTest, RejectsPastQueueDepth) {
+  Gate gate;
+  std::atomic<int> ran(0);
+  WorkerPool pool(1, 2);
+
+  std::atomic<bool> started(false);
+  ASSERT_TRUE(pool.submit(WorkerLaneInteractive, [&]() { started = true; gate.wait(); }));
+  wait_until([&]() { return started.load(); });
+
+  ASSERT_TRUE(pool.submit(WorkerLaneInteractive, [&]() { ran++; }));
+  ASSERT_TRUE(pool.submit(WorkerLaneInteractive, [&]() { ran++; }));
+  ASSERT_FALSE(pool.submit(WorkerLaneInteractive, [&]() { ran++; }));
+
+  // lanes have separate limits
+  ASSERT_TRUE(pool.submit(WorkerLaneBatch, [&]() { ran++; }));
+  ASSERT_EQ(2, pool.queued(WorkerLaneInteractive));
+  ASSERT_EQ(1, pool.queued(WorkerLaneBatch));
+
+  gate.release();
+  wait_until([&]() { return ran == 3; });
+}
+
+TEST(WorkerPoolTest, InteractiveBeforeBatch) {
+  Gate gate;
+  std::mutex order_mutex;
+  std::vector<int> order;
+  WorkerPool pool(1, 10);
+
+  std::atomic<bool> started(false);
+  pool.submit(WorkerLaneInteractive, [&]() { started = true; gate.wait(); });
+  wait_until([&]() { return started.load(); });
+
+  auto record = [&](int i) {
+    return [&, i]() {
+      std::lock_guard<std::mutex> lock(order_mutex);
+      order.push_back(i);
+    };
+  };
+  pool.submit(WorkerLaneBatch,       record(1));
+  pool.submit(WorkerLaneBatch,       record(2));
+  pool.submit(WorkerLaneInteractive, record(3));
+
+  gate.release();
+  wait_until([&]() {
+    std::lock_guard<std::mutex> lock(order_mutex);
+    return order.size() == 3;
+  });
+
+  ASSERT_EQ(std::vector<int>({3, 1, 2}), order);
+}
+
+TEST(WorkerPoolTest, BatchLeavesAThreadFree) {
+  Gate gate;
+  std::atomic<int> batch_started(0);
+  std::atomic<bool> interactive_ran(false);
+  WorkerPool pool(2, 10);
+
+  // two long batch jobs, only one gets to run
+  for(int i = 0; i < 2; i++) {
+    pool.submit(WorkerLaneBatch, [&]() { batch_started++; gate.wait(); });
+  }
+  wait_until([&]() { return batch_started == 1; });
+
+  pool.submit(WorkerLaneInteractive, [&]() { interactive_ran = true; });
+  wait_until([&]() { return interactive_ran.load(); });
+  ASSERT_EQ(1, batch_started);
+
+  gate.release();
+  wait_until([&]() { return batch_started == 2; });
+}
+
+TEST(WorkerPoolTest, SingleThreadStillRunsInteractive) {
+  Gate gate;
+  std::atomic<bool> batch_started(false);
+  std::atomic<bool> interactive_ran(false);
+  WorkerPool pool(1, 10);
+
+  pool.submit(WorkerLaneBatch, [&]() { batch_started = true; gate.wait(); });
+  wait_until([&]() { return batch_started.load(); });
+
+  pool.submit(WorkerLaneInteractive, [&]() { interactive_ran = true; });
+  wait_until([&]() { return interactive_ran.load(); });
+  ASSERT_EQ(1, pool.num_threads());
+
+  gate.release();
+}
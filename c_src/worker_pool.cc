@@ -0,0 +1,100 @@
+#include <cassert>
+
+#include "worker_pool.h"
+
+WorkerPool::WorkerPool(size_t num_threads, size_t max_queued) :
+  num_threads_(num_threads),
+  max_queued_(max_queued),
+  batch_running(0),
+  // leave a thread free for interactive jobs (see submit)
+  max_batch_running(num_threads > 1 ? num_threads - 1 : 1),
+  stopping(false)
+{
+  assert(num_threads > 0);
+
+  threads.reserve(num_threads);
+  for(size_t i = 0; i < num_threads; i++) {
+    threads.push_back(std::thread(&WorkerPool::run, this));
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    cond.notify_all();
+  }
+
+  for(auto& thread : threads) {
+    thread.join();
+  }
+}
+
+bool WorkerPool::submit(WorkerLane lane, Job job) {
+  assert(lane < WorkerLaneCount);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if(stopping || queues[lane].size() >= max_queued_) {
+    return false;
+  }
+
+  // a single thread would be taken up by the batch job, so one more
+  // comes in that batch jobs can never all have
+  if(lane == WorkerLaneBatch && threads.size() <= max_batch_running) {
+    threads.push_back(std::thread(&WorkerPool::run, this));
+  }
+
+  queues[lane].push_back(std::move(job));
+  cond.notify_one();
+  return true;
+}
+
+size_t WorkerPool::queued(WorkerLane lane) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return queues[lane].size();
+}
+
+void WorkerPool::run() {
+  while(true) {
+    Job job;
+    WorkerLane lane;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      auto interactive = &queues[WorkerLaneInteractive];
+      auto batch       = &queues[WorkerLaneBatch];
+
+      cond.wait(lock, [&]() {
+        return
+          !interactive->empty() ||
+          (!batch->empty() && batch_running < max_batch_running) ||
+          (stopping && batch->empty());
+      });
+
+      if(!interactive->empty()) {
+        lane = WorkerLaneInteractive;
+        job = std::move(interactive->front());
+        interactive->pop_front();
+      }
+      else if(!batch->empty()) {
+        lane = WorkerLaneBatch;
+        job = std::move(batch->front());
+        batch->pop_front();
+        batch_running++;
+      }
+      else {
+        // stopping, and nothing left to run
+        return;
+      }
+    }
+
+    job();
+
+    if(lane == WorkerLaneBatch) {
+      std::lock_guard<std::mutex> lock(mutex);
+      batch_running--;
+      cond.notify_all();
+    }
+  }
+}
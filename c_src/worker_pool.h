@@ -0,0 +1,63 @@
+#ifndef __WORKER_POOL_H__
+#define __WORKER_POOL_H__
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// priority lanes for jobs. interactive jobs are always picked before batch
+// ones, and batch jobs never get every thread to themselves
+enum WorkerLane {
+  WorkerLaneInteractive,
+  WorkerLaneBatch,
+  WorkerLaneCount
+};
+
+// fixed size pool of threads running jobs off a bounded queue per lane.
+// a pool of one thread couldn't run a batch job and stay free for
+// interactive ones, so the first batch job submitted to it starts a second
+// thread
+struct WorkerPool {
+  typedef std::function<void()> Job;
+
+  WorkerPool(size_t num_threads, size_t max_queued);
+
+  // runs whatever is still queued, then joins the threads
+  ~WorkerPool();
+
+  // queue 'job' on 'lane'. returns false (and drops the job) if the lane
+  // already has max_queued jobs waiting
+  bool submit(WorkerLane lane, Job job);
+
+  // as asked for, not counting a thread started for batch jobs
+  size_t num_threads() const { return num_threads_; }
+  size_t max_queued()  const { return max_queued_; }
+
+  // jobs waiting on 'lane'
+  size_t queued(WorkerLane lane);
+
+private:
+  std::mutex mutex;
+  std::condition_variable cond;
+
+  std::deque<Job> queues[WorkerLaneCount];
+  size_t num_threads_;
+  size_t max_queued_;
+
+  // batch jobs currently running, and how many may run at once
+  size_t batch_running;
+  size_t max_batch_running;
+
+  bool stopping;
+  std::vector<std::thread> threads;
+
+  void run();
+
+  WorkerPool(const WorkerPool&);
+  WorkerPool& operator=(const WorkerPool&);
+};
+
+#endif /* __WORKER_POOL_H__ */
@@ -42,10 +42,208 @@ defmodule AllTheTags do
     not_loaded
   end
 
-  def do_query(_handle, _q) do
+  # removes an entity and its tags. the memory is freed by a compaction,
+  # started in the background once enough has been deleted
+  def delete_entity(_handle, _entity) do
     not_loaded
   end
 
+  # removes a tag from every entity carrying it, along with its
+  # implications. :error if there's no such tag, or a watch/2 query names it
+  def delete_tag(_handle, _tag) do
+    not_loaded
+  end
+
+  # frees deleted entities and tags now, rather than waiting for the
+  # background compaction: {:ok, freed}
+  def compact(_handle) do
+    not_loaded
+  end
+
+  # matching entities are returned in entity ID order
+  # opts:
+  #  - consistent: true - if implications changed since the last query, wait
+  #    for the metagraph to be rebuilt rather than answering from the previous one
+  #  - limit: n - return at most n entities
+  #  - after: id - only return entities after entity `id` (in `order`)
+  #  - order: :asc | :desc - defaults to :asc
+  #  - format: :list | :binary - with :binary, the matches come back as one
+  #    binary of native endian 32 bit entity IDs rather than a list
+  #  - cache: false - skip the result cache
+  def do_query(_handle, _q, _opts \\ []) do
+    not_loaded
+  end
+
+  def query(handle, q, opts \\ []), do: do_query(handle, q, opts)
+
+  # lazily streams the entities matching a query, fetched chunk_size at a time
+  # on the async_query pool, each chunk resuming after the last entity of the
+  # one before. raises if the database is written to before the last chunk,
+  # as the chunks would no longer add up to one result. takes the same opts
+  # as do_query, plus async_query's priority
+  def stream(handle, q, chunk_size \\ 1000, opts \\ []) do
+    Stream.resource(
+      fn ->
+        case stream_start(handle, q, chunk_size, opts) do
+          {:ok, ref, stream} -> {ref, stream}
+          :error -> raise ArgumentError, "could not start query stream"
+        end
+      end,
+      fn {ref, stream} = acc ->
+        receive do
+          {^ref, {:chunk, ids}} ->
+            # ask for the next chunk while this one is being consumed
+            :ok = stream_ack(stream)
+            {[ids], acc}
+          {^ref, :done} ->
+            {:halt, acc}
+          {^ref, :error} ->
+            raise ArgumentError, "invalid query: #{inspect q}"
+          {^ref, {:error, :busy}} ->
+            raise RuntimeError, "async_query pool is busy"
+          {^ref, {:error, :changed}} ->
+            raise RuntimeError, "database changed while streaming #{inspect q}"
+        end
+      end,
+      fn {ref, stream} ->
+        stream_cancel(stream)
+        flush_stream(ref)
+      end)
+    |> Stream.flat_map(fn
+      ids when is_binary(ids) -> binary_to_ids(ids)
+      ids -> ids
+    end)
+  end
+
+  # runs the query on a native worker pool and returns straight away with
+  # {:ok, ref}. the result arrives as a {ref, {:ok, ids}} (or {ref, :error})
+  # message. {:error, :busy} means the pool's queue is full
+  # takes the same opts as do_query, plus:
+  #  - priority: :interactive | :batch - interactive queries always run
+  #    first, and batch queries never take up every worker
+  def async_query(_handle, _q, _opts \\ []), do: not_loaded
+
+  # waits for the reply to an async_query
+  def await_query(ref, timeout \\ 5000) do
+    receive do
+      {^ref, reply} -> reply
+    after
+      timeout -> {:error, :timeout}
+    end
+  end
+
+  # resizes the async_query worker pool. threads: 0 starts one per core
+  def configure_async(_threads, _max_queued), do: not_loaded
+
+  # registers a standing query for the calling process. returns
+  # {:ok, ref, ids} with the entities matching it right now, after which the
+  # process is sent {ref, {:added, ids}} and {ref, {:removed, ids}} as
+  # entities start and stop matching. implication changes are reported once
+  # the metagraph has been rebuilt. :error for an invalid query, as with
+  # do_query
+  def watch(_handle, _q), do: not_loaded
+
+  # stops a standing query started with watch/2
+  def unwatch(_handle, _ref), do: not_loaded
+
+  # low level streaming interface used by stream/4: stream_start sends
+  # {ref, {:chunk, ids}} to the caller for every stream_ack, then {ref, :done}
+  def stream_start(_handle, _q, _chunk_size, _opts), do: not_loaded
+  def stream_ack(_stream),    do: not_loaded
+  def stream_cancel(_stream), do: not_loaded
+
+  defp flush_stream(ref) do
+    receive do
+      {^ref, _} -> flush_stream(ref)
+    after
+      0 -> :ok
+    end
+  end
+
+  # decodes the result of a `format: :binary` query into a list of entity IDs
+  def binary_to_ids(bin) when is_binary(bin) do
+    for <<id::native-unsigned-32 <- bin>>, do: id
+  end
+
+  # counts how many entities matching the query carry each tag, either for
+  # a list of tags (in that order) or for the top k tags (most common first)
+  # returns {:ok, [{tag, count}]}
+  # opts:
+  #  - implied: true - count tags implied by an entity's tags as well
+  #  - consistent: true - as with do_query
+  def facets(_handle, _q, _tags_or_top_k, _opts \\ []) do
+    not_loaded
+  end
+
+  # number of entities matching the query, takes the same opts as do_query
+  def count(_handle, _q, _opts \\ []) do
+    not_loaded
+  end
+
+  # how a query is run: {:ok, [engine: ..., evaluator: ..., plan: ...]}
+  # plan is the optimized query as nested keyword lists, each node with
+  # its op, the optimizer's estimated_rows and cost, and its children in
+  # the order they're evaluated. takes the same opts as do_query, plus:
+  #  - analyze: true - run the query (skipping the result cache), adding
+  #    the actual rows, how many entities each node was evaluated against
+  #    and how often it short circuited, and the time spent on each step
+  def explain(_handle, _q, _opts \\ []), do: not_loaded
+
+  # counters for the query result cache: {:ok, [hits: n, misses: n, ...]}
+  def cache_stats(_handle), do: not_loaded
+
+  # sets the result cache's size limit in bytes, 0 turns it off
+  def configure_cache(_handle, _max_bytes), do: not_loaded
+
+  # latency histograms and counters measured inside the native library:
+  # {:ok, [nifs: [{name, latency}], read_lock_wait: latency,
+  #        write_lock_wait: latency, make_clean: latency, collapses: n,
+  #        compact: latency, jit_compiles: latency]}
+  # where each latency is [count: n, total_ns: n, max_ns: n, p50_ns: n,
+  # p90_ns: n, p99_ns: n, p999_ns: n]
+  def stats(_handle), do: not_loaded
+
+  # bytes used by each part of the database, counted as they're allocated:
+  # {:ok, [entities: n, entity_tags: n, tags: n, implications: n,
+  #        postings: n, meta_nodes: n, stats: n, query_cache: n,
+  #        jit_code: n, total: n]}
+  def memory(_handle), do: not_loaded
+
+  # writes the database's tags, implications and entities to a file, for
+  # the query log replayer (c_src/bench/replay) to load
+  def save_snapshot(_handle, _path), do: not_loaded
+
+  # records every query run on the database (with do_query and
+  # async_query) to a file until stop_query_log/1: the query, its options,
+  # when it started, how long it took and how many rows it returned. with
+  # a snapshot_path, a snapshot is saved first for the log to be replayed
+  # against
+  def start_query_log(_handle, _log_path, _snapshot_path \\ nil), do: not_loaded
+
+  # stops recording queries: {:ok, queries_recorded}
+  def stop_query_log(_handle), do: not_loaded
+
+  # keeps the queries run with do_query and async_query that take
+  # threshold_us or longer, up to the capacity most recent, for
+  # slow_queries/1 to collect. a threshold of 0 (the default) turns it off
+  def configure_slow_queries(_handle, _threshold_us, _capacity \\ 100), do: not_loaded
+
+  # the slow queries recorded since the last call, oldest first:
+  # {:ok, [[query: q, cache: bool, started_at: ms, total_us: us,
+  #         engine: ..., evaluator: ..., estimated_rows: n, rows: n,
+  #         examined: n, time_us: [parse: us, ...], plan: ...]]}
+  # with the plan as explain/3 returns it without analyze: true. started_at
+  # is in milliseconds since the epoch. a query answered from the result
+  # cache has the plan it would be run with now, and examined is 0
+  def slow_queries(_handle), do: not_loaded
+
+  # counters for the compiled query code shared by every database:
+  # {:ok, [hits: n, misses: n, ...]}
+  def jit_stats(), do: not_loaded
+
+  # sets how many bytes of compiled query code are kept around
+  def configure_jit(_max_bytes), do: not_loaded
+
   def imply_tag(_handle, _implier, _implied),   do: not_loaded
   def unimply_tag(_handle, _implier, _implied), do: not_loaded
   def get_implies(_handle, _tag), do: not_loaded
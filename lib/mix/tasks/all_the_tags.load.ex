@@ -0,0 +1,309 @@
+defmodule Mix.Tasks.AllTheTags.Load do
+  use Mix.Task
+
+  @shortdoc "Runs concurrent readers and writers against a database"
+
+  @moduledoc """
+  Loads a generated database from many processes at once, the way an
+  application's callers would, and reports each operation's throughput and
+  latency percentiles along with how busy and how responsive the BEAM's
+  schedulers were meanwhile:
+
+      mix all_the_tags.load --readers 16 --writers 2 --duration 30
+
+  Options:
+
+    * `--entities N` - entities in the database (100000)
+    * `--tags N` - tags, the lower numbered ones more popular (1000)
+    * `--tags-per-entity N` - tags on each entity (4)
+    * `--readers N` - reader processes (one per online scheduler)
+    * `--writers N` - writer processes (1)
+    * `--reads MIX` - reader operations and their weights (do_query:4,entity_tags:1)
+    * `--writes MIX` - writer operations and their weights (add_tag:9,imply_tag:1)
+    * `--duration SECONDS` - how long to run for (10)
+    * `--seed N` - seeds the database and the operations (1)
+    * `--no-cache` - readers' queries skip the result cache
+    * `--format text|csv` - output format (text)
+
+  Writers toggle: `add_tag` removes the tag instead if the entity already
+  has it, and `imply_tag` removes the implication if it's already there, so
+  the database stays about the same size however long the run is.
+  """
+
+  @switches [entities: :integer, tags: :integer, tags_per_entity: :integer,
+             readers: :integer, writers: :integer, reads: :string, writes: :string,
+             duration: :float, seed: :integer, cache: :boolean, format: :string]
+
+  @defaults [entities: 100_000, tags: 1000, tags_per_entity: 4, writers: 1,
+             reads: "do_query:4,entity_tags:1", writes: "add_tag:9,imply_tag:1",
+             duration: 10.0, seed: 1, cache: true, format: "text"]
+
+  @operations [:do_query, :entity_tags, :add_tag, :imply_tag]
+
+  # the latency probe sleeps this long (in ms) between wakeups
+  @probe_interval 1
+
+  def run(argv) do
+    Mix.Task.run("app.start")
+
+    {opts, _, _} = OptionParser.parse(argv, switches: @switches)
+    report = measure(opts)
+
+    case report.opts[:format] do
+      "csv" -> print_csv(report)
+      _     -> print_text(report)
+    end
+  end
+
+  # runs the load and returns what was measured, without printing it:
+  #   %{opts: opts, ops: %{op => summary}, schedulers: [utilization],
+  #     probe: summary, stats: AllTheTags.stats/1}
+  # where each summary is %{count: n, per_sec: n, p50: us, p90: us,
+  # p99: us, p999: us, max: us}
+  def measure(opts) do
+    opts = @defaults
+      |> Keyword.merge(opts)
+      |> Keyword.put_new(:readers, :erlang.system_info(:schedulers_online))
+
+    reads  = parse_mix(opts[:reads])
+    writes = parse_mix(opts[:writes])
+
+    {:ok, db} = AllTheTags.new
+    populate(db, opts)
+
+    duration_us = round(opts[:duration] * 1_000_000)
+    start = :os.timestamp
+    parent = self()
+
+    :erlang.system_flag(:scheduler_wall_time, true)
+    wall_before = :erlang.statistics(:scheduler_wall_time)
+
+    workers =
+      for(i <- :lists.seq(1, opts[:readers]), do: {i, reads}) ++
+      for(i <- :lists.seq(1, opts[:writers]), do: {opts[:readers] + i, writes})
+
+    Enum.each(workers, fn({i, mix}) ->
+      spawn_link(fn ->
+        :rand.seed(:exsplus, {opts[:seed], i, 0})
+        send(parent, {:load_done, work(db, opts, mix, start, duration_us, %{})})
+      end)
+    end)
+    spawn_link(fn ->
+      send(parent, {:probe_done, probe(start, duration_us, [])})
+    end)
+
+    latencies = Enum.reduce(workers, %{}, fn(_, acc) ->
+      receive do
+        {:load_done, ops} -> Map.merge(acc, ops, fn(_, a, b) -> a ++ b end)
+      end
+    end)
+    probe_latencies = receive do
+      {:probe_done, late} -> late
+    end
+
+    wall_after = :erlang.statistics(:scheduler_wall_time)
+    :erlang.system_flag(:scheduler_wall_time, false)
+    elapsed_s = :timer.now_diff(:os.timestamp, start) / 1_000_000
+
+    {:ok, stats} = AllTheTags.stats(db)
+
+    %{opts: opts,
+      ops: for({op, l} <- latencies, into: %{}, do: {op, summarize(l, elapsed_s)}),
+      schedulers: utilization(wall_before, wall_after),
+      probe: summarize(probe_latencies, elapsed_s),
+      stats: stats}
+  end
+
+  # "do_query:4,entity_tags:1" -> [{:do_query, 4}, {:entity_tags, 1}]
+  defp parse_mix(spec) do
+    spec
+      |> String.split(",", trim: true)
+      |> Enum.map(fn(part) ->
+        {name, weight} = case String.split(part, ":") do
+          [name, weight] -> {name, String.to_integer(weight)}
+          [name]         -> {name, 1}
+        end
+        op = Enum.find(@operations, &(Atom.to_string(&1) == name)) ||
+          Mix.raise("unknown operation #{name}, expected one of #{inspect @operations}")
+        {op, weight}
+      end)
+  end
+
+  defp pick(mix) do
+    n = :rand.uniform(Enum.reduce(mix, 0, fn({_, w}, sum) -> sum + w end))
+    Enum.reduce_while(mix, n, fn({op, w}, left) ->
+      if left <= w, do: {:halt, op}, else: {:cont, left - w}
+    end)
+  end
+
+  # tag ids skewed towards the low ones, so a few tags are on most entities
+  # and most tags are on a few, like real tags
+  defp random_tag(opts) do
+    u = :rand.uniform
+    trunc(u * u * opts[:tags])
+  end
+
+  defp random_entity(opts) do
+    :rand.uniform(opts[:entities]) - 1
+  end
+
+  # tags and entities with explicit ids from 0, and a taxonomy over the
+  # first tenth of the tags, each implying its parent
+  defp populate(db, opts) do
+    :rand.seed(:exsplus, {opts[:seed], 0, 0})
+    AllTheTags.mark_dirty(db)
+
+    Enum.each(:lists.seq(0, opts[:tags] - 1), fn(t) -> {:ok, ^t} = AllTheTags.new_tag(db, t) end)
+    Enum.each(:lists.seq(1, div(opts[:tags], 10)), fn(t) -> AllTheTags.imply_tag(db, t, div(t - 1, 4)) end)
+
+    Enum.each(:lists.seq(0, opts[:entities] - 1), fn(e) ->
+      {:ok, ^e} = AllTheTags.new_entity(db, e)
+      Enum.each(:lists.seq(1, opts[:tags_per_entity]), fn(_) ->
+        AllTheTags.add_tag(db, e, random_tag(opts))
+      end)
+    end)
+
+    # rebuild the metagraph before the clock starts
+    AllTheTags.do_query(db, 0, consistent: true, limit: 1)
+  end
+
+  defp random_query(opts) do
+    case :rand.uniform(4) do
+      1 -> random_tag(opts)
+      2 -> {:and, random_tag(opts), random_tag(opts)}
+      3 -> {:or, random_tag(opts), random_tag(opts)}
+      4 -> {:and, random_tag(opts), {:not, random_tag(opts)}}
+    end
+  end
+
+  defp perform(:do_query, db, opts) do
+    AllTheTags.do_query(db, random_query(opts), cache: opts[:cache])
+  end
+
+  defp perform(:entity_tags, db, opts) do
+    AllTheTags.entity_tags(db, random_entity(opts))
+  end
+
+  defp perform(:add_tag, db, opts) do
+    e = random_entity(opts)
+    t = random_tag(opts)
+    case AllTheTags.add_tag(db, e, t) do
+      :ok    -> :ok
+      :error -> AllTheTags.remove_tag(db, e, t)
+    end
+  end
+
+  defp perform(:imply_tag, db, opts) do
+    implier = random_tag(opts)
+    implied = random_tag(opts)
+    case AllTheTags.imply_tag(db, implier, implied) do
+      :ok    -> :ok
+      :error -> AllTheTags.unimply_tag(db, implier, implied)
+    end
+  end
+
+  # runs operations back to back until the duration is up, keeping each
+  # one's latency in microseconds by operation
+  defp work(db, opts, mix, start, duration_us, acc) do
+    if :timer.now_diff(:os.timestamp, start) >= duration_us do
+      acc
+    else
+      op = pick(mix)
+      {us, _} = :timer.tc(fn -> perform(op, db, opts) end)
+      work(db, opts, mix, start, duration_us, Map.update(acc, op, [us], &[us | &1]))
+    end
+  end
+
+  # wakes up every @probe_interval ms, keeping how late it woke up in
+  # microseconds. a NIF call that holds on to a scheduler for too long
+  # shows up here as the processes queued behind it waiting
+  defp probe(start, duration_us, acc) do
+    if :timer.now_diff(:os.timestamp, start) >= duration_us do
+      acc
+    else
+      before = :os.timestamp
+      receive do
+      after @probe_interval -> :ok
+      end
+      late = :timer.now_diff(:os.timestamp, before) - @probe_interval * 1000
+      probe(start, duration_us, [max(late, 0) | acc])
+    end
+  end
+
+  # the fraction of the time each scheduler spent busy, by scheduler id
+  defp utilization(before, later) do
+    before = Enum.into(before, %{}, fn({id, active, total}) -> {id, {active, total}} end)
+    later
+      |> Enum.sort
+      |> Enum.map(fn({id, active, total}) ->
+        {active0, total0} = Map.fetch!(before, id)
+        if total > total0, do: (active - active0) / (total - total0), else: 0.0
+      end)
+  end
+
+  defp summarize([], _elapsed_s) do
+    %{count: 0, per_sec: 0.0, p50: 0, p90: 0, p99: 0, p999: 0, max: 0}
+  end
+
+  defp summarize(latencies, elapsed_s) do
+    sorted = latencies |> Enum.sort |> List.to_tuple
+    n = tuple_size(sorted)
+    at = fn(q) -> elem(sorted, max(0, round(Float.ceil(q * n)) - 1)) end
+
+    %{count: n, per_sec: n / elapsed_s,
+      p50: at.(0.5), p90: at.(0.9), p99: at.(0.99), p999: at.(0.999),
+      max: elem(sorted, n - 1)}
+  end
+
+  defp lock_wait_us(stats, lock) do
+    wait = stats[lock]
+    {wait[:p99_ns] / 1000, wait[:max_ns] / 1000}
+  end
+
+  defp print_text(report) do
+    opts = report.opts
+    Mix.shell.info "#{opts[:entities]} entities, #{opts[:tags]} tags, " <>
+      "#{opts[:readers]} readers, #{opts[:writers]} writers, #{opts[:duration]}s\n"
+
+    Mix.shell.info pad(["op", "count", "ops/s", "p50_us", "p90_us", "p99_us", "p999_us", "max_us"])
+    Enum.each(report.ops, fn({op, s}) -> Mix.shell.info pad(summary_row(op, s)) end)
+
+    schedulers = report.schedulers
+    mean = Enum.sum(schedulers) / max(length(schedulers), 1)
+    Mix.shell.info "\nscheduler utilization: #{percent(mean)} mean, " <>
+      Enum.map_join(schedulers, " ", &percent/1)
+
+    p = report.probe
+    Mix.shell.info "scheduler latency (late wakeups, us): " <>
+      "p50 #{p.p50}, p99 #{p.p99}, p999 #{p.p999}, max #{p.max}"
+
+    {read_p99, read_max}   = lock_wait_us(report.stats, :read_lock_wait)
+    {write_p99, write_max} = lock_wait_us(report.stats, :write_lock_wait)
+    Mix.shell.info "lock waits (us): read p99 #{read_p99}, max #{read_max}; " <>
+      "write p99 #{write_p99}, max #{write_max}"
+  end
+
+  defp print_csv(report) do
+    opts = report.opts
+    prefix = Enum.join([opts[:entities], opts[:tags], opts[:readers], opts[:writers], opts[:duration]], ",")
+
+    Mix.shell.info "entities,tags,readers,writers,duration,op,count,ops_per_sec,p50_us,p90_us,p99_us,p999_us,max_us"
+    Enum.each(report.ops, fn({op, s}) ->
+      Mix.shell.info prefix <> "," <> Enum.join(summary_row(op, s), ",")
+    end)
+    Mix.shell.info prefix <> "," <> Enum.join(summary_row(:scheduler_latency, report.probe), ",")
+  end
+
+  defp summary_row(name, s) do
+    [to_string(name), to_string(s.count), :erlang.float_to_binary(s.per_sec / 1, decimals: 1) |
+     Enum.map([s.p50, s.p90, s.p99, s.p999, s.max], &to_string/1)]
+  end
+
+  defp pad([name | rest]) do
+    String.pad_trailing(name, 20) <> Enum.map_join(rest, "", &String.pad_leading(&1, 10))
+  end
+
+  defp percent(f) do
+    "#{round(f * 100)}%"
+  end
+end
@@ -179,6 +179,347 @@ defmodule AllTheTagsTest do
     assert same_lists(res, [f, g])
   end
 
+  test "set and threshold queries", %{handle: handle} do
+    e = set_up_e(handle)
+    {:ok, f} = handle |> AllTheTags.new_entity
+    {:ok, g} = handle |> AllTheTags.new_entity
+    {:ok, @baz} = handle |> AllTheTags.new_tag(@baz)
+
+    :ok = handle |> AllTheTags.add_tag(e, @foo)
+    :ok = handle |> AllTheTags.add_tag(e, @bar)
+    :ok = handle |> AllTheTags.add_tag(f, @bar)
+    :ok = handle |> AllTheTags.add_tag(f, @baz)
+    :ok = handle |> AllTheTags.add_tag(g, @baz)
+
+    assert {:ok, [e]}       == AllTheTags.do_query(handle, {:all, [@foo, @bar]})
+    assert {:ok, [e, f]}    == AllTheTags.do_query(handle, {:any, [@foo, @bar]})
+    assert {:ok, [e, f]}    == AllTheTags.do_query(handle, {:at_least, 2, [@foo, @bar, @baz]})
+    assert {:ok, [f, g]}    == AllTheTags.do_query(handle, {:at_least, 2, [@bar, @baz, {:not, @foo}]})
+    assert {:ok, 2}         == AllTheTags.count(handle, {:at_least, 2, [@foo, @bar, @baz]})
+
+    # the empty set of tags
+    assert {:ok, [e, f, g]} == AllTheTags.do_query(handle, {:all, []})
+    assert {:ok, []}        == AllTheTags.do_query(handle, {:any, []})
+
+    assert :error == AllTheTags.do_query(handle, {:any, @foo})
+    assert :error == AllTheTags.do_query(handle, {:all, [@foo | @bar]})
+    assert :error == AllTheTags.do_query(handle, {:at_least, -1, [@foo]})
+    assert :error == AllTheTags.do_query(handle, {:at_least, 1, [@foo, "blah"]})
+  end
+
+  test "count matches the length of the query result", %{handle: handle} do
+    e = set_up_e(handle)
+    {:ok, f} = handle |> AllTheTags.new_entity
+    {:ok, _} = handle |> AllTheTags.new_entity
+
+    :ok = handle |> AllTheTags.add_tag(e, @foo)
+    :ok = handle |> AllTheTags.add_tag(f, @foo)
+    :ok = handle |> AllTheTags.add_tag(f, @bar)
+
+    [nil, @foo, @bar, {:or, @foo, @bar}, {:and, @foo, @bar},
+     {:not, @foo}, {:not, nil}] |> Enum.each(fn(q) ->
+      {:ok, res} = handle |> AllTheTags.do_query(q)
+      assert {:ok, length(res)} == handle |> AllTheTags.count(q)
+    end)
+
+    assert :error == AllTheTags.count(handle, "blah")
+  end
+
+  test "query pages through results in ID order", %{handle: handle} do
+    {:ok, @foo} = handle |> AllTheTags.new_tag(@foo)
+    [5, 1, 4, 2, 3] |> Enum.each(fn(id) ->
+      {:ok, ^id} = handle |> AllTheTags.new_entity(id)
+      :ok = handle |> AllTheTags.add_tag(id, @foo)
+    end)
+    {:ok, 6} = handle |> AllTheTags.new_entity(6)
+
+    assert {:ok, [1, 2, 3, 4, 5]} == AllTheTags.query(handle, @foo)
+    assert {:ok, [1, 2]} == AllTheTags.query(handle, @foo, limit: 2)
+    assert {:ok, [3, 4]} == AllTheTags.query(handle, @foo, limit: 2, after: 2)
+    assert {:ok, [5]}    == AllTheTags.query(handle, @foo, limit: 2, after: 4)
+    assert {:ok, [5, 4]} == AllTheTags.query(handle, @foo, limit: 2, order: :desc)
+    assert {:ok, [2, 1]} == AllTheTags.query(handle, @foo, after: 3, order: :desc)
+    assert {:ok, [6, 5, 4]} == AllTheTags.query(handle, nil, limit: 3, order: :desc)
+
+    assert_raise ArgumentError, fn ->
+      AllTheTags.query(handle, @foo, order: :sideways)
+    end
+  end
+
+  test "facets count the tags on matching entities", %{handle: handle} do
+    e = set_up_e(handle)
+    {:ok, f} = handle |> AllTheTags.new_entity
+    {:ok, @baz} = handle |> AllTheTags.new_tag(@baz)
+
+    :ok = handle |> AllTheTags.add_tag(e, @foo)
+    :ok = handle |> AllTheTags.add_tag(e, @bar)
+    :ok = handle |> AllTheTags.add_tag(f, @bar)
+    :ok = handle |> AllTheTags.imply_tag(@bar, @baz)
+
+    assert {:ok, [{@foo, 1}, {@bar, 2}, {@baz, 0}]} ==
+      AllTheTags.facets(handle, nil, [@foo, @bar, @baz])
+    assert {:ok, [{@foo, 1}, {@bar, 2}, {@baz, 2}]} ==
+      AllTheTags.facets(handle, nil, [@foo, @bar, @baz], implied: true)
+    assert {:ok, [{@foo, 0}, {@bar, 1}]} ==
+      AllTheTags.facets(handle, {:not, @foo}, [@foo, @bar])
+
+    assert {:ok, [{@bar, 2}]} == AllTheTags.facets(handle, nil, 1)
+    assert {:ok, [{@bar, 2}, {@baz, 2}, {@foo, 1}]} ==
+      AllTheTags.facets(handle, nil, 5, implied: true)
+
+    assert :error == AllTheTags.facets(handle, nil, [@foo, 100])
+  end
+
+  test "query results can be returned as a binary", %{handle: handle} do
+    {:ok, @foo} = handle |> AllTheTags.new_tag(@foo)
+    1..100 |> Enum.each(fn(id) ->
+      {:ok, ^id} = handle |> AllTheTags.new_entity(id)
+      if rem(id, 3) == 0, do: :ok = handle |> AllTheTags.add_tag(id, @foo)
+    end)
+
+    {:ok, list} = AllTheTags.query(handle, @foo)
+    {:ok, bin}  = AllTheTags.query(handle, @foo, format: :binary)
+    assert byte_size(bin) == 4 * length(list)
+    assert AllTheTags.binary_to_ids(bin) == list
+
+    {:ok, bin} = AllTheTags.query(handle, {:not, @foo}, format: :binary, limit: 3, order: :desc)
+    assert AllTheTags.binary_to_ids(bin) == [100, 98, 97]
+
+    assert {:ok, ""} == AllTheTags.query(handle, {:not, nil}, format: :binary)
+  end
+
+  test "query results can be streamed in chunks", %{handle: handle} do
+    {:ok, @foo} = handle |> AllTheTags.new_tag(@foo)
+    1..1000 |> Enum.each(fn(id) ->
+      {:ok, ^id} = handle |> AllTheTags.new_entity(id)
+      if rem(id, 2) == 0, do: :ok = handle |> AllTheTags.add_tag(id, @foo)
+    end)
+
+    {:ok, all} = AllTheTags.query(handle, @foo)
+    assert all == handle |> AllTheTags.stream(@foo, 7) |> Enum.to_list
+    assert all == handle |> AllTheTags.stream(@foo, 64, format: :binary) |> Enum.to_list
+    assert [2, 4, 6] == handle |> AllTheTags.stream(@foo, 2) |> Enum.take(3)
+
+    # chunks pick up after the last one, within the query's range
+    assert [998, 996, 994, 992, 990] ==
+      handle |> AllTheTags.stream(@foo, 2, order: :desc, limit: 5) |> Enum.to_list
+    assert [102, 104, 106] ==
+      handle |> AllTheTags.stream(@foo, 3, after: 100, limit: 3) |> Enum.to_list
+
+    assert_raise ArgumentError, fn ->
+      handle |> AllTheTags.stream({:and, @foo, 12345}) |> Enum.to_list
+    end
+
+    # a write between chunks ends the stream rather than mixing two views
+    {:ok, ref, stream} = AllTheTags.stream_start(handle, @foo, 2, [])
+    assert_receive {^ref, {:chunk, [2, 4]}}
+    :ok = handle |> AllTheTags.add_tag(1, @foo)
+    :ok = AllTheTags.stream_ack(stream)
+    assert_receive {^ref, {:error, :changed}}
+  end
+
+  test "repeated queries are served from the cache", %{handle: handle} do
+    e = set_up_e(handle)
+    :ok = handle |> AllTheTags.add_tag(e, @foo)
+
+    assert {:ok, [e]} == AllTheTags.do_query(handle, {:or, @foo, @bar})
+    assert {:ok, [e]} == AllTheTags.do_query(handle, {:or, @bar, @foo})
+    assert {:ok, [e]} == AllTheTags.do_query(handle, @foo, cache: false)
+    {:ok, stats} = AllTheTags.cache_stats(handle)
+    assert stats[:misses] == 1
+    assert stats[:hits]   == 1
+
+    # tagging only drops the entries that depend on the tag
+    assert {:ok, []} == AllTheTags.do_query(handle, @bar)
+    {:ok, f} = handle |> AllTheTags.new_entity
+    :ok = handle |> AllTheTags.add_tag(f, @foo)
+    {:ok, stats} = AllTheTags.cache_stats(handle)
+    assert stats[:entries] == 1
+    assert {:ok, [e, f]} == AllTheTags.do_query(handle, {:or, @foo, @bar})
+
+    assert :ok == AllTheTags.configure_cache(handle, 0)
+    {:ok, stats} = AllTheTags.cache_stats(handle)
+    assert stats[:entries] == 0
+  end
+
+  test "explaining queries", %{handle: handle} do
+    e = set_up_e(handle)
+    :ok = handle |> AllTheTags.add_tag(e, @foo)
+
+    {:ok, plan} = AllTheTags.explain(handle, {:or, @foo, @bar})
+    assert plan[:engine] == :postings
+    assert plan[:plan][:op] == :or
+    assert length(plan[:plan][:children]) == 2
+    assert plan[:rows] == nil
+
+    {:ok, plan} = AllTheTags.explain(handle, {:and, {:not, @foo}, {:not, @bar}}, analyze: true)
+    assert plan[:rows] == 0
+    assert plan[:plan][:evaluated] == plan[:examined]
+    assert Keyword.has_key?(plan[:time_us], :execute)
+
+    assert_raise ArgumentError, fn -> AllTheTags.explain(handle, @foo, analyze: :yes) end
+  end
+
+  test "native telemetry", %{handle: handle} do
+    e = set_up_e(handle)
+    :ok = handle |> AllTheTags.add_tag(e, @foo)
+    {:ok, _} = AllTheTags.do_query(handle, @foo)
+    {:ok, _} = AllTheTags.do_query(handle, @bar)
+
+    {:ok, stats} = AllTheTags.stats(handle)
+    assert stats[:nifs][:do_query][:count] == 2
+    assert stats[:nifs][:add_tag][:count] == 1
+    assert stats[:nifs][:do_query][:p50_ns] <= stats[:nifs][:do_query][:max_ns]
+    assert stats[:nifs][:get_implies] == nil
+    assert stats[:read_lock_wait][:count] >= 2
+    assert stats[:make_clean][:count] == 0
+
+    :ok = AllTheTags.imply_tag(handle, @foo, @bar)
+    :ok = AllTheTags.imply_tag(handle, @bar, @foo)
+    {:ok, stats} = AllTheTags.stats(handle)
+    assert stats[:collapses] == 1
+  end
+
+  test "memory accounting", %{handle: handle} do
+    {:ok, before} = AllTheTags.memory(handle)
+
+    e = set_up_e(handle)
+    :ok = handle |> AllTheTags.add_tag(e, @foo)
+    :ok = AllTheTags.imply_tag(handle, @foo, @bar)
+
+    {:ok, mem} = AllTheTags.memory(handle)
+    assert mem[:entities] > before[:entities]
+    assert mem[:entity_tags] > before[:entity_tags]
+    assert mem[:postings] > before[:postings]
+    assert mem[:implications] > before[:implications]
+    assert mem[:meta_nodes] > 0
+
+    parts = Keyword.delete(mem, :total) |> Keyword.values |> Enum.sum
+    assert mem[:total] == parts
+  end
+
+  test "query log records queries", %{handle: handle} do
+    e = set_up_e(handle)
+    :ok = handle |> AllTheTags.add_tag(e, @foo)
+
+    dir = System.tmp_dir!
+    log = Path.join(dir, "all_the_tags_test.qlog")
+    snapshot = Path.join(dir, "all_the_tags_test.snapshot")
+
+    assert :ok == AllTheTags.start_query_log(handle, log, snapshot)
+    {:ok, [^e]} = AllTheTags.do_query(handle, @foo)
+    {:ok, []}   = AllTheTags.do_query(handle, {:and, @foo, @bar}, cache: false)
+    assert {:ok, 2} == AllTheTags.stop_query_log(handle)
+
+    # not recorded once it's stopped
+    {:ok, _} = AllTheTags.do_query(handle, @foo)
+    assert {:ok, 0} == AllTheTags.stop_query_log(handle)
+
+    assert File.exists?(log)
+    assert File.exists?(snapshot)
+    File.rm(log)
+    File.rm(snapshot)
+
+    assert :error == AllTheTags.save_snapshot(handle, Path.join([dir, "no_such_dir", "x"]))
+  end
+
+  test "slow queries are kept until they're drained", %{handle: handle} do
+    e = set_up_e(handle)
+    :ok = handle |> AllTheTags.add_tag(e, @foo)
+    assert {:ok, []} == AllTheTags.slow_queries(handle)
+
+    # every query is slow
+    :ok = AllTheTags.configure_slow_queries(handle, 1, 2)
+    Enum.each([@foo, @bar, {:not, @bar}], fn(q) ->
+      {:ok, _} = AllTheTags.do_query(handle, q, cache: false)
+    end)
+
+    {:ok, slow} = AllTheTags.slow_queries(handle)
+    assert [@bar, {:not, @bar}] == Enum.map(slow, &(&1[:query]))
+
+    [_, last] = slow
+    assert last[:rows] == 1
+    assert last[:cache] == false
+    assert last[:total_us] > 0
+    assert is_number(last[:estimated_rows])
+    assert Keyword.has_key?(last[:time_us], :execute)
+    assert last[:plan][:op] != nil
+
+    assert {:ok, []} == AllTheTags.slow_queries(handle)
+
+    :ok = AllTheTags.configure_slow_queries(handle, 0)
+    {:ok, _} = AllTheTags.do_query(handle, @foo)
+    assert {:ok, []} == AllTheTags.slow_queries(handle)
+  end
+
+  test "load harness runs readers and writers" do
+    report = Mix.Tasks.AllTheTags.Load.measure(
+      entities: 200, tags: 20, readers: 2, writers: 1, duration: 0.2)
+
+    assert report.ops[:do_query].count > 0
+    assert report.ops[:add_tag].count > 0
+    assert report.ops[:do_query].p50 <= report.ops[:do_query].max
+    assert length(report.schedulers) == :erlang.system_info(:schedulers)
+    assert report.probe.count > 0
+  end
+
+  test "jit cache counters" do
+    {:ok, stats} = AllTheTags.jit_stats()
+    assert stats[:bytes] <= stats[:max_bytes]
+    assert stats[:live] >= stats[:entries]
+    assert_raise ArgumentError, fn -> AllTheTags.configure_jit(-1) end
+  end
+
+  test "standing queries report changes to their matches", %{handle: handle} do
+    e = set_up_e(handle)
+    {:ok, f} = handle |> AllTheTags.new_entity
+    :ok = handle |> AllTheTags.add_tag(e, @foo)
+
+    {:ok, ref, [^e]} = AllTheTags.watch(handle, {:and, @foo, {:not, @bar}})
+    assert :error == AllTheTags.watch(handle, {:and, @foo, 12345})
+
+    :ok = handle |> AllTheTags.add_tag(f, @foo)
+    assert_receive {^ref, {:added, [^f]}}
+
+    :ok = handle |> AllTheTags.add_tag(e, @bar)
+    assert_receive {^ref, {:removed, [^e]}}
+
+    # f gains @bar through an implication
+    :ok = handle |> AllTheTags.imply_tag(@foo, @bar)
+    assert_receive {^ref, {:removed, [^f]}}
+
+    :ok = handle |> AllTheTags.unimply_tag(@foo, @bar)
+    assert_receive {^ref, {:added, [^f]}}
+
+    assert :ok    == AllTheTags.unwatch(handle, ref)
+    assert :error == AllTheTags.unwatch(handle, ref)
+
+    :ok = handle |> AllTheTags.remove_tag(e, @bar)
+    refute_receive {^ref, _}, 50
+  end
+
+  test "queries can run asynchronously", %{handle: handle} do
+    e = set_up_e(handle)
+    {:ok, f} = handle |> AllTheTags.new_entity
+    :ok = handle |> AllTheTags.add_tag(e, @foo)
+
+    {:ok, ref1} = AllTheTags.async_query(handle, @foo)
+    {:ok, ref2} = AllTheTags.async_query(handle, {:not, @foo}, priority: :batch)
+    {:ok, ref3} = AllTheTags.async_query(handle, {:or, @foo, 12345})
+    assert {:ok, [e]} == AllTheTags.await_query(ref1)
+    assert {:ok, [f]} == AllTheTags.await_query(ref2)
+    assert :error     == AllTheTags.await_query(ref3)
+
+    refs = Enum.map(1..100, fn(_) ->
+      {:ok, ref} = AllTheTags.async_query(handle, nil, format: :binary)
+      ref
+    end)
+    Enum.each(refs, fn(ref) ->
+      {:ok, bin} = AllTheTags.await_query(ref)
+      assert AllTheTags.binary_to_ids(bin) == [e, f]
+    end)
+  end
+
   test "query with unknown tags", %{handle: handle} do
     {:ok, e} = handle |> AllTheTags.new_entity
     assert {:ok, [e]} == AllTheTags.do_query(handle, nil)
@@ -243,12 +584,37 @@ defmodule AllTheTagsTest do
     handle |> AllTheTags.unimply_tag(@foo, @bar)
     assert true == handle |> AllTheTags.is_dirty
 
-    assert {:ok, [e]} == handle |> AllTheTags.do_query(@foo)
-    assert {:ok, []}  == handle |> AllTheTags.do_query(@bar)
+    assert {:ok, [e]} == handle |> AllTheTags.do_query(@foo, consistent: true)
+    assert {:ok, []}  == handle |> AllTheTags.do_query(@bar, consistent: true)
 
     assert false == handle |> AllTheTags.is_dirty
   end
 
+  test "dirty context is rebuilt in the background", %{handle: handle} do
+    e = handle |> set_up_e
+
+    :ok = handle |> AllTheTags.add_tag(e, @foo)
+
+    handle |> AllTheTags.imply_tag(@foo, @bar)
+    handle |> AllTheTags.imply_tag(@bar, @foo)
+    handle |> AllTheTags.unimply_tag(@foo, @bar)
+    assert true == handle |> AllTheTags.is_dirty
+
+    # answered from the previous metagraph until the rebuild lands
+    {:ok, res} = handle |> AllTheTags.do_query(@bar)
+    assert res == [e] or res == []
+
+    wait_until_clean(handle, 100)
+    assert {:ok, []} == handle |> AllTheTags.do_query(@bar)
+    assert {:ok, [e]} == handle |> AllTheTags.do_query(@foo)
+  end
+
+  test "do_query rejects unknown options", %{handle: handle} do
+    assert_raise ArgumentError, fn ->
+      AllTheTags.do_query(handle, nil, bogus: true)
+    end
+  end
+
   test "can remove tags", %{handle: handle} do
     e = handle |> set_up_e
 
@@ -261,6 +627,40 @@ defmodule AllTheTagsTest do
     assert :error == AllTheTags.remove_tag(handle, e, @foo)
   end
 
+  test "can delete entities and tags", %{handle: handle} do
+    e = handle |> set_up_e
+    {:ok, other} = handle |> AllTheTags.new_entity
+
+    assert :ok == AllTheTags.add_tag(handle, e, @foo)
+    assert :ok == AllTheTags.add_tag(handle, other, @bar)
+    assert :ok == AllTheTags.imply_tag(handle, @bar, @foo)
+    assert {:ok, [e, other]} == AllTheTags.do_query(handle, @foo)
+
+    assert :ok    == AllTheTags.delete_entity(handle, e)
+    assert :error == AllTheTags.delete_entity(handle, e)
+    assert :error == AllTheTags.entity_tags(handle, e)
+    assert 1 == AllTheTags.num_entities(handle)
+    assert {:ok, [other]} == AllTheTags.do_query(handle, @foo)
+    assert {:ok, [other]} == AllTheTags.do_query(handle, nil)
+
+    # its implications go with it
+    assert :ok    == AllTheTags.delete_tag(handle, @bar)
+    assert :error == AllTheTags.delete_tag(handle, @bar)
+    assert 1 == AllTheTags.num_tags(handle)
+    assert {:ok, []} == AllTheTags.get_implied_by(handle, @foo)
+    assert {:ok, []} == AllTheTags.do_query(handle, @foo)
+    assert {:ok, []} == AllTheTags.entity_tags(handle, other)
+
+    # tags a watcher is using stay
+    {:ok, _ref, []} = AllTheTags.watch(handle, @foo)
+    assert :error == AllTheTags.delete_tag(handle, @foo)
+
+    assert {:ok, freed} = AllTheTags.compact(handle)
+    assert freed <= 2
+    assert {:ok, 0} == AllTheTags.compact(handle)
+    assert {:ok, [other]} == AllTheTags.do_query(handle, nil)
+  end
+
   test "can create tags with specific IDs", %{handle: handle} do
     assert {:ok, 10} == handle |> AllTheTags.new_tag(10)
     assert {:ok, 15} == handle |> AllTheTags.new_tag(15)
@@ -273,6 +673,14 @@ defmodule AllTheTagsTest do
     {:ok, e}    = handle |> AllTheTags.new_entity
     e
   end
+  defp wait_until_clean(handle, tries) when tries > 0 do
+    if AllTheTags.is_dirty(handle) do
+      :timer.sleep(10)
+      wait_until_clean(handle, tries - 1)
+    end
+  end
+  defp wait_until_clean(_handle, 0), do: :ok
+
   defp same_lists(l1, l2) do
     HashSet.equal? list_to_hs(l1), list_to_hs(l2)
   end